@@ -0,0 +1,179 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <aggregates.h>
+#include <logger.h>
+#include <fnmatch.h>
+#include <json_config.h>
+
+using namespace std;
+
+/**
+ * Check if the rule applies to a datapoint
+ *
+ * @param asset		The asset name
+ * @param datapoint	The datapoint name, nested datapoints are separated by "."
+ * @return		True if both patterns match
+ */
+bool AggregateRule::matches(const string& asset, const string& datapoint) const
+{
+	return fnmatch(m_asset.c_str(), asset.c_str(), 0) == 0
+		&& fnmatch(m_datapoint.c_str(), datapoint.c_str(), 0) == 0;
+}
+
+/**
+ * Parse the aggregates configuration item. The item is a JSON document
+ * with an array of rules, each rule has an asset pattern, a datapoint
+ * pattern, a window length in seconds and a list of functions.
+ *
+ * { "aggregates" : [ { "asset" : "pump*", "datapoint" : "temperature",
+ *			"window" : 60, "functions" : [ "min", "max", "mean" ] } ] }
+ *
+ * @param json	The configuration item
+ */
+void AggregateRules::parse(const string& json)
+{
+	Logger *log = Logger::getLogger();
+
+	m_rules.clear();
+	if (json.empty())
+	{
+		return;
+	}
+	rapidjson::Document doc;
+	if (!ParseJsonConfig(doc, json, "aggregates"))
+	{
+		return;
+	}
+	if (!doc.HasMember("aggregates") || !doc["aggregates"].IsArray())
+	{
+		log->error("Missing the aggregates element in the aggregates configuration");
+		return;
+	}
+	for (auto &rule : doc["aggregates"].GetArray())
+	{
+		string asset = "*", datapoint;
+		unsigned int window = 0, functions = 0;
+		if (rule.HasMember("asset") && rule["asset"].IsString())
+			asset = rule["asset"].GetString();
+		if (rule.HasMember("datapoint") && rule["datapoint"].IsString())
+			datapoint = rule["datapoint"].GetString();
+		if (rule.HasMember("window") && rule["window"].IsUint())
+			window = rule["window"].GetUint();
+		if (rule.HasMember("functions") && rule["functions"].IsArray())
+		{
+			for (auto &f : rule["functions"].GetArray())
+			{
+				string name = f.IsString() ? f.GetString() : "";
+				if (name.compare("min") == 0)
+					functions |= AggregateRule::Minimum;
+				else if (name.compare("max") == 0)
+					functions |= AggregateRule::Maximum;
+				else if (name.compare("mean") == 0)
+					functions |= AggregateRule::Mean;
+				else if (name.compare("count") == 0)
+					functions |= AggregateRule::Count;
+				else if (name.compare("last") == 0)
+					functions |= AggregateRule::Last;
+				else
+					log->error("Unsupported aggregate function '%s'", name.c_str());
+			}
+		}
+		if (datapoint.empty() || window == 0 || functions == 0)
+		{
+			log->error("Badly formed aggregate, a datapoint, a window and at least one function must be provided");
+			continue;
+		}
+		m_rules.push_back(AggregateRule(asset, datapoint, window, functions));
+	}
+}
+
+/**
+ * Find the first rule that applies to a datapoint
+ *
+ * @param asset		The asset name
+ * @param datapoint	The datapoint name
+ * @return		The rule or NULL if no rule applies
+ */
+const AggregateRule *AggregateRules::match(const string& asset, const string& datapoint) const
+{
+	for (auto &rule : m_rules)
+	{
+		if (rule.matches(asset, datapoint))
+		{
+			return &rule;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Return the suffix used to name the variable of an aggregate function
+ *
+ * @param function	The aggregate function
+ * @return		The name of the function
+ */
+const char *AggregateRules::functionName(AggregateRule::Function function)
+{
+	switch (function)
+	{
+		case AggregateRule::Minimum:
+			return "min";
+		case AggregateRule::Maximum:
+			return "max";
+		case AggregateRule::Mean:
+			return "mean";
+		case AggregateRule::Count:
+			return "count";
+		case AggregateRule::Last:
+			return "last";
+	}
+	return "";
+}
+
+/**
+ * Add a value to the current window
+ *
+ * @param timestamp	The source timestamp of the value
+ * @param value		The value
+ * @return		False if the value belongs to a later window, the current window is then complete
+ */
+bool AggregateWindow::add(const struct timeval& timestamp, double value)
+{
+	if (m_count == 0)
+	{
+		reset(timestamp, value);
+		return true;
+	}
+	if (timestamp.tv_sec >= m_start + (time_t)m_rule->getWindow())
+	{
+		return false;
+	}
+	// Late values are included in the current window
+	if (value < m_min)
+		m_min = value;
+	if (value > m_max)
+		m_max = value;
+	m_sum += value;
+	m_last = value;
+	m_count++;
+	return true;
+}
+
+/**
+ * Start a new window with a value
+ *
+ * @param timestamp	The source timestamp of the value
+ * @param value		The value
+ */
+void AggregateWindow::reset(const struct timeval& timestamp, double value)
+{
+	m_start = timestamp.tv_sec - timestamp.tv_sec % m_rule->getWindow();
+	m_count = 1;
+	m_min = m_max = m_sum = m_last = value;
+}
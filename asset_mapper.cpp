@@ -0,0 +1,183 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <asset_mapper.h>
+#include <logger.h>
+#include <algorithm>
+#include <ctype.h>
+#include <json_config.h>
+
+using namespace std;
+
+/**
+ * Parse the asset mapping configuration item. The item is a JSON
+ * document with an array of rules, each with a regular expression and
+ * a path template.
+ *
+ * { "rules" : [ { "pattern" : "site-(\\w+)-line(\\d+)-(.*)", "path" : "Site/$1/Line$2/$3" } ] }
+ *
+ * @param json	The configuration item
+ */
+void AssetMapper::parse(const string& json)
+{
+	Logger *log = Logger::getLogger();
+
+	m_rules.clear();
+	m_prefixes.clear();
+	m_cache.clear();
+	m_maxPrefix = 0;
+	if (json.empty())
+	{
+		return;
+	}
+	rapidjson::Document doc;
+	if (!ParseJsonConfig(doc, json, "asset mapping"))
+	{
+		return;
+	}
+	if (!doc.HasMember("rules") || !doc["rules"].IsArray())
+	{
+		return;
+	}
+	for (auto &rule : doc["rules"].GetArray())
+	{
+		string pattern, path;
+		if (rule.HasMember("pattern") && rule["pattern"].IsString())
+			pattern = rule["pattern"].GetString();
+		if (rule.HasMember("path") && rule["path"].IsString())
+			path = rule["path"].GetString();
+		if (pattern.empty() || path.empty())
+		{
+			log->error("Badly formed asset mapping rule, both a pattern and a path must be provided");
+			continue;
+		}
+		try
+		{
+			m_rules.push_back(Rule(pattern, path));
+		}
+		catch (regex_error &e)
+		{
+			log->error("Invalid asset mapping pattern '%s': %s", pattern.c_str(), e.what());
+			continue;
+		}
+		string prefix = literalPrefix(pattern);
+		m_prefixes[prefix].push_back(m_rules.size() - 1);
+		if (prefix.length() > m_maxPrefix)
+			m_maxPrefix = prefix.length();
+	}
+}
+
+/**
+ * Return the literal text that any string matched by a regular
+ * expression must start with
+ *
+ * @param pattern	The regular expression
+ * @return		The literal prefix, which may be empty
+ */
+string AssetMapper::literalPrefix(const string& pattern)
+{
+	if (pattern.find('|') != string::npos)
+	{
+		// An alternation may match strings with different prefixes
+		return "";
+	}
+	size_t start = (!pattern.empty() && pattern[0] == '^') ? 1 : 0;
+	size_t end = pattern.find_first_of(".[]{}()\\*+?^$|", start);
+	if (end == string::npos)
+	{
+		return pattern.substr(start);
+	}
+	if (end > start && (pattern[end] == '*' || pattern[end] == '?' || pattern[end] == '{'))
+	{
+		// The last literal character is optional
+		end--;
+	}
+	return pattern.substr(start, end - start);
+}
+
+/**
+ * Replace the references to groups in a path template
+ *
+ * @param path	The path template
+ * @param match	The result of matching the asset name
+ * @return	The path
+ */
+string AssetMapper::expand(const string& path, const smatch& match)
+{
+	string result;
+	for (size_t i = 0; i < path.length(); i++)
+	{
+		if (path[i] == '$' && i + 1 < path.length() && isdigit(path[i + 1]))
+		{
+			size_t group = 0;
+			while (i + 1 < path.length() && isdigit(path[i + 1]))
+			{
+				group = group * 10 + (path[++i] - '0');
+			}
+			if (group < match.size())
+			{
+				result.append(match[group].str());
+			}
+		}
+		else if (path[i] == '$' && i + 1 < path.length() && path[i + 1] == '$')
+		{
+			result.push_back('$');
+			i++;
+		}
+		else
+		{
+			result.push_back(path[i]);
+		}
+	}
+	return result;
+}
+
+/**
+ * Find the location of an asset in the hierarchy
+ *
+ * @param asset	The asset name
+ * @param path	The path of the parent of the asset, separated by "/"
+ * @return	True if a rule matched the asset
+ */
+bool AssetMapper::map(const string& asset, string& path)
+{
+	auto cached = m_cache.find(asset);
+	if (cached != m_cache.end())
+	{
+		path = cached->second.second;
+		return cached->second.first;
+	}
+
+	// Gather the rules whose literal prefix is a prefix of the asset name
+	vector<uint32_t> candidates;
+	size_t max = asset.length() < m_maxPrefix ? asset.length() : m_maxPrefix;
+	for (size_t len = 0; len <= max; len++)
+	{
+		auto it = m_prefixes.find(asset.substr(0, len));
+		if (it != m_prefixes.end())
+		{
+			candidates.insert(candidates.end(), it->second.begin(), it->second.end());
+		}
+	}
+	sort(candidates.begin(), candidates.end());
+
+	bool matched = false;
+	path.clear();
+	for (auto index : candidates)
+	{
+		smatch match;
+		if (regex_match(asset, match, m_rules[index].m_regex))
+		{
+			path = expand(m_rules[index].m_path, match);
+			matched = true;
+			break;
+		}
+	}
+	m_cache[asset] = pair<bool, string>(matched, path);
+	return matched;
+}
@@ -0,0 +1,130 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <backend_registry.h>
+#include <logger.h>
+#include <stdexcept>
+
+using namespace std;
+
+mutex				BackendRegistry::m_mutex;
+map<string, BackendRegistry::Server>	BackendRegistry::m_servers;
+
+/**
+ * Acquire the server for an endpoint URL, starting it if no other
+ * instance of the plugin is using it, and register the namespace of
+ * the caller in it.
+ *
+ * @param url		The endpoint URL of the server
+ * @param backend	The backend to start the server with
+ * @param uri		The URI of the server
+ * @param name		The name of the server
+ * @param ns		The namespace of the caller
+ * @param idx		Set to the index of the namespace
+ * @return		The backend of the server
+ * @throws runtime_error	If the server fails to start or the namespace is already in use
+ */
+OPCUABackend *BackendRegistry::acquire(const string& url, const string& backend,
+				const string& uri, const string& name, const string& ns, uint16_t& idx)
+{
+	Logger *log = Logger::getLogger();
+	lock_guard<mutex> guard(m_mutex);
+	auto it = m_servers.find(url);
+	if (it == m_servers.end())
+	{
+		OPCUABackend *server = OPCUABackend::create(backend);
+		if (!server)
+		{
+			log->error("The OPC UA backend %s is not available, the freeopcua backend will be used",
+					backend.c_str());
+			server = OPCUABackend::create("freeopcua");
+		}
+		log->info("Starting OPC UA Server on %s using %s", url.c_str(), server->name());
+		try
+		{
+			server->start(url, uri, name);
+		}
+		catch (...)
+		{
+			delete server;
+			throw;
+		}
+		it = m_servers.insert(pair<string, Server>(url, Server(server, uri, name))).first;
+	}
+	else
+	{
+		if (backend.compare(it->second.m_backend->name()) != 0)
+		{
+			log->warn("The OPC UA server on %s is shared with another instance and uses the %s backend",
+					url.c_str(), it->second.m_backend->name());
+		}
+		if (uri.compare(it->second.m_uri) != 0 || name.compare(it->second.m_name) != 0)
+		{
+			log->warn("The OPC UA server on %s is shared with another instance and has the URI %s and name %s",
+					url.c_str(), it->second.m_uri.c_str(), it->second.m_name.c_str());
+		}
+		if (it->second.m_namespaces.count(ns))
+		{
+			throw runtime_error("namespace " + ns + " is already used by another instance on " + url);
+		}
+		log->info("Sharing the OPC UA Server on %s", url.c_str());
+	}
+	Server& server = it->second;
+	try
+	{
+		idx = server.m_backend->registerNamespace(ns);
+	}
+	catch (...)
+	{
+		if (server.m_namespaces.empty())
+		{
+			server.m_backend->stop();
+			delete server.m_backend;
+			m_servers.erase(it);
+		}
+		throw;
+	}
+	server.m_namespaces.insert(ns);
+	return server.m_backend;
+}
+
+/**
+ * Release a server acquired by an instance of the plugin. The server is
+ * stopped and deleted when the last instance using it releases it,
+ * otherwise the instance is called back to remove its nodes from the
+ * server. The lock is held throughout, so that another instance cannot
+ * acquire the server between the decision to stop it and stopping it.
+ *
+ * @param backend	The backend of the server
+ * @param ns		The namespace of the instance
+ * @param unshare	Called if other instances still use the server
+ */
+void BackendRegistry::release(OPCUABackend *backend, const string& ns, const function<void()>& unshare)
+{
+	lock_guard<mutex> guard(m_mutex);
+	for (auto it = m_servers.begin(); it != m_servers.end(); ++it)
+	{
+		if (it->second.m_backend != backend)
+		{
+			continue;
+		}
+		it->second.m_namespaces.erase(ns);
+		if (it->second.m_namespaces.empty())
+		{
+			Logger::getLogger()->info("Stopping OPC UA Server on %s", it->first.c_str());
+			backend->stop();
+			delete backend;
+			m_servers.erase(it);
+		}
+		else
+		{
+			unshare();
+		}
+		return;
+	}
+}
@@ -0,0 +1,537 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Subscription fan-out benchmark. Starts the plugin on the loopback
+ * interface, forks a number of client processes that each subscribe to
+ * a set of variables and drives readings through the plugin at a fixed
+ * rate. Reports the notification throughput, the delivery latency from
+ * the timestamp of the reading to the notification reaching the client,
+ * in total and for each group of assets, the CPU used by the server and
+ * by each client, and the memory the
+ * address space takes per asset and per variable.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <plugin_api.h>
+#include <config_category.h>
+#include <reading.h>
+#include <latency.h>
+#include <opc/ua/client/client.h>
+#include <opc/ua/subscription.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace OpcUa;
+
+extern "C" {
+	PLUGIN_INFORMATION *plugin_info();
+	PLUGIN_HANDLE plugin_init(ConfigCategory *config);
+	uint32_t plugin_send(const PLUGIN_HANDLE handle, const vector<Reading *>& readings);
+	void plugin_shutdown(PLUGIN_HANDLE handle);
+}
+
+#define NAMESPACE	"http://fledge.dianomic.com"
+
+// The number of monitored items created in each request
+#define SUBSCRIBE_BATCH	500
+
+// The maximum number of asset groups the delivery latency is reported for
+#define MAX_GROUPS	8
+
+/**
+ * The benchmark parameters
+ */
+class Parameters {
+	public:
+		Parameters() : m_clients(4), m_items(1000), m_assets(100), m_datapoints(10),
+			m_rate(1000), m_duration(30), m_port(48400), m_publishInterval(100),
+			m_threads(0), m_shards(1), m_groups(1), m_backend("freeopcua") {};
+		unsigned int	m_clients;
+		unsigned int	m_items;
+		unsigned int	m_assets;
+		unsigned int	m_datapoints;
+		unsigned int	m_rate;
+		unsigned int	m_duration;
+		unsigned int	m_port;
+		unsigned int	m_publishInterval;
+		unsigned int	m_threads;
+		unsigned int	m_shards;
+		unsigned int	m_groups;
+		string		m_backend;
+};
+
+/**
+ * The results reported by a client process
+ */
+class ClientResult {
+	public:
+		ClientResult() : m_subscribed(0), m_notifications(0), m_cpuSeconds(0) {};
+		uint64_t		m_subscribed;
+		uint64_t		m_notifications;
+		double			m_cpuSeconds;
+		LatencyHistogram	m_latency;
+		LatencyHistogram	m_groupLatency[MAX_GROUPS];
+};
+
+/**
+ * Counts the notifications received by a client and records their latency,
+ * in total and for the group of assets of the variable
+ */
+class BenchmarkHandler : public SubscriptionHandler {
+	public:
+		BenchmarkHandler(ClientResult& result) : m_result(result), m_measuring(false) {};
+		void	DataValueChange(uint32_t handle, const Node& node, const DataValue& val, AttributeId attr) override
+			{
+				if (!m_measuring)
+					return;
+				int64_t now = (int64_t)DateTime::Current();
+				int64_t latency = (now - (int64_t)val.SourceTimestamp) / 10;
+				m_result.m_notifications++;
+				m_result.m_latency.record(latency);
+				auto it = m_groups.find(node.GetId());
+				if (it != m_groups.end())
+					m_result.m_groupLatency[it->second].record(latency);
+			};
+		ClientResult&		m_result;
+		std::atomic<bool>	m_measuring;
+		// The asset group of each monitored variable, set before measuring starts
+		map<NodeId, unsigned int>
+					m_groups;
+};
+
+/**
+ * Return the CPU time used by the calling process
+ *
+ * @return	The user and system time in seconds
+ */
+static double cpuSeconds()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+		+ usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+/**
+ * Return the resident set size of the calling process
+ *
+ * @return	The resident set size in bytes
+ */
+static size_t residentBytes()
+{
+	unsigned long size = 0, resident = 0;
+	FILE *fp = fopen("/proc/self/statm", "r");
+	if (fp)
+	{
+		if (fscanf(fp, "%lu %lu", &size, &resident) != 2)
+			resident = 0;
+		fclose(fp);
+	}
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * Return the current time
+ *
+ * @return	The time in seconds
+ */
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/**
+ * Return the group an asset belongs to. The assets are divided into
+ * groups of consecutive assets of equal size.
+ *
+ * @param params	The benchmark parameters
+ * @param asset		The number of the asset
+ * @return		The group of the asset
+ */
+static unsigned int groupOf(const Parameters& params, unsigned int asset)
+{
+	return (uint64_t)asset * params.m_groups / params.m_assets;
+}
+
+/**
+ * Return the endpoint of a shard of the benchmark server
+ *
+ * @param params	The benchmark parameters
+ * @param shard		The shard number
+ * @return		The endpoint URL
+ */
+static string endpoint(const Parameters& params, unsigned int shard)
+{
+	return "opc.tcp://127.0.0.1:" + to_string(params.m_port + shard) + "/fledge/benchmark";
+}
+
+/**
+ * The body of a client process. Waits for the server to be ready,
+ * subscribes to its share of the variables, then counts notifications
+ * until told to stop. If the server is sharded the client connects to
+ * every shard and finds each asset on the shard that holds it.
+ *
+ * @param params	The benchmark parameters
+ * @param client	The number of the client
+ * @param control	The pipe on which the start and stop commands are received
+ * @param report	The pipe on which readiness and the results are sent
+ */
+static void runClient(const Parameters& params, unsigned int client, int control, int report)
+{
+	ClientResult result;
+	BenchmarkHandler handler(result);
+	vector<UaClient *> servers;
+	vector<Subscription::SharedPtr> subscriptions;
+	char cmd;
+
+	if (read(control, &cmd, 1) != 1)
+		exit(1);
+	try
+	{
+		vector<uint32_t> namespaces;
+		for (unsigned int shard = 0; shard < params.m_shards; shard++)
+		{
+			servers.push_back(new UaClient(false));
+			servers.back()->Connect(endpoint(params, shard));
+			namespaces.push_back(servers.back()->GetNamespaceIndex(NAMESPACE));
+		}
+
+		// Find the variables of the assets this client monitors
+		unsigned int variables = params.m_assets * params.m_datapoints;
+		map<unsigned int, pair<unsigned int, map<string, NodeId> > > assets;
+		vector<vector<ReadValueId> > items(servers.size());
+		for (unsigned int i = 0; i < params.m_items && i < variables; i++)
+		{
+			unsigned int variable = (client * params.m_items + i) % variables;
+			unsigned int asset = variable / params.m_datapoints;
+			auto it = assets.find(asset);
+			if (it == assets.end())
+			{
+				it = assets.insert(pair<unsigned int, pair<unsigned int, map<string, NodeId> > >(asset,
+							pair<unsigned int, map<string, NodeId> >(0, map<string, NodeId>()))).first;
+				for (unsigned int shard = 0; shard < servers.size() && it->second.second.empty(); shard++)
+				{
+					try
+					{
+						Node obj = servers[shard]->GetNode(NodeId("bench" + to_string(asset), namespaces[shard]));
+						for (auto &child : obj.GetChildren())
+						{
+							it->second.second[child.GetBrowseName().Name] = child.GetId();
+						}
+						it->second.first = shard;
+					}
+					catch (exception &e)
+					{
+						// Not held by this shard
+					}
+				}
+			}
+			auto dp = it->second.second.find("v" + to_string(variable % params.m_datapoints));
+			if (dp != it->second.second.end())
+			{
+				ReadValueId item;
+				item.NodeId = dp->second;
+				item.AttributeId = AttributeId::Value;
+				items[it->second.first].push_back(item);
+				handler.m_groups[dp->second] = groupOf(params, asset);
+			}
+		}
+
+		for (unsigned int shard = 0; shard < servers.size(); shard++)
+		{
+			Subscription::SharedPtr sub = servers[shard]->CreateSubscription(params.m_publishInterval, handler);
+			for (size_t i = 0; i < items[shard].size(); i += SUBSCRIBE_BATCH)
+			{
+				size_t end = i + SUBSCRIBE_BATCH < items[shard].size() ? i + SUBSCRIBE_BATCH : items[shard].size();
+				sub->SubscribeDataChange(vector<ReadValueId>(items[shard].begin() + i, items[shard].begin() + end));
+			}
+			subscriptions.push_back(sub);
+			result.m_subscribed += items[shard].size();
+		}
+
+		// Discard the initial notifications of the subscriptions
+		sleep(1);
+		double cpu = cpuSeconds();
+		handler.m_measuring = true;
+		cmd = 'r';
+		if (write(report, &cmd, 1) != 1)
+			exit(1);
+
+		if (read(control, &cmd, 1) != 1)
+			exit(1);
+		handler.m_measuring = false;
+		result.m_cpuSeconds = cpuSeconds() - cpu;
+		for (auto &sub : subscriptions)
+			sub->Delete();
+		for (auto server : servers)
+			server->Disconnect();
+	}
+	catch (exception &e)
+	{
+		fprintf(stderr, "Client %u: %s\n", client, e.what());
+		cmd = 'r';
+		if (write(report, &cmd, 1) != 1)
+			exit(1);
+		if (read(control, &cmd, 1) != 1)
+			exit(1);
+	}
+	if (write(report, &result, sizeof(result)) != sizeof(result))
+		exit(1);
+	exit(0);
+}
+
+/**
+ * Read the result of a client, which may arrive in more than one read
+ * as it is larger than the atomic size of a pipe write
+ *
+ * @param fd		The pipe the client reports on
+ * @param result	The result of the client
+ * @return		True if the whole result was read
+ */
+static bool readResult(int fd, ClientResult& result)
+{
+	char *p = (char *)&result;
+	size_t remaining = sizeof(result);
+	while (remaining > 0)
+	{
+		ssize_t n = read(fd, p, remaining);
+		if (n <= 0)
+			return false;
+		p += n;
+		remaining -= n;
+	}
+	return true;
+}
+
+/**
+ * Create a reading of an asset with a new value for every datapoint
+ *
+ * @param params	The benchmark parameters
+ * @param asset		The number of the asset
+ * @param sequence	A sequence number used to generate changing values
+ * @return		The reading
+ */
+static Reading *makeReading(const Parameters& params, unsigned int asset, unsigned long sequence)
+{
+	vector<Datapoint *> datapoints;
+	for (unsigned int i = 0; i < params.m_datapoints; i++)
+	{
+		DatapointValue value((double)sequence + i / 100.0);
+		datapoints.push_back(new Datapoint("v" + to_string(i), value));
+	}
+	return new Reading("bench" + to_string(asset), datapoints);
+}
+
+/**
+ * Print the usage of the benchmark and exit
+ *
+ * @param name	The name of the program
+ */
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"  -c <clients>     Number of client processes (4)\n"
+		"  -m <items>       Monitored items per client (1000)\n"
+		"  -a <assets>      Number of assets, at least 2 (100)\n"
+		"  -d <datapoints>  Datapoints per asset (10)\n"
+		"  -r <rate>        Readings per second (1000)\n"
+		"  -t <seconds>     Duration of the measurement (30)\n"
+		"  -p <port>        Port of the server (48400)\n"
+		"  -i <ms>          Publishing interval of the subscriptions (100)\n"
+		"  -w <threads>     Conversion threads of the plugin (0)\n"
+		"  -s <shards>      Server shards of the plugin (1)\n"
+		"  -b <backend>     Server backend of the plugin, freeopcua or open62541 (freeopcua)\n"
+		"  -g <groups>      Asset groups to report the delivery latency of, up to 8 (1)\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	Parameters params;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:m:a:d:r:t:p:i:w:s:b:g:")) != -1)
+	{
+		unsigned int value = strtoul(optarg, NULL, 10);
+		switch (opt)
+		{
+			case 'c': params.m_clients = value; break;
+			case 'm': params.m_items = value; break;
+			case 'a': params.m_assets = value; break;
+			case 'd': params.m_datapoints = value; break;
+			case 'r': params.m_rate = value; break;
+			case 't': params.m_duration = value; break;
+			case 'p': params.m_port = value; break;
+			case 'i': params.m_publishInterval = value; break;
+			case 'w': params.m_threads = value; break;
+			case 's': params.m_shards = value; break;
+			case 'b': params.m_backend = optarg; break;
+			case 'g': params.m_groups = value; break;
+			default: usage(argv[0]);
+		}
+	}
+	if (params.m_assets < 2 || params.m_datapoints == 0 || params.m_rate == 0
+			|| params.m_groups == 0 || params.m_groups > MAX_GROUPS || params.m_groups > params.m_assets)
+		usage(argv[0]);
+
+	// The clients are forked before the server creates any threads
+	vector<int> control(params.m_clients), report(params.m_clients);
+	vector<pid_t> pids(params.m_clients);
+	for (unsigned int i = 0; i < params.m_clients; i++)
+	{
+		int down[2], up[2];
+		if (pipe(down) == -1 || pipe(up) == -1)
+		{
+			perror("pipe");
+			return 1;
+		}
+		pids[i] = fork();
+		if (pids[i] == 0)
+		{
+			close(down[1]);
+			close(up[0]);
+			runClient(params, i, down[0], up[1]);
+		}
+		close(down[0]);
+		close(up[1]);
+		control[i] = down[1];
+		report[i] = up[0];
+	}
+
+	PLUGIN_INFORMATION *info = plugin_info();
+	ConfigCategory config("benchmark", info->config);
+	config.setItemsValueFromDefault();
+	config.setValue("url", endpoint(params, 0));
+	config.setValue("conversionThreads", to_string(params.m_threads));
+	config.setValue("parallelThreshold", "1");
+	config.setValue("shards", to_string(params.m_shards));
+	config.setValue("backend", params.m_backend);
+	PLUGIN_HANDLE handle = plugin_init(&config);
+
+	// Create the address space, the first asset starts the server so
+	// that the memory of the others is measured without it
+	unsigned long sequence = 0;
+	vector<Reading *> block;
+	size_t resident = 0;
+	for (unsigned int i = 0; i < params.m_assets; i++)
+	{
+		block.push_back(makeReading(params, i, sequence));
+		plugin_send(handle, block);
+		delete block.back();
+		block.clear();
+		if (i == 0)
+			resident = residentBytes();
+	}
+	double addressSpace = (double)residentBytes() - resident;
+	unsigned int measuredAssets = params.m_assets - 1;
+
+	char cmd = 'g';
+	for (unsigned int i = 0; i < params.m_clients; i++)
+		if (write(control[i], &cmd, 1) != 1)
+			return 1;
+	for (unsigned int i = 0; i < params.m_clients; i++)
+		if (read(report[i], &cmd, 1) != 1)
+			return 1;
+
+	// Drive readings at the target rate in blocks every 10ms
+	double cpu = cpuSeconds();
+	double start = now(), elapsed = 0;
+	unsigned long sent = 0;
+	unsigned int asset = 0;
+	while ((elapsed = now() - start) < params.m_duration)
+	{
+		unsigned long due = (unsigned long)(elapsed * params.m_rate);
+		for (; sent < due; sent++)
+		{
+			block.push_back(makeReading(params, asset, ++sequence));
+			asset = (asset + 1) % params.m_assets;
+		}
+		if (!block.empty())
+		{
+			plugin_send(handle, block);
+			for (auto reading : block)
+				delete reading;
+			block.clear();
+		}
+		usleep(10000);
+	}
+	double serverCpu = cpuSeconds() - cpu;
+	elapsed = now() - start;
+
+	// Allow the last notifications to be delivered
+	usleep(2 * params.m_publishInterval * 1000);
+	cmd = 's';
+	for (unsigned int i = 0; i < params.m_clients; i++)
+		if (write(control[i], &cmd, 1) != 1)
+			return 1;
+
+	LatencyHistogram latency, groupLatency[MAX_GROUPS];
+	uint64_t notifications = 0, subscribed = 0;
+	double clientCpu = 0, maxClientCpu = 0;
+	for (unsigned int i = 0; i < params.m_clients; i++)
+	{
+		ClientResult result;
+		if (!readResult(report[i], result))
+		{
+			fprintf(stderr, "No result from client %u\n", i);
+			continue;
+		}
+		waitpid(pids[i], NULL, 0);
+		latency.merge(result.m_latency);
+		for (unsigned int group = 0; group < params.m_groups; group++)
+			groupLatency[group].merge(result.m_groupLatency[group]);
+		notifications += result.m_notifications;
+		subscribed += result.m_subscribed;
+		clientCpu += result.m_cpuSeconds;
+		if (result.m_cpuSeconds > maxClientCpu)
+			maxClientCpu = result.m_cpuSeconds;
+	}
+	plugin_shutdown(handle);
+
+	LatencySummary summary;
+	latency.summarise(summary);
+	printf("Backend %s, clients %u, monitored items %lu, variables %u\n",
+			params.m_backend.c_str(), params.m_clients, (unsigned long)subscribed, params.m_assets * params.m_datapoints);
+	printf("Target rate %u readings/s, publishing interval %ums, conversion threads %u, shards %u\n",
+			params.m_rate, params.m_publishInterval, params.m_threads, params.m_shards);
+	printf("Readings sent %lu in %.1fs, %.0f readings/s, %.0f values/s\n",
+			sent, elapsed, sent / elapsed, sent * params.m_datapoints / elapsed);
+	printf("Notifications %lu, %.0f/s, %.0f/s per client\n", (unsigned long)notifications,
+			notifications / elapsed, params.m_clients ? notifications / elapsed / params.m_clients : 0);
+	printf("Delivery latency ms: mean %.2f, p50 %.2f, p95 %.2f, p99 %.2f, max %.2f\n",
+			summary.m_mean, summary.m_p50, summary.m_p95, summary.m_p99, summary.m_max);
+	for (unsigned int group = 0; params.m_groups > 1 && group < params.m_groups; group++)
+	{
+		unsigned int first = (params.m_assets * group + params.m_groups - 1) / params.m_groups;
+		unsigned int last = (params.m_assets * (group + 1) + params.m_groups - 1) / params.m_groups - 1;
+		LatencySummary groupSummary;
+		groupLatency[group].summarise(groupSummary);
+		printf("  Assets bench%u to bench%u: count %lu, mean %.2f, p50 %.2f, p95 %.2f, p99 %.2f, max %.2f\n",
+				first, last, (unsigned long)groupSummary.m_count, groupSummary.m_mean,
+				groupSummary.m_p50, groupSummary.m_p95, groupSummary.m_p99, groupSummary.m_max);
+	}
+	printf("CPU: server %.1f%%, client mean %.1f%%, client max %.1f%%\n",
+			100 * serverCpu / elapsed,
+			params.m_clients ? 100 * clientCpu / elapsed / params.m_clients : 0,
+			100 * maxClientCpu / elapsed);
+	printf("Address space: %.1f MB resident for %u assets, %.0f bytes per asset, %.0f bytes per variable\n",
+			addressSpace / (1024 * 1024), measuredAssets, addressSpace / measuredAssets,
+			addressSpace / (measuredAssets * params.m_datapoints));
+	return 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * History store benchmark. Appends samples for a number of variables to
+ * a disk history store, as the update path does, and reports the rate
+ * at which samples are appended and the size of the compressed segments.
+ * The store is then reopened and random time ranges are read back with
+ * ReadRaw, reporting the latency of each read.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <history_store.h>
+#include <latency.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace OpcUa;
+
+// The number of 100ns ticks between 1601, the OPC UA epoch, and 1970
+#define EPOCH_OFFSET	116444736000000000LL
+
+// The most samples appended before the writer thread is given time to write them
+#define APPEND_CHUNK	(512 * 1024)
+
+/**
+ * Return the current time
+ *
+ * @return	The time in microseconds
+ */
+static int64_t now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/**
+ * Return the total size of the segment files in a directory
+ *
+ * @param directory	The history directory
+ * @param segments	Set to the number of segment files
+ * @return		The size in bytes
+ */
+static size_t segmentSize(const string& directory, unsigned int& segments)
+{
+	size_t size = 0;
+	segments = 0;
+	DIR *dir = opendir(directory.c_str());
+	if (!dir)
+	{
+		return 0;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (strncmp(entry->d_name, "segment-", 8) != 0)
+			continue;
+		struct stat st;
+		if (stat((directory + "/" + entry->d_name).c_str(), &st) == 0)
+		{
+			size += st.st_size;
+			segments++;
+		}
+	}
+	closedir(dir);
+	return size;
+}
+
+/**
+ * Print the usage of the benchmark and exit
+ *
+ * @param name	The name of the program
+ */
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"  -d <directory>    Directory for the history, a temporary directory if not given\n"
+		"  -v <variables>    Number of variables (100)\n"
+		"  -n <samples>      Number of samples per variable (100000)\n"
+		"  -i <interval>     Interval between the samples of a variable in milliseconds (1000)\n"
+		"  -g <seconds>      Segment period in seconds (1)\n"
+		"  -q <queries>      Number of ReadRaw queries (1000)\n"
+		"  -w <samples>      Number of samples in the time range of each query (3600)\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	string directory;
+	unsigned int variables = 100, samples = 100000, interval = 1000, segmentSeconds = 1;
+	unsigned int queries = 1000, window = 3600;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:v:n:i:g:q:w:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'd':
+				directory = optarg;
+				break;
+			case 'v':
+				variables = strtoul(optarg, NULL, 10);
+				break;
+			case 'n':
+				samples = strtoul(optarg, NULL, 10);
+				break;
+			case 'i':
+				interval = strtoul(optarg, NULL, 10);
+				break;
+			case 'g':
+				segmentSeconds = strtoul(optarg, NULL, 10);
+				break;
+			case 'q':
+				queries = strtoul(optarg, NULL, 10);
+				break;
+			case 'w':
+				window = strtoul(optarg, NULL, 10);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind != argc || variables == 0 || samples == 0 || interval == 0)
+		usage(argv[0]);
+	bool temporary = directory.empty();
+	if (temporary)
+	{
+		char path[] = "/tmp/opcua-history-XXXXXX";
+		if (!mkdtemp(path))
+		{
+			perror("mkdtemp");
+			return 1;
+		}
+		directory = path;
+	}
+
+	// Samples end now and go back in time at the sample interval
+	int64_t step = (int64_t)interval * 10000;
+	int64_t first = (int64_t)time(NULL) * 10000000 + EPOCH_OFFSET - step * samples;
+
+	HistoryStore store;
+	if (!store.open(directory, segmentSeconds, 0, 0))
+	{
+		fprintf(stderr, "Unable to open the history store in %s\n", directory.c_str());
+		return 1;
+	}
+	for (unsigned int v = 0; v < variables; v++)
+	{
+		store.add(v, NodeId(v + 1, 2), "asset" + to_string(v / 10) + "\tdatapoint" + to_string(v % 10));
+	}
+
+	// The values wander slowly and are rounded, as sensor values typically are
+	int64_t appendTime = 0, start = now();
+	unsigned long appended = 0;
+	vector<double> values(variables, 20.0);
+	unsigned int seed = 1;
+	for (unsigned int s = 0; s < samples; s++)
+	{
+		int64_t timestamp = first + step * s;
+		int64_t before = now();
+		for (unsigned int v = 0; v < variables; v++)
+		{
+			values[v] += (rand_r(&seed) % 21 - 10) / 100.0;
+			store.append(v, timestamp, round(values[v] * 100) / 100);
+		}
+		appendTime += now() - before;
+		appended += variables;
+		if (appended % APPEND_CHUNK < variables && s + 1 < samples)
+		{
+			// The writer collects the queued samples once a second
+			usleep(1100000);
+		}
+	}
+	int64_t closeStart = now();
+	store.close();
+	int64_t closeTime = now() - closeStart;
+	int64_t wall = now() - start;
+
+	unsigned int segments;
+	size_t size = segmentSize(directory, segments);
+	printf("Appended %lu samples of %u variables in %.2fs\n", appended, variables, wall / 1e6);
+	printf("Append rate %.0f samples/s, %.1fns per sample on the update path\n",
+			appendTime ? appended / (appendTime / 1e6) : 0, appendTime * 1000.0 / appended);
+	printf("Writing the final samples on close took %.3fs\n", closeTime / 1e6);
+	printf("%u segments of %lu bytes in total, %.2f bytes per sample\n",
+			segments, (unsigned long)size, (double)size / appended);
+
+	if (!store.open(directory, segmentSeconds, 0, 0))
+	{
+		fprintf(stderr, "Unable to reopen the history store in %s\n", directory.c_str());
+		return 1;
+	}
+	for (unsigned int v = 0; v < variables; v++)
+	{
+		store.add(v, NodeId(v + 1, 2), "asset" + to_string(v / 10) + "\tdatapoint" + to_string(v % 10));
+	}
+	LatencyHistogram readTimes;
+	unsigned long returned = 0;
+	if (window > samples)
+		window = samples;
+	for (unsigned int q = 0; q < queries; q++)
+	{
+		unsigned int variable = rand_r(&seed) % variables;
+		int64_t rangeStart = first + step * (rand_r(&seed) % (samples - window + 1));
+		int64_t rangeEnd = rangeStart + step * (window - 1);
+		vector<int64_t> timestamps;
+		vector<double> result;
+		int64_t before = now();
+		store.readRaw(NodeId(variable + 1, 2), rangeStart, rangeEnd, 0, timestamps, result);
+		readTimes.record(now() - before);
+		returned += result.size();
+	}
+	store.close();
+
+	LatencySummary summary;
+	readTimes.summarise(summary);
+	printf("%u ReadRaw queries of %u samples, %.0f samples returned per query\n",
+			queries, window, queries ? (double)returned / queries : 0);
+	printf("ReadRaw latency ms: mean %.3f, p50 %.3f, p95 %.3f, p99 %.3f, max %.3f\n",
+			summary.m_mean, summary.m_p50, summary.m_p95, summary.m_p99, summary.m_max);
+
+	if (temporary)
+	{
+		DIR *dir = opendir(directory.c_str());
+		struct dirent *entry;
+		while (dir && (entry = readdir(dir)) != NULL)
+		{
+			if (entry->d_name[0] != '.')
+				unlink((directory + "/" + entry->d_name).c_str());
+		}
+		if (dir)
+			closedir(dir);
+		rmdir(directory.c_str());
+	}
+	return 0;
+}
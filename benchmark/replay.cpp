@@ -0,0 +1,224 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Replays a capture file through the plugin. The blocks of readings are
+ * passed to the plugin with their original timing, scaled by a speed
+ * factor, or as fast as possible. Reports the time spent sending the
+ * blocks so that performance can be compared between builds using the
+ * same traffic. It can also replay the file once for each number of
+ * conversion threads in a range to show how the conversion scales.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <plugin_api.h>
+#include <config_category.h>
+#include <reading.h>
+#include <capture.h>
+#include <latency.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+extern "C" {
+	PLUGIN_INFORMATION *plugin_info();
+	PLUGIN_HANDLE plugin_init(ConfigCategory *config);
+	uint32_t plugin_send(const PLUGIN_HANDLE handle, const vector<Reading *>& readings);
+	void plugin_shutdown(PLUGIN_HANDLE handle);
+}
+
+/**
+ * Return the current time
+ *
+ * @return	The time in microseconds
+ */
+static int64_t now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/**
+ * The results of replaying a capture file
+ */
+class ReplayResult {
+	public:
+		ReplayResult() : m_blocks(0), m_readings(0), m_busy(0), m_wall(0) {};
+		unsigned long		m_blocks;
+		unsigned long		m_readings;
+		int64_t			m_busy;
+		int64_t			m_wall;
+		LatencyHistogram	m_sendTimes;
+};
+
+/**
+ * Replay a capture file through a new instance of the plugin
+ *
+ * @param path		The capture file
+ * @param speed		The replay speed, 0 for as fast as possible
+ * @param loops		The number of times to replay the file
+ * @param settings	The plugin configuration items to set
+ * @param result	The result of the replay
+ * @return		False if the file is not a capture file
+ */
+static bool replay(const char *path, double speed, unsigned int loops,
+		const vector<pair<string, string> >& settings, ReplayResult& result)
+{
+	PLUGIN_INFORMATION *info = plugin_info();
+	ConfigCategory config("replay", info->config);
+	config.setItemsValueFromDefault();
+	for (auto &setting : settings)
+		config.setValue(setting.first, setting.second);
+	PLUGIN_HANDLE handle = plugin_init(&config);
+
+	int64_t start = now();
+	for (unsigned int loop = 0; loop < loops; loop++)
+	{
+		CaptureReader reader;
+		if (!reader.open(path))
+		{
+			plugin_shutdown(handle);
+			return false;
+		}
+		vector<Reading *> block;
+		int64_t offset, loopStart = now();
+		while (reader.next(block, offset))
+		{
+			if (speed > 0)
+			{
+				int64_t delay = loopStart + (int64_t)(offset / speed) - now();
+				if (delay > 0)
+					usleep(delay);
+			}
+			int64_t before = now();
+			plugin_send(handle, block);
+			int64_t elapsed = now() - before;
+			result.m_busy += elapsed;
+			result.m_sendTimes.record(elapsed);
+			result.m_blocks++;
+			result.m_readings += block.size();
+			for (auto reading : block)
+				delete reading;
+		}
+	}
+	result.m_wall = now() - start;
+	plugin_shutdown(handle);
+	return true;
+}
+
+/**
+ * Return the rate at which readings were sent while the plugin was busy
+ *
+ * @param result	The result of a replay
+ * @return		The readings per second
+ */
+static double sendRate(const ReplayResult& result)
+{
+	return result.m_busy ? result.m_readings / (result.m_busy / 1e6) : 0;
+}
+
+/**
+ * Print the usage of the replay tool and exit
+ *
+ * @param name	The name of the program
+ */
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [options] <capture file>\n"
+		"  -x <speed>        Replay speed relative to the capture, 0 for as fast as possible (1)\n"
+		"  -n <loops>        Number of times to replay the file (1)\n"
+		"  -c <item=value>   Set a plugin configuration item, may be repeated\n"
+		"  -t <threads>      Replay once for each number of conversion threads from 1 to threads\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	double speed = 1.0;
+	unsigned int loops = 1, threads = 0;
+	vector<pair<string, string> > settings;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "x:n:c:t:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'x':
+				speed = strtod(optarg, NULL);
+				break;
+			case 'n':
+				loops = strtoul(optarg, NULL, 10);
+				break;
+			case 'c':
+			{
+				const char *eq = strchr(optarg, '=');
+				if (!eq)
+					usage(argv[0]);
+				settings.push_back(pair<string, string>(string(optarg, eq - optarg), string(eq + 1)));
+				break;
+			}
+			case 't':
+				threads = strtoul(optarg, NULL, 10);
+				if (threads == 0)
+					usage(argv[0]);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || speed < 0)
+		usage(argv[0]);
+	const char *path = argv[optind];
+
+	if (threads)
+	{
+		// The sweep overrides any conversionThreads set with -c
+		settings.push_back(pair<string, string>("conversionThreads", ""));
+		double base = 0;
+		printf("Threads  Readings/s  Speedup  p50 ms  p99 ms\n");
+		for (unsigned int count = 1; count <= threads; count++)
+		{
+			settings.back().second = to_string(count);
+			ReplayResult result;
+			if (!replay(path, speed, loops, settings, result))
+			{
+				fprintf(stderr, "%s is not a capture file\n", path);
+				return 1;
+			}
+			LatencySummary summary;
+			result.m_sendTimes.summarise(summary);
+			double rate = sendRate(result);
+			if (count == 1)
+				base = rate;
+			printf("%7u  %10.0f  %7.2f  %6.3f  %6.3f\n", count, rate,
+					base ? rate / base : 0, summary.m_p50, summary.m_p99);
+		}
+		return 0;
+	}
+
+	ReplayResult result;
+	if (!replay(path, speed, loops, settings, result))
+	{
+		fprintf(stderr, "%s is not a capture file\n", path);
+		return 1;
+	}
+
+	LatencySummary summary;
+	result.m_sendTimes.summarise(summary);
+	printf("Replayed %lu blocks, %lu readings in %.2fs\n", result.m_blocks, result.m_readings, result.m_wall / 1e6);
+	printf("Time in send %.2fs, %.0f readings/s while sending\n",
+			result.m_busy / 1e6, sendRate(result));
+	printf("Send time per block ms: mean %.3f, p50 %.3f, p95 %.3f, p99 %.3f, max %.3f\n",
+			summary.m_mean, summary.m_p50, summary.m_p95, summary.m_p99, summary.m_max);
+	return 0;
+}
@@ -0,0 +1,297 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Concurrency stress test for the control path of the plugin. An
+ * OPCUAServer is started on the loopback interface with a control map
+ * of a number of nodes. Reader threads call nodeChange on it with the
+ * NodeIds of the control variables, as the subscription thread of the
+ * backend does when a client writes to them, while another thread keeps
+ * registering one of two sets of control callbacks with registerControl
+ * and the main thread restarts the server, so that createControlNodes
+ * publishes a new control index while the readers look nodes up in the
+ * old one. The write callbacks check that every node they are called
+ * for is passed with the destination of that node. Build with -DTSAN=ON
+ * to run it under ThreadSanitizer.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <opcua.h>
+#include <opc/ua/client/client.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace OpcUa;
+
+extern "C" {
+	PLUGIN_INFORMATION *plugin_info();
+}
+
+#define NAMESPACE	"http://fledge.dianomic.com"
+#define SERVICES	7
+
+static atomic<bool>		finished(false);
+static atomic<unsigned long>	writes[2];
+static atomic<unsigned long>	registrations(0);
+static atomic<unsigned long>	errors(0);
+
+/**
+ * Return the time in microseconds from a monotonic clock
+ */
+static int64_t now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Check that a control write is for a control node of the map with the
+ * service of that node as its destination
+ *
+ * @param name		The name of the control node
+ * @param destination	The destination of the write
+ * @param service	The service the write is sent to
+ * @return		True if the write is consistent with the control map
+ */
+static bool consistent(const char *name, ControlDestination destination, const char *service)
+{
+	if (strncmp(name, "control", 7) != 0 || destination != DestinationService || !service)
+	{
+		return false;
+	}
+	unsigned int node = strtoul(name + 7, NULL, 10);
+	return ("service" + to_string(node % SERVICES)).compare(service) == 0;
+}
+
+/**
+ * The first of the control write callbacks
+ */
+static bool writeFirst(const char *name, const char *value, ControlDestination destination, ...)
+{
+	va_list ap;
+	va_start(ap, destination);
+	const char *service = va_arg(ap, const char *);
+	va_end(ap);
+	if (!consistent(name, destination, service))
+		errors++;
+	writes[0]++;
+	return true;
+}
+
+/**
+ * The second of the control write callbacks
+ */
+static bool writeSecond(const char *name, const char *value, ControlDestination destination, ...)
+{
+	va_list ap;
+	va_start(ap, destination);
+	const char *service = va_arg(ap, const char *);
+	va_end(ap);
+	if (!consistent(name, destination, service))
+		errors++;
+	writes[1]++;
+	return true;
+}
+
+/**
+ * The control operation callback, control methods are not configured
+ */
+static int operation(char *operation, int paramCount, char *parameters[], ControlDestination destination, ...)
+{
+	return 0;
+}
+
+/**
+ * Return the control map of the test
+ *
+ * @param nodes	The number of control nodes
+ * @return	The control map
+ */
+static string controlMap(unsigned int nodes)
+{
+	string map = "{ \"nodes\" : [";
+	for (unsigned int i = 0; i < nodes; i++)
+	{
+		if (i)
+			map += ", ";
+		map += "{ \"name\" : \"control" + to_string(i) + "\", \"type\" : \""
+			+ (i % 2 ? "float" : "integer") + "\", \"service\" : \"service"
+			+ to_string(i % SERVICES) + "\" }";
+	}
+	return map + "] }";
+}
+
+/**
+ * Find the NodeIds of the control variables by browsing the server
+ *
+ * @param url		The endpoint of the server
+ * @param nodes		Set to the NodeIds of the control variables
+ */
+static void findControlNodes(const string& url, vector<NodeId>& nodes)
+{
+	UaClient client(false);
+	client.Connect(url);
+	uint32_t idx = client.GetNamespaceIndex(NAMESPACE);
+	Node control = client.GetNode(NodeId(99, idx));
+	for (auto &child : control.GetChildren())
+	{
+		nodes.push_back(child.GetId());
+	}
+	client.Disconnect();
+}
+
+/**
+ * Report writes to the control variables until the test finishes
+ *
+ * @param server	The server
+ * @param nodes		The NodeIds of the control variables
+ * @param seed		The seed for the choice of node
+ */
+static void reader(OPCUAServer *server, const vector<NodeId> *nodes, unsigned int seed)
+{
+	while (!finished.load())
+	{
+		const NodeId &node = (*nodes)[rand_r(&seed) % nodes->size()];
+		server->nodeChange(node, Variant((int32_t)rand_r(&seed)));
+	}
+}
+
+/**
+ * Swap the control callbacks of the server until the test finishes
+ *
+ * @param server	The server
+ */
+static void registrar(OPCUAServer *server)
+{
+	unsigned long count = 0;
+	while (!finished.load())
+	{
+		server->registerControl((count++ & 1) ? writeSecond : writeFirst, operation);
+	}
+	registrations += count;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"  -r <readers>   Number of reader threads (4)\n"
+		"  -n <nodes>     Number of control nodes (200)\n"
+		"  -g <restarts>  Number of times the server is restarted (20)\n"
+		"  -p <port>      Port of the server (48500)\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int readers = 4, nodes = 200, port = 48500;
+	unsigned long restarts = 20;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "r:n:g:p:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'r':
+				readers = strtoul(optarg, NULL, 10);
+				break;
+			case 'n':
+				nodes = strtoul(optarg, NULL, 10);
+				break;
+			case 'g':
+				restarts = strtoul(optarg, NULL, 10);
+				break;
+			case 'p':
+				port = strtoul(optarg, NULL, 10);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (readers == 0 || nodes == 0 || optind != argc)
+		usage(argv[0]);
+
+	string url = "opc.tcp://127.0.0.1:" + to_string(port) + "/fledge/stress";
+	PLUGIN_INFORMATION *info = plugin_info();
+	ConfigCategory config("stress", info->config);
+	config.setItemsValueFromDefault();
+	config.setValue("url", url);
+	config.setValue("controlMap", controlMap(nodes));
+
+	OPCUAServer server;
+	server.configure(&config);
+	server.registerControl(writeFirst, operation);
+
+	vector<Datapoint *> datapoints;
+	DatapointValue value((long)1);
+	datapoints.push_back(new Datapoint("value", value));
+	Reading reading("stress", datapoints);
+	vector<Reading *> block(1, &reading);
+	if (server.send(block) != 1)
+	{
+		fprintf(stderr, "The server failed to start\n");
+		return 1;
+	}
+
+	vector<NodeId> controls;
+	try
+	{
+		findControlNodes(url, controls);
+	}
+	catch (exception &e)
+	{
+		fprintf(stderr, "Failed to browse the control nodes: %s\n", e.what());
+		return 1;
+	}
+	if (controls.size() != nodes)
+	{
+		fprintf(stderr, "Found %u control nodes, %u were configured\n", (unsigned int)controls.size(), nodes);
+		return 1;
+	}
+
+	int64_t start = now();
+	vector<thread> threads;
+	for (unsigned int i = 0; i < readers; i++)
+	{
+		threads.push_back(thread(reader, &server, &controls, i + 1));
+	}
+	threads.push_back(thread(registrar, &server));
+	for (unsigned long restart = 0; restart < restarts; restart++)
+	{
+		// Each start publishes a new control index while the readers use the old one
+		server.stop();
+		if (server.send(block) != 1)
+		{
+			fprintf(stderr, "The server failed to restart\n");
+			errors++;
+		}
+	}
+	finished = true;
+	for (auto &t : threads)
+	{
+		t.join();
+	}
+	double elapsed = (now() - start) / 1e6;
+	server.stop();
+
+	unsigned long total = writes[0].load() + writes[1].load();
+	printf("Restarted the server %lu times with %u readers of %u control nodes in %.2fs\n",
+			restarts, readers, nodes, elapsed);
+	printf("Control writes: %lu (%.0f/s), %lu and %lu through each callback\n",
+			total, total / elapsed, writes[0].load(), writes[1].load());
+	printf("Callback registrations: %lu\n", registrations.load());
+	printf("Errors: %lu\n", errors.load());
+	return (errors.load() || total == 0) ? 1 : 0;
+}
@@ -0,0 +1,580 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <capture.h>
+#include <logger.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+using namespace std;
+
+#define CAPTURE_MAGIC	"FOPCAP1\n"
+#define MAGIC_LENGTH	8
+
+// The maximum length of a string or number of items accepted by the reader
+#define MAX_LENGTH	(64 * 1024 * 1024)
+
+/**
+ * The types of datapoint values in a capture file
+ */
+enum CaptureType { CaptureNull, CaptureInteger, CaptureFloat, CaptureString,
+			CaptureFloatArray, CaptureDict, CaptureList };
+
+/**
+ * Constructor for the capture writer
+ */
+CaptureWriter::CaptureWriter() : m_file(NULL), m_limit(0), m_written(0), m_anonymise(false), m_start(0)
+{
+}
+
+/**
+ * Destructor for the capture writer
+ */
+CaptureWriter::~CaptureWriter()
+{
+	close();
+}
+
+/**
+ * Create a capture file
+ *
+ * @param path		The path of the file
+ * @param limit		The maximum size of the file in bytes, 0 for no limit
+ * @param anonymise	Replace names and string values with tokens
+ * @return		True if the file was created
+ */
+bool CaptureWriter::open(const string& path, size_t limit, bool anonymise)
+{
+	close();
+	m_file = fopen(path.c_str(), "w");
+	if (!m_file)
+	{
+		Logger::getLogger()->error("Unable to create capture file %s: %s", path.c_str(), strerror(errno));
+		return false;
+	}
+	m_limit = limit;
+	m_anonymise = anonymise;
+	m_written = MAGIC_LENGTH;
+	m_start = 0;
+	m_names.clear();
+	m_tokens.clear();
+	fwrite(CAPTURE_MAGIC, 1, MAGIC_LENGTH, m_file);
+	Logger::getLogger()->info("Capturing readings to %s", path.c_str());
+	return true;
+}
+
+/**
+ * Close the capture file
+ */
+void CaptureWriter::close()
+{
+	if (m_file)
+	{
+		fclose(m_file);
+		m_file = NULL;
+	}
+}
+
+/**
+ * Append a block of readings to the capture file
+ *
+ * @param readings	The block of readings
+ */
+void CaptureWriter::write(const vector<Reading *>& readings)
+{
+	if (!m_file)
+	{
+		return;
+	}
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	int64_t micros = (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+	if (m_start == 0)
+	{
+		m_start = micros;
+	}
+
+	m_buffer.clear();
+	putVarint(micros > m_start ? micros - m_start : 0);
+	putVarint(readings.size());
+	for (auto reading : readings)
+	{
+		struct timeval userTS, ingestTS;
+		reading->getUserTimestamp(&userTS);
+		reading->getTimestamp(&ingestTS);
+		putName(reading->getAssetName());
+		putTime(userTS);
+		putTime(ingestTS);
+		putDatapoints(reading->getReadingData());
+	}
+	if (m_limit && m_written + m_buffer.length() > m_limit)
+	{
+		Logger::getLogger()->warn("The capture file has reached its size limit, capture has stopped");
+		close();
+		return;
+	}
+	if (fwrite(m_buffer.data(), 1, m_buffer.length(), m_file) != m_buffer.length())
+	{
+		Logger::getLogger()->error("Failed to write to the capture file: %s, capture has stopped", strerror(errno));
+		close();
+		return;
+	}
+	m_written += m_buffer.length();
+}
+
+/**
+ * Append a variable length integer
+ *
+ * @param value	The integer
+ */
+void CaptureWriter::putVarint(uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		m_buffer.push_back((char)(value | 0x80));
+		value >>= 7;
+	}
+	m_buffer.push_back((char)value);
+}
+
+/**
+ * Append a double
+ *
+ * @param value	The double
+ */
+void CaptureWriter::putDouble(double value)
+{
+	m_buffer.append((const char *)&value, sizeof(value));
+}
+
+/**
+ * Append a string as its length followed by its characters
+ *
+ * @param str	The string
+ */
+void CaptureWriter::putString(const string& str)
+{
+	if (m_anonymise)
+	{
+		string token = anonymise(str);
+		putVarint(token.length());
+		m_buffer.append(token);
+		return;
+	}
+	putVarint(str.length());
+	m_buffer.append(str);
+}
+
+/**
+ * Append a name. A name is written in full the first time it is seen,
+ * after that only its index is written.
+ *
+ * @param name	The name
+ */
+void CaptureWriter::putName(const string& name)
+{
+	auto it = m_names.find(name);
+	if (it != m_names.end())
+	{
+		putVarint(it->second);
+		return;
+	}
+	uint64_t index = m_names.size();
+	m_names.insert(pair<string, uint64_t>(name, index));
+	putVarint(index);
+	putString(name);
+}
+
+/**
+ * Append a timestamp
+ *
+ * @param tv	The timestamp
+ */
+void CaptureWriter::putTime(const struct timeval& tv)
+{
+	putVarint(tv.tv_sec);
+	putVarint(tv.tv_usec);
+}
+
+/**
+ * Append a set of datapoints
+ *
+ * @param datapoints	The datapoints
+ */
+void CaptureWriter::putDatapoints(vector<Datapoint *>& datapoints)
+{
+	putVarint(datapoints.size());
+	for (auto dp : datapoints)
+	{
+		putName(dp->getName());
+		putValue(dp->getData());
+	}
+}
+
+/**
+ * Append a datapoint value
+ *
+ * @param value	The value
+ */
+void CaptureWriter::putValue(DatapointValue& value)
+{
+	switch (value.getType())
+	{
+		case DatapointValue::T_INTEGER:
+		{
+			int64_t v = value.toInt();
+			m_buffer.push_back(CaptureInteger);
+			putVarint(((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+			break;
+		}
+		case DatapointValue::T_FLOAT:
+			m_buffer.push_back(CaptureFloat);
+			putDouble(value.toDouble());
+			break;
+		case DatapointValue::T_STRING:
+			m_buffer.push_back(CaptureString);
+			putString(value.toStringValue());
+			break;
+		case DatapointValue::T_FLOAT_ARRAY:
+		{
+			vector<double> *array = value.getDpArr();
+			m_buffer.push_back(CaptureFloatArray);
+			putVarint(array->size());
+			for (auto v : *array)
+				putDouble(v);
+			break;
+		}
+		case DatapointValue::T_DP_DICT:
+			m_buffer.push_back(CaptureDict);
+			putDatapoints(*value.getDpVec());
+			break;
+		case DatapointValue::T_DP_LIST:
+			m_buffer.push_back(CaptureList);
+			putDatapoints(*value.getDpVec());
+			break;
+		default:
+			m_buffer.push_back(CaptureNull);
+			break;
+	}
+}
+
+/**
+ * Replace each "/" separated part of a string with a token. The same
+ * part is always replaced by the same token so the structure of the
+ * hierarchy and the relationships between names are retained.
+ *
+ * @param str	The string
+ * @return	The anonymised string
+ */
+string CaptureWriter::anonymise(const string& str)
+{
+	string result;
+	size_t start = 0;
+	while (start <= str.length())
+	{
+		size_t end = str.find('/', start);
+		if (end == string::npos)
+			end = str.length();
+		if (end > start)
+		{
+			string part = str.substr(start, end - start);
+			auto it = m_tokens.find(part);
+			if (it == m_tokens.end())
+			{
+				it = m_tokens.insert(pair<string, string>(part, "s" + to_string(m_tokens.size()))).first;
+			}
+			result.append(it->second);
+		}
+		if (end < str.length())
+			result.push_back('/');
+		start = end + 1;
+	}
+	return result;
+}
+
+/**
+ * Constructor for the capture reader
+ */
+CaptureReader::CaptureReader() : m_file(NULL)
+{
+}
+
+/**
+ * Destructor for the capture reader
+ */
+CaptureReader::~CaptureReader()
+{
+	close();
+}
+
+/**
+ * Open a capture file
+ *
+ * @param path	The path of the file
+ * @return	True if the file is a capture file
+ */
+bool CaptureReader::open(const string& path)
+{
+	close();
+	m_file = fopen(path.c_str(), "r");
+	if (!m_file)
+	{
+		return false;
+	}
+	char magic[MAGIC_LENGTH];
+	if (fread(magic, 1, MAGIC_LENGTH, m_file) != MAGIC_LENGTH || memcmp(magic, CAPTURE_MAGIC, MAGIC_LENGTH) != 0)
+	{
+		close();
+		return false;
+	}
+	m_names.clear();
+	return true;
+}
+
+/**
+ * Close the capture file
+ */
+void CaptureReader::close()
+{
+	if (m_file)
+	{
+		fclose(m_file);
+		m_file = NULL;
+	}
+}
+
+/**
+ * Read the next block of readings. The caller is responsible for
+ * deleting the readings.
+ *
+ * @param readings	The readings of the block
+ * @param offset	The time in microseconds after the start of the capture that the block was received
+ * @return		False at the end of the file or if the file is truncated or corrupt
+ */
+bool CaptureReader::next(vector<Reading *>& readings, int64_t& offset)
+{
+	uint64_t micros, count;
+	readings.clear();
+	if (!m_file || !getVarint(micros) || !getVarint(count) || count > MAX_LENGTH)
+	{
+		return false;
+	}
+	offset = micros;
+	for (uint64_t i = 0; i < count; i++)
+	{
+		string asset;
+		struct timeval userTS, ingestTS;
+		vector<Datapoint *> datapoints;
+		if (!getName(asset) || !getTime(userTS) || !getTime(ingestTS) || !getDatapoints(datapoints))
+		{
+			for (auto dp : datapoints)
+				delete dp;
+			for (auto reading : readings)
+				delete reading;
+			readings.clear();
+			return false;
+		}
+		Reading *reading = new Reading(asset, datapoints);
+		reading->setUserTimestamp(userTS);
+		reading->setTimestamp(ingestTS);
+		readings.push_back(reading);
+	}
+	return true;
+}
+
+/**
+ * Read a variable length integer
+ *
+ * @param value	The integer
+ * @return	False if the end of the file was reached
+ */
+bool CaptureReader::getVarint(uint64_t& value)
+{
+	value = 0;
+	for (int shift = 0; shift < 64; shift += 7)
+	{
+		int c = fgetc(m_file);
+		if (c == EOF)
+		{
+			return false;
+		}
+		value |= (uint64_t)(c & 0x7f) << shift;
+		if ((c & 0x80) == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Read a double
+ *
+ * @param value	The double
+ * @return	False if the end of the file was reached
+ */
+bool CaptureReader::getDouble(double& value)
+{
+	return fread(&value, sizeof(value), 1, m_file) == 1;
+}
+
+/**
+ * Read a string
+ *
+ * @param str	The string
+ * @return	False if the end of the file was reached
+ */
+bool CaptureReader::getString(string& str)
+{
+	uint64_t length;
+	if (!getVarint(length) || length > MAX_LENGTH)
+	{
+		return false;
+	}
+	str.resize(length);
+	return length == 0 || fread(&str[0], 1, length, m_file) == length;
+}
+
+/**
+ * Read a name, either a new name or the index of a name already read
+ *
+ * @param name	The name
+ * @return	False if the end of the file was reached or the index is invalid
+ */
+bool CaptureReader::getName(string& name)
+{
+	uint64_t index;
+	if (!getVarint(index) || index > m_names.size())
+	{
+		return false;
+	}
+	if (index == m_names.size())
+	{
+		if (!getString(name))
+			return false;
+		m_names.push_back(name);
+		return true;
+	}
+	name = m_names[index];
+	return true;
+}
+
+/**
+ * Read a timestamp
+ *
+ * @param tv	The timestamp
+ * @return	False if the end of the file was reached
+ */
+bool CaptureReader::getTime(struct timeval& tv)
+{
+	uint64_t sec, usec;
+	if (!getVarint(sec) || !getVarint(usec))
+	{
+		return false;
+	}
+	tv.tv_sec = sec;
+	tv.tv_usec = usec;
+	return true;
+}
+
+/**
+ * Read a set of datapoints
+ *
+ * @param datapoints	The datapoints read, the caller must delete them
+ * @return		False if the end of the file was reached or the file is corrupt
+ */
+bool CaptureReader::getDatapoints(vector<Datapoint *>& datapoints)
+{
+	uint64_t count;
+	if (!getVarint(count) || count > MAX_LENGTH)
+	{
+		return false;
+	}
+	for (uint64_t i = 0; i < count; i++)
+	{
+		string name;
+		if (!getName(name))
+		{
+			return false;
+		}
+		DatapointValue *value = getValue();
+		if (!value)
+		{
+			return false;
+		}
+		datapoints.push_back(new Datapoint(name, *value));
+		delete value;
+	}
+	return true;
+}
+
+/**
+ * Read a datapoint value. Values of types that are not captured are
+ * read as an empty string.
+ *
+ * @return	The value, NULL if the end of the file was reached or the file is corrupt
+ */
+DatapointValue *CaptureReader::getValue()
+{
+	int type = fgetc(m_file);
+	switch (type)
+	{
+		case CaptureNull:
+			return new DatapointValue(string(""));
+		case CaptureInteger:
+		{
+			uint64_t v;
+			if (!getVarint(v))
+				return NULL;
+			return new DatapointValue((long)((v >> 1) ^ (~(v & 1) + 1)));
+		}
+		case CaptureFloat:
+		{
+			double v;
+			if (!getDouble(v))
+				return NULL;
+			return new DatapointValue(v);
+		}
+		case CaptureString:
+		{
+			string v;
+			if (!getString(v))
+				return NULL;
+			return new DatapointValue(v);
+		}
+		case CaptureFloatArray:
+		{
+			uint64_t count;
+			if (!getVarint(count) || count > MAX_LENGTH)
+				return NULL;
+			vector<double> array(count);
+			for (uint64_t i = 0; i < count; i++)
+			{
+				if (!getDouble(array[i]))
+					return NULL;
+			}
+			return new DatapointValue(array);
+		}
+		case CaptureDict:
+		case CaptureList:
+		{
+			vector<Datapoint *> *children = new vector<Datapoint *>;
+			if (!getDatapoints(*children))
+			{
+				for (auto dp : *children)
+					delete dp;
+				delete children;
+				return NULL;
+			}
+			return new DatapointValue(children, type == CaptureDict);
+		}
+		default:
+			return NULL;
+	}
+}
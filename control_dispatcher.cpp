@@ -0,0 +1,175 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <control_dispatcher.h>
+#include <logger.h>
+#include <chrono>
+
+// The time in milliseconds stop waits for running operations to complete
+#define STOP_WAIT	5000
+
+using namespace std;
+
+/**
+ * Constructor for the control dispatcher
+ */
+ControlDispatcher::ControlDispatcher()
+{
+}
+
+/**
+ * Destructor for the control dispatcher
+ */
+ControlDispatcher::~ControlDispatcher()
+{
+	stop();
+}
+
+/**
+ * Start the threads that run the operations
+ *
+ * @param threads		The number of threads
+ * @param destinationLimit	The number of operations that may be queued or running for one destination
+ */
+void ControlDispatcher::start(unsigned int threads, unsigned int destinationLimit)
+{
+	stop();
+	m_state = make_shared<State>(destinationLimit ? destinationLimit : 1);
+	for (unsigned int i = 0; i < (threads ? threads : 1); i++)
+	{
+		m_threads.push_back(thread(&ControlDispatcher::worker, m_state));
+	}
+}
+
+/**
+ * Stop the threads. Queued operations that have not started are
+ * discarded. Those that are running are waited for, for at most
+ * STOP_WAIT milliseconds, after which the threads are detached and
+ * each exits once its operation completes.
+ */
+void ControlDispatcher::stop()
+{
+	if (!m_state)
+	{
+		return;
+	}
+	bool idle;
+	{
+		unique_lock<mutex> lck(m_state->m_mutex);
+		m_state->m_stop = true;
+		m_state->m_queue.clear();
+		m_state->m_active.clear();
+		m_state->m_work.notify_all();
+		m_state->m_complete.notify_all();
+		State *state = m_state.get();
+		idle = m_state->m_idle.wait_for(lck, chrono::milliseconds(STOP_WAIT),
+					[state] { return state->m_busy == 0; });
+		if (!idle)
+		{
+			Logger::getLogger()->warn("%u control operations are still running, they will be left to complete",
+					state->m_busy);
+		}
+	}
+	for (auto &t : m_threads)
+	{
+		if (idle)
+			t.join();
+		else
+			t.detach();
+	}
+	m_threads.clear();
+	m_state.reset();
+}
+
+/**
+ * Run an operation and wait for it to complete
+ *
+ * @param destination	The destination of the operation
+ * @param operation	The operation to run
+ * @param timeout	The time in milliseconds to wait for the operation
+ * @param result	Set to the return value of the operation if it completes
+ * @return		Whether the operation completed, was rejected or timed out
+ */
+ControlDispatcher::Outcome ControlDispatcher::call(const string& destination, const function<int()>& operation,
+						unsigned long timeout, int& result)
+{
+	shared_ptr<State> state = m_state;
+	if (!state)
+	{
+		return Rejected;
+	}
+	unique_lock<mutex> lck(state->m_mutex);
+	if (state->m_stop)
+	{
+		return Rejected;
+	}
+	unsigned int &active = state->m_active[destination];
+	if (active >= state->m_destinationLimit)
+	{
+		Logger::getLogger()->warn("Control operation for %s rejected, %u operations are already in progress",
+				destination.c_str(), active);
+		return Rejected;
+	}
+	active++;
+	shared_ptr<Request> request = make_shared<Request>(destination, operation);
+	state->m_queue.push_back(request);
+	state->m_work.notify_one();
+	if (!state->m_complete.wait_for(lck, chrono::milliseconds(timeout),
+				[&state, &request] { return request->m_done || state->m_stop; })
+			|| !request->m_done)
+	{
+		Logger::getLogger()->warn("Control operation for %s did not complete within %lums",
+				destination.c_str(), timeout);
+		return TimedOut;
+	}
+	result = request->m_result;
+	return Completed;
+}
+
+/**
+ * The thread that runs the operations
+ *
+ * @param state	The state shared with the dispatcher
+ */
+void ControlDispatcher::worker(shared_ptr<State> state)
+{
+	unique_lock<mutex> lck(state->m_mutex);
+	while (true)
+	{
+		state->m_work.wait(lck, [&state] { return state->m_stop || !state->m_queue.empty(); });
+		if (state->m_stop)
+		{
+			return;
+		}
+		shared_ptr<Request> request = state->m_queue.front();
+		state->m_queue.pop_front();
+		state->m_busy++;
+		lck.unlock();
+		int result = 0;
+		try
+		{
+			result = request->m_operation();
+		}
+		catch (exception &e)
+		{
+			Logger::getLogger()->error("Control operation for %s failed: %s",
+					request->m_destination.c_str(), e.what());
+		}
+		lck.lock();
+		request->m_result = result;
+		request->m_done = true;
+		auto it = state->m_active.find(request->m_destination);
+		if (it != state->m_active.end() && it->second > 0)
+		{
+			it->second--;
+		}
+		state->m_busy--;
+		state->m_complete.notify_all();
+		state->m_idle.notify_all();
+	}
+}
@@ -0,0 +1,231 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <datapoint_filter.h>
+#include <logger.h>
+#include <fnmatch.h>
+#include <json_config.h>
+
+using namespace std;
+
+/**
+ * Compile a shell style pattern
+ *
+ * @param pattern	The pattern
+ */
+CompiledPattern::CompiledPattern(const string& pattern) : m_kind(Glob), m_pattern(pattern)
+{
+	size_t special = pattern.find_first_of("*?[\\");
+	if (pattern.compare("*") == 0)
+	{
+		m_kind = Any;
+	}
+	else if (special == string::npos)
+	{
+		m_kind = Literal;
+		m_text = pattern;
+	}
+	else if (special == pattern.length() - 1 && pattern[special] == '*')
+	{
+		m_kind = Prefix;
+		m_text = pattern.substr(0, special);
+	}
+	else if (special == 0 && pattern[0] == '*' && pattern.find_first_of("*?[\\", 1) == string::npos)
+	{
+		m_kind = Suffix;
+		m_text = pattern.substr(1);
+	}
+}
+
+/**
+ * Match a string against the pattern
+ *
+ * @param str	The string to match
+ * @return	True if the string matches
+ */
+bool CompiledPattern::matches(const string& str) const
+{
+	switch (m_kind)
+	{
+		case Any:
+			return true;
+		case Literal:
+			return str.compare(m_text) == 0;
+		case Prefix:
+			return str.compare(0, m_text.length(), m_text) == 0;
+		case Suffix:
+			return str.length() >= m_text.length()
+				&& str.compare(str.length() - m_text.length(), m_text.length(), m_text) == 0;
+		case Glob:
+			return fnmatch(m_pattern.c_str(), str.c_str(), 0) == 0;
+	}
+	return false;
+}
+
+/**
+ * Parse the datapoint filter configuration item. The item is a JSON
+ * document with a default action and an array of rules, each rule has
+ * an asset pattern, a datapoint pattern and an action.
+ *
+ * { "default" : "include",
+ *   "rules" : [ { "asset" : "*", "datapoint" : "debug*", "action" : "exclude" } ] }
+ *
+ * @param json	The configuration item
+ */
+void DatapointFilter::parse(const string& json)
+{
+	Logger *log = Logger::getLogger();
+
+	m_rules.clear();
+	m_default = true;
+	if (json.empty())
+	{
+		return;
+	}
+	rapidjson::Document doc;
+	if (!ParseJsonConfig(doc, json, "datapoint filter"))
+	{
+		return;
+	}
+	if (doc.HasMember("default") && doc["default"].IsString())
+	{
+		m_default = string(doc["default"].GetString()).compare("exclude") != 0;
+	}
+	if (!doc.HasMember("rules") || !doc["rules"].IsArray())
+	{
+		return;
+	}
+	for (auto &rule : doc["rules"].GetArray())
+	{
+		string asset = "*", datapoint, action;
+		if (rule.HasMember("asset") && rule["asset"].IsString())
+			asset = rule["asset"].GetString();
+		if (rule.HasMember("datapoint") && rule["datapoint"].IsString())
+			datapoint = rule["datapoint"].GetString();
+		if (rule.HasMember("action") && rule["action"].IsString())
+			action = rule["action"].GetString();
+		if (datapoint.empty() || (action.compare("include") != 0 && action.compare("exclude") != 0))
+		{
+			log->error("Badly formed datapoint filter rule, a datapoint and an action of include or exclude must be provided");
+			continue;
+		}
+		m_rules.push_back(Rule(asset, datapoint, action.compare("include") == 0));
+	}
+}
+
+/**
+ * Build the projection for an asset from the rules whose asset
+ * pattern matches the asset. Literal datapoint patterns are held in
+ * a hash table, keeping the first rule for each name.
+ *
+ * @param asset	The asset name
+ * @return	The projection for the asset
+ */
+DatapointProjection DatapointFilter::forAsset(const string& asset) const
+{
+	DatapointProjection projection;
+	projection.m_enabled = isEnabled();
+	projection.m_default = m_default;
+	for (uint32_t i = 0; i < m_rules.size(); i++)
+	{
+		const Rule& rule = m_rules[i];
+		if (!rule.m_asset.matches(asset))
+		{
+			continue;
+		}
+		if (rule.m_datapoint.getKind() == CompiledPattern::Literal)
+		{
+			projection.m_literals.insert(pair<string, pair<uint32_t, bool> >(rule.m_datapoint.getText(),
+						pair<uint32_t, bool>(i, rule.m_include)));
+		}
+		else
+		{
+			projection.m_rules.push_back(DatapointProjection::Rule(rule.m_datapoint, i, rule.m_include));
+		}
+	}
+	return projection;
+}
+
+/**
+ * Evaluate the rules for a datapoint
+ *
+ * @param path	The datapoint name, nested datapoints are separated by "."
+ * @return	True if the datapoint is included
+ */
+bool DatapointProjection::evaluate(const string& path) const
+{
+	uint32_t first = UINT32_MAX;
+	bool include = m_default;
+	auto literal = m_literals.find(path);
+	if (literal != m_literals.end())
+	{
+		first = literal->second.first;
+		include = literal->second.second;
+	}
+	for (auto &rule : m_rules)
+	{
+		if (rule.m_order > first)
+		{
+			break;
+		}
+		if (rule.m_pattern.matches(path))
+		{
+			return rule.m_include;
+		}
+	}
+	return include;
+}
+
+/**
+ * Check if a top level datapoint is included
+ *
+ * @param index	The position of the datapoint in the reading
+ * @param name	The name of the datapoint
+ * @return	True if the datapoint is included
+ */
+bool DatapointProjection::included(size_t index, const string& name)
+{
+	if (!m_enabled)
+	{
+		return true;
+	}
+	if (index < m_names.size() && m_names[index].compare(name) == 0)
+	{
+		return m_mask[index];
+	}
+	if (index >= m_names.size())
+	{
+		m_names.resize(index + 1);
+		m_mask.resize(index + 1);
+	}
+	m_names[index] = name;
+	m_mask[index] = evaluate(name);
+	return m_mask[index];
+}
+
+/**
+ * Check if a nested datapoint is included
+ *
+ * @param path	The path of the datapoint
+ * @return	True if the datapoint is included
+ */
+bool DatapointProjection::included(const string& path)
+{
+	if (!m_enabled)
+	{
+		return true;
+	}
+	auto it = m_nested.find(path);
+	if (it != m_nested.end())
+	{
+		return it->second;
+	}
+	bool include = evaluate(path);
+	m_nested[path] = include;
+	return include;
+}
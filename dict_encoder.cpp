@@ -0,0 +1,214 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <dict_encoder.h>
+#include <stdio.h>
+#include <math.h>
+
+using namespace std;
+
+// The number of shapes for which templates are retained
+#define MAX_SHAPES	1024
+
+/**
+ * Encode a nested datapoint as a JSON object
+ *
+ * @param value	The nested datapoint
+ * @param out	The JSON document
+ */
+void DictEncoder::encode(DatapointValue& value, string& out)
+{
+	string shape;
+	vector<DatapointValue *> leaves;
+	shapeOf(value, shape, leaves);
+
+	auto it = m_templates.find(shape);
+	if (it == m_templates.end())
+	{
+		if (m_templates.size() >= MAX_SHAPES)
+		{
+			m_templates.clear();
+		}
+		vector<string> fragments(1);
+		buildTemplate(value, fragments);
+		it = m_templates.insert(pair<string, vector<string> >(shape, fragments)).first;
+	}
+	const vector<string>& fragments = it->second;
+	out.clear();
+	out.append(fragments[0]);
+	for (size_t i = 0; i < leaves.size(); i++)
+	{
+		appendValue(*leaves[i], out);
+		out.append(fragments[i + 1]);
+	}
+}
+
+/**
+ * Build the shape key of a nested datapoint and collect the values
+ * of its leaves in order
+ *
+ * @param value		The nested datapoint
+ * @param shape		The shape key
+ * @param leaves	The leaf values
+ */
+void DictEncoder::shapeOf(DatapointValue& value, string& shape, vector<DatapointValue *>& leaves)
+{
+	vector<Datapoint *> *children = value.getDpVec();
+	shape.push_back('{');
+	for (auto child : *children)
+	{
+		DatapointValue& data = child->getData();
+		shape.append(child->getName());
+		shape.push_back('\0');
+		if (data.getType() == DatapointValue::T_DP_DICT)
+		{
+			shapeOf(data, shape, leaves);
+		}
+		else
+		{
+			shape.push_back('0' + data.getType());
+			leaves.push_back(&data);
+		}
+	}
+	shape.push_back('}');
+}
+
+/**
+ * Build the literal fragments between the values of a nested datapoint.
+ * The last fragment is extended as the datapoint is walked.
+ *
+ * @param value		The nested datapoint
+ * @param fragments	The fragments
+ */
+void DictEncoder::buildTemplate(DatapointValue& value, vector<string>& fragments)
+{
+	vector<Datapoint *> *children = value.getDpVec();
+	fragments.back().push_back('{');
+	bool first = true;
+	for (auto child : *children)
+	{
+		if (!first)
+		{
+			fragments.back().push_back(',');
+		}
+		first = false;
+		appendString(child->getName(), fragments.back());
+		fragments.back().push_back(':');
+		DatapointValue& data = child->getData();
+		if (data.getType() == DatapointValue::T_DP_DICT)
+		{
+			buildTemplate(data, fragments);
+		}
+		else
+		{
+			fragments.push_back(string());
+		}
+	}
+	fragments.back().push_back('}');
+}
+
+/**
+ * Append a leaf value to the JSON document
+ *
+ * @param value	The value
+ * @param out	The JSON document
+ */
+void DictEncoder::appendValue(DatapointValue& value, string& out)
+{
+	char buf[32];
+	switch (value.getType())
+	{
+		case DatapointValue::T_INTEGER:
+			snprintf(buf, sizeof(buf), "%ld", value.toInt());
+			out.append(buf);
+			break;
+		case DatapointValue::T_FLOAT:
+			if (isfinite(value.toDouble()))
+			{
+				snprintf(buf, sizeof(buf), "%.17g", value.toDouble());
+				out.append(buf);
+			}
+			else
+			{
+				out.append("null");
+			}
+			break;
+		case DatapointValue::T_STRING:
+			appendString(value.toStringValue(), out);
+			break;
+		case DatapointValue::T_FLOAT_ARRAY:
+		{
+			vector<double> *array = value.getDpArr();
+			out.push_back('[');
+			for (size_t i = 0; i < array->size(); i++)
+			{
+				if (i)
+					out.push_back(',');
+				if (isfinite((*array)[i]))
+				{
+					snprintf(buf, sizeof(buf), "%.17g", (*array)[i]);
+					out.append(buf);
+				}
+				else
+				{
+					out.append("null");
+				}
+			}
+			out.push_back(']');
+			break;
+		}
+		default:
+			out.append("null");
+			break;
+	}
+}
+
+/**
+ * Append a quoted and escaped JSON string
+ *
+ * @param str	The string
+ * @param out	The JSON document
+ */
+void DictEncoder::appendString(const string& str, string& out)
+{
+	out.push_back('"');
+	for (char c : str)
+	{
+		switch (c)
+		{
+			case '"':
+				out.append("\\\"");
+				break;
+			case '\\':
+				out.append("\\\\");
+				break;
+			case '\n':
+				out.append("\\n");
+				break;
+			case '\r':
+				out.append("\\r");
+				break;
+			case '\t':
+				out.append("\\t");
+				break;
+			default:
+				if ((unsigned char)c < 0x20)
+				{
+					char buf[8];
+					snprintf(buf, sizeof(buf), "\\u%04x", c);
+					out.append(buf);
+				}
+				else
+				{
+					out.push_back(c);
+				}
+				break;
+		}
+	}
+	out.push_back('"');
+}
@@ -0,0 +1,299 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <freeopcua_backend.h>
+
+using namespace std;
+using namespace OpcUa;
+
+/**
+ * Constructor for the freeopcua backend
+ */
+FreeOpcUaBackend::FreeOpcUaBackend() : m_server(NULL)
+{
+}
+
+/**
+ * Destructor for the freeopcua backend
+ */
+FreeOpcUaBackend::~FreeOpcUaBackend()
+{
+	delete m_server;
+}
+
+/**
+ * Start the server
+ *
+ * @param url	The endpoint URL of the server
+ * @param uri	The URI of the server
+ * @param name	The name of the server
+ */
+void FreeOpcUaBackend::start(const string& url, const string& uri, const string& name)
+{
+	m_server = new UaServer(true);
+	m_server->SetEndpoint(url);
+	m_server->SetServerURI(uri);
+	m_server->SetServerName(name);
+	m_server->Start();
+	m_services = m_server->GetObjectsNode().GetServices();
+	m_addressSpace = dynamic_pointer_cast<OpcUa::Server::AddressSpace>(m_services->Attributes());
+	m_server->EnableEventNotification();
+}
+
+/**
+ * Stop the server
+ */
+void FreeOpcUaBackend::stop()
+{
+	if (m_server)
+	{
+		m_server->Stop();
+	}
+}
+
+/**
+ * Register a namespace, or return the index of the namespace if it is
+ * already registered
+ *
+ * @param uri	The URI of the namespace
+ * @return	The index of the namespace
+ */
+uint16_t FreeOpcUaBackend::registerNamespace(const string& uri)
+{
+	try
+	{
+		// The namespace remains registered when an instance sharing the server restarts
+		return m_server->GetNamespaceIndex(uri);
+	}
+	catch (exception& e)
+	{
+		return m_server->RegisterNamespace(uri);
+	}
+}
+
+/**
+ * Add a set of nodes to the address space with a single AddNodes call
+ *
+ * @param nodes	The nodes to add, updated with the result of adding each
+ */
+void FreeOpcUaBackend::addNodes(vector<BackendNode>& nodes)
+{
+	vector<AddNodesItem> items;
+	items.reserve(nodes.size());
+	for (auto& node : nodes)
+	{
+		AddNodesItem item;
+		item.BrowseName = node.m_name;
+		item.ParentNodeId = node.m_parent;
+		item.RequestedNewNodeId = node.m_requested;
+		item.ReferenceTypeId = ObjectId::HasComponent;
+		if (node.m_object)
+		{
+			item.Class = NodeClass::Object;
+			item.TypeDefinition = ObjectId::BaseObjectType;
+			ObjectAttributes attr;
+			attr.DisplayName = LocalizedText(node.m_name.Name);
+			attr.Description = LocalizedText(node.m_name.Name);
+			attr.WriteMask = 0;
+			attr.UserWriteMask = 0;
+			attr.EventNotifier = 0;
+			item.Attributes = attr;
+		}
+		else
+		{
+			item.Class = NodeClass::Variable;
+			item.TypeDefinition = ObjectId::BaseDataVariableType;
+			VariableAttributes attr;
+			attr.DisplayName = LocalizedText(node.m_name.Name);
+			attr.Description = LocalizedText(node.m_name.Name);
+			attr.AccessLevel = (uint8_t)VariableAccessLevel::CurrentRead;
+			if (node.m_writable)
+			{
+				attr.AccessLevel |= (uint8_t)VariableAccessLevel::CurrentWrite;
+			}
+			attr.UserAccessLevel = attr.AccessLevel;
+			attr.WriteMask = 0;
+			attr.UserWriteMask = 0;
+			attr.Value = node.m_value;
+			attr.Type = VariantTypeToDataType(node.m_value.Type());
+			attr.Rank = -1;
+			attr.Dimensions = node.m_value.Dimensions;
+			item.Attributes = attr;
+		}
+		items.push_back(item);
+	}
+	vector<AddNodesResult> results = m_services->NodeManagement()->AddNodes(items);
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		if (i < results.size())
+		{
+			nodes[i].m_status = results[i].Status;
+			nodes[i].m_id = results[i].AddedNodeId;
+		}
+		else
+		{
+			nodes[i].m_status = StatusCode::BadInternalError;
+		}
+	}
+}
+
+/**
+ * Delete a set of nodes and the references to them
+ *
+ * @param nodes	The nodes to delete
+ * @return	The status of deleting each node
+ */
+vector<StatusCode> FreeOpcUaBackend::deleteNodes(const vector<NodeId>& nodes)
+{
+	vector<DeleteNodesItem> items;
+	items.reserve(nodes.size());
+	lock_guard<mutex> guard(m_subscriptionMutex);
+	for (auto& id : nodes)
+	{
+		auto it = m_monitoredItems.find(id);
+		if (it != m_monitoredItems.end())
+		{
+			m_subscription->UnSubscribe(it->second);
+			m_subscriptionClient.removeHandler(id);
+			m_monitoredItems.erase(it);
+		}
+		DeleteNodesItem item;
+		item.NodeId = id;
+		item.DeleteTargetReferences = true;
+		items.push_back(item);
+	}
+	return m_services->NodeManagement()->DeleteNodes(items);
+}
+
+/**
+ * Write a set of values with a single Write call
+ *
+ * @param values	The values to write
+ * @return		The status of each write
+ */
+vector<StatusCode> FreeOpcUaBackend::write(const vector<WriteValue>& values)
+{
+	return m_services->Attributes()->Write(values);
+}
+
+/**
+ * Read the value of a variable
+ *
+ * @param node	The variable to read
+ * @return	The value of the variable
+ */
+DataValue FreeOpcUaBackend::read(const NodeId& node)
+{
+	return Node(m_services, node).GetDataValue();
+}
+
+/**
+ * Subscribe to changes of a set of variables in order to see the values
+ * written to them by clients. The subscription also reports the initial
+ * value of each variable. All of the variables share one subscription.
+ *
+ * @param nodes		The variables
+ * @param handler	Called on the subscription thread with each new value
+ */
+void FreeOpcUaBackend::subscribeWrites(const vector<NodeId>& nodes, WriteHandler handler)
+{
+	lock_guard<mutex> guard(m_subscriptionMutex);
+	if (!m_subscription)
+	{
+		m_subscription = m_server->CreateSubscription(100, m_subscriptionClient);
+	}
+	for (auto& node : nodes)
+	{
+		m_subscriptionClient.addHandler(node, handler);
+		m_monitoredItems[node] = m_subscription->SubscribeDataChange(Node(m_services, node));
+	}
+}
+
+/**
+ * Serve reads of the value of a variable from a callback. The freeopcua
+ * server does not report the deletion of monitored items, so the release
+ * handler is never called.
+ *
+ * @param node		The variable
+ * @param handler	Returns the value of the variable
+ * @param released	Not used
+ */
+void FreeOpcUaBackend::setReadHandler(const NodeId& node, ReadHandler handler, ReleaseHandler released)
+{
+	m_addressSpace->SetValueCallback(node, AttributeId::Value, handler);
+}
+
+/**
+ * Add a method to an object
+ *
+ * @param parent	The object
+ * @param ns		The namespace of the method
+ * @param name		The name of the method
+ * @param handler	Called with the arguments of each call of the method
+ * @param method	Set to the NodeId of the method
+ * @return		True, methods are supported
+ */
+bool FreeOpcUaBackend::addMethod(const NodeId& parent, uint16_t ns, const string& name, MethodHandler handler,
+				NodeId& method)
+{
+	Node node = Node(m_services, parent).AddMethod(ns, name,
+		[handler](NodeId context, vector<Variant> arguments) {
+			return handler(arguments);
+		});
+	method = node.GetId();
+	return true;
+}
+
+/**
+ * Subscription Client handler for data change events
+ *
+ * @param handle
+ * @param node		The node that has changed
+ * @param val		The value the node is being assigned
+ * @param attr		The Attribute ID
+ */
+void SubClient::DataChange(uint32_t handle,
+						   const OpcUa::Node &node,
+						   const OpcUa::Variant &val,
+						   OpcUa::AttributeId attr)
+{
+	if (val.IsNul())
+		return;
+	OPCUABackend::WriteHandler handler;
+	{
+		lock_guard<mutex> guard(m_mutex);
+		auto it = m_handlers.find(node.GetId());
+		if (it == m_handlers.end())
+			return;
+		handler = it->second;
+	}
+	handler(node.GetId(), val);
+}
+
+/**
+ * Set the handler for the data changes of a node
+ *
+ * @param node		The node
+ * @param handler	Called with each new value of the node
+ */
+void SubClient::addHandler(const OpcUa::NodeId& node, OPCUABackend::WriteHandler handler)
+{
+	lock_guard<mutex> guard(m_mutex);
+	m_handlers[node] = handler;
+}
+
+/**
+ * Remove the handler for the data changes of a node
+ *
+ * @param node		The node
+ */
+void SubClient::removeHandler(const OpcUa::NodeId& node)
+{
+	lock_guard<mutex> guard(m_mutex);
+	m_handlers.erase(node);
+}
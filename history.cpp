@@ -0,0 +1,284 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <history.h>
+#include <logger.h>
+
+using namespace std;
+using namespace OpcUa;
+
+/**
+ * Constructor for the history buffer
+ */
+HistoryBuffer::HistoryBuffer() : m_depth(0), m_maxSlots(0), m_nextSlot(0), m_full(false)
+{
+}
+
+/**
+ * Configure the history buffer
+ *
+ * @param depth		The number of values to retain per variable, 0 disables the history
+ * @param budget	The maximum number of bytes to use for history values
+ */
+void HistoryBuffer::configure(unsigned int depth, size_t budget)
+{
+	lock_guard<mutex> guard(m_mutex);
+	m_depth = depth;
+	if (depth)
+	{
+		size_t perSlot = depth * (sizeof(int64_t) + sizeof(double)) + sizeof(Ring) + sizeof(NodeId);
+		m_maxSlots = budget / perSlot;
+		// Reserve the columns up front, growing them one slot at a time
+		// would let their capacity reach twice the budget
+		m_timestamps.reserve((size_t)m_maxSlots * depth);
+		m_values.reserve((size_t)m_maxSlots * depth);
+		m_rings.reserve(m_maxSlots);
+		m_ids.reserve(m_maxSlots);
+		Logger::getLogger()->info("History of %u values will be kept for up to %u variables",
+				depth, m_maxSlots);
+	}
+}
+
+/**
+ * Allocate a ring buffer for a variable
+ *
+ * @param handle	The handle of the variable
+ * @param nodeId	The NodeId of the variable
+ */
+void HistoryBuffer::add(NodeHandle handle, const NodeId& nodeId)
+{
+	lock_guard<mutex> guard(m_mutex);
+	if (m_depth == 0)
+	{
+		return;
+	}
+	uint32_t slot;
+	if (!m_freeSlots.empty())
+	{
+		slot = m_freeSlots.back();
+		m_freeSlots.pop_back();
+		m_rings[slot] = Ring();
+		m_ids[slot] = nodeId;
+	}
+	else if (m_nextSlot < m_maxSlots
+			&& (size_t)(m_nextSlot + 1) * m_depth <= m_timestamps.capacity()
+			&& (size_t)(m_nextSlot + 1) * m_depth <= m_values.capacity())
+	{
+		slot = m_nextSlot++;
+		m_timestamps.resize((size_t)m_nextSlot * m_depth);
+		m_values.resize((size_t)m_nextSlot * m_depth);
+		m_rings.push_back(Ring());
+		m_ids.push_back(nodeId);
+	}
+	else
+	{
+		if (!m_full)
+		{
+			Logger::getLogger()->warn("History memory limit reached, new variables will not be historized");
+			m_full = true;
+		}
+		return;
+	}
+	if (handle >= m_index.size())
+	{
+		m_index.resize(handle + 1, -1);
+	}
+	m_index[handle] = slot;
+	m_nodeIds[nodeId] = slot;
+}
+
+/**
+ * Release the ring buffer of a variable that has been removed
+ *
+ * @param handle	The handle of the variable
+ */
+void HistoryBuffer::remove(NodeHandle handle)
+{
+	lock_guard<mutex> guard(m_mutex);
+	if (handle >= m_index.size() || m_index[handle] < 0)
+	{
+		return;
+	}
+	uint32_t slot = m_index[handle];
+	m_nodeIds.erase(m_ids[slot]);
+	m_freeSlots.push_back(slot);
+	m_index[handle] = -1;
+}
+
+/**
+ * Append a value to the history of a variable, overwriting the
+ * oldest value if the ring buffer is full
+ *
+ * @param handle	The handle of the variable
+ * @param timestamp	The source timestamp of the value
+ * @param value		The value
+ */
+void HistoryBuffer::append(NodeHandle handle, int64_t timestamp, double value)
+{
+	lock_guard<mutex> guard(m_mutex);
+	if (handle >= m_index.size() || m_index[handle] < 0)
+	{
+		return;
+	}
+	uint32_t slot = m_index[handle];
+	Ring& ring = m_rings[slot];
+	size_t offset = (size_t)slot * m_depth + ring.m_head;
+	m_timestamps[offset] = timestamp;
+	m_values[offset] = value;
+	if (++ring.m_head == m_depth)
+	{
+		ring.m_head = 0;
+	}
+	if (ring.m_count < m_depth)
+	{
+		ring.m_count++;
+	}
+}
+
+/**
+ * Find the slot of a variable. Called with the mutex held.
+ *
+ * @param nodeId	The NodeId of the variable
+ * @return		The slot or -1 if the variable is not historized
+ */
+int HistoryBuffer::find(const NodeId& nodeId)
+{
+	auto it = m_nodeIds.find(nodeId);
+	if (it == m_nodeIds.end())
+	{
+		return -1;
+	}
+	return it->second;
+}
+
+/**
+ * Return the raw values of a variable between two times, oldest first
+ *
+ * @param nodeId	The NodeId of the variable
+ * @param start		The start of the time range
+ * @param end		The end of the time range
+ * @param max		The maximum number of values to return, 0 for no limit
+ * @param timestamps	The timestamps of the values returned
+ * @param values	The values returned
+ * @return		False if the variable is not historized
+ */
+bool HistoryBuffer::readRaw(const NodeId& nodeId, int64_t start, int64_t end, unsigned int max,
+			vector<int64_t>& timestamps, vector<double>& values)
+{
+	lock_guard<mutex> guard(m_mutex);
+	int slot = find(nodeId);
+	if (slot < 0)
+	{
+		return false;
+	}
+	const Ring& ring = m_rings[slot];
+	size_t base = (size_t)slot * m_depth;
+	uint32_t oldest = (ring.m_head + m_depth - ring.m_count) % m_depth;
+	for (uint32_t i = 0; i < ring.m_count; i++)
+	{
+		size_t offset = base + (oldest + i) % m_depth;
+		if (m_timestamps[offset] >= start && m_timestamps[offset] <= end)
+		{
+			timestamps.push_back(m_timestamps[offset]);
+			values.push_back(m_values[offset]);
+			if (max && values.size() >= max)
+			{
+				break;
+			}
+		}
+	}
+	return true;
+}
+
+/**
+ * Check if the history of a variable extends back to a given time
+ *
+ * @param nodeId	The NodeId of the variable
+ * @param start		The time
+ * @return		True if the ring buffer is full and the oldest value is no later than start
+ */
+bool HistoryBuffer::covers(const NodeId& nodeId, int64_t start)
+{
+	lock_guard<mutex> guard(m_mutex);
+	int slot = find(nodeId);
+	if (slot < 0)
+	{
+		return false;
+	}
+	const Ring& ring = m_rings[slot];
+	if (ring.m_count < m_depth)
+	{
+		return false;
+	}
+	return m_timestamps[(size_t)slot * m_depth + ring.m_head] <= start;
+}
+
+/**
+ * Aggregate raw values over a set of intervals. Intervals that
+ * contain no values are omitted.
+ *
+ * @param rawTimes	The timestamps of the raw values
+ * @param rawValues	The raw values
+ * @param start		The start of the first interval
+ * @param interval	The length of each interval
+ * @param aggregate	The aggregate to calculate
+ * @param timestamps	The start times of the intervals returned
+ * @param values	The aggregate values
+ */
+void HistoryBuffer::aggregate(const vector<int64_t>& rawTimes, const vector<double>& rawValues,
+			int64_t start, int64_t interval, Aggregate aggregate,
+			vector<int64_t>& timestamps, vector<double>& values)
+{
+	// Only intervals that contain values are held, so a small interval
+	// over a long range costs no more than the raw values themselves
+	map<int64_t, pair<double, uint32_t> > buckets;
+	for (size_t i = 0; i < rawTimes.size(); i++)
+	{
+		int64_t bucket = (rawTimes[i] - start) / interval;
+		double value = rawValues[i];
+		auto it = buckets.find(bucket);
+		if (it == buckets.end())
+		{
+			buckets[bucket] = pair<double, uint32_t>(value, 1);
+			continue;
+		}
+		switch (aggregate)
+		{
+			case Minimum:
+				if (value < it->second.first)
+					it->second.first = value;
+				break;
+			case Maximum:
+				if (value > it->second.first)
+					it->second.first = value;
+				break;
+			case Average:
+				it->second.first += value;
+				break;
+		}
+		it->second.second++;
+	}
+	for (auto &bucket : buckets)
+	{
+		timestamps.push_back(start + bucket.first * interval);
+		values.push_back(aggregate == Average ? bucket.second.first / bucket.second.second : bucket.second.first);
+	}
+}
+
+/**
+ * Return the memory used by the history
+ *
+ * @return	The number of bytes used
+ */
+size_t HistoryBuffer::memoryUsage()
+{
+	lock_guard<mutex> guard(m_mutex);
+	return m_timestamps.capacity() * sizeof(int64_t) + m_values.capacity() * sizeof(double)
+		+ m_rings.capacity() * sizeof(Ring) + m_ids.capacity() * sizeof(NodeId)
+		+ m_index.capacity() * sizeof(int32_t);
+}
@@ -0,0 +1,812 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <history_store.h>
+#include <logger.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+using namespace OpcUa;
+
+// The largest encoding of a sample, a 64 bit delta of delta and
+// a new window for a 64 bit XOR of the value
+#define MAX_SAMPLE_BITS	(4 + 64 + 2 + 5 + 6 + 64)
+
+// Samples queued beyond this are discarded if the writer falls behind
+#define MAX_QUEUED_SAMPLES	(1024 * 1024)
+
+/**
+ * Constructor for a block encoder
+ *
+ * @param variable	The variable the block holds samples for
+ */
+HistoryBlockEncoder::HistoryBlockEncoder(uint32_t variable) : m_lastTime(0), m_lastDelta(0),
+	m_lastValue(0), m_leading(64), m_trailing(0)
+{
+	memset(m_block, 0, sizeof(m_block));
+	HistoryBlockHeader *hdr = header();
+	hdr->magic = HISTORY_BLOCK_MAGIC;
+	hdr->variable = variable;
+	hdr->minTime = INT64_MAX;
+	hdr->maxTime = INT64_MIN;
+}
+
+/**
+ * Write bits to the payload of the block, most significant bit first
+ *
+ * @param value	The value to write, in the least significant bits
+ * @param bits	The number of bits to write
+ */
+void HistoryBlockEncoder::write(uint64_t value, unsigned int bits)
+{
+	HistoryBlockHeader *hdr = header();
+	uint8_t *payload = m_block + sizeof(HistoryBlockHeader);
+	while (bits > 0)
+	{
+		unsigned int avail = 8 - (hdr->bits & 7);
+		unsigned int n = bits < avail ? bits : avail;
+		uint8_t chunk = (value >> (bits - n)) & ((1u << n) - 1);
+		payload[hdr->bits >> 3] |= chunk << (avail - n);
+		hdr->bits += n;
+		bits -= n;
+	}
+}
+
+/**
+ * Append a sample to the block
+ *
+ * @param timestamp	The timestamp of the sample
+ * @param value		The value of the sample
+ * @return		False if the block is full
+ */
+bool HistoryBlockEncoder::append(int64_t timestamp, double value)
+{
+	HistoryBlockHeader *hdr = header();
+	if (hdr->bits + MAX_SAMPLE_BITS > HISTORY_BLOCK_PAYLOAD * 8)
+	{
+		return false;
+	}
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	if (hdr->count == 0)
+	{
+		write((uint64_t)timestamp, 64);
+		write(bits, 64);
+	}
+	else
+	{
+		int64_t delta = timestamp - m_lastTime;
+		int64_t dod = delta - m_lastDelta;
+		if (dod == 0)
+		{
+			write(0, 1);
+		}
+		else if (dod >= -63 && dod <= 64)
+		{
+			write(2, 2);
+			write((uint64_t)(dod + 63), 7);
+		}
+		else if (dod >= -255 && dod <= 256)
+		{
+			write(6, 3);
+			write((uint64_t)(dod + 255), 9);
+		}
+		else if (dod >= -2047 && dod <= 2048)
+		{
+			write(14, 4);
+			write((uint64_t)(dod + 2047), 12);
+		}
+		else
+		{
+			write(15, 4);
+			write((uint64_t)dod, 64);
+		}
+		m_lastDelta = delta;
+
+		uint64_t x = bits ^ m_lastValue;
+		if (x == 0)
+		{
+			write(0, 1);
+		}
+		else
+		{
+			unsigned int leading = __builtin_clzll(x);
+			unsigned int trailing = __builtin_ctzll(x);
+			if (leading > 31)
+			{
+				leading = 31;
+			}
+			write(1, 1);
+			if (leading >= m_leading && trailing >= m_trailing)
+			{
+				// The meaningful bits fit in the previous window
+				write(0, 1);
+				write(x >> m_trailing, 64 - m_leading - m_trailing);
+			}
+			else
+			{
+				unsigned int length = 64 - leading - trailing;
+				write(1, 1);
+				write(leading, 5);
+				write(length - 1, 6);
+				write(x >> trailing, length);
+				m_leading = leading;
+				m_trailing = trailing;
+			}
+		}
+	}
+	m_lastTime = timestamp;
+	m_lastValue = bits;
+	if (timestamp < hdr->minTime)
+		hdr->minTime = timestamp;
+	if (timestamp > hdr->maxTime)
+		hdr->maxTime = timestamp;
+	hdr->count++;
+	return true;
+}
+
+/**
+ * Constructor for a block decoder
+ *
+ * @param block	The block to decode, HISTORY_BLOCK_SIZE bytes
+ */
+HistoryBlockDecoder::HistoryBlockDecoder(const uint8_t *block) : m_index(0), m_position(0),
+	m_lastTime(0), m_lastDelta(0), m_lastValue(0), m_leading(0), m_trailing(0)
+{
+	m_header = (const HistoryBlockHeader *)block;
+	m_payload = block + sizeof(HistoryBlockHeader);
+	m_limit = m_header->bits <= HISTORY_BLOCK_PAYLOAD * 8 ? m_header->bits : 0;
+}
+
+/**
+ * Read bits from the payload of the block
+ *
+ * @param bits	The number of bits to read
+ * @return	The bits read, 0 if the read passes the end of the block
+ */
+uint64_t HistoryBlockDecoder::read(unsigned int bits)
+{
+	uint64_t value = 0;
+	if (m_position + bits > m_limit)
+	{
+		m_position = m_limit + 1;
+		return 0;
+	}
+	while (bits > 0)
+	{
+		unsigned int avail = 8 - (m_position & 7);
+		unsigned int n = bits < avail ? bits : avail;
+		uint8_t chunk = (m_payload[m_position >> 3] >> (avail - n)) & ((1u << n) - 1);
+		value = (value << n) | chunk;
+		m_position += n;
+		bits -= n;
+	}
+	return value;
+}
+
+/**
+ * Return the next sample from the block
+ *
+ * @param timestamp	The timestamp of the sample
+ * @param value		The value of the sample
+ * @return		False if there are no more samples
+ */
+bool HistoryBlockDecoder::next(int64_t& timestamp, double& value)
+{
+	if (m_index >= m_header->count)
+	{
+		return false;
+	}
+	if (m_index == 0)
+	{
+		m_lastTime = (int64_t)read(64);
+		m_lastValue = read(64);
+	}
+	else
+	{
+		int64_t dod;
+		if (read(1) == 0)
+			dod = 0;
+		else if (read(1) == 0)
+			dod = (int64_t)read(7) - 63;
+		else if (read(1) == 0)
+			dod = (int64_t)read(9) - 255;
+		else if (read(1) == 0)
+			dod = (int64_t)read(12) - 2047;
+		else
+			dod = (int64_t)read(64);
+		m_lastDelta += dod;
+		m_lastTime += m_lastDelta;
+
+		if (read(1))
+		{
+			if (read(1))
+			{
+				m_leading = read(5);
+				unsigned int length = read(6) + 1;
+				if (m_leading + length > 64)
+				{
+					m_position = m_limit + 1;
+					length = 64 - m_leading;
+				}
+				m_trailing = 64 - m_leading - length;
+			}
+			m_lastValue ^= read(64 - m_leading - m_trailing) << m_trailing;
+		}
+	}
+	if (m_position > m_limit)
+	{
+		// Corrupt block
+		m_index = m_header->count;
+		return false;
+	}
+	m_index++;
+	timestamp = m_lastTime;
+	memcpy(&value, &m_lastValue, sizeof(value));
+	return true;
+}
+
+/**
+ * Add a block to the index of a segment
+ *
+ * @param header	The header of the block
+ * @param offset	The offset of the block in the segment file
+ */
+void HistoryStore::Segment::addBlock(const HistoryBlockHeader *header, off_t offset)
+{
+	m_blocks[header->variable].push_back(BlockRef(offset, header->minTime, header->maxTime));
+	if (header->minTime < m_minTime)
+		m_minTime = header->minTime;
+	if (header->maxTime > m_maxTime)
+		m_maxTime = header->maxTime;
+}
+
+/**
+ * Constructor for the history store
+ */
+HistoryStore::HistoryStore() : m_segmentSeconds(3600), m_retentionHours(0), m_retentionBytes(0),
+	m_running(false), m_thread(NULL), m_overflow(false), m_nextVariable(0), m_variables(NULL),
+	m_fd(-1), m_totalSize(0)
+{
+}
+
+/**
+ * Destructor for the history store
+ */
+HistoryStore::~HistoryStore()
+{
+	close();
+}
+
+/**
+ * Open the history store, index the existing segments and start
+ * the writer thread
+ *
+ * @param directory		The directory that holds the segment files
+ * @param segmentSeconds	The period covered by each segment
+ * @param retentionHours	The age after which segments are removed, 0 for no limit
+ * @param retentionBytes	The maximum size of the store, 0 for no limit
+ * @return			True if the store was opened
+ */
+bool HistoryStore::open(const string& directory, unsigned int segmentSeconds,
+			unsigned int retentionHours, size_t retentionBytes)
+{
+	close();
+	m_directory = directory;
+	m_segmentSeconds = segmentSeconds ? segmentSeconds : 3600;
+	m_retentionHours = retentionHours;
+	m_retentionBytes = retentionBytes;
+	if (mkdir(directory.c_str(), 0755) == -1 && errno != EEXIST)
+	{
+		Logger::getLogger()->error("Unable to create history directory %s: %s",
+				directory.c_str(), strerror(errno));
+		return false;
+	}
+	loadVariables();
+	if (!m_variables)
+	{
+		return false;
+	}
+	loadSegments();
+	m_running = true;
+	m_thread = new thread(&HistoryStore::writer, this);
+	Logger::getLogger()->info("History is stored in %s, %u segments of %lu bytes found",
+			directory.c_str(), (unsigned int)m_segments.size(), (unsigned long)m_totalSize);
+	return true;
+}
+
+/**
+ * Stop the writer thread, write the remaining samples and close the store
+ */
+void HistoryStore::close()
+{
+	if (m_thread)
+	{
+		{
+			lock_guard<mutex> guard(m_queueMutex);
+			m_running = false;
+		}
+		m_queueCV.notify_all();
+		m_thread->join();
+		delete m_thread;
+		m_thread = NULL;
+		process(m_queue);
+		lock_guard<mutex> guard(m_mutex);
+		flush();
+	}
+	if (m_fd != -1)
+	{
+		::close(m_fd);
+		m_fd = -1;
+	}
+	if (m_variables)
+	{
+		fclose(m_variables);
+		m_variables = NULL;
+	}
+	m_queue.clear();
+	m_handles.clear();
+	m_nodeIds.clear();
+	m_keys.clear();
+	m_segments.clear();
+	m_open.clear();
+	m_nextVariable = 0;
+	m_totalSize = 0;
+	m_overflow = false;
+}
+
+/**
+ * Load the persistent variable ids. The variables file has a line
+ * of the form "id<TAB>asset<TAB>datapoint" for each variable.
+ */
+void HistoryStore::loadVariables()
+{
+	string path = m_directory + "/variables";
+	ifstream in(path.c_str());
+	string line;
+	while (getline(in, line))
+	{
+		size_t tab = line.find('\t');
+		if (tab == string::npos)
+		{
+			continue;
+		}
+		uint32_t id = strtoul(line.substr(0, tab).c_str(), NULL, 10);
+		m_keys[line.substr(tab + 1)] = id;
+		if (id >= m_nextVariable)
+		{
+			m_nextVariable = id + 1;
+		}
+	}
+	m_variables = fopen(path.c_str(), "a");
+	if (!m_variables)
+	{
+		Logger::getLogger()->error("Unable to open history variables file %s: %s",
+				path.c_str(), strerror(errno));
+	}
+}
+
+/**
+ * Find and index the segment files in the store directory
+ */
+void HistoryStore::loadSegments()
+{
+	DIR *dir = opendir(m_directory.c_str());
+	if (!dir)
+	{
+		return;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		unsigned long start;
+		char suffix[8];
+		if (sscanf(entry->d_name, "segment-%lu.%7s", &start, suffix) == 2 && strcmp(suffix, "hist") == 0)
+		{
+			m_segments.push_back(Segment(m_directory + "/" + entry->d_name, (time_t)start));
+		}
+	}
+	closedir(dir);
+	sort(m_segments.begin(), m_segments.end(),
+		[](const Segment& a, const Segment& b) { return a.m_start < b.m_start; });
+	for (auto& segment : m_segments)
+	{
+		indexSegment(segment);
+	}
+}
+
+/**
+ * Build the block index of a segment from the block headers. Any
+ * partial block at the end of the file is ignored.
+ *
+ * @param segment	The segment to index
+ */
+void HistoryStore::indexSegment(Segment& segment)
+{
+	int fd = ::open(segment.m_path.c_str(), O_RDONLY);
+	if (fd == -1)
+	{
+		return;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size >= HISTORY_BLOCK_SIZE)
+	{
+		size_t size = (st.st_size / HISTORY_BLOCK_SIZE) * HISTORY_BLOCK_SIZE;
+		void *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (addr != MAP_FAILED)
+		{
+			for (size_t offset = 0; offset < size; offset += HISTORY_BLOCK_SIZE)
+			{
+				const HistoryBlockHeader *header = (const HistoryBlockHeader *)((char *)addr + offset);
+				if (header->magic == HISTORY_BLOCK_MAGIC)
+				{
+					segment.addBlock(header, offset);
+				}
+			}
+			munmap(addr, size);
+		}
+		segment.m_size = st.st_size;
+		m_totalSize += st.st_size;
+	}
+	::close(fd);
+}
+
+/**
+ * Allocate the persistent id of a variable
+ *
+ * @param handle	The handle of the variable
+ * @param nodeId	The NodeId of the variable
+ * @param key		The asset and datapoint names of the variable, separated by a tab
+ */
+void HistoryStore::add(NodeHandle handle, const NodeId& nodeId, const string& key)
+{
+	if (!m_running)
+	{
+		return;
+	}
+	lock_guard<mutex> guard(m_mutex);
+	uint32_t id;
+	auto it = m_keys.find(key);
+	if (it != m_keys.end())
+	{
+		id = it->second;
+	}
+	else
+	{
+		id = m_nextVariable++;
+		m_keys[key] = id;
+		fprintf(m_variables, "%u\t%s\n", id, key.c_str());
+		fflush(m_variables);
+	}
+	if (handle >= m_handles.size())
+	{
+		m_handles.resize(handle + 1, -1);
+	}
+	m_handles[handle] = id;
+	m_nodeIds[nodeId] = id;
+}
+
+/**
+ * Stop recording the history of a variable that has been removed.
+ * The history already written is retained on disk.
+ *
+ * @param handle	The handle of the variable
+ * @param nodeId	The NodeId of the variable
+ */
+void HistoryStore::remove(NodeHandle handle, const NodeId& nodeId)
+{
+	if (handle >= m_handles.size() || m_handles[handle] < 0)
+	{
+		return;
+	}
+	lock_guard<mutex> guard(m_mutex);
+	m_handles[handle] = -1;
+	m_nodeIds.erase(nodeId);
+}
+
+/**
+ * Queue a sample for the writer thread. The handle table is only
+ * modified by the thread that calls append, so it is read without
+ * taking the store lock.
+ *
+ * @param handle	The handle of the variable
+ * @param timestamp	The source timestamp of the value
+ * @param value		The value
+ */
+void HistoryStore::append(NodeHandle handle, int64_t timestamp, double value)
+{
+	if (handle >= m_handles.size() || m_handles[handle] < 0)
+	{
+		return;
+	}
+	lock_guard<mutex> guard(m_queueMutex);
+	if (m_queue.size() >= MAX_QUEUED_SAMPLES)
+	{
+		if (!m_overflow)
+		{
+			Logger::getLogger()->warn("History writer is not keeping up, samples are being discarded");
+			m_overflow = true;
+		}
+		return;
+	}
+	m_overflow = false;
+	m_queue.push_back(Sample((uint32_t)m_handles[handle], timestamp, value));
+}
+
+/**
+ * The writer thread. Queued samples are collected once a second and
+ * appended to the open blocks of the current segment.
+ */
+void HistoryStore::writer()
+{
+	vector<Sample> samples;
+	unique_lock<mutex> lck(m_queueMutex);
+	while (m_running)
+	{
+		m_queueCV.wait_for(lck, chrono::seconds(1));
+		samples.swap(m_queue);
+		lck.unlock();
+		process(samples);
+		samples.clear();
+		lck.lock();
+	}
+}
+
+/**
+ * Append a set of samples to the store, starting a new segment
+ * if the current one has ended
+ *
+ * @param samples	The samples to append
+ */
+void HistoryStore::process(vector<Sample>& samples)
+{
+	lock_guard<mutex> guard(m_mutex);
+	time_t now = time(NULL);
+	if (!samples.empty())
+	{
+		if (m_fd == -1 || now >= m_segments.back().m_start + (time_t)m_segmentSeconds)
+		{
+			rotate(now);
+		}
+		for (auto& sample : samples)
+		{
+			auto it = m_open.find(sample.m_variable);
+			if (it == m_open.end())
+			{
+				it = m_open.insert(make_pair(sample.m_variable, HistoryBlockEncoder(sample.m_variable))).first;
+			}
+			if (!it->second.append(sample.m_timestamp, sample.m_value))
+			{
+				writeBlock(it->second);
+				it->second = HistoryBlockEncoder(sample.m_variable);
+				it->second.append(sample.m_timestamp, sample.m_value);
+			}
+		}
+	}
+	enforceRetention(now);
+}
+
+/**
+ * Write a full block to the current segment and add it to the index.
+ * Called with the store lock held.
+ *
+ * @param encoder	The block to write
+ */
+void HistoryStore::writeBlock(const HistoryBlockEncoder& encoder)
+{
+	if (m_fd == -1)
+	{
+		return;
+	}
+	Segment& segment = m_segments.back();
+	if (::write(m_fd, encoder.data(), HISTORY_BLOCK_SIZE) != HISTORY_BLOCK_SIZE)
+	{
+		Logger::getLogger()->error("Failed to write history to %s: %s",
+				segment.m_path.c_str(), strerror(errno));
+		// Discard any partial write so the segment remains a whole number of blocks
+		if (ftruncate(m_fd, segment.m_size) == -1)
+		{
+			::close(m_fd);
+			m_fd = -1;
+		}
+		return;
+	}
+	segment.addBlock((const HistoryBlockHeader *)encoder.data(), segment.m_size);
+	segment.m_size += HISTORY_BLOCK_SIZE;
+	m_totalSize += HISTORY_BLOCK_SIZE;
+}
+
+/**
+ * Write the partially filled blocks to the current segment. Called
+ * with the store lock held.
+ */
+void HistoryStore::flush()
+{
+	for (auto& block : m_open)
+	{
+		if (block.second.count())
+		{
+			writeBlock(block.second);
+		}
+	}
+	m_open.clear();
+}
+
+/**
+ * Close the current segment and start a new one. Called with the
+ * store lock held.
+ *
+ * @param now	The current time
+ */
+void HistoryStore::rotate(time_t now)
+{
+	if (m_fd != -1)
+	{
+		flush();
+		::close(m_fd);
+		m_fd = -1;
+	}
+	time_t start = now;
+	if (!m_segments.empty() && m_segments.back().m_start >= start)
+	{
+		start = m_segments.back().m_start + 1;
+	}
+	string path = m_directory + "/segment-" + to_string((unsigned long)start) + ".hist";
+	m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (m_fd == -1)
+	{
+		Logger::getLogger()->error("Unable to create history segment %s: %s", path.c_str(), strerror(errno));
+		return;
+	}
+	m_segments.push_back(Segment(path, start));
+}
+
+/**
+ * Remove the oldest segments once they pass the retention age or
+ * the store exceeds its size limit. The current segment is never
+ * removed. Called with the store lock held.
+ *
+ * @param now	The current time
+ */
+void HistoryStore::enforceRetention(time_t now)
+{
+	while (m_segments.size() > 1)
+	{
+		Segment& oldest = m_segments.front();
+		bool expired = m_retentionHours
+			&& oldest.m_start + (time_t)m_segmentSeconds + (time_t)m_retentionHours * 3600 < now;
+		bool oversize = m_retentionBytes && m_totalSize > m_retentionBytes;
+		if (!expired && !oversize)
+		{
+			break;
+		}
+		unlink(oldest.m_path.c_str());
+		m_totalSize -= (oldest.m_size < m_totalSize ? oldest.m_size : m_totalSize);
+		m_segments.erase(m_segments.begin());
+	}
+}
+
+/**
+ * Read the samples of a variable within a time range from a segment.
+ * Called with the store lock held.
+ *
+ * @param segment	The segment to read
+ * @param variable	The variable id
+ * @param start		The start of the time range
+ * @param end		The end of the time range
+ * @param samples	The samples found
+ */
+void HistoryStore::readSegment(const Segment& segment, uint32_t variable, int64_t start, int64_t end,
+			vector<pair<int64_t, double> >& samples)
+{
+	auto blocks = segment.m_blocks.find(variable);
+	if (blocks == segment.m_blocks.end() || segment.m_size == 0)
+	{
+		return;
+	}
+	int fd = ::open(segment.m_path.c_str(), O_RDONLY);
+	if (fd == -1)
+	{
+		return;
+	}
+	void *addr = mmap(NULL, segment.m_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (addr == MAP_FAILED)
+	{
+		return;
+	}
+	for (auto& block : blocks->second)
+	{
+		if (block.m_maxTime < start || block.m_minTime > end)
+		{
+			continue;
+		}
+		HistoryBlockDecoder decoder((const uint8_t *)addr + block.m_offset);
+		int64_t timestamp;
+		double value;
+		while (decoder.next(timestamp, value))
+		{
+			if (timestamp >= start && timestamp <= end)
+			{
+				samples.push_back(make_pair(timestamp, value));
+			}
+		}
+	}
+	munmap(addr, segment.m_size);
+}
+
+/**
+ * Return the raw values of a variable between two times, oldest first.
+ * Samples still held in the open blocks are included, samples queued
+ * for the writer in the last second are not.
+ *
+ * @param nodeId	The NodeId of the variable
+ * @param start		The start of the time range
+ * @param end		The end of the time range
+ * @param max		The maximum number of values to return, 0 for no limit
+ * @param timestamps	The timestamps of the values returned
+ * @param values	The values returned
+ * @return		False if the variable is not historized
+ */
+bool HistoryStore::readRaw(const NodeId& nodeId, int64_t start, int64_t end, unsigned int max,
+			vector<int64_t>& timestamps, vector<double>& values)
+{
+	vector<pair<int64_t, double> > samples;
+	{
+		lock_guard<mutex> guard(m_mutex);
+		auto it = m_nodeIds.find(nodeId);
+		if (it == m_nodeIds.end())
+		{
+			return false;
+		}
+		uint32_t variable = it->second;
+		for (auto& segment : m_segments)
+		{
+			if (segment.m_maxTime >= start && segment.m_minTime <= end)
+			{
+				readSegment(segment, variable, start, end, samples);
+			}
+		}
+		auto open = m_open.find(variable);
+		if (open != m_open.end())
+		{
+			HistoryBlockDecoder decoder(open->second.data());
+			int64_t timestamp;
+			double value;
+			while (decoder.next(timestamp, value))
+			{
+				if (timestamp >= start && timestamp <= end)
+				{
+					samples.push_back(make_pair(timestamp, value));
+				}
+			}
+		}
+	}
+	stable_sort(samples.begin(), samples.end(),
+		[](const pair<int64_t, double>& a, const pair<int64_t, double>& b) { return a.first < b.first; });
+	for (auto& sample : samples)
+	{
+		if (max && values.size() >= max)
+		{
+			break;
+		}
+		timestamps.push_back(sample.first);
+		values.push_back(sample.second);
+	}
+	return true;
+}
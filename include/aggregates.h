@@ -0,0 +1,85 @@
+#ifndef _AGGREGATES_H
+#define _AGGREGATES_H
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/time.h>
+
+/**
+ * A rule that requests windowed aggregates for the datapoints whose
+ * asset and datapoint names match a pair of shell style patterns
+ */
+class AggregateRule {
+	public:
+		enum Function { Minimum = 1, Maximum = 2, Mean = 4, Count = 8, Last = 16 };
+		AggregateRule(const std::string& asset, const std::string& datapoint,
+				unsigned int window, unsigned int functions) :
+			m_asset(asset), m_datapoint(datapoint), m_window(window), m_functions(functions) {};
+		bool		matches(const std::string& asset, const std::string& datapoint) const;
+		unsigned int	getWindow() const { return m_window; };
+		unsigned int	getFunctions() const { return m_functions; };
+	private:
+		std::string	m_asset;
+		std::string	m_datapoint;
+		unsigned int	m_window;
+		unsigned int	m_functions;
+};
+
+/**
+ * The set of aggregate rules from the plugin configuration
+ */
+class AggregateRules {
+	public:
+		void		parse(const std::string& json);
+		bool		isEnabled() const { return !m_rules.empty(); };
+		const AggregateRule
+				*match(const std::string& asset, const std::string& datapoint) const;
+		static const char
+				*functionName(AggregateRule::Function function);
+	private:
+		std::vector<AggregateRule>	m_rules;
+};
+
+/**
+ * The state of a tumbling window for a single variable. Windows are
+ * aligned to multiples of the window length and values are assigned
+ * to a window by their source timestamp. A window is complete when
+ * the first value of a later window arrives, or when it is flushed
+ * because its asset has stopped reporting.
+ */
+class AggregateWindow {
+	public:
+		AggregateWindow(const AggregateRule *rule) : m_rule(rule), m_start(0), m_count(0) {};
+		bool		add(const struct timeval& timestamp, double value);
+		void		reset(const struct timeval& timestamp, double value);
+		void		clear() { m_count = 0; };
+		bool		isOpen() const { return m_count > 0; };
+		const AggregateRule
+				*getRule() const { return m_rule; };
+		time_t		getStart() const { return m_start; };
+		time_t		getEnd() const { return m_start + (time_t)m_rule->getWindow(); };
+		double		getMinimum() const { return m_min; };
+		double		getMaximum() const { return m_max; };
+		double		getMean() const { return m_count ? m_sum / m_count : 0.0; };
+		uint64_t	getCount() const { return m_count; };
+		double		getLast() const { return m_last; };
+	private:
+		const AggregateRule
+				*m_rule;
+		time_t		m_start;
+		uint64_t	m_count;
+		double		m_min;
+		double		m_max;
+		double		m_sum;
+		double		m_last;
+};
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef _ASSET_MAPPER_H
+#define _ASSET_MAPPER_H
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <string>
+#include <vector>
+#include <regex>
+#include <unordered_map>
+#include <stdint.h>
+
+/**
+ * Maps asset names to a location in the hierarchy using a set of
+ * regular expression rules, each with a path template in which $n is
+ * replaced by the text matched by the nth group of the expression.
+ *
+ * The rules are indexed by the literal prefix of their expression so
+ * that only the rules that can possibly match an asset are evaluated,
+ * the first of these that matches the whole asset name is used. The
+ * result for each asset name is cached.
+ */
+class AssetMapper {
+	public:
+		AssetMapper() : m_maxPrefix(0) {};
+		void		parse(const std::string& json);
+		bool		isEnabled() const { return !m_rules.empty(); };
+		bool		map(const std::string& asset, std::string& path);
+	private:
+		class Rule {
+			public:
+				Rule(const std::string& pattern, const std::string& path) :
+					m_regex(pattern), m_path(path) {};
+				std::regex	m_regex;
+				std::string	m_path;
+		};
+		static std::string
+				literalPrefix(const std::string& pattern);
+		static std::string
+				expand(const std::string& path, const std::smatch& match);
+		std::vector<Rule>	m_rules;
+		std::unordered_map<std::string, std::vector<uint32_t> >
+					m_prefixes;
+		size_t			m_maxPrefix;
+		std::unordered_map<std::string, std::pair<bool, std::string> >
+					m_cache;
+};
+
+#endif
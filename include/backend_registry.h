@@ -0,0 +1,47 @@
+#ifndef _BACKEND_REGISTRY_H
+#define _BACKEND_REGISTRY_H
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <map>
+#include <set>
+#include <mutex>
+#include <string>
+#include <functional>
+#include <opcua_backend.h>
+
+/**
+ * The OPC UA servers running in the process, keyed by endpoint URL.
+ *
+ * Instances of the plugin in the same process that are configured with
+ * the same URL share one server, each placing its nodes in its own
+ * namespace. The server is started by the first instance to acquire it
+ * and stopped when the last instance releases it.
+ */
+class BackendRegistry {
+	public:
+		static OPCUABackend	*acquire(const std::string& url, const std::string& backend,
+						const std::string& uri, const std::string& name,
+						const std::string& ns, uint16_t& idx);
+		static void		release(OPCUABackend *backend, const std::string& ns,
+						const std::function<void()>& unshare);
+	private:
+		class Server {
+			public:
+				Server(OPCUABackend *backend, const std::string& uri, const std::string& name)
+							: m_backend(backend), m_uri(uri), m_name(name) {};
+				OPCUABackend		*m_backend;
+				std::string		m_uri;
+				std::string		m_name;
+				std::set<std::string>	m_namespaces;
+		};
+		static std::mutex			m_mutex;
+		static std::map<std::string, Server>	m_servers;
+};
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdio.h>
+#include <stdint.h>
+#include <reading.h>
+
+/**
+ * A capture file holds the blocks of readings passed to the plugin,
+ * with the time at which each block was received, so that they can be
+ * replayed later.
+ *
+ * The file starts with a magic number followed by a sequence of blocks.
+ * Integers are stored as variable length integers and strings that are
+ * names, asset and datapoint names, are stored once and then referred
+ * to by index. Each block records the time since the capture started,
+ * followed by its readings, each with its asset name, timestamps and
+ * datapoints.
+ */
+class CaptureWriter {
+	public:
+		CaptureWriter();
+		~CaptureWriter();
+		bool		open(const std::string& path, size_t limit, bool anonymise);
+		void		close();
+		bool		isOpen() const { return m_file != NULL; };
+		void		write(const std::vector<Reading *>& readings);
+	private:
+		void		putVarint(uint64_t value);
+		void		putDouble(double value);
+		void		putString(const std::string& str);
+		void		putName(const std::string& name);
+		void		putValue(DatapointValue& value);
+		void		putDatapoints(std::vector<Datapoint *>& datapoints);
+		void		putTime(const struct timeval& tv);
+		std::string	anonymise(const std::string& str);
+		FILE		*m_file;
+		size_t		m_limit;
+		size_t		m_written;
+		bool		m_anonymise;
+		int64_t		m_start;
+		std::string	m_buffer;
+		std::unordered_map<std::string, uint64_t>
+				m_names;
+		std::unordered_map<std::string, std::string>
+				m_tokens;
+};
+
+/**
+ * Reads the blocks of readings from a capture file
+ */
+class CaptureReader {
+	public:
+		CaptureReader();
+		~CaptureReader();
+		bool		open(const std::string& path);
+		void		close();
+		bool		next(std::vector<Reading *>& readings, int64_t& offset);
+	private:
+		bool		getVarint(uint64_t& value);
+		bool		getDouble(double& value);
+		bool		getString(std::string& str);
+		bool		getName(std::string& name);
+		DatapointValue	*getValue();
+		bool		getDatapoints(std::vector<Datapoint *>& datapoints);
+		bool		getTime(struct timeval& tv);
+		FILE		*m_file;
+		std::vector<std::string>
+				m_names;
+};
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef _CONTROL_DISPATCHER_H
+#define _CONTROL_DISPATCHER_H
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <map>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+
+/**
+ * Runs the control operations requested by method calls on a fixed pool
+ * of threads so that the server thread making the call waits for at
+ * most a timeout, however long the operation takes.
+ *
+ * Each operation has a destination, the service, asset or script it is
+ * sent to. The number of operations queued or running for a destination
+ * is limited and calls beyond the limit are rejected at once, so a
+ * destination that is slow to respond ties up no more than its share of
+ * the threads and never blocks the server. An operation that times out
+ * continues to run, and counts against its destination, until it
+ * completes.
+ *
+ * The state shared with the threads is held by the threads themselves,
+ * so that stopping the dispatcher waits only a bounded time for running
+ * operations and then leaves any thread that is still running one to
+ * exit once its operation completes.
+ */
+class ControlDispatcher {
+	public:
+		enum Outcome { Completed, Rejected, TimedOut };
+		ControlDispatcher();
+		~ControlDispatcher();
+		void		start(unsigned int threads, unsigned int destinationLimit);
+		void		stop();
+		bool		isRunning() const { return !m_threads.empty(); };
+		Outcome		call(const std::string& destination, const std::function<int()>& operation,
+					unsigned long timeout, int& result);
+	private:
+		class Request {
+			public:
+				Request(const std::string& destination, const std::function<int()>& operation)
+						: m_destination(destination), m_operation(operation),
+						  m_done(false), m_result(0) {};
+				std::string		m_destination;
+				std::function<int()>	m_operation;
+				bool			m_done;
+				int			m_result;
+		};
+		class State {
+			public:
+				State(unsigned int destinationLimit)
+						: m_destinationLimit(destinationLimit), m_stop(false), m_busy(0) {};
+				std::mutex		m_mutex;
+				std::condition_variable	m_work;
+				std::condition_variable	m_complete;
+				std::condition_variable	m_idle;
+				std::deque<std::shared_ptr<Request> >
+							m_queue;
+				std::map<std::string, unsigned int>
+							m_active;
+				unsigned int		m_destinationLimit;
+				bool			m_stop;
+				unsigned int		m_busy;
+		};
+		static void	worker(std::shared_ptr<State> state);
+		std::vector<std::thread>	m_threads;
+		std::shared_ptr<State>		m_state;
+};
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef _DATAPOINT_FILTER_H
+#define _DATAPOINT_FILTER_H
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+
+/**
+ * A shell style pattern compiled into the cheapest form that can
+ * match it. Patterns without wildcards are compared as literals and
+ * patterns with a single leading or trailing * as suffixes or
+ * prefixes, other patterns are matched with fnmatch.
+ */
+class CompiledPattern {
+	public:
+		enum Kind { Any, Literal, Prefix, Suffix, Glob };
+		CompiledPattern(const std::string& pattern);
+		bool		matches(const std::string& str) const;
+		Kind		getKind() const { return m_kind; };
+		const std::string&
+				getText() const { return m_text; };
+	private:
+		Kind		m_kind;
+		std::string	m_pattern;
+		std::string	m_text;
+};
+
+/**
+ * The datapoint filter rules that apply to a single asset, with a cache
+ * of the result for each datapoint.
+ *
+ * The top level datapoints of a reading are cached by their position
+ * in the reading so that, while the readings of the asset keep the same
+ * shape, the cost of the filter is a name comparison and a bit test.
+ * Nested datapoints are cached by their path.
+ */
+class DatapointProjection {
+	public:
+		DatapointProjection() : m_enabled(false), m_default(true) {};
+		bool		included(size_t index, const std::string& name);
+		bool		included(const std::string& path);
+	private:
+		friend class DatapointFilter;
+		class Rule {
+			public:
+				Rule(const CompiledPattern& pattern, uint32_t order, bool include) :
+					m_pattern(pattern), m_order(order), m_include(include) {};
+				CompiledPattern	m_pattern;
+				uint32_t	m_order;
+				bool		m_include;
+		};
+		bool		evaluate(const std::string& path) const;
+		bool		m_enabled;
+		bool		m_default;
+		std::vector<Rule>
+				m_rules;
+		std::unordered_map<std::string, std::pair<uint32_t, bool> >
+				m_literals;
+		std::vector<std::string>
+				m_names;
+		std::vector<bool>
+				m_mask;
+		std::unordered_map<std::string, bool>
+				m_nested;
+};
+
+/**
+ * The datapoint include and exclude rules from the plugin configuration.
+ * The rules are evaluated in order and the first rule that matches both
+ * the asset and the datapoint decides whether the datapoint is exposed.
+ */
+class DatapointFilter {
+	public:
+		DatapointFilter() : m_default(true) {};
+		void		parse(const std::string& json);
+		bool		isEnabled() const { return !m_rules.empty() || !m_default; };
+		DatapointProjection
+				forAsset(const std::string& asset) const;
+	private:
+		class Rule {
+			public:
+				Rule(const std::string& asset, const std::string& datapoint, bool include) :
+					m_asset(asset), m_datapoint(datapoint), m_include(include) {};
+				CompiledPattern	m_asset;
+				CompiledPattern	m_datapoint;
+				bool		m_include;
+		};
+		std::vector<Rule>	m_rules;
+		bool			m_default;
+};
+
+#endif
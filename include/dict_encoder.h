@@ -0,0 +1,38 @@
+#ifndef _DICT_ENCODER_H
+#define _DICT_ENCODER_H
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <reading.h>
+
+/**
+ * Encodes a nested datapoint as a single JSON document so that it can
+ * be published as one variable.
+ *
+ * The shape of a nested datapoint, the names and types of its children,
+ * is turned into a template of the literal text between the values the
+ * first time the shape is seen. Encoding a datapoint of a known shape
+ * then only formats the values into the template.
+ */
+class DictEncoder {
+	public:
+		void		encode(DatapointValue& value, std::string& out);
+		size_t		shapes() const { return m_templates.size(); };
+	private:
+		void		shapeOf(DatapointValue& value, std::string& shape, std::vector<DatapointValue *>& leaves);
+		void		buildTemplate(DatapointValue& value, std::vector<std::string>& fragments);
+		static void	appendValue(DatapointValue& value, std::string& out);
+		static void	appendString(const std::string& str, std::string& out);
+		std::unordered_map<std::string, std::vector<std::string> >
+				m_templates;
+};
+
+#endif
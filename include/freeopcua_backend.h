@@ -0,0 +1,70 @@
+#ifndef _FREEOPCUA_BACKEND_H
+#define _FREEOPCUA_BACKEND_H
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <map>
+#include <mutex>
+#include <opcua_backend.h>
+#include <opc/ua/node.h>
+#include <opc/ua/subscription.h>
+#include <opc/ua/server/server.h>
+#include <opc/ua/server/address_space.h>
+
+/**
+ * The subscription client used to handle the data change events. Each
+ * subscribed node has its own handler as the server may be shared by
+ * several instances of the plugin.
+ */
+class SubClient : public OpcUa::SubscriptionHandler
+{
+	public:
+		void	addHandler(const OpcUa::NodeId& node, OPCUABackend::WriteHandler handler);
+		void	removeHandler(const OpcUa::NodeId& node);
+		void 	DataChange(uint32_t handle, const OpcUa::Node & node, const OpcUa::Variant & val, OpcUa::AttributeId attr) override;
+	private:
+		std::mutex						m_mutex;
+		std::map<OpcUa::NodeId, OPCUABackend::WriteHandler>	m_handlers;
+};
+
+/**
+ * The backend built on the freeopcua server. Writes to the control
+ * variables are seen via a subscription to the variables.
+ */
+class FreeOpcUaBackend : public OPCUABackend {
+	public:
+		FreeOpcUaBackend();
+		~FreeOpcUaBackend();
+		const char	*name() const { return "freeopcua"; };
+		void		start(const std::string& url, const std::string& uri, const std::string& name);
+		void		stop();
+		uint16_t	registerNamespace(const std::string& uri);
+		void		addNodes(std::vector<BackendNode>& nodes);
+		std::vector<OpcUa::StatusCode>
+				deleteNodes(const std::vector<OpcUa::NodeId>& nodes);
+		std::vector<OpcUa::StatusCode>
+				write(const std::vector<OpcUa::WriteValue>& values);
+		OpcUa::DataValue
+				read(const OpcUa::NodeId& node);
+		void		subscribeWrites(const std::vector<OpcUa::NodeId>& nodes, WriteHandler handler);
+		bool		supportsReadHandlers() const { return m_addressSpace != NULL; };
+		void		setReadHandler(const OpcUa::NodeId& node, ReadHandler handler,
+					ReleaseHandler released);
+		bool		addMethod(const OpcUa::NodeId& parent, uint16_t ns, const std::string& name,
+					MethodHandler handler, OpcUa::NodeId& method);
+	private:
+		OpcUa::UaServer				*m_server;
+		OpcUa::Services::SharedPtr		m_services;
+		OpcUa::Server::AddressSpace::SharedPtr	m_addressSpace;
+		OpcUa::Subscription::SharedPtr		m_subscription;
+		std::mutex				m_subscriptionMutex;
+		std::map<OpcUa::NodeId, uint32_t>	m_monitoredItems;
+		SubClient				m_subscriptionClient;
+};
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef _HISTORY_H
+#define _HISTORY_H
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <node_table.h>
+
+/**
+ * In memory history of the numeric variables of the server.
+ *
+ * Each historized variable has a fixed capacity ring buffer of
+ * timestamps and values. The ring buffers are allocated from a pair
+ * of columns, one of timestamps and one of values, whose capacity is
+ * reserved at the configured memory budget and which are filled on
+ * demand. Variables created once the reserved capacity is exhausted
+ * are not historized.
+ *
+ * Timestamps are held as OPC UA DateTime values. The history is
+ * indexed by the NodeId of the variable so that it can be queried
+ * from the OPC UA server threads.
+ */
+class HistoryBuffer {
+	public:
+		enum Aggregate { Minimum, Maximum, Average };
+		HistoryBuffer();
+		void		configure(unsigned int depth, size_t budget);
+		bool		isEnabled() const { return m_depth > 0; };
+		void		add(NodeHandle handle, const OpcUa::NodeId& nodeId);
+		void		remove(NodeHandle handle);
+		void		append(NodeHandle handle, int64_t timestamp, double value);
+		bool		readRaw(const OpcUa::NodeId& nodeId, int64_t start, int64_t end, unsigned int max,
+					std::vector<int64_t>& timestamps, std::vector<double>& values);
+		bool		covers(const OpcUa::NodeId& nodeId, int64_t start);
+		static void	aggregate(const std::vector<int64_t>& rawTimes, const std::vector<double>& rawValues,
+					int64_t start, int64_t interval, Aggregate aggregate,
+					std::vector<int64_t>& timestamps, std::vector<double>& values);
+		size_t		memoryUsage();
+	private:
+		class Ring {
+			public:
+				Ring() : m_head(0), m_count(0) {};
+				uint32_t	m_head;
+				uint32_t	m_count;
+		};
+		int		find(const OpcUa::NodeId& nodeId);
+		std::mutex				m_mutex;
+		unsigned int				m_depth;
+		uint32_t				m_maxSlots;
+		uint32_t				m_nextSlot;
+		std::vector<uint32_t>			m_freeSlots;
+		std::vector<int64_t>			m_timestamps;
+		std::vector<double>			m_values;
+		std::vector<int32_t>			m_index;
+		std::vector<Ring>			m_rings;
+		std::vector<OpcUa::NodeId>		m_ids;
+		std::map<OpcUa::NodeId, uint32_t>	m_nodeIds;
+		bool					m_full;
+};
+
+#endif
@@ -0,0 +1,181 @@
+#ifndef _HISTORY_STORE_H
+#define _HISTORY_STORE_H
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <stdint.h>
+#include <time.h>
+#include <node_table.h>
+
+#define HISTORY_BLOCK_SIZE	512
+#define HISTORY_BLOCK_MAGIC	0x31424846	// FHB1
+
+/**
+ * The header of a block of history samples. Blocks are a fixed size
+ * so that the blocks of a segment can be indexed without reading the
+ * compressed samples.
+ */
+struct HistoryBlockHeader {
+	uint32_t	magic;
+	uint32_t	variable;
+	uint32_t	count;
+	uint32_t	bits;
+	int64_t		minTime;
+	int64_t		maxTime;
+};
+
+#define HISTORY_BLOCK_PAYLOAD	(HISTORY_BLOCK_SIZE - sizeof(HistoryBlockHeader))
+
+/**
+ * Compress samples into a history block. Timestamps are stored as
+ * deltas of deltas and values as the XOR of the previous value, in
+ * the style of the Gorilla time series compression.
+ */
+class HistoryBlockEncoder {
+	public:
+		HistoryBlockEncoder(uint32_t variable);
+		bool		append(int64_t timestamp, double value);
+		const uint8_t	*data() const { return m_block; };
+		uint32_t	count() const { return ((const HistoryBlockHeader *)m_block)->count; };
+	private:
+		HistoryBlockHeader
+				*header() { return (HistoryBlockHeader *)m_block; };
+		void		write(uint64_t value, unsigned int bits);
+		uint8_t		m_block[HISTORY_BLOCK_SIZE];
+		int64_t		m_lastTime;
+		int64_t		m_lastDelta;
+		uint64_t	m_lastValue;
+		unsigned int	m_leading;
+		unsigned int	m_trailing;
+};
+
+/**
+ * Decompress the samples in a history block
+ */
+class HistoryBlockDecoder {
+	public:
+		HistoryBlockDecoder(const uint8_t *block);
+		bool		next(int64_t& timestamp, double& value);
+	private:
+		uint64_t	read(unsigned int bits);
+		const HistoryBlockHeader
+				*m_header;
+		const uint8_t	*m_payload;
+		uint32_t	m_index;
+		uint32_t	m_position;
+		uint32_t	m_limit;
+		int64_t		m_lastTime;
+		int64_t		m_lastDelta;
+		uint64_t	m_lastValue;
+		unsigned int	m_leading;
+		unsigned int	m_trailing;
+};
+
+/**
+ * A disk backed store for the history of numeric variables.
+ *
+ * Samples are queued by the update path and written by a background
+ * thread into time partitioned segment files. Each segment is a
+ * sequence of fixed size compressed blocks, each holding samples for
+ * a single variable. An in memory index of the blocks of each segment,
+ * with the time range of each block, allows queries to read only the
+ * blocks that overlap the requested time range via a memory mapping
+ * of the segment.
+ *
+ * Variables are identified by a persistent id allocated from their
+ * asset and datapoint names so that history survives a restart. Segments
+ * are removed once they exceed the configured age or the store exceeds
+ * the configured size.
+ */
+class HistoryStore {
+	public:
+		HistoryStore();
+		~HistoryStore();
+		bool		open(const std::string& directory, unsigned int segmentSeconds,
+					unsigned int retentionHours, size_t retentionBytes);
+		void		close();
+		bool		isEnabled() const { return m_running; };
+		void		add(NodeHandle handle, const OpcUa::NodeId& nodeId, const std::string& key);
+		void		remove(NodeHandle handle, const OpcUa::NodeId& nodeId);
+		void		append(NodeHandle handle, int64_t timestamp, double value);
+		bool		readRaw(const OpcUa::NodeId& nodeId, int64_t start, int64_t end, unsigned int max,
+					std::vector<int64_t>& timestamps, std::vector<double>& values);
+	private:
+		class Sample {
+			public:
+				Sample(uint32_t variable, int64_t timestamp, double value) :
+					m_variable(variable), m_timestamp(timestamp), m_value(value) {};
+				uint32_t	m_variable;
+				int64_t		m_timestamp;
+				double		m_value;
+		};
+		class BlockRef {
+			public:
+				BlockRef(off_t offset, int64_t minTime, int64_t maxTime) :
+					m_offset(offset), m_minTime(minTime), m_maxTime(maxTime) {};
+				off_t		m_offset;
+				int64_t		m_minTime;
+				int64_t		m_maxTime;
+		};
+		class Segment {
+			public:
+				Segment(const std::string& path, time_t start) :
+					m_path(path), m_start(start), m_size(0),
+					m_minTime(INT64_MAX), m_maxTime(INT64_MIN) {};
+				void		addBlock(const HistoryBlockHeader *header, off_t offset);
+				std::string	m_path;
+				time_t		m_start;
+				size_t		m_size;
+				int64_t		m_minTime;
+				int64_t		m_maxTime;
+				std::unordered_map<uint32_t, std::vector<BlockRef> >
+						m_blocks;
+		};
+		void		loadVariables();
+		void		loadSegments();
+		void		indexSegment(Segment& segment);
+		void		writer();
+		void		process(std::vector<Sample>& samples);
+		void		writeBlock(const HistoryBlockEncoder& encoder);
+		void		rotate(time_t now);
+		void		flush();
+		void		enforceRetention(time_t now);
+		void		readSegment(const Segment& segment, uint32_t variable, int64_t start, int64_t end,
+					std::vector<std::pair<int64_t, double> >& samples);
+		std::string				m_directory;
+		unsigned int				m_segmentSeconds;
+		unsigned int				m_retentionHours;
+		size_t					m_retentionBytes;
+		bool					m_running;
+		std::thread				*m_thread;
+		std::mutex				m_queueMutex;
+		std::condition_variable			m_queueCV;
+		std::vector<Sample>			m_queue;
+		bool					m_overflow;
+		std::vector<int64_t>			m_handles;
+		std::mutex				m_mutex;
+		std::map<OpcUa::NodeId, uint32_t>	m_nodeIds;
+		std::unordered_map<std::string, uint32_t>
+							m_keys;
+		uint32_t				m_nextVariable;
+		FILE					*m_variables;
+		std::vector<Segment>			m_segments;
+		int					m_fd;
+		std::unordered_map<uint32_t, HistoryBlockEncoder>
+							m_open;
+		size_t					m_totalSize;
+};
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef _JSON_CONFIG_H
+#define _JSON_CONFIG_H
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <string>
+#include <rapidjson/document.h>
+
+/**
+ * Parse the value of a JSON configuration item, logging the reason for
+ * and the position of any parse error.
+ */
+bool	ParseJsonConfig(rapidjson::Document& doc, const std::string& json, const char *item);
+
+#endif
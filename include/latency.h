@@ -0,0 +1,97 @@
+#ifndef _LATENCY_H
+#define _LATENCY_H
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+#include <sys/time.h>
+#include <reading.h>
+
+/**
+ * A summary of the latencies recorded in one interval, in milliseconds
+ */
+class LatencySummary {
+	public:
+		LatencySummary() : m_count(0), m_mean(0), m_p50(0), m_p95(0), m_p99(0), m_max(0) {};
+		uint64_t	m_count;
+		double		m_mean;
+		double		m_p50;
+		double		m_p95;
+		double		m_p99;
+		double		m_max;
+};
+
+/**
+ * A histogram of latencies with logarithmic buckets. Each power of two
+ * microseconds is split into two buckets, so a percentile taken from
+ * the histogram is within a third of the true value.
+ */
+class LatencyHistogram {
+	public:
+		LatencyHistogram();
+		void		record(int64_t micros);
+		void		merge(const LatencyHistogram& other);
+		void		summarise(LatencySummary& summary) const;
+		void		reset();
+	private:
+		static const int BUCKETS = 64;
+		static int	bucket(uint64_t micros);
+		static double	upperBound(int bucket);
+		double		percentile(double fraction) const;
+		uint64_t	m_buckets[BUCKETS];
+		uint64_t	m_count;
+		uint64_t	m_sum;
+		uint64_t	m_max;
+};
+
+/**
+ * The latency between the timestamps of readings and the values being
+ * written to the server, for all assets and for configured groups of
+ * assets. The latencies are summarised over fixed intervals, the
+ * summaries of the last complete interval are available until the end
+ * of the next interval.
+ */
+class LatencyMetrics {
+	public:
+		LatencyMetrics();
+		void		configure(bool enabled, unsigned int interval, const std::string& groups);
+		bool		isEnabled() const { return m_enabled; };
+		void		record(const Reading *reading);
+		bool		due(time_t now);
+		size_t		groups() const { return m_groups.size(); };
+		const std::string&
+				groupName(size_t group) const { return m_groups[group].m_name; };
+		const LatencySummary&
+				sourceLatency(size_t group) const { return m_groups[group].m_sourceSummary; };
+		const LatencySummary&
+				ingestLatency(size_t group) const { return m_groups[group].m_ingestSummary; };
+	private:
+		class Group {
+			public:
+				Group(const std::string& name, const std::string& asset) : m_name(name), m_asset(asset) {};
+				std::string		m_name;
+				std::string		m_asset;
+				LatencyHistogram	m_source;
+				LatencyHistogram	m_ingest;
+				LatencySummary		m_sourceSummary;
+				LatencySummary		m_ingestSummary;
+		};
+		int		groupOf(const std::string& asset);
+		bool		m_enabled;
+		unsigned int	m_interval;
+		time_t		m_windowStart;
+		std::vector<Group>
+				m_groups;
+		std::unordered_map<std::string, int>
+				m_assetGroups;
+};
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef _NODE_BATCH_H
+#define _NODE_BATCH_H
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <string>
+#include <vector>
+#include <opcua_backend.h>
+#include <node_table.h>
+
+/**
+ * Collects the objects and variables to be added to the address space
+ * so that they can be added with a single call to the backend, and the
+ * initial values of the variables written with a single call, rather
+ * than with several calls to the server for every node.
+ *
+ * A handle is returned for each node as it is queued. Objects have a
+ * NodeId chosen by the plugin, variables have their NodeId assigned by
+ * the server and the handle is updated with it when the batch is
+ * flushed. Nodes may be queued beneath objects earlier in the same
+ * batch. Nothing may be read from or written to a queued node until the
+ * batch has been flushed.
+ */
+class NodeBatch {
+	public:
+		NodeBatch(NodeTable& nodes);
+		void		setBackend(OPCUABackend *backend)
+				{
+					m_backend = backend;
+				};
+		NodeHandle	addObject(const OpcUa::NodeId& parent, const OpcUa::NodeId& nodeId,
+					const OpcUa::QualifiedName& name);
+		NodeHandle	addVariable(const OpcUa::NodeId& parent, uint16_t ns, const std::string& name,
+					const OpcUa::Variant& value, bool writable);
+		NodeHandle	addVariable(const OpcUa::NodeId& parent, uint16_t ns, const std::string& name,
+					const OpcUa::Variant& value, const OpcUa::DateTime& sourceTime);
+		bool		empty() const { return m_items.empty(); };
+		size_t		size() const { return m_items.size(); };
+		void		flush();
+	private:
+		NodeTable&				m_nodes;
+		OPCUABackend				*m_backend;
+		std::vector<BackendNode>		m_items;
+		std::vector<NodeHandle>			m_handles;
+		std::vector<std::pair<size_t, OpcUa::DataValue> >
+							m_values;
+};
+
+#endif
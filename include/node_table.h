@@ -0,0 +1,60 @@
+#ifndef _NODE_TABLE_H
+#define _NODE_TABLE_H
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+#include <opc/ua/protocol/protocol.h>
+
+/**
+ * A compact handle for a node in the OPC UA address space
+ */
+typedef uint32_t NodeHandle;
+
+#define INVALID_NODE_HANDLE	((NodeHandle)-1)
+
+/**
+ * A dense table of the NodeIds of the nodes the plugin has created.
+ *
+ * Rather than hold the full NodeId of every object and variable the
+ * plugin holds a 32 bit handle into this table. Integer NodeIds are
+ * stored inline, string NodeIds hold an index into a table of strings.
+ */
+class NodeTable {
+	public:
+		NodeTable();
+		NodeHandle		add(const OpcUa::NodeId& nodeId);
+		void			replace(NodeHandle handle, const OpcUa::NodeId& nodeId);
+		void			remove(NodeHandle handle);
+		OpcUa::NodeId		getNodeId(NodeHandle handle) const;
+		bool			matches(NodeHandle handle, const OpcUa::NodeId& nodeId) const;
+		void			nodeIds(std::vector<OpcUa::NodeId>& ids) const;
+		size_t			size() const { return m_entries.size() - m_free.size(); };
+		size_t			memoryUsage() const;
+	private:
+		void			assign(NodeHandle handle, const OpcUa::NodeId& nodeId);
+		void			release(NodeHandle handle);
+		enum EntryType { Free, Integer, String, Other };
+		class Entry {
+			public:
+				Entry() : m_id(0), m_namespace(0), m_type(Free) {};
+				uint32_t	m_id;
+				uint16_t	m_namespace;
+				uint8_t		m_type;
+		};
+		std::vector<Entry>			m_entries;
+		std::vector<NodeHandle>			m_free;
+		std::vector<std::string>		m_strings;
+		std::vector<uint32_t>			m_freeStrings;
+		std::map<NodeHandle, OpcUa::NodeId>	m_other;
+};
+
+#endif
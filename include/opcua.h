@@ -1,41 +1,49 @@
 #ifndef _OPCUASERVER_H
 #define _OPCUASERVER_H
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <list>
 #include <stack>
+#include <atomic>
 #include <reading.h>
 #include <config_category.h>
 #include <logger.h>
 #include <string>
-#include <opc/ua/node.h>
-#include <opc/ua/subscription.h>
-#include <opc/ua/server/server.h>
 #include <plugin_api.h>
-
-class OPCUAServer;
-
-/**
- * The subscription client used to handle the data change events
- */
-class SubClient : public OpcUa::SubscriptionHandler
-{
-	public:
-		void	registerServer(OPCUAServer *server) { m_server = server; };
-		void 	DataChange(uint32_t handle, const OpcUa::Node & node, const OpcUa::Variant & val, OpcUa::AttributeId attr) override;
-	private:
-		OPCUAServer		*m_server;
-};
+#include <timer_wheel.h>
+#include <node_table.h>
+#include <node_batch.h>
+#include <opcua_backend.h>
+#include <backend_registry.h>
+#include <value_store.h>
+#include <shm_export.h>
+#include <history.h>
+#include <history_store.h>
+#include <aggregates.h>
+#include <publish_policy.h>
+#include <datapoint_filter.h>
+#include <asset_mapper.h>
+#include <dict_encoder.h>
+#include <worker_pool.h>
+#include <snapshot.h>
+#include <latency.h>
+#include <sampling_hints.h>
+#include <control_dispatcher.h>
+#include <trace.h>
 
 /**
  * The OPCUA Server 
  */
 class OPCUAServer {
 	public:
-		OPCUAServer();
+		OPCUAServer(unsigned int shard = 0);
 		~OPCUAServer();
 		void		configure(const ConfigCategory *conf);
-		uint32_t	send(const std::vector<Reading *>& readings);
+		uint32_t	send(const std::vector<Reading *>& readings, bool trace = false);
 		void		stop();
-		void		nodeChange(const OpcUa::Node& node, const std::string& value);
+		std::string	shardKey(const Reading *reading);
+		void		nodeChange(const OpcUa::NodeId& node, const OpcUa::Variant& value);
 		void		registerControl(bool ( *write)(const char *name, const char *value, ControlDestination destination, ...),
                                 int (* operation)(char *operation, int paramCount, char *parameters[], ControlDestination destination, ...));
 	private:
@@ -63,12 +71,14 @@ class OPCUAServer {
 		class ControlNode {
 			public:
 				ControlNode(const std::string& name, const std::string& type)
-									: m_name(name), m_type(type), m_destination(DestinationBroadcast) {};
+									: m_name(name), m_type(type), m_destination(DestinationBroadcast),
+									  m_node(INVALID_NODE_HANDLE) {};
 				ControlNode(const std::string& name, const std::string& type, ControlDestination dest, const std::string& arg)
-									: m_name(name), m_type(type), m_destination(dest), m_arg(arg) {};
-				void			createNode(uint32_t idx, OpcUa::Node& parent);
+									: m_name(name), m_type(type), m_destination(dest), m_arg(arg),
+									  m_node(INVALID_NODE_HANDLE) {};
+				void			createNode(uint16_t idx, const OpcUa::NodeId& parent, NodeBatch& batch);
 				const std::string&	getName() const { return m_name; };
-				const OpcUa::Node	getNode() const { return m_node; };
+				NodeHandle		getNode() const { return m_node; };
 				ControlDestination	getDestination() const { return m_destination; };
 				const std::string&	getArgument() const { return m_arg; };
 			private:
@@ -77,25 +87,303 @@ class OPCUAServer {
 				const ControlDestination
 							m_destination;
 				const std::string	m_arg;
-				OpcUa::Node		m_node;
+				NodeHandle		m_node;
+		};
+		/**
+		 * A method that clients call to run a control operation
+		 */
+		class ControlMethod {
+			public:
+				ControlMethod(const std::string& name, const std::string& operation,
+						const std::vector<std::string>& parameters, ControlDestination dest,
+						const std::string& arg, unsigned long timeout)
+									: m_name(name), m_operation(operation), m_parameters(parameters),
+									  m_destination(dest), m_arg(arg), m_timeout(timeout) {};
+				std::string		m_name;
+				std::string		m_operation;
+				std::vector<std::string>
+							m_parameters;
+				ControlDestination	m_destination;
+				std::string		m_arg;
+				unsigned long		m_timeout;
+		};
+		class ParentNode {
+			public:
+				ParentNode(NodeHandle node, const std::string& parent)
+									: m_node(node), m_parent(parent), m_children(0) {};
+				NodeHandle		getNode() const { return m_node; };
+				const std::string&	getParent() const { return m_parent; };
+				void			addChild() { m_children++; };
+				unsigned int		removeChild() { return m_children ? --m_children : 0; };
+			private:
+				NodeHandle		m_node;
+				std::string		m_parent;
+				unsigned int		m_children;
+		};
+		/**
+		 * The variable or object of a datapoint. The variable of an
+		 * aggregate holds the handle of the variable the aggregate is
+		 * calculated from, other datapoints hold INVALID_NODE_HANDLE.
+		 */
+		class DatapointNode {
+			public:
+				DatapointNode(NodeHandle node, bool object, NodeHandle source, unsigned int index)
+									: m_node(node), m_object(object), m_source(source), m_index(index) {};
+				bool			isAggregate() const { return m_source != INVALID_NODE_HANDLE; };
+				NodeHandle		m_node;
+				bool			m_object;
+				NodeHandle		m_source;
+				unsigned int		m_index;
+		};
+		/**
+		 * The variables of an asset, indexed by the path of their
+		 * datapoint. Each datapoint is also given an index into a pair
+		 * of bitsets that record which datapoints have been seen in the
+		 * current window and which have been flagged as vanished.
+		 */
+		class AssetNode {
+			public:
+				AssetNode(NodeHandle object, const std::string& parent, bool owner)
+									: m_lastSeen(0), m_nodes(0), m_stale(false), m_scheduled(false),
+									  m_windowStart(0), m_windowEnded(false), m_aggregateWindow(0),
+									  m_aggregatesScheduled(false), m_readingTime(0), m_object(object), m_parent(parent),
+									  m_owner(owner) {};
+				NodeHandle		getObject() const { return m_object; };
+				const std::string&	getParent() const { return m_parent; };
+				bool			ownsObject() const { return m_owner; };
+				void			addDatapoint(const std::string& path, NodeHandle node, bool object,
+								NodeHandle source = INVALID_NODE_HANDLE)
+							{
+								unsigned int index = m_seen.size();
+								if (!m_free.empty())
+								{
+									index = m_free.back();
+									m_free.pop_back();
+								}
+								else
+								{
+									m_seen.push_back(false);
+									m_flagged.push_back(false);
+								}
+								m_seen[index] = true;
+								m_flagged[index] = false;
+								m_datapoints.insert(std::pair<std::string, DatapointNode>(path, DatapointNode(node, object, source, index)));
+							};
+				void			removeDatapoint(const std::string& path)
+							{
+								auto it = m_datapoints.find(path);
+								if (it != m_datapoints.end())
+								{
+									m_free.push_back(it->second.m_index);
+									m_datapoints.erase(it);
+								}
+							};
+				void			seen(const DatapointNode& dp)
+							{
+								m_seen[dp.m_index] = true;
+								m_flagged[dp.m_index] = false;
+							};
+				bool			isSeen(const DatapointNode& dp) const { return m_seen[dp.m_index]; };
+				bool			isFlagged(const DatapointNode& dp) const { return m_flagged[dp.m_index]; };
+				void			flag(const DatapointNode& dp) { m_flagged[dp.m_index] = true; };
+				void			newWindow(time_t now)
+							{
+								m_seen.assign(m_seen.size(), false);
+								m_windowStart = now;
+							};
+				DatapointNode		*findDatapoint(const std::string& path)
+							{
+								auto it = m_datapoints.find(path);
+								return it == m_datapoints.end() ? NULL : &it->second;
+							};
+				const std::map<std::string, DatapointNode>&
+							getDatapoints() const { return m_datapoints; };
+				time_t			m_lastSeen;
+				unsigned long		m_nodes;
+				bool			m_stale;
+				bool			m_scheduled;
+				std::list<std::string>::iterator
+							m_lru;
+				DatapointProjection	m_projection;
+				time_t			m_windowStart;
+				bool			m_windowEnded;
+				unsigned int		m_aggregateWindow;
+				bool			m_aggregatesScheduled;
+				time_t			m_readingTime;
+			private:
+				NodeHandle		m_object;
+				std::string		m_parent;
+				bool			m_owner;
+				std::map<std::string, DatapointNode>
+							m_datapoints;
+				std::vector<bool>	m_seen;
+				std::vector<bool>	m_flagged;
+				std::vector<unsigned int>
+							m_free;
+		};
+		/**
+		 * The publish state of an asset that has a publish policy
+		 */
+		class AssetThrottle {
+			public:
+				AssetThrottle(const PublishPolicy *policy) : m_policy(policy),
+									m_bucket(policy ? policy->getRate() : 0.0, policy ? policy->getBurst() : 1.0),
+									m_pending(NULL) {};
+				const PublishPolicy	*m_policy;
+				TokenBucket		m_bucket;
+				Reading			*m_pending;
+		};
+		/**
+		 * A datapoint value converted ready to be written to its variable
+		 */
+		class PreparedValue {
+			public:
+				PreparedValue(const DatapointNode& dp, const std::string& name, DatapointValue *value)
+									: m_node(dp.m_node), m_datapoint(&dp), m_name(name), m_value(value) {};
+				NodeHandle		m_node;
+				const DatapointNode	*m_datapoint;
+				std::string		m_name;
+				DatapointValue		*m_value;
+				OpcUa::Variant		m_variant;
+		};
+		/**
+		 * A reading converted ready to be written. If m_asset is NULL the
+		 * reading could not be converted and is added or updated as normal.
+		 */
+		class PreparedReading {
+			public:
+				PreparedReading() : m_asset(NULL) {};
+				AssetNode		*m_asset;
+				struct timeval		m_userTS;
+				OpcUa::DateTime		m_sourceTime;
+				std::vector<PreparedValue>
+							m_values;
+		};
+		/**
+		 * A cumulative counter of a statistic and the rate calculated
+		 * from the change in the counter between readings
+		 */
+		class StatisticCounter {
+			public:
+				StatisticCounter(const std::string& name, NodeHandle value, NodeHandle rate)
+									: m_name(name), m_value(value), m_rate(rate),
+									  m_last(0.0), m_lastTime(0.0), m_primed(false) {};
+				std::string		m_name;
+				NodeHandle		m_value;
+				NodeHandle		m_rate;
+				double			m_last;
+				double			m_lastTime;
+				bool			m_primed;
+		};
+		/**
+		 * The object of a statistic and its counters. The layout maps
+		 * the position of each datapoint in the readings of the
+		 * statistic to the index of its counter, or -1 if the
+		 * datapoint is not numeric, so that the counters of a reading
+		 * with the same shape are found without searching by name.
+		 */
+		class StatisticNode {
+			public:
+				StatisticNode(NodeHandle object) : m_object(object) {};
+				bool			matches(Reading *reading) const;
+				void			layout(Reading *reading);
+				NodeHandle		m_object;
+				std::vector<StatisticCounter>
+							m_counters;
+				std::vector<int>	m_layout;
+		};
+		/**
+		 * A new variable that needs its history or value callback
+		 * set up once the batch that adds it has been flushed
+		 */
+		class PendingVariable {
+			public:
+				PendingVariable(NodeHandle node) : m_node(node), m_history(false),
+									m_timestamp(0), m_value(0.0) {};
+				NodeHandle		m_node;
+				bool			m_history;
+				std::string		m_key;
+				int64_t			m_timestamp;
+				double			m_value;
 		};
+		void		addAssets(const std::vector<Reading *>& readings, time_t now, std::vector<bool>& added);
+		void		flushNodes();
+		void		flushWrites();
+		void		releaseBackend();
+		void		removeNamespaceNodes();
+		void		scheduleReadings(const std::vector<Reading *>& readings, std::vector<Reading *>& ordered,
+					std::vector<Reading *>& released);
+		void		publishParallel(const std::vector<Reading *>& readings, const std::vector<bool>& added, time_t now);
+		void		prepareReading(Reading *reading, PreparedReading& prepared);
 		void		updateAsset(Reading *reading);
 		void		addAsset(Reading *reading);
-		void		addDatapoint(std::string& assetName, OpcUa::Node& obj,
-					std::string& name, DatapointValue& value, struct timeval userTS);
-		void		updateDatapoint(std::string& assetName, OpcUa::Node& obj,
-					std::string& name, DatapointValue& value, struct timeval userTS);
-		OpcUa::Node	createHierarchyFromPathSegments(std::stack<std::string> &pathSegments, const OpcUa::Node &root, std::string &key);
-		OpcUa::Node		findParent(const Reading *reading);
-		OpcUa::Node		findParent(const std::vector<NodeTree>& hierarchy, const Reading *reading, OpcUa::Node& root, std::string key);
+		void		addDatapoint(AssetNode& asset, const std::string& prefix, std::string& assetName,
+					NodeHandle parent, std::string& name, DatapointValue& value, struct timeval userTS);
+		void		updateDatapoint(AssetNode& asset, const std::string& prefix, std::string& assetName,
+					NodeHandle parent, std::string& name, DatapointValue& value, struct timeval userTS);
+		void		writeValue(AssetNode& asset, const std::string& prefix, std::string& assetName,
+					NodeHandle parent, std::string& name, NodeHandle handle, DatapointValue& value,
+					struct timeval userTS, const OpcUa::Variant& variant, const OpcUa::DateTime& sourceTime);
+		OpcUa::NodeId	createHierarchyFromPathSegments(std::stack<std::string> &pathSegments, const OpcUa::NodeId &root, std::string &key);
+		OpcUa::NodeId		findParent(const Reading *reading);
+		OpcUa::NodeId		findParent(const std::vector<NodeTree>& hierarchy, const Reading *reading, const OpcUa::NodeId& root, std::string key);
 		void 		parseChildren(NodeTree& parent, const rapidjson::Value& value);
 		void		addControlNode(const std::string& name, const std::string& type);
 		void		addControlNode(const std::string& name, const std::string& type, ControlDestination dest, const std::string& arg);
 		void		createControlNodes();
-		bool 					(*m_write)(const char *name, const char *value, ControlDestination destination, ...);
-		OpcUa::UaServer				*m_server;
-		std::map<std::string, OpcUa::Node>	m_assets;
-		std::map<std::string, OpcUa::Node>	m_parents;
+		void		createControlMethods(const OpcUa::NodeId& parent);
+		std::vector<OpcUa::Variant>
+				callMethod(const ControlMethod& method, const std::vector<OpcUa::Variant>& arguments);
+		void		touchAsset(const std::string& assetName, time_t now);
+		time_t		nextDeadline(const AssetNode& asset) const;
+		void		expireAssets(time_t now);
+		void		enforceNodeLimit();
+		void		markStale(const AssetNode& asset);
+		void		markStale(const DatapointNode& dp, std::vector<OpcUa::WriteValue>& writes);
+		void		removeAsset(const std::string& assetName);
+		void		releaseDatapoint(const DatapointNode& dp, std::vector<OpcUa::NodeId>& nodes);
+		void		expireDatapoints(time_t now);
+		void		expireDatapoints(AssetNode& asset, const std::string& assetName, time_t now);
+		void		releaseParent(const std::string& key);
+		void		deleteNodes(const std::vector<OpcUa::NodeId>& nodes);
+		bool		storeValue(NodeHandle handle, DatapointValue& value, struct timeval userTS);
+		void		registerValueCallback(NodeHandle handle);
+		void		exportValue(NodeHandle handle, DatapointValue& value, struct timeval userTS);
+		void		historyValue(NodeHandle handle, DatapointValue& value, struct timeval userTS);
+		void		createHistoryMethods();
+		void		createLatencyNodes();
+		void		publishLatency();
+		void		publishStatistics(const std::vector<Reading *>& readings);
+		void		writeStatistics(const std::vector<Reading *>& readings,
+						const std::vector<StatisticNode *>& statistics,
+						size_t first, size_t last);
+		void		createStatisticNodes();
+		StatisticNode	*addStatistic(Reading *reading, StatisticNode *statistic);
+		void		addStatisticCounter(StatisticNode *statistic, const OpcUa::NodeId& obj,
+						const std::string& name, const OpcUa::Variant& initial);
+		void		writeStatistic(StatisticCounter& counter, DatapointValue& value,
+					struct timeval userTS, const OpcUa::DateTime& sourceTime);
+		void		aggregateValue(AssetNode& asset, const std::string& prefix, std::string& assetName,
+					NodeHandle parent, std::string& name, NodeHandle handle,
+					DatapointValue& value, struct timeval userTS);
+		bool		publishAggregates(AssetNode& asset, const std::string& prefix, std::string& assetName,
+					NodeHandle parent, const std::string& name, const AggregateWindow& window);
+		void		flushAggregates(time_t now);
+		typedef bool				(*ControlWrite)(const char *name, const char *value,
+							ControlDestination destination, ...);
+		typedef int				(*ControlOperation)(char *operation, int paramCount,
+							char *parameters[], ControlDestination destination, ...);
+		// Set on the north thread, read on the subscription and method threads of the backend
+		std::atomic<ControlWrite>		m_write;
+		OPCUABackend				*m_backend;
+		std::string				m_backendName;
+		NodeTable				m_nodes;
+		NodeBatch				m_batch;
+		std::vector<PendingVariable>		m_pending;
+		std::vector<OpcUa::WriteValue>		m_writes;
+		// Only used on the north thread and by the conversion threads while the north thread waits for them
+		std::map<std::string, AssetNode>	m_assets;
+		std::map<std::string, ParentNode>	m_parents;
 		std::string				m_name;
 		std::string				m_url;
 		std::string				m_uri;
@@ -104,15 +392,62 @@ class OPCUAServer {
 		bool					m_includeAsset;
 		bool					m_parseAsset;
 		int					m_idx;
-		OpcUa::Node				m_objects;
+		OpcUa::NodeId				m_objects;
 		Logger					*m_log;
 		std::vector<NodeTree>			m_hierarchy;
-		OpcUa::Subscription::SharedPtr		m_subscription;
-		SubClient				m_subscriptionClient;
 		std::vector<ControlNode>		m_control;
+		Snapshot<std::map<OpcUa::NodeId, ControlNode> >
+							m_controlIndex;
 		std::string				m_controlRoot;
+		std::vector<ControlMethod>		m_methods;
+		std::atomic<ControlOperation>		m_operation;
+		ControlDispatcher			m_dispatcher;
+		unsigned int				m_methodThreads;
+		unsigned int				m_methodConcurrency;
+		unsigned long				m_methodTimeout;
 		std::vector<DatapointValue::DatapointTag>
 							m_warned;
+		std::unordered_set<NodeHandle>		m_unsupported;
+		unsigned long				m_staleTimeout;
+		unsigned long				m_removeTimeout;
+		unsigned long				m_maxNodes;
+		unsigned long				m_datapointWindow;
+		bool					m_removeDatapoints;
+		std::vector<std::string>		m_windowsEnded;
+		unsigned long				m_nodeCount;
+		TimerWheel				m_wheel;
+		std::list<std::string>			m_lru;
+		bool					m_lazyValues;
+		ValueStore				m_values;
+		ShmExport				m_shm;
+		HistoryBuffer				m_history;
+		HistoryStore				m_historyStore;
+		AggregateRules				m_aggregates;
+		std::unordered_map<NodeHandle, AggregateWindow>
+							m_windows;
+		TimerWheel				m_aggregateWheel;
+		NodeHandle				m_aggregateSource;
+		PublishPolicies				m_policies;
+		std::unordered_map<std::string, AssetThrottle>
+							m_throttles;
+		std::vector<std::string>		m_throttled;
+		DatapointFilter				m_filter;
+		AssetMapper				m_mapper;
+		bool					m_structuredDatapoints;
+		DictEncoder				m_dictEncoder;
+		WorkerPool				m_conversionPool;
+		unsigned int				m_shard;
+		std::string				m_shardName;
+		LatencyMetrics				m_latency;
+		std::vector<NodeHandle>			m_latencyNodes;
+		unsigned long				m_parallelThreshold;
+		SamplingHints				m_sampling;
+		bool					m_trace;
+		bool					m_statisticsFastPath;
+		bool					m_statisticsRates;
+		std::unordered_map<std::string, StatisticNode>
+							m_statistics;
+		std::vector<std::string>		m_statisticKeys;
 };
 
 #endif
@@ -0,0 +1,90 @@
+#ifndef _OPCUA_BACKEND_H
+#define _OPCUA_BACKEND_H
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <string>
+#include <vector>
+#include <functional>
+#include <opc/ua/protocol/protocol.h>
+
+/**
+ * A node to be added to the address space by a backend, with the
+ * result of adding it. A requested NodeId with a null identifier asks
+ * the server to assign the NodeId.
+ */
+class BackendNode {
+	public:
+		BackendNode(const OpcUa::NodeId& parent, const OpcUa::NodeId& requested,
+				const OpcUa::QualifiedName& name)
+					: m_parent(parent), m_requested(requested), m_name(name),
+					  m_object(true), m_writable(false), m_status(OpcUa::StatusCode::Good) {};
+		BackendNode(const OpcUa::NodeId& parent, const OpcUa::NodeId& requested,
+				const OpcUa::QualifiedName& name, const OpcUa::Variant& value, bool writable)
+					: m_parent(parent), m_requested(requested), m_name(name),
+					  m_object(false), m_writable(writable), m_value(value),
+					  m_status(OpcUa::StatusCode::Good) {};
+		OpcUa::NodeId		m_parent;
+		OpcUa::NodeId		m_requested;
+		OpcUa::QualifiedName	m_name;
+		bool			m_object;
+		bool			m_writable;
+		OpcUa::Variant		m_value;
+		OpcUa::StatusCode	m_status;
+		OpcUa::NodeId		m_id;
+};
+
+/**
+ * The interface between the plugin and the OPC UA server SDK that
+ * holds the address space.
+ *
+ * The plugin uses the freeopcua protocol types, NodeId, Variant and
+ * DataValue, as its vocabulary. A backend built on another SDK converts
+ * them at this interface. Calls are made from the north thread, the
+ * write and read handlers are called on a thread of the backend.
+ *
+ * A backend that reports the deletion of monitored items calls the
+ * release handler of a variable when its last monitored item is deleted.
+ *
+ * A backend may be shared by several instances of the plugin, each with
+ * its own namespace, so the handlers are held per node and are removed
+ * when the node is deleted.
+ */
+class OPCUABackend {
+	public:
+		typedef std::function<void(const OpcUa::NodeId& node, const OpcUa::Variant& value)>
+					WriteHandler;
+		typedef std::function<OpcUa::DataValue()>
+					ReadHandler;
+		typedef std::function<void()>
+					ReleaseHandler;
+		typedef std::function<std::vector<OpcUa::Variant>(const std::vector<OpcUa::Variant>& arguments)>
+					MethodHandler;
+		virtual			~OPCUABackend() {};
+		static OPCUABackend	*create(const std::string& name);
+		virtual const char	*name() const = 0;
+		virtual void		start(const std::string& url, const std::string& uri, const std::string& name) = 0;
+		virtual void		stop() = 0;
+		virtual uint16_t	registerNamespace(const std::string& uri) = 0;
+		virtual void		addNodes(std::vector<BackendNode>& nodes) = 0;
+		virtual std::vector<OpcUa::StatusCode>
+					deleteNodes(const std::vector<OpcUa::NodeId>& nodes) = 0;
+		virtual std::vector<OpcUa::StatusCode>
+					write(const std::vector<OpcUa::WriteValue>& values) = 0;
+		virtual OpcUa::DataValue
+					read(const OpcUa::NodeId& node) = 0;
+		virtual void		subscribeWrites(const std::vector<OpcUa::NodeId>& nodes, WriteHandler handler) = 0;
+		virtual bool		supportsReadHandlers() const = 0;
+		virtual void		setReadHandler(const OpcUa::NodeId& node, ReadHandler handler,
+						ReleaseHandler released) = 0;
+		virtual bool		addMethod(const OpcUa::NodeId& parent, uint16_t ns, const std::string& name,
+						MethodHandler handler, OpcUa::NodeId& method) = 0;
+		OpcUa::NodeId		objectsFolder() const { return OpcUa::NodeId(OpcUa::ObjectId::ObjectsFolder); };
+};
+
+#endif
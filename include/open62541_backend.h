@@ -0,0 +1,69 @@
+#ifndef _OPEN62541_BACKEND_H
+#define _OPEN62541_BACKEND_H
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <opcua_backend.h>
+
+struct UA_Server;
+
+/**
+ * The backend built on the open62541 server SDK. It is only available
+ * if the plugin is built with open62541.
+ *
+ * The server is driven by a thread of the backend that iterates the
+ * server event loop. The open62541 server is not thread safe, unless
+ * built with multithreading support, so the backend holds a mutex
+ * while the server iterates and while it is called from the north
+ * thread. Writes to the control variables are seen via a value
+ * callback rather than a subscription, as are reads of variables
+ * that have a read handler. The value callbacks are called with the
+ * mutex held, as is the callback that reports the creation and deletion
+ * of monitored items.
+ */
+class Open62541Backend : public OPCUABackend {
+	public:
+		Open62541Backend();
+		~Open62541Backend();
+		const char	*name() const { return "open62541"; };
+		void		start(const std::string& url, const std::string& uri, const std::string& name);
+		void		stop();
+		uint16_t	registerNamespace(const std::string& uri);
+		void		addNodes(std::vector<BackendNode>& nodes);
+		std::vector<OpcUa::StatusCode>
+				deleteNodes(const std::vector<OpcUa::NodeId>& nodes);
+		std::vector<OpcUa::StatusCode>
+				write(const std::vector<OpcUa::WriteValue>& values);
+		OpcUa::DataValue
+				read(const OpcUa::NodeId& node);
+		void		subscribeWrites(const std::vector<OpcUa::NodeId>& nodes, WriteHandler handler);
+		bool		supportsReadHandlers() const { return true; };
+		void		setReadHandler(const OpcUa::NodeId& node, ReadHandler handler,
+					ReleaseHandler released);
+		bool		addMethod(const OpcUa::NodeId& parent, uint16_t ns, const std::string& name,
+					MethodHandler handler, OpcUa::NodeId& method);
+		void		valueRead(const OpcUa::NodeId& node);
+		void		valueWritten(const OpcUa::NodeId& node, const OpcUa::Variant& value);
+		void		monitoredItem(const OpcUa::NodeId& node, bool removed);
+	private:
+		void		run();
+		UA_Server				*m_server;
+		std::thread				*m_thread;
+		std::atomic<bool>			m_running;
+		std::mutex				m_mutex;
+		std::map<OpcUa::NodeId, WriteHandler>	m_writeHandlers;
+		std::map<OpcUa::NodeId, ReadHandler>	m_readHandlers;
+		std::map<OpcUa::NodeId, ReleaseHandler>	m_releaseHandlers;
+		std::map<OpcUa::NodeId, unsigned int>	m_monitored;
+};
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef _PUBLISH_POLICY_H
+#define _PUBLISH_POLICY_H
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <string>
+#include <vector>
+
+/**
+ * The publish policy for the assets whose names match a shell style
+ * pattern. A policy may limit the rate at which readings of an asset
+ * are written to the server and sets the priority of the asset.
+ */
+class PublishPolicy {
+	public:
+		enum Priority { High, Normal, Low };
+		PublishPolicy(const std::string& asset, double rate, double burst, Priority priority) :
+			m_asset(asset), m_rate(rate), m_burst(burst), m_priority(priority) {};
+		bool		matches(const std::string& asset) const;
+		double		getRate() const { return m_rate; };
+		double		getBurst() const { return m_burst; };
+		Priority	getPriority() const { return m_priority; };
+	private:
+		std::string	m_asset;
+		double		m_rate;
+		double		m_burst;
+		Priority	m_priority;
+};
+
+/**
+ * The set of publish policies from the plugin configuration
+ */
+class PublishPolicies {
+	public:
+		void		parse(const std::string& json);
+		bool		isEnabled() const { return !m_policies.empty(); };
+		const PublishPolicy
+				*match(const std::string& asset) const;
+	private:
+		std::vector<PublishPolicy>	m_policies;
+};
+
+/**
+ * A token bucket that limits the rate of an asset. Tokens accumulate
+ * at the configured rate up to the burst size and each reading that
+ * is written consumes a token.
+ */
+class TokenBucket {
+	public:
+		TokenBucket(double rate, double burst) : m_rate(rate), m_burst(burst), m_tokens(burst), m_last(0) {};
+		bool		take(double now);
+	private:
+		void		refill(double now);
+		double		m_rate;
+		double		m_burst;
+		double		m_tokens;
+		double		m_last;
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef _SAMPLING_HINTS_H
+#define _SAMPLING_HINTS_H
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <unordered_map>
+#include <stdint.h>
+#include <sys/time.h>
+#include <node_table.h>
+
+/**
+ * Tracks the rate at which each variable is updated in order to
+ * advertise a MinimumSamplingInterval that stops clients sampling a
+ * variable faster than its value can change.
+ *
+ * The interval between updates is taken from the user timestamps of
+ * the readings and smoothed with an exponentially weighted mean. The
+ * hint is half of the mean interval, rounded down to a 1, 2, 5 series
+ * of milliseconds, and is only changed when it moves by a material
+ * amount so that jitter in the update rate does not cause the attribute
+ * to be rewritten.
+ */
+class SamplingHints {
+	public:
+		SamplingHints();
+		void		configure(bool enabled, unsigned long maximum);
+		bool		isEnabled() const { return m_enabled; };
+		bool		update(NodeHandle node, const struct timeval& userTS, double& interval);
+		void		remove(NodeHandle node) { m_rates.erase(node); };
+		size_t		memoryUsage() const;
+	private:
+		class Rate {
+			public:
+				Rate() : m_last(0), m_mean(0), m_samples(0), m_advertised(-1) {};
+				int64_t		m_last;
+				double		m_mean;
+				unsigned int	m_samples;
+				double		m_advertised;
+		};
+		static double	quantise(double interval);
+		bool		m_enabled;
+		double		m_maximum;
+		std::unordered_map<NodeHandle, Rate>
+				m_rates;
+};
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef _SHARDED_SERVER_H
+#define _SHARDED_SERVER_H
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <opcua.h>
+#include <worker_pool.h>
+#include <capture.h>
+
+/**
+ * Divides the assets between a number of OPC UA servers, each with its
+ * own endpoint and address space, so that the load of serving many
+ * clients is spread across several servers.
+ *
+ * Each asset is assigned to a shard by a hash of either its name or of
+ * the top level of the hierarchy it is placed in, and stays in that
+ * shard for the life of the plugin. With a single shard the readings
+ * are passed directly to the one server.
+ */
+class ShardedServer {
+	public:
+		ShardedServer();
+		~ShardedServer();
+		void		configure(const ConfigCategory *conf);
+		uint32_t	send(const std::vector<Reading *>& readings);
+		void		stop();
+		void		registerControl(bool ( *write)(const char *name, const char *value, ControlDestination destination, ...),
+                                int (* operation)(char *operation, int paramCount, char *parameters[], ControlDestination destination, ...));
+	private:
+		uint32_t	sendBlock(const std::vector<Reading *>& readings, bool trace);
+		unsigned int	shardOf(const Reading *reading);
+		static uint32_t	hash(const std::string& key);
+		std::vector<OPCUAServer *>	m_shards;
+		bool				m_byHierarchy;
+		std::unordered_map<std::string, unsigned int>
+						m_assignment;
+		WorkerPool			m_pool;
+		CaptureWriter			m_capture;
+};
+
+#endif
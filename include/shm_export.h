@@ -0,0 +1,100 @@
+#ifndef _SHM_EXPORT_H
+#define _SHM_EXPORT_H
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <string>
+#include <vector>
+#include <atomic>
+#include <stdio.h>
+#include <stdint.h>
+#include <node_table.h>
+
+#define SHM_EXPORT_MAGIC	"FLOPCUA"
+#define SHM_EXPORT_VERSION	1
+#define SHM_EXPORT_STRING_LEN	32
+
+/**
+ * The header at the start of the memory mapped value file
+ */
+struct ShmExportHeader {
+	char			magic[8];
+	uint32_t		version;
+	uint32_t		recordSize;
+	uint32_t		capacity;
+	std::atomic<uint32_t>	running;
+	uint64_t		started;
+	uint8_t			reserved[32];
+};
+
+/**
+ * A single fixed size record in the value file. The record is protected
+ * by a sequence lock, the writer increments the sequence number before
+ * and after updating the record so a reader that sees an odd sequence
+ * number, or a sequence number that changes while it copies the record,
+ * must retry.
+ */
+struct ShmExportRecord {
+	std::atomic<uint32_t>	seq;
+	uint32_t		status;
+	uint8_t			type;
+	uint8_t			reserved[3];
+	uint32_t		length;
+	int64_t			timestamp;
+	union {
+		int64_t		i;
+		double		d;
+	}			value;
+	char			str[SHM_EXPORT_STRING_LEN];
+};
+
+/**
+ * Export of the current value table to memory mapped files so that
+ * processes on the same machine can read current values without going
+ * through the OPC UA endpoint.
+ *
+ * Two files are created. The value file, <path>.values, holds a header
+ * followed by an array of fixed size records. The index file,
+ * <path>.index, is a text file to which a line of the form
+ * "slot<TAB>asset<TAB>datapoint" is appended each time a slot is
+ * allocated to a variable. Slots are reused when variables are removed,
+ * the last line in the index for a slot is the current mapping.
+ * Timestamps are in microseconds since the epoch, strings longer than
+ * the record are truncated and have their full length in the length field.
+ */
+class ShmExport {
+	public:
+		enum ValueType { Empty, Integer, Double, String };
+		ShmExport();
+		~ShmExport();
+		bool		open(const std::string& path, unsigned int capacity);
+		void		close();
+		bool		isEnabled() const { return m_records != NULL; };
+		void		add(NodeHandle handle, const std::string& asset, const std::string& datapoint);
+		void		remove(NodeHandle handle);
+		void		set(NodeHandle handle, int64_t value, int64_t timestamp);
+		void		set(NodeHandle handle, double value, int64_t timestamp);
+		void		set(NodeHandle handle, const std::string& value, int64_t timestamp);
+		void		setStatus(NodeHandle handle, uint32_t status);
+	private:
+		ShmExportRecord	*begin(NodeHandle handle);
+		void		end(ShmExportRecord *record);
+		std::string		m_path;
+		int			m_fd;
+		size_t			m_size;
+		ShmExportHeader		*m_header;
+		ShmExportRecord		*m_records;
+		FILE			*m_index;
+		uint32_t		m_capacity;
+		uint32_t		m_next;
+		std::vector<uint32_t>	m_free;
+		std::vector<int32_t>	m_slots;
+		bool			m_full;
+};
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <memory>
+
+/**
+ * An immutable snapshot of a structure that is built by one thread and
+ * read by others.
+ *
+ * The writer builds a complete new copy of the structure and publishes
+ * it by atomically replacing the current snapshot. Readers take a
+ * reference to the current snapshot and may use it for as long as they
+ * hold the reference, even after a newer snapshot has been published.
+ * The old snapshot is freed when the last reader releases it. Neither
+ * readers nor the writer wait for the other while using a snapshot.
+ */
+template<class T> class Snapshot {
+	public:
+		/**
+		 * Return the current snapshot, an empty pointer if none has been published
+		 */
+		std::shared_ptr<const T>	get() const
+						{
+							return std::atomic_load(&m_current);
+						};
+		/**
+		 * Publish a new snapshot
+		 *
+		 * @param next	The new snapshot
+		 */
+		void				publish(std::shared_ptr<const T> next)
+						{
+							std::atomic_store(&m_current, next);
+						};
+	private:
+		std::shared_ptr<const T>	m_current;
+};
+
+#endif
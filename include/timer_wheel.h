@@ -0,0 +1,47 @@
+#ifndef _TIMER_WHEEL_H
+#define _TIMER_WHEEL_H
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <string>
+#include <vector>
+#include <time.h>
+
+/**
+ * A hashed timer wheel used to schedule the expiry of assets.
+ *
+ * Timers are placed in a slot determined by their expiry time, the
+ * wheel is advanced by calling expire which returns the keys of all
+ * the timers that have expired since the previous call. Timers that
+ * are more than one revolution of the wheel in the future are left
+ * in their slot until the wheel comes around to them again.
+ *
+ * Timers are never cancelled, the owner of the wheel is expected to
+ * check the current state of the key when the timer fires and
+ * reschedule it if required.
+ */
+class TimerWheel {
+	public:
+		TimerWheel(unsigned int slots = 256, unsigned int resolution = 1);
+		void		schedule(const std::string& key, time_t expiry);
+		void		expire(time_t now, std::vector<std::string>& expired);
+		size_t		size() const { return m_count; };
+	private:
+		class Timer {
+			public:
+				Timer(const std::string& key, time_t expiry) : m_key(key), m_expiry(expiry) {};
+				std::string	m_key;
+				time_t		m_expiry;
+		};
+		std::vector<std::vector<Timer> >	m_slots;
+		unsigned int				m_resolution;
+		time_t					m_current;
+		size_t					m_count;
+};
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <stdio.h>
+#include <stdint.h>
+
+// The number of bytes of the detail of a span that are retained
+#define TRACE_DETAIL	48
+
+// The number of spans each thread can hold between flushes
+#define TRACE_BUFFER	8192
+
+/**
+ * A span recorded by a thread
+ */
+class TraceEvent {
+	public:
+		const char	*m_name;
+		char		m_detail[TRACE_DETAIL];
+		int64_t		m_start;
+		int64_t		m_duration;
+};
+
+/**
+ * The spans recorded by one thread. The buffer is a ring with a single
+ * writer, the thread, and a single reader, the thread flushing the
+ * trace, so neither takes a lock. Spans are dropped if the ring is full.
+ */
+class TraceBuffer {
+	public:
+		TraceBuffer(unsigned int tid) : m_tid(tid), m_dropped(0), m_orphaned(false), m_head(0), m_tail(0) {};
+		bool		push(const char *name, const char *detail, int64_t start, int64_t end);
+		bool		pop(TraceEvent& event);
+		unsigned int			m_tid;
+		std::atomic<unsigned long>	m_dropped;
+		std::atomic<bool>		m_orphaned;
+	private:
+		TraceEvent			m_events[TRACE_BUFFER];
+		std::atomic<size_t>		m_head;
+		std::atomic<size_t>		m_tail;
+};
+
+/**
+ * Records the time spent in the phases of sending a block of readings
+ * and writes them to a file in the Chrome trace event format, which
+ * can be loaded into Perfetto or chrome://tracing.
+ *
+ * The trace is shared by every instance of the plugin in the process.
+ * Only one block in every sampling interval is traced, so that tracing
+ * adds little to the cost of sending readings. Control writes and
+ * methods are rare and always traced. Each thread records spans into
+ * its own buffer and the buffers are written to the file at the end of
+ * each traced block.
+ */
+class Tracer {
+	public:
+		static bool		open(const std::string& path, unsigned int sampling);
+		static void		close();
+		static bool		isEnabled() { return m_enabled.load(std::memory_order_relaxed); };
+		static bool		sample();
+		static int64_t		now();
+		static void		record(const char *name, const char *detail, int64_t start, int64_t end);
+		static void		flush();
+	private:
+		static TraceBuffer	*buffer();
+		static void		writeString(const char *str);
+		static std::mutex			m_mutex;
+		static std::vector<TraceBuffer *>	m_buffers;
+		static FILE				*m_file;
+		static std::string			m_path;
+		static bool				m_first;
+		static std::atomic<bool>		m_enabled;
+		static std::atomic<unsigned int>	m_sampling;
+		static std::atomic<unsigned long>	m_blocks;
+		static std::atomic<unsigned int>	m_threads;
+};
+
+/**
+ * A span that is recorded from its construction until it goes out of
+ * scope, if enabled. The detail must remain valid for the life of the
+ * span.
+ */
+class TraceSpan {
+	public:
+		TraceSpan(bool enabled, const char *name, const char *detail = NULL)
+					: m_name(enabled ? name : NULL), m_detail(detail), m_start(0)
+				{
+					if (m_name)
+						m_start = Tracer::now();
+				};
+		~TraceSpan()
+				{
+					if (m_name)
+						Tracer::record(m_name, m_detail, m_start, Tracer::now());
+				};
+	private:
+		const char	*m_name;
+		const char	*m_detail;
+		int64_t		m_start;
+};
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef _VALUE_STORE_H
+#define _VALUE_STORE_H
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <stdint.h>
+#include <node_table.h>
+
+/**
+ * A plugin owned store of the current value of each variable.
+ *
+ * The store is organised as a set of columns indexed by the node
+ * handle of the variable. When the lazy value mode is enabled the
+ * OPC UA server reads values from the store via a value callback
+ * rather than the plugin writing every update into the address space.
+ *
+ * A variable is marked as observed the first time the server reads
+ * it, which happens when a client reads the variable or creates a
+ * monitored item for it. Only observed variables need to be written
+ * into the address space in order to trigger data change notifications.
+ * The mark is cleared when the backend reports that the last monitored
+ * item of the variable has been deleted.
+ */
+class ValueStore {
+	public:
+		enum ValueType { Empty, Integer, Double, String };
+		ValueStore() {};
+		bool		set(NodeHandle handle, int64_t value, int64_t timestamp);
+		bool		set(NodeHandle handle, double value, int64_t timestamp);
+		bool		set(NodeHandle handle, const std::string& value, int64_t timestamp);
+		bool		setStatus(NodeHandle handle, OpcUa::StatusCode status);
+		bool		contains(NodeHandle handle);
+		void		clear(NodeHandle handle);
+		OpcUa::DataValue
+				read(NodeHandle handle);
+		void		release(NodeHandle handle);
+		size_t		memoryUsage();
+	private:
+		union Value {
+			int64_t		i;
+			double		d;
+		};
+		void		reserve(NodeHandle handle);
+		std::mutex				m_mutex;
+		std::vector<uint8_t>			m_types;
+		std::vector<uint8_t>			m_observed;
+		std::vector<Value>			m_values;
+		std::vector<int64_t>			m_timestamps;
+		std::vector<uint32_t>			m_status;
+		std::unordered_map<NodeHandle, std::string>
+							m_strings;
+};
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef _WORKER_POOL_H
+#define _WORKER_POOL_H
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+/**
+ * A fixed pool of worker threads that run a batch of independent tasks.
+ *
+ * The tasks of a batch are numbered and the workers, together with the
+ * thread that submits the batch, repeatedly claim the next unclaimed
+ * task until none remain. A thread that finishes its tasks early
+ * therefore takes work that would otherwise wait for a busier thread.
+ * Submitting a batch blocks until every task has completed.
+ */
+class WorkerPool {
+	public:
+		WorkerPool();
+		~WorkerPool();
+		void		start(unsigned int threads);
+		void		stop();
+		unsigned int	size() const { return m_threads.size(); };
+		void		run(size_t tasks, const std::function<void(size_t)>& task);
+	private:
+		void		worker(unsigned long seen);
+		void		work();
+		std::vector<std::thread>	m_threads;
+		std::mutex			m_mutex;
+		std::condition_variable		m_start;
+		std::condition_variable		m_done;
+		const std::function<void(size_t)>
+						*m_task;
+		size_t				m_tasks;
+		std::atomic<size_t>		m_next;
+		unsigned int			m_busy;
+		unsigned long			m_generation;
+		bool				m_stop;
+};
+
+#endif
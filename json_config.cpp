@@ -0,0 +1,33 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <json_config.h>
+#include <logger.h>
+#include <rapidjson/error/en.h>
+
+using namespace std;
+
+/**
+ * Parse the value of a JSON configuration item
+ *
+ * @param doc	The document to parse the item into
+ * @param json	The value of the configuration item
+ * @param item	The name of the item used in the error message
+ * @return	True if the item was parsed
+ */
+bool ParseJsonConfig(rapidjson::Document& doc, const string& json, const char *item)
+{
+	rapidjson::ParseResult result = doc.Parse(json.c_str());
+	if (!result)
+	{
+		Logger::getLogger()->error("Error parsing %s: %s at %u", item,
+				rapidjson::GetParseError_En(result.Code()), (unsigned int)result.Offset());
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,291 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <latency.h>
+#include <logger.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <json_config.h>
+
+using namespace std;
+
+/**
+ * Constructor for the latency histogram
+ */
+LatencyHistogram::LatencyHistogram()
+{
+	reset();
+}
+
+/**
+ * Remove all of the recorded latencies
+ */
+void LatencyHistogram::reset()
+{
+	memset(m_buckets, 0, sizeof(m_buckets));
+	m_count = 0;
+	m_sum = 0;
+	m_max = 0;
+}
+
+/**
+ * Return the bucket of a latency. Bucket 2n holds latencies from 2^n
+ * up to 1.5 * 2^n microseconds and bucket 2n + 1 those from 1.5 * 2^n
+ * up to 2^(n+1) microseconds.
+ *
+ * @param micros	The latency in microseconds
+ * @return		The bucket
+ */
+int LatencyHistogram::bucket(uint64_t micros)
+{
+	if (micros < 2)
+	{
+		return (int)micros;
+	}
+	int msb = 63 - __builtin_clzll(micros);
+	int index = 2 * msb + (int)((micros >> (msb - 1)) & 1);
+	return index < BUCKETS ? index : BUCKETS - 1;
+}
+
+/**
+ * Return the upper bound of a bucket
+ *
+ * @param bucket	The bucket
+ * @return		The upper bound in milliseconds
+ */
+double LatencyHistogram::upperBound(int bucket)
+{
+	if (bucket < 2)
+	{
+		return bucket / 1000.0;
+	}
+	int msb = bucket / 2;
+	uint64_t half = (uint64_t)1 << (msb - 1);
+	uint64_t lower = ((uint64_t)1 << msb) + (bucket & 1) * half;
+	return (lower + half) / 1000.0;
+}
+
+/**
+ * Record a latency
+ *
+ * @param micros	The latency in microseconds, negative latencies are recorded as 0
+ */
+void LatencyHistogram::record(int64_t micros)
+{
+	uint64_t value = micros > 0 ? (uint64_t)micros : 0;
+	m_buckets[bucket(value)]++;
+	m_count++;
+	m_sum += value;
+	if (value > m_max)
+		m_max = value;
+}
+
+/**
+ * Add the latencies recorded in another histogram
+ *
+ * @param other	The other histogram
+ */
+void LatencyHistogram::merge(const LatencyHistogram& other)
+{
+	for (int i = 0; i < BUCKETS; i++)
+	{
+		m_buckets[i] += other.m_buckets[i];
+	}
+	m_count += other.m_count;
+	m_sum += other.m_sum;
+	if (other.m_max > m_max)
+		m_max = other.m_max;
+}
+
+/**
+ * Return the latency below which a fraction of the recorded latencies fall
+ *
+ * @param fraction	The fraction
+ * @return		The latency in milliseconds
+ */
+double LatencyHistogram::percentile(double fraction) const
+{
+	uint64_t target = (uint64_t)(fraction * m_count + 0.5);
+	if (target < 1)
+		target = 1;
+	uint64_t seen = 0;
+	for (int i = 0; i < BUCKETS; i++)
+	{
+		seen += m_buckets[i];
+		if (seen >= target)
+		{
+			double bound = upperBound(i);
+			return bound < m_max / 1000.0 ? bound : m_max / 1000.0;
+		}
+	}
+	return m_max / 1000.0;
+}
+
+/**
+ * Summarise the recorded latencies
+ *
+ * @param summary	The summary
+ */
+void LatencyHistogram::summarise(LatencySummary& summary) const
+{
+	if (m_count == 0)
+	{
+		summary = LatencySummary();
+		return;
+	}
+	summary.m_count = m_count;
+	summary.m_mean = (double)m_sum / m_count / 1000.0;
+	summary.m_p50 = percentile(0.50);
+	summary.m_p95 = percentile(0.95);
+	summary.m_p99 = percentile(0.99);
+	summary.m_max = m_max / 1000.0;
+}
+
+/**
+ * Constructor for the latency metrics
+ */
+LatencyMetrics::LatencyMetrics() : m_enabled(false), m_interval(60), m_windowStart(0)
+{
+}
+
+/**
+ * Configure the latency metrics. The groups are a JSON document with
+ * an array of groups, each with a name and an asset pattern.
+ *
+ * { "groups" : [ { "name" : "Line1", "asset" : "line1-*" } ] }
+ *
+ * The latencies of all assets are also recorded in a group called All.
+ *
+ * @param enabled	True if latencies should be recorded
+ * @param interval	The interval in seconds over which latencies are summarised
+ * @param groups	The configuration of the asset groups
+ */
+void LatencyMetrics::configure(bool enabled, unsigned int interval, const string& groups)
+{
+	Logger *log = Logger::getLogger();
+
+	m_enabled = enabled;
+	m_interval = interval ? interval : 60;
+	m_windowStart = 0;
+	m_groups.clear();
+	m_assetGroups.clear();
+	m_groups.push_back(Group("All", "*"));
+	if (groups.empty())
+	{
+		return;
+	}
+	rapidjson::Document doc;
+	if (!ParseJsonConfig(doc, groups, "latency groups"))
+	{
+		return;
+	}
+	if (!doc.HasMember("groups") || !doc["groups"].IsArray())
+	{
+		log->error("Missing the groups element in the latency group configuration");
+		return;
+	}
+	for (auto &group : doc["groups"].GetArray())
+	{
+		string name, asset;
+		if (group.HasMember("name") && group["name"].IsString())
+			name = group["name"].GetString();
+		if (group.HasMember("asset") && group["asset"].IsString())
+			asset = group["asset"].GetString();
+		if (name.empty() || asset.empty())
+		{
+			log->error("Badly formed latency group, both a name and an asset pattern must be given");
+			continue;
+		}
+		m_groups.push_back(Group(name, asset));
+	}
+}
+
+/**
+ * Return the group of an asset, other than the All group
+ *
+ * @param asset	The asset name
+ * @return	The index of the first group whose pattern matches the asset, 0 if none match
+ */
+int LatencyMetrics::groupOf(const string& asset)
+{
+	auto it = m_assetGroups.find(asset);
+	if (it != m_assetGroups.end())
+	{
+		return it->second;
+	}
+	int group = 0;
+	for (size_t i = 1; i < m_groups.size(); i++)
+	{
+		if (fnmatch(m_groups[i].m_asset.c_str(), asset.c_str(), 0) == 0)
+		{
+			group = i;
+			break;
+		}
+	}
+	m_assetGroups[asset] = group;
+	return group;
+}
+
+/**
+ * Record the latency of a reading that has just been written to the
+ * server. The source latency is measured from the user timestamp of
+ * the reading and the ingest latency from the time Fledge received it.
+ *
+ * @param reading	The reading
+ */
+void LatencyMetrics::record(const Reading *reading)
+{
+	struct timeval now, userTS, ingestTS;
+	gettimeofday(&now, NULL);
+	reading->getUserTimestamp(&userTS);
+	reading->getTimestamp(&ingestTS);
+	int64_t source = (int64_t)(now.tv_sec - userTS.tv_sec) * 1000000 + (now.tv_usec - userTS.tv_usec);
+	int64_t ingest = (int64_t)(now.tv_sec - ingestTS.tv_sec) * 1000000 + (now.tv_usec - ingestTS.tv_usec);
+
+	m_groups[0].m_source.record(source);
+	m_groups[0].m_ingest.record(ingest);
+	if (m_groups.size() > 1)
+	{
+		int group = groupOf(reading->getAssetName());
+		if (group)
+		{
+			m_groups[group].m_source.record(source);
+			m_groups[group].m_ingest.record(ingest);
+		}
+	}
+}
+
+/**
+ * Check if the current interval has ended. If it has the summaries
+ * are updated from the latencies recorded in the interval and a new
+ * interval is started.
+ *
+ * @param now	The current time
+ * @return	True if the summaries have been updated
+ */
+bool LatencyMetrics::due(time_t now)
+{
+	if (m_windowStart == 0)
+	{
+		m_windowStart = now;
+		return false;
+	}
+	if (now < m_windowStart + (time_t)m_interval)
+	{
+		return false;
+	}
+	for (auto &group : m_groups)
+	{
+		group.m_source.summarise(group.m_sourceSummary);
+		group.m_ingest.summarise(group.m_ingestSummary);
+		group.m_source.reset();
+		group.m_ingest.reset();
+	}
+	m_windowStart = now;
+	return true;
+}
@@ -0,0 +1,151 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <node_batch.h>
+#include <logger.h>
+
+using namespace std;
+using namespace OpcUa;
+
+/**
+ * Constructor for the node batch
+ *
+ * @param nodes	The table in which the handles of the nodes are held
+ */
+NodeBatch::NodeBatch(NodeTable& nodes) : m_nodes(nodes), m_backend(NULL)
+{
+}
+
+/**
+ * Queue an object to be added to the address space
+ *
+ * @param parent	The NodeId of the parent of the object
+ * @param nodeId	The NodeId of the object
+ * @param name		The browse name of the object
+ * @return		The handle of the object
+ */
+NodeHandle NodeBatch::addObject(const NodeId& parent, const NodeId& nodeId, const QualifiedName& name)
+{
+	m_items.push_back(BackendNode(parent, nodeId, name));
+
+	NodeHandle handle = m_nodes.add(nodeId);
+	m_handles.push_back(handle);
+	return handle;
+}
+
+/**
+ * Queue a variable to be added to the address space with an initial
+ * value. The value is given no source timestamp, this is used for
+ * control variables and when the value of the variable is read through
+ * a read handler.
+ *
+ * @param parent	The NodeId of the parent of the variable
+ * @param ns		The namespace of the variable
+ * @param name		The browse name of the variable
+ * @param value		The initial value of the variable
+ * @param writable	True if clients may write the variable
+ * @return		The handle of the variable
+ */
+NodeHandle NodeBatch::addVariable(const NodeId& parent, uint16_t ns, const string& name, const Variant& value,
+				bool writable)
+{
+	m_items.push_back(BackendNode(parent, NodeId(0u, ns), QualifiedName(name, ns), value, writable));
+
+	// The server assigns the NodeId, the handle is updated when the batch is flushed
+	NodeHandle handle = m_nodes.add(NodeId(0u, ns));
+	m_handles.push_back(handle);
+	return handle;
+}
+
+/**
+ * Queue a variable to be added to the address space with an initial
+ * value and the source timestamp of that value
+ *
+ * @param parent	The NodeId of the parent of the variable
+ * @param ns		The namespace of the variable
+ * @param name		The browse name of the variable
+ * @param value		The initial value of the variable
+ * @param sourceTime	The source timestamp of the value
+ * @return		The handle of the variable
+ */
+NodeHandle NodeBatch::addVariable(const NodeId& parent, uint16_t ns, const string& name, const Variant& value,
+				const DateTime& sourceTime)
+{
+	NodeHandle handle = addVariable(parent, ns, name, value, false);
+
+	// The attributes of a new variable carry no timestamps, so the value is written once added
+	DataValue dv(value);
+	dv.Status = StatusCode::Good;
+	dv.SourceTimestamp = sourceTime;
+	dv.Encoding |= DATA_VALUE_SOURCE_TIMESTAMP;
+	m_values.push_back(pair<size_t, DataValue>(m_items.size() - 1, dv));
+	return handle;
+}
+
+/**
+ * Add the queued nodes to the address space and write the initial values
+ * of the variables. Nodes that could not be added are logged, their
+ * handles remain allocated so that the structures that refer to them
+ * stay consistent.
+ */
+void NodeBatch::flush()
+{
+	if (m_items.empty())
+	{
+		return;
+	}
+	Logger *log = Logger::getLogger();
+	try
+	{
+		m_backend->addNodes(m_items);
+		vector<bool> added(m_items.size(), false);
+		for (size_t i = 0; i < m_items.size(); i++)
+		{
+			if (m_items[i].m_status != StatusCode::Good)
+			{
+				log->error("Failed to add node %s, status 0x%08x",
+						m_items[i].m_name.Name.c_str(), (unsigned int)m_items[i].m_status);
+				continue;
+			}
+			added[i] = true;
+			if (!m_items[i].m_object)
+			{
+				m_nodes.replace(m_handles[i], m_items[i].m_id);
+			}
+		}
+		vector<WriteValue> values;
+		values.reserve(m_values.size());
+		for (auto &v : m_values)
+		{
+			if (added[v.first])
+			{
+				values.push_back(WriteValue(m_nodes.getNodeId(m_handles[v.first]), AttributeId::Value, v.second));
+			}
+		}
+		if (!values.empty())
+		{
+			vector<StatusCode> status = m_backend->write(values);
+			for (size_t i = 0; i < status.size(); i++)
+			{
+				if (status[i] != StatusCode::Good)
+				{
+					log->warn("Failed to set the initial value of a new variable, status 0x%08x",
+							(unsigned int)status[i]);
+				}
+			}
+		}
+		log->debug("Added %u nodes to the address space", (unsigned int)m_items.size());
+	}
+	catch (exception& e)
+	{
+		log->error("Failed to add %u nodes to the address space: %s", (unsigned int)m_items.size(), e.what());
+	}
+	m_items.clear();
+	m_handles.clear();
+	m_values.clear();
+}
@@ -0,0 +1,238 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <node_table.h>
+
+using namespace std;
+using namespace OpcUa;
+
+/**
+ * Constructor for the node table
+ */
+NodeTable::NodeTable()
+{
+}
+
+/**
+ * Add a NodeId to the table and return the handle for it
+ *
+ * @param nodeId	The NodeId to add
+ * @return		The handle for the node
+ */
+NodeHandle NodeTable::add(const NodeId& nodeId)
+{
+	NodeHandle handle;
+
+	if (m_free.empty())
+	{
+		handle = m_entries.size();
+		m_entries.push_back(Entry());
+	}
+	else
+	{
+		handle = m_free.back();
+		m_free.pop_back();
+	}
+	assign(handle, nodeId);
+	return handle;
+}
+
+/**
+ * Change the NodeId a handle refers to. This is used when a handle is
+ * allocated before the server has assigned the NodeId of the node.
+ *
+ * @param handle	The handle to change
+ * @param nodeId	The new NodeId of the handle
+ */
+void NodeTable::replace(NodeHandle handle, const NodeId& nodeId)
+{
+	if (handle >= m_entries.size() || m_entries[handle].m_type == Free)
+	{
+		return;
+	}
+	release(handle);
+	assign(handle, nodeId);
+}
+
+/**
+ * Return the NodeIds of all of the nodes in the table, most recently
+ * allocated handle first so that nodes generally precede their parents
+ *
+ * @param ids	The vector to which the NodeIds are appended
+ */
+void NodeTable::nodeIds(vector<NodeId>& ids) const
+{
+	ids.reserve(ids.size() + size());
+	for (size_t handle = m_entries.size(); handle-- > 0; )
+	{
+		if (m_entries[handle].m_type != Free)
+		{
+			ids.push_back(getNodeId(handle));
+		}
+	}
+}
+
+/**
+ * Store a NodeId in the entry for a handle
+ *
+ * @param handle	The handle of the entry
+ * @param nodeId	The NodeId to store
+ */
+void NodeTable::assign(NodeHandle handle, const NodeId& nodeId)
+{
+	Entry& entry = m_entries[handle];
+	entry.m_namespace = nodeId.GetNamespaceIndex();
+	if (nodeId.IsInteger())
+	{
+		entry.m_type = Integer;
+		entry.m_id = nodeId.GetIntegerIdentifier();
+	}
+	else if (nodeId.IsString())
+	{
+		entry.m_type = String;
+		if (m_freeStrings.empty())
+		{
+			entry.m_id = m_strings.size();
+			m_strings.push_back(nodeId.GetStringIdentifier());
+		}
+		else
+		{
+			entry.m_id = m_freeStrings.back();
+			m_freeStrings.pop_back();
+			m_strings[entry.m_id] = nodeId.GetStringIdentifier();
+		}
+	}
+	else
+	{
+		entry.m_type = Other;
+		entry.m_id = 0;
+		m_other[handle] = nodeId;
+	}
+}
+
+/**
+ * Remove an entry from the table. The handle may be reused by
+ * a subsequent call to add.
+ *
+ * @param handle	The handle to remove
+ */
+void NodeTable::remove(NodeHandle handle)
+{
+	if (handle >= m_entries.size() || m_entries[handle].m_type == Free)
+	{
+		return;
+	}
+	release(handle);
+	m_entries[handle].m_type = Free;
+	m_free.push_back(handle);
+}
+
+/**
+ * Release the string or NodeId held by the entry for a handle
+ *
+ * @param handle	The handle of the entry
+ */
+void NodeTable::release(NodeHandle handle)
+{
+	Entry& entry = m_entries[handle];
+	if (entry.m_type == String)
+	{
+		m_strings[entry.m_id].clear();
+		m_strings[entry.m_id].shrink_to_fit();
+		m_freeStrings.push_back(entry.m_id);
+	}
+	else if (entry.m_type == Other)
+	{
+		m_other.erase(handle);
+	}
+}
+
+/**
+ * Return the NodeId for a handle
+ *
+ * @param handle	The node handle
+ * @return		The NodeId of the node
+ */
+NodeId NodeTable::getNodeId(NodeHandle handle) const
+{
+	if (handle >= m_entries.size())
+	{
+		return NodeId();
+	}
+	const Entry& entry = m_entries[handle];
+	switch (entry.m_type)
+	{
+		case Integer:
+			return NodeId(entry.m_id, entry.m_namespace);
+		case String:
+			return NodeId(m_strings[entry.m_id], entry.m_namespace);
+		case Other:
+		{
+			auto it = m_other.find(handle);
+			if (it != m_other.end())
+				return it->second;
+			return NodeId();
+		}
+		default:
+			return NodeId();
+	}
+}
+
+/**
+ * Check if a handle refers to a given NodeId without constructing
+ * a NodeId for the handle in the common cases.
+ *
+ * @param handle	The node handle
+ * @param nodeId	The NodeId to compare with
+ * @return		True if the handle refers to the NodeId
+ */
+bool NodeTable::matches(NodeHandle handle, const NodeId& nodeId) const
+{
+	if (handle >= m_entries.size())
+	{
+		return false;
+	}
+	const Entry& entry = m_entries[handle];
+	if (entry.m_namespace != nodeId.GetNamespaceIndex())
+	{
+		return false;
+	}
+	switch (entry.m_type)
+	{
+		case Integer:
+			return nodeId.IsInteger() && nodeId.GetIntegerIdentifier() == entry.m_id;
+		case String:
+			return nodeId.IsString() && nodeId.GetStringIdentifier() == m_strings[entry.m_id];
+		case Other:
+			return getNodeId(handle) == nodeId;
+		default:
+			return false;
+	}
+}
+
+/**
+ * Return an estimate of the memory used by the table
+ *
+ * @return	The number of bytes used by the table
+ */
+size_t NodeTable::memoryUsage() const
+{
+	size_t size = sizeof(*this);
+
+	size += m_entries.capacity() * sizeof(Entry);
+	size += m_free.capacity() * sizeof(NodeHandle);
+	size += m_freeStrings.capacity() * sizeof(uint32_t);
+	size += m_strings.capacity() * sizeof(string);
+	for (auto& s : m_strings)
+	{
+		if (s.capacity() >= sizeof(string))
+			size += s.capacity() + 1;
+	}
+	size += m_other.size() * (sizeof(NodeHandle) + sizeof(NodeId) + 4 * sizeof(void *));
+	return size;
+}
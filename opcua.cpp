@@ -15,7 +15,9 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <chrono>
 #include <rapidjson/document.h>
+#include <json_config.h>
 #include "string_utils.h"
 
 using namespace std;
@@ -132,10 +134,282 @@ static std::string NodeIdString(const NodeId &nodeId)
 	return nodeIdStr;
 }
 
+/**
+ * Convert a numeric Variant to a double
+ *
+ * @param value	The Variant to convert
+ * @return	The value as a double, 0 if the Variant is not numeric
+ */
+static double VariantToDouble(const Variant &value)
+{
+	if (!value.IsScalar())
+	{
+		return 0.0;
+	}
+	switch (value.Type())
+	{
+		case VariantType::SBYTE:
+			return value.As<int8_t>();
+		case VariantType::BYTE:
+			return value.As<uint8_t>();
+		case VariantType::INT16:
+			return value.As<int16_t>();
+		case VariantType::UINT16:
+			return value.As<uint16_t>();
+		case VariantType::INT32:
+			return value.As<int32_t>();
+		case VariantType::UINT32:
+			return value.As<uint32_t>();
+		case VariantType::INT64:
+			return value.As<int64_t>();
+		case VariantType::UINT64:
+			return value.As<uint64_t>();
+		case VariantType::FLOAT:
+			return value.As<float>();
+		case VariantType::DOUBLE:
+			return value.As<double>();
+		default:
+			return 0.0;
+	}
+}
+
+/**
+ * Convert a list datapoint to an array of doubles. Only lists whose
+ * elements are all numeric can be held in an OPC UA array variable.
+ *
+ * @param value		The list datapoint value
+ * @param array		The converted array
+ * @return		True if every element of the list is numeric
+ */
+static bool ListToArray(DatapointValue &value, vector<double> &array)
+{
+	vector<Datapoint *> *elements = value.getDpVec();
+	if (!elements)
+	{
+		return false;
+	}
+	array.reserve(elements->size());
+	for (auto dp : *elements)
+	{
+		DatapointValue &element = dp->getData();
+		if (element.getType() == DatapointValue::T_INTEGER)
+			array.push_back((double)element.toInt());
+		else if (element.getType() == DatapointValue::T_FLOAT)
+			array.push_back(element.toDouble());
+		else
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Convert a scalar or numeric array datapoint value to a Variant
+ *
+ * @param value		The datapoint value
+ * @param variant	The Variant, unchanged if the value can not be converted
+ * @return		True if the value was converted
+ */
+static bool DatapointToVariant(DatapointValue &value, Variant &variant)
+{
+	switch (value.getType())
+	{
+		case DatapointValue::T_FLOAT_ARRAY:
+			variant = Variant(*value.getDpArr());
+			return true;
+		case DatapointValue::T_DP_LIST:
+		{
+			vector<double> array;
+			if (!ListToArray(value, array))
+			{
+				return false;
+			}
+			variant = Variant(array);
+			return true;
+		}
+		case DatapointValue::T_INTEGER:
+			variant = Variant(value.toInt());
+			return true;
+		case DatapointValue::T_FLOAT:
+			variant = Variant(value.toDouble());
+			return true;
+		case DatapointValue::T_STRING:
+			variant = Variant(value.toStringValue());
+			return true;
+		default:
+			return false;
+	}
+}
+
+/**
+ * Build the output arguments of the history methods
+ *
+ * @param timestamps	The timestamps of the values
+ * @param values	The values
+ * @return		The output arguments, an array of values and an array of timestamps
+ */
+static vector<Variant> HistoryResult(const vector<int64_t> &timestamps, const vector<double> &values)
+{
+	vector<DateTime> times;
+	times.reserve(timestamps.size());
+	for (auto ts : timestamps)
+	{
+		times.push_back(DateTime(ts));
+	}
+	vector<Variant> result;
+	result.push_back(Variant(values));
+	result.push_back(Variant(times));
+	return result;
+}
+
+/**
+ * Read the raw history of a variable. The in memory history is used
+ * if it extends back to the start of the requested range, otherwise
+ * the values are read from the history store.
+ *
+ * @param history	The in memory history
+ * @param store		The disk backed history store
+ * @param nodeId	The NodeId of the variable
+ * @param start		The start of the time range
+ * @param end		The end of the time range
+ * @param max		The maximum number of values to return, 0 for no limit
+ * @param timestamps	The timestamps of the values returned
+ * @param values	The values returned
+ */
+static void HistoryRaw(HistoryBuffer *history, HistoryStore *store, const NodeId &nodeId,
+			int64_t start, int64_t end, unsigned int max,
+			vector<int64_t> &timestamps, vector<double> &values)
+{
+	if (store->isEnabled() && !history->covers(nodeId, start)
+			&& store->readRaw(nodeId, start, end, max, timestamps, values))
+	{
+		return;
+	}
+	history->readRaw(nodeId, start, end, max, timestamps, values);
+}
+
+/**
+ * Implementation of the ReadRaw history method
+ *
+ * Input arguments are the NodeId of the variable, the start and end
+ * times and the maximum number of values to return.
+ *
+ * @param history	The in memory history
+ * @param store		The disk backed history store
+ * @param arguments	The input arguments of the method
+ * @return		The output arguments, an array of values and an array of timestamps
+ */
+static vector<Variant> HistoryReadRaw(HistoryBuffer *history, HistoryStore *store, const vector<Variant> &arguments)
+{
+	vector<int64_t> timestamps;
+	vector<double> values;
+
+	if (arguments.size() < 3 || arguments[0].Type() != VariantType::NODE_Id
+			|| arguments[1].Type() != VariantType::DATE_TIME
+			|| arguments[2].Type() != VariantType::DATE_TIME)
+	{
+		Logger::getLogger()->warn("History ReadRaw called with invalid arguments");
+		return HistoryResult(timestamps, values);
+	}
+	unsigned int max = arguments.size() > 3 ? (unsigned int)VariantToDouble(arguments[3]) : 0;
+	HistoryRaw(history, store, arguments[0].As<NodeId>(),
+			(int64_t)arguments[1].As<DateTime>(),
+			(int64_t)arguments[2].As<DateTime>(),
+			max, timestamps, values);
+	return HistoryResult(timestamps, values);
+}
+
+/**
+ * Implementation of the ReadProcessed history method
+ *
+ * Input arguments are the NodeId of the variable, the start and end
+ * times, the processing interval in milliseconds and the name of the
+ * aggregate, one of min, max or avg.
+ *
+ * @param history	The in memory history
+ * @param store		The disk backed history store
+ * @param arguments	The input arguments of the method
+ * @return		The output arguments, an array of values and an array of interval start times
+ */
+static vector<Variant> HistoryReadProcessed(HistoryBuffer *history, HistoryStore *store, const vector<Variant> &arguments)
+{
+	vector<int64_t> timestamps;
+	vector<double> values;
+	vector<int64_t> rawTimes;
+	vector<double> rawValues;
+
+	if (arguments.size() < 5 || arguments[0].Type() != VariantType::NODE_Id
+			|| arguments[1].Type() != VariantType::DATE_TIME
+			|| arguments[2].Type() != VariantType::DATE_TIME
+			|| arguments[4].Type() != VariantType::STRING)
+	{
+		Logger::getLogger()->warn("History ReadProcessed called with invalid arguments");
+		return HistoryResult(timestamps, values);
+	}
+	// DateTime values are in units of 100 nanoseconds
+	int64_t interval = (int64_t)(VariantToDouble(arguments[3]) * 10000);
+	string name = arguments[4].As<string>();
+	HistoryBuffer::Aggregate aggregate;
+	if (name.compare("min") == 0)
+		aggregate = HistoryBuffer::Minimum;
+	else if (name.compare("max") == 0)
+		aggregate = HistoryBuffer::Maximum;
+	else if (name.compare("avg") == 0)
+		aggregate = HistoryBuffer::Average;
+	else
+	{
+		Logger::getLogger()->warn("History ReadProcessed called with unsupported aggregate %s", name.c_str());
+		return HistoryResult(timestamps, values);
+	}
+	int64_t start = (int64_t)arguments[1].As<DateTime>();
+	int64_t end = (int64_t)arguments[2].As<DateTime>();
+	if (interval <= 0 || end < start)
+	{
+		Logger::getLogger()->warn("History ReadProcessed called with an invalid interval or time range");
+		return HistoryResult(timestamps, values);
+	}
+	HistoryRaw(history, store, arguments[0].As<NodeId>(), start, end, 0, rawTimes, rawValues);
+	HistoryBuffer::aggregate(rawTimes, rawValues, start, interval, aggregate, timestamps, values);
+	return HistoryResult(timestamps, values);
+}
+
+/**
+ * Return the endpoint URL of a shard. The port of the URL is offset by
+ * the shard number.
+ *
+ * @param url	The configured endpoint URL
+ * @param shard	The shard number
+ * @return	The endpoint URL of the shard
+ */
+static string ShardUrl(const string &url, unsigned int shard)
+{
+	size_t host = url.find("://");
+	host = (host == string::npos) ? 0 : host + 3;
+	size_t path = url.find('/', host);
+	if (path == string::npos)
+	{
+		path = url.length();
+	}
+	size_t colon = url.rfind(':', path);
+	if (colon == string::npos || colon < host || url.find(']', colon) < path)
+	{
+		return url.substr(0, path) + ":" + to_string(4840 + shard) + url.substr(path);
+	}
+	unsigned long port = strtoul(url.substr(colon + 1, path - colon - 1).c_str(), NULL, 10);
+	return url.substr(0, colon + 1) + to_string(port + shard) + url.substr(path);
+}
+
 /**
  * Constructor for the OPCUAServer object
+ *
+ * @param shard	The shard number when the address space is divided between several servers
  */
-OPCUAServer::OPCUAServer() : m_server(NULL), m_write(NULL), m_includeAsset(true), m_parseAsset(false)
+OPCUAServer::OPCUAServer(unsigned int shard) : m_write(NULL), m_backend(NULL), m_batch(m_nodes),
+	m_includeAsset(true), m_parseAsset(false), m_operation(NULL), m_methodThreads(2),
+	m_methodConcurrency(1), m_methodTimeout(5000), m_staleTimeout(0), m_removeTimeout(0),
+	m_maxNodes(0), m_datapointWindow(0), m_removeDatapoints(true), m_nodeCount(0),
+	m_lazyValues(false), m_aggregateSource(INVALID_NODE_HANDLE), m_structuredDatapoints(false),
+	m_shard(shard), m_shardName("shard " + to_string(shard)), m_parallelThreshold(0),
+	m_trace(false), m_statisticsFastPath(false), m_statisticsRates(false)
 {
 	m_log = Logger::getLogger();
 }
@@ -145,6 +419,7 @@ OPCUAServer::OPCUAServer() : m_server(NULL), m_write(NULL), m_includeAsset(true)
  */
 OPCUAServer::~OPCUAServer()
 {
+	releaseBackend();
 }
 
 /**
@@ -169,6 +444,18 @@ void OPCUAServer::configure(const ConfigCategory *conf)
 		m_name = conf->getValue("name");
 	else
 		m_log->error("Missing name in configuration");
+	if (m_shard)
+	{
+		// Each shard is a separate server so must have its own endpoint and identity
+		string suffix = "shard" + to_string(m_shard);
+		m_url = ShardUrl(m_url, m_shard);
+		m_uri.append(":" + suffix);
+		m_name.append(" " + suffix);
+	}
+	if (conf->itemExists("backend"))
+		m_backendName = conf->getValue("backend");
+	else
+		m_backendName = "freeopcua";
 	if (conf->itemExists("root"))
 		m_root = conf->getValue("root");
 	else
@@ -195,13 +482,7 @@ void OPCUAServer::configure(const ConfigCategory *conf)
 		if (hierarchy.length() > 0)
 		{
 			rapidjson::Document doc;
-			rapidjson::ParseResult result = doc.Parse(hierarchy.c_str());
-			if (!result)
-			{
-				Logger::getLogger()->error("Error parsing hierarchy: %s at %u",
-										   doc.GetParseError(), result.Offset());
-			}
-			else
+			if (ParseJsonConfig(doc, hierarchy, "hierarchy"))
 			{
 				for (rapidjson::Value::ConstMemberIterator itr = doc.MemberBegin();
 					 itr != doc.MemberEnd(); ++itr)
@@ -213,21 +494,148 @@ void OPCUAServer::configure(const ConfigCategory *conf)
 			}
 		}
 	}
+	if (conf->itemExists("staleTimeout"))
+		m_staleTimeout = strtoul(conf->getValue("staleTimeout").c_str(), NULL, 10);
+	if (conf->itemExists("removeTimeout"))
+		m_removeTimeout = strtoul(conf->getValue("removeTimeout").c_str(), NULL, 10);
+	if (conf->itemExists("maxNodes"))
+		m_maxNodes = strtoul(conf->getValue("maxNodes").c_str(), NULL, 10);
+	if (conf->itemExists("datapointWindow"))
+		m_datapointWindow = strtoul(conf->getValue("datapointWindow").c_str(), NULL, 10);
+	if (conf->itemExists("vanishedDatapoints"))
+		m_removeDatapoints = conf->getValue("vanishedDatapoints").compare("flag") != 0;
+	if (conf->itemExists("lazyValues"))
+	{
+		string configValue = conf->getValue("lazyValues");
+		std::transform(configValue.begin(), configValue.end(), configValue.begin(), ::tolower);
+		m_lazyValues = (configValue.compare("true") == 0) ? true : false;
+	}
+	if (conf->itemExists("sharedMemory"))
+	{
+		string path = conf->getValue("sharedMemory");
+		unsigned int records = 10000;
+		if (conf->itemExists("sharedMemoryRecords"))
+			records = strtoul(conf->getValue("sharedMemoryRecords").c_str(), NULL, 10);
+		if (m_shard && !path.empty())
+			path.append("-shard" + to_string(m_shard));
+		if (!path.empty() && records > 0)
+			m_shm.open(path, records);
+	}
+	if (conf->itemExists("historyDepth"))
+	{
+		unsigned int depth = strtoul(conf->getValue("historyDepth").c_str(), NULL, 10);
+		size_t budget = 64;
+		if (conf->itemExists("historyMemory"))
+			budget = strtoul(conf->getValue("historyMemory").c_str(), NULL, 10);
+		m_history.configure(depth, budget * 1024 * 1024);
+	}
+	if (conf->itemExists("aggregates"))
+		m_aggregates.parse(conf->getValue("aggregates"));
+	if (conf->itemExists("publishPolicies"))
+		m_policies.parse(conf->getValue("publishPolicies"));
+	if (conf->itemExists("datapointFilter"))
+		m_filter.parse(conf->getValue("datapointFilter"));
+	if (conf->itemExists("assetMapping"))
+		m_mapper.parse(conf->getValue("assetMapping"));
+	if (conf->itemExists("structuredDatapoints"))
+	{
+		string configValue = conf->getValue("structuredDatapoints");
+		std::transform(configValue.begin(), configValue.end(), configValue.begin(), ::tolower);
+		m_structuredDatapoints = (configValue.compare("true") == 0) ? true : false;
+	}
+	if (conf->itemExists("conversionThreads"))
+	{
+		unsigned int threads = strtoul(conf->getValue("conversionThreads").c_str(), NULL, 10);
+		if (threads > 1)
+			m_conversionPool.start(threads - 1);
+		else
+			m_conversionPool.stop();
+	}
+	if (conf->itemExists("parallelThreshold"))
+		m_parallelThreshold = strtoul(conf->getValue("parallelThreshold").c_str(), NULL, 10);
+	if (conf->itemExists("source") && conf->itemExists("statisticsFastPath"))
+	{
+		string configValue = conf->getValue("statisticsFastPath");
+		std::transform(configValue.begin(), configValue.end(), configValue.begin(), ::tolower);
+		m_statisticsFastPath = conf->getValue("source").compare("statistics") == 0
+				&& configValue.compare("true") == 0;
+	}
+	if (conf->itemExists("statisticsRates"))
+	{
+		string configValue = conf->getValue("statisticsRates");
+		std::transform(configValue.begin(), configValue.end(), configValue.begin(), ::tolower);
+		m_statisticsRates = (configValue.compare("true") == 0) ? true : false;
+	}
+	if (conf->itemExists("statistics"))
+	{
+		string statistics = conf->getValue("statistics");
+		rapidjson::Document doc;
+		m_statisticKeys.clear();
+		if (ParseJsonConfig(doc, statistics, "statistics")
+				&& doc.HasMember("statistics") && doc["statistics"].IsArray())
+		{
+			for (auto &key : doc["statistics"].GetArray())
+			{
+				if (key.IsString())
+					m_statisticKeys.push_back(key.GetString());
+				else
+					m_log->error("Badly formed statistics, the keys of the statistics must be strings");
+			}
+		}
+	}
+	if (conf->itemExists("latencyMetrics"))
+	{
+		string configValue = conf->getValue("latencyMetrics");
+		std::transform(configValue.begin(), configValue.end(), configValue.begin(), ::tolower);
+		unsigned int interval = 60;
+		string groups;
+		if (conf->itemExists("latencyInterval"))
+			interval = strtoul(conf->getValue("latencyInterval").c_str(), NULL, 10);
+		if (conf->itemExists("latencyGroups"))
+			groups = conf->getValue("latencyGroups");
+		m_latency.configure(configValue.compare("true") == 0, interval, groups);
+	}
+	if (conf->itemExists("samplingHints"))
+	{
+		string configValue = conf->getValue("samplingHints");
+		std::transform(configValue.begin(), configValue.end(), configValue.begin(), ::tolower);
+		unsigned long maximum = 60000;
+		if (conf->itemExists("maxSamplingHint"))
+			maximum = strtoul(conf->getValue("maxSamplingHint").c_str(), NULL, 10);
+		m_sampling.configure(configValue.compare("true") == 0, maximum);
+	}
+	if (conf->itemExists("historyDirectory"))
+	{
+		string directory = conf->getValue("historyDirectory");
+		unsigned int segment = 3600;
+		unsigned int retention = 168;
+		size_t storage = 1024;
+		if (conf->itemExists("historySegment"))
+			segment = strtoul(conf->getValue("historySegment").c_str(), NULL, 10);
+		if (conf->itemExists("historyRetention"))
+			retention = strtoul(conf->getValue("historyRetention").c_str(), NULL, 10);
+		if (conf->itemExists("historyStorage"))
+			storage = strtoul(conf->getValue("historyStorage").c_str(), NULL, 10);
+		if (m_shard && !directory.empty())
+			directory.append("-shard" + to_string(m_shard));
+		if (!directory.empty())
+			m_historyStore.open(directory, segment, retention, storage * 1024 * 1024);
+	}
 	if (conf->itemExists("controlRoot"))
 		m_controlRoot = conf->getValue("controlRoot");
 	else
 		m_log->error("Missing URL in configuration");
+	if (conf->itemExists("methodThreads"))
+		m_methodThreads = strtoul(conf->getValue("methodThreads").c_str(), NULL, 10);
+	if (conf->itemExists("methodConcurrency"))
+		m_methodConcurrency = strtoul(conf->getValue("methodConcurrency").c_str(), NULL, 10);
+	if (conf->itemExists("methodTimeout"))
+		m_methodTimeout = strtoul(conf->getValue("methodTimeout").c_str(), NULL, 10) * 1000;
 	if (conf->itemExists("controlMap"))
 	{
 		string controlMap = conf->getValue("controlMap");
 		rapidjson::Document doc;
-		rapidjson::ParseResult result = doc.Parse(controlMap.c_str());
-		if (!result)
-		{
-			Logger::getLogger()->error("Error parsing control map: %s at %u",
-									   doc.GetParseError(), result.Offset());
-		}
-		else
+		if (ParseJsonConfig(doc, controlMap, "control map"))
 		{
 			if (doc.HasMember("nodes") && doc["nodes"].IsArray())
 			{
@@ -287,10 +695,54 @@ void OPCUAServer::configure(const ConfigCategory *conf)
 					}
 				}
 			}
-			else
+			else if (!doc.HasMember("methods"))
 			{
 				m_log->error("Missing the nodes element in the control map");
 			}
+			if (doc.HasMember("methods") && doc["methods"].IsArray())
+			{
+				for (auto &method : doc["methods"].GetArray())
+				{
+					string name, operation, service, asset, script;
+					vector<string> parameters;
+					unsigned long timeout = m_methodTimeout;
+					if (method.HasMember("name") && method["name"].IsString())
+						name = method["name"].GetString();
+					if (method.HasMember("operation") && method["operation"].IsString())
+						operation = method["operation"].GetString();
+					if (method.HasMember("service") && method["service"].IsString())
+						service = method["service"].GetString();
+					if (method.HasMember("asset") && method["asset"].IsString())
+						asset = method["asset"].GetString();
+					if (method.HasMember("script") && method["script"].IsString())
+						script = method["script"].GetString();
+					if (method.HasMember("timeout") && method["timeout"].IsNumber())
+						timeout = (unsigned long)(method["timeout"].GetDouble() * 1000);
+					if (method.HasMember("parameters") && method["parameters"].IsArray())
+					{
+						for (auto &p : method["parameters"].GetArray())
+						{
+							if (p.IsString())
+								parameters.push_back(p.GetString());
+						}
+					}
+					if (name.empty())
+					{
+						m_log->error("Badly formed control map, a method must have a name");
+						continue;
+					}
+					if (operation.empty())
+						operation = name;
+					if (!script.empty())
+						m_methods.push_back(ControlMethod(name, operation, parameters, DestinationScript, script, timeout));
+					else if (!asset.empty())
+						m_methods.push_back(ControlMethod(name, operation, parameters, DestinationAsset, asset, timeout));
+					else if (!service.empty())
+						m_methods.push_back(ControlMethod(name, operation, parameters, DestinationService, service, timeout));
+					else
+						m_methods.push_back(ControlMethod(name, operation, parameters, DestinationBroadcast, "", timeout));
+				}
+			}
 		}
 	}
 }
@@ -320,173 +772,642 @@ void OPCUAServer::parseChildren(NodeTree &parent, const rapidjson::Value &value)
  * Send a block of readings to OPCUA Server
  *
  * @param readings	The readings to send
+ * @param trace		True if the phases of sending the block are traced
  * @return 		The number of readings sent
  */
-uint32_t OPCUAServer::send(const vector<Reading *> &readings)
+uint32_t OPCUAServer::send(const vector<Reading *> &readings, bool trace)
 {
-	int n = 0;
+	vector<Reading *> ordered;
+	vector<Reading *> released;
 
-	if (!m_server)
+	m_trace = trace;
+	TraceSpan span(m_trace, "send", m_shardName.c_str());
+	if (!m_backend)
 	{
-		m_log->info("Starting OPC UA Server on %s", m_url.c_str());
+		TraceSpan span(m_trace, "startServer");
 		try
 		{
-			//	m_server = new UaServer(m_log);
-			m_server = new UaServer(true);
-			m_server->SetEndpoint(m_url);
-			m_server->SetServerURI(m_uri);
-			m_server->SetServerName(m_name);
-			m_server->Start();
-			m_log->info("Server started");
+			uint16_t idx;
+			m_backend = BackendRegistry::acquire(m_url, m_backendName, m_uri, m_name, m_namespace, idx);
+			m_batch.setBackend(m_backend);
+			m_idx = idx;
+			m_log->info("Server started, namespace %s has index %d", m_namespace.c_str(), m_idx);
 
-			m_idx = m_server->RegisterNamespace(m_namespace);
-			m_objects = m_server->GetObjectsNode();
+			m_objects = m_backend->objectsFolder();
+			if (m_lazyValues && !m_backend->supportsReadHandlers())
+			{
+				m_log->error("The OPC UA server does not support value callbacks, lazy values will not be used");
+				m_lazyValues = false;
+			}
 			if (m_root.length() > 0)
 			{
 				NodeId nodeId(m_root, m_idx);
 				QualifiedName qn(m_root, m_idx);
-				m_objects = m_objects.AddObject(nodeId, qn);
+				m_batch.addObject(m_objects, nodeId, qn);
+				m_batch.flush();
+				m_objects = nodeId;
 			}
 
-			m_server->EnableEventNotification();
-
-			createControlNodes();
+			if (m_shard == 0)
+			{
+				// Only the first shard has the control nodes, so each control request reaches Fledge once
+				createControlNodes();
+			}
+			if (m_history.isEnabled() || m_historyStore.isEnabled())
+			{
+				createHistoryMethods();
+			}
+			if (m_latency.isEnabled())
+			{
+				createLatencyNodes();
+			}
+			if (m_statisticsFastPath)
+			{
+				createStatisticNodes();
+			}
 		}
 		catch (exception &e)
 		{
 			m_log->error("Failed to start OPC UA Server: %s", e.what());
+			releaseBackend();
+			return 0;
+		}
+	}
+	if (m_statisticsFastPath)
+	{
+		publishStatistics(readings);
+		return readings.size();
+	}
+	if (m_policies.isEnabled())
+	{
+		scheduleReadings(readings, ordered, released);
+	}
+	const vector<Reading *> &block = m_policies.isEnabled() ? ordered : readings;
+	time_t now = time(NULL);
+	vector<bool> added;
+	addAssets(block, now, added);
+	if (m_conversionPool.size() > 0 && block.size() >= m_parallelThreshold)
+	{
+		publishParallel(block, added, now);
+	}
+	else
+	{
+		TraceSpan span(m_trace, "publish");
+		for (size_t i = 0; i < block.size(); i++)
+		{
+			if (added[i])
+			{
+				continue;
+			}
+			string assetName = block[i]->getAssetName();
+			if (m_assets.find(assetName) == m_assets.end())
+			{
+				addAsset(block[i]);
+			}
+			else
+			{
+				updateAsset(block[i]);
+			}
+			flushNodes();
+			if (m_latency.isEnabled())
+			{
+				m_latency.record(block[i]);
+			}
+			touchAsset(assetName, now);
 		}
 	}
-	for (auto reading = readings.cbegin(); reading != readings.cend(); reading++)
+	flushWrites();
+	if (m_latency.isEnabled() && m_latency.due(now))
 	{
-		string assetName = (*reading)->getAssetName();
+		publishLatency();
+	}
+	for (auto reading : released)
+	{
+		delete reading;
+	}
+	{
+		TraceSpan span(m_trace, "expireAssets");
+		flushAggregates(now);
+		expireDatapoints(now);
+		expireAssets(now);
+		enforceNodeLimit();
+	}
+	return readings.size();
+}
+
+/**
+ * Add the assets that are seen for the first time in a block of readings.
+ * The objects and variables of all of the new assets, and any new levels
+ * of the hierarchy they are placed in, are added to the address space
+ * together when the batch of nodes is flushed. The readings that added
+ * an asset are marked so that they are not written again.
+ *
+ * @param readings	The block of readings
+ * @param now		The time the block was received
+ * @param added		Set true for each reading that added its asset
+ */
+void OPCUAServer::addAssets(const vector<Reading *> &readings, time_t now, vector<bool> &added)
+{
+	TraceSpan span(m_trace, "addAssets");
+	added.assign(readings.size(), false);
+	for (size_t i = 0; i < readings.size(); i++)
+	{
+		string assetName = readings[i]->getAssetName();
+		if (m_assets.find(assetName) != m_assets.end())
+		{
+			continue;
+		}
+		addAsset(readings[i]);
 		if (m_assets.find(assetName) == m_assets.end())
 		{
-			addAsset(*reading);
+			continue;	// Failed, the reading is retried as normal
 		}
-		else
+		added[i] = true;
+		if (m_latency.isEnabled())
 		{
-			updateAsset(*reading);
+			m_latency.record(readings[i]);
 		}
-		n++;
+		touchAsset(assetName, now);
 	}
-	return n;
+	flushNodes();
 }
 
 /**
- * Add a new asset to the object tree
- * Called the first time we see a particular asset
- *
- * @param reading	The reading to add
+ * Add the queued nodes to the address space, then add the new variables
+ * to the history and register their value callbacks, neither of which
+ * can be done until the server has assigned the NodeIds of the variables.
  */
-void OPCUAServer::addAsset(Reading *reading)
+void OPCUAServer::flushNodes()
 {
-	string assetName = reading->getAssetName();
-	OpcUa::Node parent = findParent(reading);
-
-	try
+	if (m_batch.empty())
 	{
-		Node obj;
-		if (m_includeAsset)
+		return;
+	}
+	TraceSpan span(m_trace, "flushNodes");
+	m_batch.flush();
+	for (auto &pending : m_pending)
+	{
+		if (pending.m_history)
 		{
-			NodeId nodeId(assetName, m_idx);
-			QualifiedName qn(assetName, m_idx);
-			obj = parent.AddObject(nodeId, qn);
-			m_log->debug("Asset added: %s (NodeId: %s ParentId: %s)",
-						 assetName.c_str(),
-						 NodeIdString(obj.GetId()).c_str(),
-						 NodeIdString(parent.GetId()).c_str());
+			NodeId nodeId = m_nodes.getNodeId(pending.m_node);
+			m_history.add(pending.m_node, nodeId);
+			m_historyStore.add(pending.m_node, nodeId, pending.m_key);
+			m_history.append(pending.m_node, pending.m_timestamp, pending.m_value);
+			m_historyStore.append(pending.m_node, pending.m_timestamp, pending.m_value);
 		}
-		else
+		if (m_lazyValues)
 		{
-			obj = parent;
+			registerValueCallback(pending.m_node);
 		}
+	}
+	m_pending.clear();
+}
 
-		struct timeval userTS;
-		reading->getUserTimestamp(&userTS);
-		vector<Datapoint *> &dataPoints = reading->getReadingData();
-		for (vector<Datapoint *>::iterator it = dataPoints.begin(); it != dataPoints.end(); ++it)
+/**
+ * Write the values queued by writeValue to the address space with a
+ * single call to the backend
+ */
+void OPCUAServer::flushWrites()
+{
+	if (m_writes.empty())
+	{
+		return;
+	}
+	TraceSpan span(m_trace, "flushWrites");
+	try
+	{
+		vector<StatusCode> status = m_backend->write(m_writes);
+		for (size_t i = 0; i < status.size(); i++)
 		{
-			// Get the reference to a DataPointValue
-			DatapointValue &value = (*it)->getData();
-			string name = (*it)->getName();
-			addDatapoint(assetName, obj, name, value, userTS);
+			if (status[i] != StatusCode::Good)
+			{
+				m_log->warn("Failed to write the %s of %s, status 0x%08x",
+						m_writes[i].AttributeId == AttributeId::Value ? "value" : "sampling hint",
+						NodeIdString(m_writes[i].NodeId).c_str(), (unsigned int)status[i]);
+			}
 		}
-		m_assets.insert(pair<string, Node>(assetName, obj));
 	}
-	catch (const std::exception &e)
+	catch (exception &e)
 	{
-		m_log->error("Exception creating Asset %s: %s", assetName.c_str(), e.what());
+		m_log->error("Failed to write %u values: %s", (unsigned int)m_writes.size(), e.what());
 	}
+	m_writes.clear();
 }
 
 /**
- * Add the variable within an asset object. This may be
- * called recursively for nested objects
+ * Write a block of readings, converting the readings on the conversion
+ * worker pool. The readings are divided into partitions by asset so
+ * that the readings of an asset are converted in order by a single
+ * thread, there being several partitions per thread so that threads
+ * that finish early take on the remaining partitions. The converted
+ * values are then written to the server by this thread in the order of
+ * the block.
  *
- * @param assetName The name of the asset being added
- * @param obj	The parent object
- * @param name	The name of the variable to add
- * @param value	The value of the variable
- * @param userTS	The timestamp of the variable
+ * @param readings	The readings to write
+ * @param added		The readings that added their asset and need not be written
+ * @param now		The time the block was received
  */
-void OPCUAServer::addDatapoint(string &assetName, Node &obj, string &name, DatapointValue &value, struct timeval userTS)
+void OPCUAServer::publishParallel(const vector<Reading *> &readings, const vector<bool> &added, time_t now)
 {
-	try
+	vector<PreparedReading> prepared(readings.size());
+	vector<vector<size_t> > partitions((m_conversionPool.size() + 1) * 4);
+	hash<string> hasher;
+	for (size_t i = 0; i < readings.size(); i++)
 	{
-		if (value.getType() == DatapointValue::T_INTEGER)
-		{
-			Node myvar = obj.AddVariable(m_idx, name, Variant((int64_t)value.toInt()));
-			DataValue dv = myvar.GetDataValue();
-			dv.SourceTimestamp = DateTime::FromTimeT(userTS.tv_sec, userTS.tv_usec);
-			dv.Encoding |= DATA_VALUE_SOURCE_TIMESTAMP;
-			myvar.SetValue(dv);
-		}
-		else if (value.getType() == DatapointValue::T_FLOAT)
+		partitions[hasher(readings[i]->getAssetName()) % partitions.size()].push_back(i);
+	}
+	m_conversionPool.run(partitions.size(), [this, &readings, &added, &prepared, &partitions](size_t partition) {
+		TraceSpan span(m_trace, "prepareReadings");
+		for (auto i : partitions[partition])
 		{
-			Node myvar = obj.AddVariable(m_idx, name, Variant(value.toDouble()));
-			DataValue dv = myvar.GetDataValue();
-			dv.SourceTimestamp = DateTime::FromTimeT(userTS.tv_sec, userTS.tv_usec);
-			dv.Encoding |= DATA_VALUE_SOURCE_TIMESTAMP;
-			myvar.SetValue(dv);
+			if (!added[i])
+			{
+				prepareReading(readings[i], prepared[i]);
+			}
 		}
-		else if (value.getType() == DatapointValue::T_STRING)
+	});
+
+	TraceSpan span(m_trace, "writeValues");
+	for (size_t i = 0; i < readings.size(); i++)
+	{
+		if (added[i])
 		{
-			Node myvar = obj.AddVariable(m_idx, name, value.toStringValue());
-			DataValue dv = myvar.GetDataValue();
-			dv.SourceTimestamp = DateTime::FromTimeT(userTS.tv_sec, userTS.tv_usec);
-			dv.Encoding |= DATA_VALUE_SOURCE_TIMESTAMP;
-			myvar.SetValue(dv);
+			continue;
 		}
-		else if (value.getType() == DatapointValue::T_DP_DICT)
+		string assetName = readings[i]->getAssetName();
+		PreparedReading &reading = prepared[i];
+		if (reading.m_asset)
 		{
-			string fullname = assetName + "_" + name;
-			NodeId nodeId(fullname, m_idx);
-			QualifiedName qn(name, m_idx);
-			Node child = obj.AddObject(nodeId, qn);
-			vector<Datapoint *> *children = value.getDpVec();
-			for (auto dpit = children->begin(); dpit != children->end(); dpit++)
+			AssetNode &asset = *reading.m_asset;
+			for (auto &v : reading.m_values)
 			{
-				name = (*dpit)->getName();
-				DatapointValue &val = (*dpit)->getData();
-				addDatapoint(assetName, child, name, val, userTS);
+				asset.seen(*v.m_datapoint);
+				try
+				{
+					writeValue(asset, "", assetName, asset.getObject(), v.m_name, v.m_node,
+							*v.m_value, reading.m_userTS, v.m_variant, reading.m_sourceTime);
+				}
+				catch (exception &e)
+				{
+					m_log->error("Failed to update asset %s datapoint %s, %s",
+							assetName.c_str(), v.m_name.c_str(), e.what());
+				}
 			}
 		}
-		else if (value.getType() == DatapointValue::T_FLOAT_ARRAY)
+		else if (m_assets.find(assetName) == m_assets.end())
 		{
-			vector<double> array = *value.getDpArr();
-			Node myvar = obj.AddVariable(m_idx, name, Variant(array));
-			DataValue dv = myvar.GetDataValue();
-			dv.SourceTimestamp = DateTime::FromTimeT(userTS.tv_sec, userTS.tv_usec);
-			dv.Encoding |= DATA_VALUE_SOURCE_TIMESTAMP;
-			myvar.SetValue(dv);
-		} // TODO add support for arrays (T_DP_LIST)
+			addAsset(readings[i]);
+		}
 		else
 		{
-			// Log unsupported types just once per run of the plugin
-			bool found = false;
-			DatapointValue::DatapointTag type = value.getType();
-			for (auto &w : m_warned)
+			updateAsset(readings[i]);
+		}
+		flushNodes();
+		if (m_latency.isEnabled())
+		{
+			m_latency.record(readings[i]);
+		}
+		touchAsset(assetName, now);
+	}
+}
+
+/**
+ * Convert a reading of an existing asset ready to be written. This is
+ * called on the conversion worker pool, it only reads the asset table
+ * and modifies only the asset of the reading. Readings that would add
+ * variables or that have nested or non-numeric list datapoints are left to be
+ * written as normal.
+ *
+ * @param reading	The reading to convert
+ * @param prepared	The converted reading
+ */
+void OPCUAServer::prepareReading(Reading *reading, PreparedReading &prepared)
+{
+	try
+	{
+		auto it = m_assets.find(reading->getAssetName());
+		if (it == m_assets.end())
+		{
+			return;
+		}
+		AssetNode &asset = it->second;
+		vector<Datapoint *> &dataPoints = reading->getReadingData();
+		prepared.m_values.reserve(dataPoints.size());
+		for (size_t i = 0; i < dataPoints.size(); i++)
+		{
+			string name = dataPoints[i]->getName();
+			if (!asset.m_projection.included(i, name))
+			{
+				continue;
+			}
+			DatapointValue &value = dataPoints[i]->getData();
+			DatapointNode *dp = asset.findDatapoint(name);
+			if (!dp || dp->m_object || dp->isAggregate())
+			{
+				prepared.m_values.clear();
+				return;
+			}
+			prepared.m_values.push_back(PreparedValue(*dp, name, &value));
+			if (!DatapointToVariant(value, prepared.m_values.back().m_variant))
+			{
+				prepared.m_values.clear();
+				return;
+			}
+		}
+		reading->getUserTimestamp(&prepared.m_userTS);
+		prepared.m_sourceTime = DateTime::FromTimeT(prepared.m_userTS.tv_sec, prepared.m_userTS.tv_usec);
+		prepared.m_asset = &asset;
+	}
+	catch (exception &e)
+	{
+		prepared.m_values.clear();
+		prepared.m_asset = NULL;
+	}
+}
+
+/**
+ * Apply the publish policies to a block of readings. Readings of assets
+ * that have exceeded their maximum rate are held back, only the latest
+ * reading of each asset is retained and it is written by a later call
+ * once the asset has a token. The readings to write are ordered by the
+ * priority of their asset, keeping the order of readings within each
+ * priority.
+ *
+ * @param readings	The block of readings passed to send
+ * @param ordered	The readings to write, in priority order
+ * @param released	Retained readings added to ordered, to be deleted once written
+ */
+void OPCUAServer::scheduleReadings(const vector<Reading *> &readings, vector<Reading *> &ordered,
+				vector<Reading *> &released)
+{
+	vector<Reading *> lanes[PublishPolicy::Low + 1];
+	double now = chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+
+	// Readings retained from earlier blocks are older so are written first
+	for (auto it = m_throttled.begin(); it != m_throttled.end(); )
+	{
+		auto throttle = m_throttles.find(*it);
+		if (throttle == m_throttles.end() || !throttle->second.m_pending)
+		{
+			it = m_throttled.erase(it);
+			continue;
+		}
+		AssetThrottle &t = throttle->second;
+		if (t.m_bucket.take(now))
+		{
+			lanes[t.m_policy->getPriority()].push_back(t.m_pending);
+			released.push_back(t.m_pending);
+			t.m_pending = NULL;
+			it = m_throttled.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+	for (auto reading : readings)
+	{
+		const string &assetName = reading->getAssetName();
+		auto it = m_throttles.find(assetName);
+		if (it == m_throttles.end())
+		{
+			it = m_throttles.insert(pair<string, AssetThrottle>(assetName,
+						AssetThrottle(m_policies.match(assetName)))).first;
+		}
+		AssetThrottle &t = it->second;
+		if (t.m_policy && t.m_policy->getRate() > 0.0 && !t.m_bucket.take(now))
+		{
+			if (t.m_pending)
+				delete t.m_pending;
+			else
+				m_throttled.push_back(assetName);
+			t.m_pending = new Reading(*reading);
+			continue;
+		}
+		if (t.m_pending)
+		{
+			// Superseded by a newer reading
+			delete t.m_pending;
+			t.m_pending = NULL;
+		}
+		lanes[t.m_policy ? t.m_policy->getPriority() : PublishPolicy::Normal].push_back(reading);
+	}
+	for (auto &lane : lanes)
+	{
+		ordered.insert(ordered.end(), lane.begin(), lane.end());
+	}
+}
+
+/**
+ * Add a new asset to the object tree
+ * Called the first time we see a particular asset. The nodes of the
+ * asset are queued in the node batch and are not in the address space
+ * until flushNodes is called.
+ *
+ * @param reading	The reading to add
+ */
+void OPCUAServer::addAsset(Reading *reading)
+{
+	string assetName = reading->getAssetName();
+	TraceSpan span(m_trace, "addAsset", assetName.c_str());
+	NodeId parentId;
+	{
+		TraceSpan span(m_trace, "findParent", assetName.c_str());
+		parentId = findParent(reading);
+	}
+
+	try
+	{
+		NodeHandle obj;
+		if (m_includeAsset)
+		{
+			NodeId nodeId(assetName, m_idx);
+			QualifiedName qn(assetName, m_idx);
+			obj = m_batch.addObject(parentId, nodeId, qn);
+			m_log->debug("Asset added: %s (NodeId: %s ParentId: %s)",
+						 assetName.c_str(),
+						 NodeIdString(nodeId).c_str(),
+						 NodeIdString(parentId).c_str());
+		}
+		else
+		{
+			obj = m_nodes.add(parentId);
+		}
+
+		string parentKey;
+		if (parentId.IsString() && m_parents.find(parentId.GetStringIdentifier()) != m_parents.end())
+		{
+			parentKey = parentId.GetStringIdentifier();
+		}
+		auto res = m_assets.insert(pair<string, AssetNode>(assetName,
+					AssetNode(obj, parentKey, m_includeAsset)));
+		AssetNode &asset = res.first->second;
+		if (m_includeAsset)
+		{
+			// The parent objects are counted by createHierarchyFromPathSegments and releaseParent
+			asset.m_nodes++;
+			m_nodeCount++;
+		}
+		if (!parentKey.empty())
+		{
+			m_parents.find(parentKey)->second.addChild();
+		}
+		if (m_filter.isEnabled())
+		{
+			asset.m_projection = m_filter.forAsset(assetName);
+		}
+
+		struct timeval userTS;
+		reading->getUserTimestamp(&userTS);
+		vector<Datapoint *> &dataPoints = reading->getReadingData();
+		for (size_t i = 0; i < dataPoints.size(); i++)
+		{
+			string name = dataPoints[i]->getName();
+			if (!asset.m_projection.included(i, name))
+			{
+				continue;
+			}
+			// Get the reference to a DataPointValue
+			DatapointValue &value = dataPoints[i]->getData();
+			addDatapoint(asset, "", assetName, asset.getObject(), name, value, userTS);
+		}
+	}
+	catch (const std::exception &e)
+	{
+		m_log->error("Exception creating Asset %s: %s", assetName.c_str(), e.what());
+		if (m_assets.find(assetName) != m_assets.end())
+		{
+			// Undo the node counts of the partly added asset, its reading is retried as normal
+			flushNodes();
+			removeAsset(assetName);
+		}
+	}
+}
+
+/**
+ * Add the variable within an asset object. This may be
+ * called recursively for nested objects
+ *
+ * @param asset	The asset the datapoint belongs to
+ * @param prefix	The path of the enclosing datapoint for nested datapoints
+ * @param assetName The name of the asset being added
+ * @param parent	The parent object
+ * @param name	The name of the variable to add
+ * @param value	The value of the variable
+ * @param userTS	The timestamp of the variable
+ */
+void OPCUAServer::addDatapoint(AssetNode &asset, const string &prefix, string &assetName, NodeHandle parent,
+				string &name, DatapointValue &value, struct timeval userTS)
+{
+	if (m_structuredDatapoints && value.getType() == DatapointValue::T_DP_DICT)
+	{
+		string json;
+		m_dictEncoder.encode(value, json);
+		DatapointValue structured(json);
+		addDatapoint(asset, prefix, assetName, parent, name, structured, userTS);
+		return;
+	}
+	try
+	{
+		NodeId obj = m_nodes.getNodeId(parent);
+		Variant array;
+		if (value.getType() == DatapointValue::T_INTEGER
+				|| value.getType() == DatapointValue::T_FLOAT
+				|| value.getType() == DatapointValue::T_STRING)
+		{
+			Variant variant;
+			if (value.getType() == DatapointValue::T_INTEGER)
+				variant = Variant((int64_t)value.toInt());
+			else if (value.getType() == DatapointValue::T_FLOAT)
+				variant = Variant(value.toDouble());
+			else
+				variant = Variant(value.toStringValue());
+			NodeHandle handle;
+			if (m_lazyValues)
+				handle = m_batch.addVariable(obj, m_idx, name, variant, false);
+			else
+				handle = m_batch.addVariable(obj, m_idx, name, variant,
+						DateTime::FromTimeT(userTS.tv_sec, userTS.tv_usec));
+			asset.addDatapoint(prefix + name, handle, false, m_aggregateSource);
+			asset.m_nodes++;
+			m_nodeCount++;
+			if (m_shm.isEnabled())
+			{
+				m_shm.add(handle, assetName, prefix + name);
+				exportValue(handle, value, userTS);
+			}
+			// The history and value callback need the NodeId the server assigns the variable
+			PendingVariable pending(handle);
+			if ((m_history.isEnabled() || m_historyStore.isEnabled())
+					&& value.getType() != DatapointValue::T_STRING)
+			{
+				pending.m_history = true;
+				pending.m_key = assetName + "\t" + prefix + name;
+				pending.m_timestamp = (int64_t)DateTime::FromTimeT(userTS.tv_sec, userTS.tv_usec);
+				pending.m_value = value.getType() == DatapointValue::T_INTEGER ? (double)value.toInt() : value.toDouble();
+			}
+			if (pending.m_history || m_lazyValues)
+			{
+				m_pending.push_back(pending);
+			}
+			if (m_aggregates.isEnabled() && m_aggregateSource == INVALID_NODE_HANDLE
+					&& value.getType() != DatapointValue::T_STRING)
+			{
+				const AggregateRule *rule = m_aggregates.match(assetName, prefix + name);
+				if (rule)
+				{
+					m_windows.insert(pair<NodeHandle, AggregateWindow>(handle, AggregateWindow(rule)));
+					if (!asset.m_aggregateWindow || rule->getWindow() < asset.m_aggregateWindow)
+					{
+						asset.m_aggregateWindow = rule->getWindow();
+					}
+					aggregateValue(asset, prefix, assetName, parent, name, handle, value, userTS);
+				}
+			}
+			if (m_lazyValues)
+			{
+				storeValue(handle, value, userTS);
+			}
+		}
+		else if (value.getType() == DatapointValue::T_DP_DICT)
+		{
+			string fullname = assetName + "_" + name;
+			NodeId nodeId(fullname, m_idx);
+			QualifiedName qn(name, m_idx);
+			NodeHandle childHandle = m_batch.addObject(obj, nodeId, qn);
+			string path = prefix + name;
+			asset.addDatapoint(path, childHandle, true);
+			asset.m_nodes++;
+			m_nodeCount++;
+			path.append(".");
+			vector<Datapoint *> *children = value.getDpVec();
+			for (auto dpit = children->begin(); dpit != children->end(); dpit++)
+			{
+				string childName = (*dpit)->getName();
+				if (!asset.m_projection.included(path + childName))
+				{
+					continue;
+				}
+				DatapointValue &val = (*dpit)->getData();
+				addDatapoint(asset, path, assetName, childHandle, childName, val, userTS);
+			}
+		}
+		else if ((value.getType() == DatapointValue::T_FLOAT_ARRAY
+					|| value.getType() == DatapointValue::T_DP_LIST)
+				&& DatapointToVariant(value, array))
+		{
+			NodeHandle handle = m_batch.addVariable(obj, m_idx, name, array,
+						DateTime::FromTimeT(userTS.tv_sec, userTS.tv_usec));
+			asset.addDatapoint(prefix + name, handle, false);
+			asset.m_nodes++;
+			m_nodeCount++;
+		}
+		else
+		{
+			// Log unsupported types just once per run of the plugin
+			bool found = false;
+			DatapointValue::DatapointTag type = value.getType();
+			for (auto &w : m_warned)
 				if (w == type)
 					found = true;
 			if (!found)
@@ -502,270 +1423,1215 @@ void OPCUAServer::addDatapoint(string &assetName, Node &obj, string &name, Datap
 	}
 	catch (exception &e)
 	{
-		m_log->error("Failed to add asset %s datapoint %s, %s", assetName.c_str(), name.c_str(), e.what());
+		m_log->error("Failed to add asset %s datapoint %s, %s", assetName.c_str(), name.c_str(), e.what());
+	}
+}
+
+/**
+ * Update the value of an asset we have seen previously
+ *
+ * @param reading	The reading to update
+ */
+void OPCUAServer::updateAsset(Reading *reading)
+{
+	string assetName = reading->getAssetName();
+	TraceSpan span(m_trace, "updateAsset", assetName.c_str());
+
+	m_log->debug("Update asset: %s (%u)", assetName.c_str(), reading->getDatapointCount());
+	auto it = m_assets.find(assetName);
+	if (it != m_assets.end())
+	{
+		AssetNode &asset = it->second;
+
+		vector<Datapoint *> &dataPoints = reading->getReadingData();
+		struct timeval userTS;
+		reading->getUserTimestamp(&userTS);
+		for (size_t i = 0; i < dataPoints.size(); i++)
+		{
+			string name = dataPoints[i]->getName();
+			if (!asset.m_projection.included(i, name))
+			{
+				continue;
+			}
+			// Get the reference to a DataPointValue
+			DatapointValue &value = dataPoints[i]->getData();
+			updateDatapoint(asset, "", assetName, asset.getObject(), name, value, userTS);
+		}
+	}
+}
+
+/**
+ * Update the datapoint for a given asset
+ *
+ * @param asset	The asset the datapoint belongs to
+ * @param prefix	The path of the enclosing datapoint for nested datapoints
+ * @param assetName The name of the asset being updated
+ * @param parent	The parent object
+ * @param name	The name of the variable to update
+ * @param value	The value of the variable
+ * @param userTS	The timestamp of the variable
+ */
+void OPCUAServer::updateDatapoint(AssetNode &asset, const string &prefix, string &assetName, NodeHandle parent,
+				string &name, DatapointValue &value, struct timeval userTS)
+{
+	string path = prefix + name;
+	DatapointNode *dp = asset.findDatapoint(path);
+	if (!dp)
+	{
+		addDatapoint(asset, prefix, assetName, parent, name, value, userTS);
+		return;
+	}
+	asset.seen(*dp);
+	if (dp->isAggregate() && m_aggregateSource == INVALID_NODE_HANDLE)
+	{
+		// The reading has a datapoint with the name of an aggregate, the variable now belongs to the datapoint
+		m_log->warn("Asset %s datapoint %s has the same name as an aggregate variable", assetName.c_str(), path.c_str());
+		dp->m_source = INVALID_NODE_HANDLE;
+	}
+	try
+	{
+		if (value.getType() == DatapointValue::T_DP_DICT)
+		{
+			if (!dp->m_object)
+			{
+				if (m_structuredDatapoints)
+				{
+					string json;
+					m_dictEncoder.encode(value, json);
+					DatapointValue structured(json);
+					updateDatapoint(asset, prefix, assetName, parent, name, structured, userTS);
+				}
+				return;
+			}
+			NodeHandle object = dp->m_node;
+			path.append(".");
+			vector<Datapoint *> *children = value.getDpVec();
+			for (auto dpit = children->begin(); dpit != children->end(); dpit++)
+			{
+				string childName = (*dpit)->getName();
+				if (!asset.m_projection.included(path + childName))
+				{
+					continue;
+				}
+				DatapointValue &val = (*dpit)->getData();
+				updateDatapoint(asset, path, assetName, object, childName, val, userTS);
+			}
+			return;
+		}
+		if (dp->m_object)
+		{
+			return;
+		}
+		Variant variant;
+		DatapointToVariant(value, variant);
+		writeValue(asset, prefix, assetName, parent, name, dp->m_node, value, userTS, variant,
+				DateTime::FromTimeT(userTS.tv_sec, userTS.tv_usec));
+	}
+	catch (exception &e)
+	{
+		m_log->error("Failed to update asset %s datapoint %s, %s", assetName.c_str(), name.c_str(), e.what());
+	}
+}
+
+/**
+ * Write a new value to an existing scalar variable. The value is also
+ * passed to the shared memory export, history and aggregates. The write
+ * to the address space is queued and made with the other writes of the
+ * block by flushWrites.
+ *
+ * @param asset	The asset the datapoint belongs to
+ * @param prefix	The path of the enclosing datapoint for nested datapoints
+ * @param assetName The name of the asset being updated
+ * @param parent	The parent object
+ * @param name	The name of the variable to update
+ * @param handle	The handle of the variable
+ * @param value	The value of the variable
+ * @param userTS	The timestamp of the variable
+ * @param variant	The value converted to a variant, null if the type is not supported
+ * @param sourceTime	The timestamp converted to an OPC UA time
+ */
+void OPCUAServer::writeValue(AssetNode &asset, const string &prefix, string &assetName, NodeHandle parent,
+				string &name, NodeHandle handle, DatapointValue &value, struct timeval userTS,
+				const Variant &variant, const DateTime &sourceTime)
+{
+	if (m_shm.isEnabled())
+	{
+		exportValue(handle, value, userTS);
+	}
+	if (m_history.isEnabled() || m_historyStore.isEnabled())
+	{
+		historyValue(handle, value, userTS);
+	}
+	if (!m_windows.empty())
+	{
+		aggregateValue(asset, prefix, assetName, parent, name, handle, value, userTS);
+	}
+	double interval;
+	if (m_sampling.isEnabled() && m_sampling.update(handle, userTS, interval))
+	{
+		m_writes.push_back(WriteValue(m_nodes.getNodeId(handle), AttributeId::MinimumSamplingInterval,
+					DataValue(Variant(interval))));
+	}
+	if (m_lazyValues && !storeValue(handle, value, userTS))
+	{
+		// Nobody is observing the variable, the server will read it from the store
+		return;
+	}
+	if (variant.IsNul())
+	{
+		// The datapoint has changed to a type the variable can not hold, report it once
+		if (m_unsupported.insert(handle).second)
+		{
+			m_log->warn("Asset %s, datapoint %s%s has changed to unsupported type %d, its variable will not be updated",
+					assetName.c_str(), prefix.c_str(), name.c_str(), value.getType());
+		}
+		return;
+	}
+	DataValue dv(variant);
+	dv.Status = StatusCode::Good;
+	dv.SourceTimestamp = sourceTime;
+	dv.Encoding |= DATA_VALUE_STATUS_CODE | DATA_VALUE_SOURCE_TIMESTAMP;
+	m_writes.push_back(WriteValue(m_nodes.getNodeId(handle), AttributeId::Value, dv));
+}
+
+/**
+ * Stop the OPCUA server
+ */
+void OPCUAServer::stop()
+{
+	if (m_backend)
+	{
+		m_log->info("Node table holds %lu nodes in %lu bytes",
+				(unsigned long)m_nodes.size(), (unsigned long)m_nodes.memoryUsage());
+		if (m_lazyValues)
+		{
+			m_log->info("Value store uses %lu bytes", (unsigned long)m_values.memoryUsage());
+		}
+		if (m_history.isEnabled())
+		{
+			m_log->info("History uses %lu bytes", (unsigned long)m_history.memoryUsage());
+		}
+		if (m_sampling.isEnabled())
+		{
+			m_log->info("Sampling hints use %lu bytes", (unsigned long)m_sampling.memoryUsage());
+		}
+		if (m_latency.isEnabled() && m_latency.sourceLatency(0).m_count)
+		{
+			const LatencySummary &latency = m_latency.sourceLatency(0);
+			m_log->info("Source latency in the last interval: mean %.1fms, 99th percentile %.1fms, maximum %.1fms",
+					latency.m_mean, latency.m_p99, latency.m_max);
+		}
+		releaseBackend();
+	}
+	for (auto &throttle : m_throttles)
+	{
+		delete throttle.second.m_pending;
+	}
+	m_throttles.clear();
+	m_throttled.clear();
+	m_conversionPool.stop();
+	m_dispatcher.stop();
+	m_shm.close();
+	m_historyStore.close();
+}
+
+/**
+ * Release the server. If other instances of the plugin share the server
+ * the nodes this instance created are removed from it, otherwise the
+ * server is stopped.
+ */
+void OPCUAServer::releaseBackend()
+{
+	if (!m_backend)
+	{
+		return;
+	}
+	BackendRegistry::release(m_backend, m_namespace, [this]() { removeNamespaceNodes(); });
+	m_backend = NULL;
+	m_batch.setBackend(NULL);
+}
+
+/**
+ * Remove the nodes this instance created from a server that is shared
+ * with other instances of the plugin. Only nodes in the namespace of
+ * this instance are removed. The objects of assets that were placed
+ * directly in their parent, without an object of their own, refer to
+ * the parent and are not removed, nor are the standard nodes, such as
+ * the Objects folder, that the table may refer to.
+ */
+void OPCUAServer::removeNamespaceNodes()
+{
+	for (auto &asset : m_assets)
+	{
+		if (!asset.second.ownsObject())
+		{
+			m_nodes.remove(asset.second.getObject());
+		}
+	}
+	vector<NodeId> all;
+	m_nodes.nodeIds(all);
+	vector<NodeId> nodes;
+	nodes.reserve(all.size());
+	for (auto &node : all)
+	{
+		if (node.GetNamespaceIndex() == m_idx)
+		{
+			nodes.push_back(node);
+		}
+	}
+	try
+	{
+		m_backend->deleteNodes(nodes);
+		m_log->info("Removed %lu nodes from the shared OPC UA server", (unsigned long)nodes.size());
+	}
+	catch (exception &e)
+	{
+		m_log->warn("Failed to remove the nodes from the shared OPC UA server: %s", e.what());
+	}
+}
+
+void OPCUAServer::registerControl(bool (*write)(const char *name, const char *value, ControlDestination destination, ...),
+								  int (*operation)(char *operation, int paramCount, char *parameters[], ControlDestination destination, ...))
+{
+	m_write = write;
+	m_operation = operation;
+}
+
+/**
+ * Find the parent OPCUA node for this asset
+ *
+ * @param reading	The reading we are sending
+ * @return 		The NodeId of the OPCUA parent node
+ */
+NodeId OPCUAServer::findParent(const Reading *reading)
+{
+	NodeId opcNode = m_objects;
+	string key;
+	vector<Datapoint *> datapoints = reading->getReadingData();
+	std::stack<std::string> pathSegments;
+
+	// A matching asset mapping rule takes precedence over the other methods
+	string mappedPath;
+	if (m_mapper.isEnabled() && m_mapper.map(reading->getAssetName(), mappedPath))
+	{
+		ParsePath(pathSegments, mappedPath, '/');
+		if (!pathSegments.empty())
+		{
+			opcNode = createHierarchyFromPathSegments(pathSegments, opcNode, key);
+		}
+		return opcNode;
+	}
+
+	if (m_parseAsset)
+	{
+		ParsePath(pathSegments, reading->getAssetName(), '/');
+	}
+
+	for (int i = 0; i < datapoints.size(); i++)
+	{
+		string name = datapoints[i]->getName();
+		for (int j = 0; j < m_hierarchy.size(); j++)
+		{
+			if (m_hierarchy[j].getName().compare(name) == 0)
+			{
+				DatapointValue value = datapoints[i]->getData();
+				string svalue = value.toStringValue();
+
+				// If the first path segment from the Asset Name matches
+				// the last segment of the path, remove the duplicate.
+				if (!pathSegments.empty())
+				{
+					TrimTokenFromEndOfPath(pathSegments.top(), svalue, '/');
+				}
+
+				ParsePath(pathSegments, svalue, '/');
+				opcNode = createHierarchyFromPathSegments(pathSegments, opcNode, key);
+				return findParent(m_hierarchy[j].getChildren(), reading, opcNode, svalue);
+			}
+		}
+	}
+
+	if (!pathSegments.empty())
+	{
+		opcNode = createHierarchyFromPathSegments(pathSegments, opcNode, key);	
+	}
+
+	return opcNode;
+}
+
+/**
+ * Return the name of the top level of the hierarchy an asset is placed
+ * in, the asset name if the asset is not placed in a hierarchy. This
+ * follows the same rules as findParent without creating any nodes.
+ *
+ * @param reading	The reading of the asset
+ * @return		The name of the top level of the hierarchy
+ */
+string OPCUAServer::shardKey(const Reading *reading)
+{
+	std::stack<std::string> pathSegments;
+
+	string mappedPath;
+	if (m_mapper.isEnabled() && m_mapper.map(reading->getAssetName(), mappedPath))
+	{
+		ParsePath(pathSegments, mappedPath, '/');
+		return pathSegments.empty() ? reading->getAssetName() : pathSegments.top();
+	}
+	if (m_parseAsset)
+	{
+		ParsePath(pathSegments, reading->getAssetName(), '/');
+	}
+	vector<Datapoint *> datapoints = reading->getReadingData();
+	for (auto dp : datapoints)
+	{
+		string name = dp->getName();
+		for (auto &level : m_hierarchy)
+		{
+			if (level.getName().compare(name) == 0)
+			{
+				string svalue = dp->getData().toStringValue();
+				if (!pathSegments.empty())
+				{
+					TrimTokenFromEndOfPath(pathSegments.top(), svalue, '/');
+				}
+				ParsePath(pathSegments, svalue, '/');
+				return pathSegments.empty() ? reading->getAssetName() : pathSegments.top();
+			}
+		}
+	}
+	return pathSegments.empty() ? reading->getAssetName() : pathSegments.top();
+}
+
+/**
+ * Find the parent OPCUA node for this asset
+ *
+ * @param hierarchy	The definition for the current level of the hierarchy
+ * @param reading	The reading we are sending
+ * @param root		The current root for the point in the hierarchy we are at
+ * @param key		The key to use to lookup the cache of OPCUA nodes
+ * @return 		The NodeId of the OPCUA parent node
+ */
+NodeId OPCUAServer::findParent(const vector<NodeTree> &hierarchy, const Reading *reading, const NodeId &root, string key)
+{
+	NodeId opcNode = root;
+	std::stack<std::string> pathSegments;
+
+	if (m_parseAsset)
+	{
+		ParsePath(pathSegments, reading->getAssetName(), '/');
+	}
+
+	vector<Datapoint *> datapoints = reading->getReadingData();
+	for (int i = 0; i < datapoints.size(); i++)
+	{
+		string name = datapoints[i]->getName();
+		for (int j = 0; j < hierarchy.size(); j++)
+		{
+			if (hierarchy[j].getName().compare(name) == 0)
+			{
+				DatapointValue value = datapoints[i]->getData();
+				string svalue = value.toStringValue();
+				string newkey = StringSlashFix(key);
+
+				// If the first path segment from the Asset Name matches
+				// the last segment of the path, remove the duplicate.
+				if (!pathSegments.empty())
+				{
+					TrimTokenFromEndOfPath(pathSegments.top(), svalue, '/');
+				}
+
+				ParsePath(pathSegments, svalue, '/');
+				opcNode = createHierarchyFromPathSegments(pathSegments, opcNode, newkey);
+				return findParent(hierarchy[j].getChildren(), reading, opcNode, svalue);
+			}
+		}
+	}
+
+	return opcNode;
+}
+
+/**
+ * Create an OPC UA Address Space hierarchy from a collection of path segments.
+ * New levels of the hierarchy are queued in the node batch.
+ *
+ * @param pathSegments	Stack object containing path segments
+ * @param root			OPC UA Node under which to add child Nodes
+ * @param key			Key to lookup an OPC UA Node in the index of Nodes
+ * @return				NodeId of the OPC UA Node representing the leaf node of the created hierarchy
+ */
+NodeId OPCUAServer::createHierarchyFromPathSegments(std::stack<std::string> &pathSegments, const NodeId &root, std::string &key)
+{
+	NodeId opcNode = root;
+
+	while (!pathSegments.empty())
+	{
+		string pathSegment = pathSegments.top();
+		string parentKey = key;
+
+		if (key.empty())
+		{
+			key.append(pathSegment);
+		}
+		else
+		{
+			key.append("/");
+			key.append(pathSegment);
+		}
+
+		auto it = m_parents.find(key);
+		if (it != m_parents.end())
+		{
+			opcNode = m_nodes.getNodeId(it->second.getNode());
+		}
+		else
+		{
+			NodeId parentId = opcNode;
+			NodeId nodeId(key, m_idx);
+			QualifiedName qn(pathSegment, m_idx);
+			NodeHandle handle = m_batch.addObject(parentId, nodeId, qn);
+			opcNode = nodeId;
+			auto parent = m_parents.find(parentKey);
+			if (parent != m_parents.end())
+			{
+				parent->second.addChild();
+			}
+			else
+			{
+				parentKey.clear();
+			}
+			m_parents.insert(pair<string, ParentNode>(key, ParentNode(handle, parentKey)));
+			m_nodeCount++;
+			m_log->debug("Asset added: %s (NodeId: %s ParentId: %s)",
+						 pathSegment.c_str(),
+						 NodeIdString(opcNode).c_str(),
+						 NodeIdString(parentId).c_str());
+		}
+		
+		pathSegments.pop();
+	}
+
+	return opcNode;
+}
+
+/**
+ * Record that an asset has been seen in the current block. The
+ * asset is moved to the head of the least recently used list and,
+ * if expiry is enabled, given a timer in the timer wheel. If the
+ * datapoint window of the asset has ended the asset is queued to have
+ * the datapoints that were not seen during the window expired once the
+ * block has been written.
+ *
+ * @param assetName	The name of the asset
+ * @param now		The time the block was received
+ */
+void OPCUAServer::touchAsset(const string &assetName, time_t now)
+{
+	auto it = m_assets.find(assetName);
+	if (it == m_assets.end())
+	{
+		return;
+	}
+	AssetNode &asset = it->second;
+	if (asset.m_lastSeen == 0)
+	{
+		m_lru.push_front(assetName);
+		asset.m_lru = m_lru.begin();
+	}
+	else if (asset.m_lru != m_lru.begin())
+	{
+		m_lru.splice(m_lru.begin(), m_lru, asset.m_lru);
+	}
+	asset.m_lastSeen = now;
+	asset.m_stale = false;
+	if (m_datapointWindow)
+	{
+		if (asset.m_windowStart == 0)
+		{
+			asset.m_windowStart = now;
+		}
+		else if (now >= asset.m_windowStart + (time_t)m_datapointWindow && !asset.m_windowEnded)
+		{
+			asset.m_windowEnded = true;
+			m_windowsEnded.push_back(assetName);
+		}
+	}
+	if (!asset.m_scheduled)
+	{
+		time_t deadline = nextDeadline(asset);
+		if (deadline)
+		{
+			m_wheel.schedule(assetName, deadline);
+			asset.m_scheduled = true;
+		}
+	}
+	if (asset.m_aggregateWindow && !asset.m_aggregatesScheduled)
+	{
+		m_aggregateWheel.schedule(assetName, now + asset.m_aggregateWindow);
+		asset.m_aggregatesScheduled = true;
+	}
+}
+
+/**
+ * Return the time at which the next expiry action is due for an asset
+ *
+ * @param asset	The asset to check
+ * @return	The time of the next action or 0 if there is none
+ */
+time_t OPCUAServer::nextDeadline(const AssetNode &asset) const
+{
+	if (!asset.m_stale && m_staleTimeout)
+	{
+		return asset.m_lastSeen + m_staleTimeout;
+	}
+	if (m_removeTimeout)
+	{
+		return asset.m_lastSeen + m_removeTimeout;
+	}
+	return 0;
+}
+
+/**
+ * Process the timers that have expired. Assets that have been
+ * updated since the timer was set are simply rescheduled, others
+ * are first marked as stale and later removed from the address space.
+ *
+ * @param now	The current time
+ */
+void OPCUAServer::expireAssets(time_t now)
+{
+	if (m_staleTimeout == 0 && m_removeTimeout == 0)
+	{
+		return;
+	}
+	vector<string> expired;
+	m_wheel.expire(now, expired);
+	for (auto &name : expired)
+	{
+		auto it = m_assets.find(name);
+		if (it == m_assets.end())
+		{
+			continue;
+		}
+		AssetNode &asset = it->second;
+		asset.m_scheduled = false;
+		time_t deadline;
+		while ((deadline = nextDeadline(asset)) != 0)
+		{
+			if (deadline > now)
+			{
+				m_wheel.schedule(name, deadline);
+				asset.m_scheduled = true;
+				break;
+			}
+			if (!asset.m_stale && m_staleTimeout)
+			{
+				m_log->info("Asset %s has not been updated for %lu seconds, marking as stale",
+						name.c_str(), (unsigned long)(now - asset.m_lastSeen));
+				markStale(asset);
+				asset.m_stale = true;
+			}
+			else
+			{
+				m_log->info("Asset %s has not been updated for %lu seconds, removing",
+						name.c_str(), (unsigned long)(now - asset.m_lastSeen));
+				removeAsset(name);
+				break;
+			}
+		}
+	}
+}
+
+/**
+ * Remove the least recently updated assets until the number of
+ * nodes in the address space is within the configured limit
+ */
+void OPCUAServer::enforceNodeLimit()
+{
+	while (m_maxNodes && m_nodeCount > m_maxNodes && m_lru.size() > 1)
+	{
+		string name = m_lru.back();
+		m_log->info("Node limit of %lu exceeded, removing least recently updated asset %s",
+				m_maxNodes, name.c_str());
+		removeAsset(name);
+	}
+}
+
+/**
+ * Set the status of all the variables of an asset to uncertain,
+ * the last value is retained.
+ *
+ * @param asset	The asset to mark
+ */
+void OPCUAServer::markStale(const AssetNode &asset)
+{
+	try
+	{
+		vector<WriteValue> writes;
+		for (auto &dp : asset.getDatapoints())
+		{
+			if (!dp.second.m_object)
+			{
+				markStale(dp.second, writes);
+			}
+		}
+		if (!writes.empty())
+		{
+			m_backend->write(writes);
+		}
+	}
+	catch (exception &e)
+	{
+		m_log->error("Failed to mark asset as stale: %s", e.what());
 	}
 }
 
 /**
- * Update the value of an asset we have seen previously
+ * Set the status of a variable to uncertain. The status is set at
+ * once in the value store and shared memory export, the write needed
+ * to set it in the address space is added to a list of writes.
  *
- * @param reading	The reading to update
+ * @param dp		The datapoint of the variable
+ * @param writes	The list of writes
  */
-void OPCUAServer::updateAsset(Reading *reading)
+void OPCUAServer::markStale(const DatapointNode &dp, vector<WriteValue> &writes)
 {
-	string assetName = reading->getAssetName();
+	m_shm.setStatus(dp.m_node, (uint32_t)StatusCode::UncertainLastUsableValue);
+	if (m_lazyValues && m_values.contains(dp.m_node)
+			&& !m_values.setStatus(dp.m_node, StatusCode::UncertainLastUsableValue))
+	{
+		return;
+	}
+	NodeId var = m_nodes.getNodeId(dp.m_node);
+	DataValue dv = m_backend->read(var);
+	dv.Status = StatusCode::UncertainLastUsableValue;
+	dv.Encoding |= DATA_VALUE_STATUS_CODE;
+	writes.push_back(WriteValue(var, AttributeId::Value, dv));
+}
 
-	m_log->debug("Update asset: %s (%u)", assetName.c_str(), reading->getDatapointCount());
+/**
+ * Remove an asset and all of the variables and objects created for
+ * it from the address space. Any parent objects that are left empty
+ * are also removed.
+ *
+ * @param assetName	The name of the asset to remove
+ */
+void OPCUAServer::removeAsset(const string &assetName)
+{
 	auto it = m_assets.find(assetName);
-	if (it != m_assets.end())
+	if (it == m_assets.end())
+	{
+		return;
+	}
+	AssetNode &asset = it->second;
+	vector<NodeId> nodes;
+	// Reverse order so that nested datapoints are removed before their parent
+	for (auto dp = asset.getDatapoints().rbegin(); dp != asset.getDatapoints().rend(); ++dp)
+	{
+		releaseDatapoint(dp->second, nodes);
+	}
+	if (asset.ownsObject())
+	{
+		nodes.push_back(m_nodes.getNodeId(asset.getObject()));
+	}
+	m_nodes.remove(asset.getObject());
+	try
+	{
+		deleteNodes(nodes);
+	}
+	catch (exception &e)
 	{
-		Node obj = it->second;
+		m_log->error("Failed to remove asset %s: %s", assetName.c_str(), e.what());
+	}
+	m_nodeCount -= (asset.m_nodes < m_nodeCount ? asset.m_nodes : m_nodeCount);
+	if (asset.m_lastSeen)
+	{
+		m_lru.erase(asset.m_lru);
+	}
+	string parent = asset.getParent();
+	m_assets.erase(it);
+	releaseParent(parent);
+}
 
-		vector<Datapoint *> &dataPoints = reading->getReadingData();
-		struct timeval userTS;
-		reading->getUserTimestamp(&userTS);
-		for (vector<Datapoint *>::iterator dpit = dataPoints.begin(); dpit != dataPoints.end(); ++dpit)
+/**
+ * Release everything held for the variable or object of a datapoint
+ * that is being removed and add its NodeId to the list of nodes to
+ * delete from the address space.
+ *
+ * @param dp		The datapoint being removed
+ * @param nodes		The list of nodes to delete
+ */
+void OPCUAServer::releaseDatapoint(const DatapointNode &dp, vector<NodeId> &nodes)
+{
+	nodes.push_back(m_nodes.getNodeId(dp.m_node));
+	m_historyStore.remove(dp.m_node, nodes.back());
+	m_nodes.remove(dp.m_node);
+	m_values.clear(dp.m_node);
+	m_shm.remove(dp.m_node);
+	m_history.remove(dp.m_node);
+	m_windows.erase(dp.m_node);
+	m_sampling.remove(dp.m_node);
+	m_unsupported.erase(dp.m_node);
+}
+
+/**
+ * Expire the datapoints of the assets whose datapoint window ended in
+ * the block just written. This is done after the block, rather than as
+ * each reading is written, as the converted readings of the block hold
+ * references to the datapoints of their asset.
+ *
+ * @param now		The time the block was received
+ */
+void OPCUAServer::expireDatapoints(time_t now)
+{
+	for (auto &name : m_windowsEnded)
+	{
+		auto it = m_assets.find(name);
+		if (it != m_assets.end())
 		{
-			// Get the reference to a DataPointValue
-			DatapointValue &value = (*dpit)->getData();
-			string name = (*dpit)->getName();
-			updateDatapoint(assetName, obj, name, value, userTS);
+			it->second.m_windowEnded = false;
+			expireDatapoints(it->second, name, now);
 		}
 	}
+	m_windowsEnded.clear();
 }
 
 /**
- * Update the datapoint for a given asset
+ * Expire the datapoints of an asset that have not been seen during the
+ * datapoint window and start a new window. A vanished datapoint is
+ * either removed, or the status of its variable is set to uncertain
+ * once until it is seen again. Datapoints nested within a vanished
+ * datapoint vanish with it. The variables of aggregates are written
+ * only at the end of each aggregate window, so they follow the
+ * datapoint they are calculated from.
  *
- * @param assetName The name of the asset being updated
- * @param obj	The parent object
- * @param name	The name of the variable to update
- * @param value	The value of the variable
- * @param userTS	The timestamp of the variable
+ * @param asset		The asset
+ * @param assetName	The name of the asset
+ * @param now		The time the block was received
  */
-void OPCUAServer::updateDatapoint(string &assetName, Node &obj, string &name, DatapointValue &value, struct timeval userTS)
+void OPCUAServer::expireDatapoints(AssetNode &asset, const string &assetName, time_t now)
 {
-	bool found = false;
-	vector<OpcUa::Node> variables = obj.GetVariables();
-	for (auto var : variables)
+	const map<string, DatapointNode> &datapoints = asset.getDatapoints();
+	vector<string> vanished;
+	unordered_map<NodeHandle, bool> sources;
+	for (auto &dp : datapoints)
 	{
-		OpcUa::QualifiedName qName = var.GetBrowseName();
-		if (qName.Name.compare(name) == 0)
+		bool seen = asset.isSeen(dp.second);
+		if (dp.second.isAggregate())
 		{
-			if (value.getType() == DatapointValue::T_INTEGER)
+			if (sources.empty())
 			{
-				DataValue dv = var.GetDataValue();
-				dv.Value = Variant(value.toInt());
-				dv.SourceTimestamp = DateTime::FromTimeT(userTS.tv_sec, userTS.tv_usec);
-				dv.Encoding |= DATA_VALUE_SOURCE_TIMESTAMP;
-				var.SetValue(dv);
+				for (auto &source : datapoints)
+				{
+					sources[source.second.m_node] = asset.isSeen(source.second);
+				}
 			}
-			else if (value.getType() == DatapointValue::T_FLOAT)
+			auto source = sources.find(dp.second.m_source);
+			seen = source != sources.end() && source->second;
+		}
+		if (!seen && (m_removeDatapoints || !asset.isFlagged(dp.second)))
+		{
+			vanished.push_back(dp.first);
+		}
+	}
+	asset.newWindow(now);
+	if (vanished.empty())
+	{
+		return;
+	}
+	if (m_removeDatapoints)
+	{
+		m_log->info("Removing %u datapoints of asset %s that have not been seen for %lu seconds",
+				(unsigned int)vanished.size(), assetName.c_str(), m_datapointWindow);
+		vector<NodeId> nodes;
+		// Reverse order so that nested datapoints are removed before their parent
+		for (auto path = vanished.rbegin(); path != vanished.rend(); ++path)
+		{
+			releaseDatapoint(*asset.findDatapoint(*path), nodes);
+			asset.removeDatapoint(*path);
+		}
+		try
+		{
+			deleteNodes(nodes);
+		}
+		catch (exception &e)
+		{
+			m_log->error("Failed to remove datapoints of asset %s: %s", assetName.c_str(), e.what());
+		}
+		unsigned long removed = vanished.size();
+		asset.m_nodes -= (removed < asset.m_nodes ? removed : asset.m_nodes);
+		m_nodeCount -= (removed < m_nodeCount ? removed : m_nodeCount);
+	}
+	else
+	{
+		m_log->info("Marking %u datapoints of asset %s that have not been seen for %lu seconds as stale",
+				(unsigned int)vanished.size(), assetName.c_str(), m_datapointWindow);
+		try
+		{
+			vector<WriteValue> writes;
+			for (auto &path : vanished)
 			{
-				DataValue dv = var.GetDataValue();
-				dv.Value = Variant(value.toDouble());
-				dv.SourceTimestamp = DateTime::FromTimeT(userTS.tv_sec, userTS.tv_usec);
-				dv.Encoding |= DATA_VALUE_SOURCE_TIMESTAMP;
-				var.SetValue(dv);
+				DatapointNode *dp = asset.findDatapoint(path);
+				asset.flag(*dp);
+				if (!dp->m_object)
+				{
+					markStale(*dp, writes);
+				}
 			}
-			else if (value.getType() == DatapointValue::T_STRING)
+			if (!writes.empty())
 			{
-				DataValue dv = var.GetDataValue();
-				dv.Value = Variant(value.toStringValue());
-				dv.SourceTimestamp = DateTime::FromTimeT(userTS.tv_sec, userTS.tv_usec);
-				dv.Encoding |= DATA_VALUE_SOURCE_TIMESTAMP;
-				var.SetValue(dv);
+				m_backend->write(writes);
 			}
-			else if (value.getType() == DatapointValue::T_DP_DICT)
-			{
-				vector<OpcUa::Node> childNodes = obj.GetChildren();
-				vector<Datapoint *> *children = value.getDpVec();
-				for (auto dpit = children->begin(); dpit != children->end(); dpit++)
-				{
-					name = (*dpit)->getName();
-					DatapointValue &val = (*dpit)->getData();
-					for (auto child : childNodes)
-					{
-						QualifiedName qName = child.GetBrowseName();
-						if (qName.Name.compare(name) == 0)
-						{
-							updateDatapoint(assetName, child, name, val, userTS);
-						}
-					}
-				}
-			} // TODO add support for arrays (T_DP_LIST)
-			found = true;
 		}
-	}
-	if (!found)
-	{
-		addDatapoint(assetName, obj, name, value, userTS);
+		catch (exception &e)
+		{
+			m_log->error("Failed to mark datapoints of asset %s as stale: %s", assetName.c_str(), e.what());
+		}
 	}
 }
 
 /**
- * Stop the OPCUA server
+ * Drop a reference to a parent object, removing the object and
+ * any of its ancestors that no longer have any children.
+ *
+ * @param key	The key of the parent in the index of parent nodes
  */
-void OPCUAServer::stop()
+void OPCUAServer::releaseParent(const string &key)
 {
-	if (m_server)
+	string current = key;
+
+	while (!current.empty())
 	{
-		m_server->Stop();
+		auto it = m_parents.find(current);
+		if (it == m_parents.end() || it->second.removeChild() > 0)
+		{
+			break;
+		}
+		m_log->debug("Removing empty object %s", current.c_str());
+		try
+		{
+			vector<NodeId> nodes;
+			nodes.push_back(m_nodes.getNodeId(it->second.getNode()));
+			deleteNodes(nodes);
+		}
+		catch (exception &e)
+		{
+			m_log->error("Failed to remove object %s: %s", current.c_str(), e.what());
+		}
+		m_nodes.remove(it->second.getNode());
+		if (m_nodeCount)
+		{
+			m_nodeCount--;
+		}
+		current = it->second.getParent();
+		m_parents.erase(it);
 	}
 }
 
-void OPCUAServer::registerControl(bool (*write)(const char *name, const char *value, ControlDestination destination, ...),
-								  int (*operation)(char *operation, int paramCount, char *parameters[], ControlDestination destination, ...))
+/**
+ * Store the value of a datapoint in the value store
+ *
+ * @param handle	The handle of the variable
+ * @param value		The datapoint value
+ * @param userTS	The timestamp of the value
+ * @return		True if the variable is being observed and must also be written to the server
+ */
+bool OPCUAServer::storeValue(NodeHandle handle, DatapointValue &value, struct timeval userTS)
 {
-	m_write = write;
+	int64_t ts = (int64_t)DateTime::FromTimeT(userTS.tv_sec, userTS.tv_usec);
+
+	switch (value.getType())
+	{
+		case DatapointValue::T_INTEGER:
+			return m_values.set(handle, (int64_t)value.toInt(), ts);
+		case DatapointValue::T_FLOAT:
+			return m_values.set(handle, value.toDouble(), ts);
+		case DatapointValue::T_STRING:
+			return m_values.set(handle, value.toStringValue(), ts);
+		default:
+			return true;
+	}
 }
 
 /**
- * Find the parent OPCUA node for this asset
+ * Update the value of a variable in the shared memory export
  *
- * @param reading	The reading we are sending
- * @return 		The OPCUA parent node
+ * @param handle	The handle of the variable
+ * @param value		The datapoint value
+ * @param userTS	The timestamp of the value
  */
-OpcUa::Node OPCUAServer::findParent(const Reading *reading)
+void OPCUAServer::exportValue(NodeHandle handle, DatapointValue &value, struct timeval userTS)
 {
-	OpcUa::Node opcNode = m_objects;
-	string key;
-	vector<Datapoint *> datapoints = reading->getReadingData();
-	std::stack<std::string> pathSegments;
+	int64_t ts = (int64_t)userTS.tv_sec * 1000000 + userTS.tv_usec;
 
-	if (m_parseAsset)
+	switch (value.getType())
 	{
-		ParsePath(pathSegments, reading->getAssetName(), '/');
+		case DatapointValue::T_INTEGER:
+			m_shm.set(handle, (int64_t)value.toInt(), ts);
+			break;
+		case DatapointValue::T_FLOAT:
+			m_shm.set(handle, value.toDouble(), ts);
+			break;
+		case DatapointValue::T_STRING:
+			m_shm.set(handle, value.toStringValue(), ts);
+			break;
+		default:
+			break;
 	}
+}
 
-	for (int i = 0; i < datapoints.size(); i++)
+/**
+ * Add the value of a numeric variable to its aggregate window. If the
+ * value starts a new window the aggregates of the completed window
+ * are published.
+ *
+ * @param asset		The asset the variable belongs to
+ * @param prefix	The path of the parent of the variable within the asset
+ * @param assetName	The name of the asset
+ * @param parent	The handle of the parent object of the variable
+ * @param name		The name of the variable
+ * @param handle	The handle of the variable
+ * @param value		The datapoint value
+ * @param userTS	The timestamp of the value
+ */
+void OPCUAServer::aggregateValue(AssetNode &asset, const string &prefix, string &assetName, NodeHandle parent,
+				string &name, NodeHandle handle, DatapointValue &value, struct timeval userTS)
+{
+	auto it = m_windows.find(handle);
+	if (it == m_windows.end())
 	{
-		string name = datapoints[i]->getName();
-		for (int j = 0; j < m_hierarchy.size(); j++)
-		{
-			if (m_hierarchy[j].getName().compare(name) == 0)
-			{
-				DatapointValue value = datapoints[i]->getData();
-				string svalue = value.toStringValue();
-
-				// If the first path segment from the Asset Name matches
-				// the last segment of the path, remove the duplicate.
-				if (!pathSegments.empty())
-				{
-					TrimTokenFromEndOfPath(pathSegments.top(), svalue, '/');
-				}
-
-				ParsePath(pathSegments, svalue, '/');
-				opcNode = createHierarchyFromPathSegments(pathSegments, opcNode, key);
-				return findParent(m_hierarchy[j].getChildren(), reading, opcNode, svalue);
-			}
-		}
+		return;
 	}
-
-	if (!pathSegments.empty())
+	double v;
+	if (value.getType() == DatapointValue::T_INTEGER)
+		v = (double)value.toInt();
+	else if (value.getType() == DatapointValue::T_FLOAT)
+		v = value.toDouble();
+	else
+		return;
+	if (userTS.tv_sec > asset.m_readingTime)
 	{
-		opcNode = createHierarchyFromPathSegments(pathSegments, opcNode, key);	
+		asset.m_readingTime = userTS.tv_sec;
+	}
+	if (it->second.add(userTS, v))
+	{
+		return;
+	}
+	// Publishing may add variables and windows, so work from a copy
+	AggregateWindow completed = it->second;
+	it->second.reset(userTS, v);
+	if (!publishAggregates(asset, prefix, assetName, parent, name, completed))
+	{
+		m_windows.erase(handle);
 	}
-
-	return opcNode;
 }
 
 /**
- * Find the parent OPCUA node for this asset
+ * Publish the aggregates of open windows that would otherwise never be
+ * completed. The window of a variable is only completed by the first
+ * value of the next window, so the last window of a variable that stops
+ * appearing, or of an asset that stops reporting, would never be
+ * published. Windows are aligned on the timestamps of the readings, so
+ * a window is flushed once a later reading of its asset is past the end
+ * of the window. An asset that stops reporting has no later readings,
+ * so its windows are also flushed once nothing has been received for
+ * the asset for the length of the window. This idle check is the only
+ * use of the time the readings were received.
  *
- * @param hierarchy	The definition for the current level of the hierarchy
- * @param reading	The reading we are sending
- * @param root		The current root for the point in the hierarchy we are at
- * @param key		The key to use to lookup the cache of OPCUA nodes
- * @return 		The OPCUA parent node
+ * @param now	The current time
  */
-OpcUa::Node OPCUAServer::findParent(const vector<NodeTree> &hierarchy, const Reading *reading, OpcUa::Node &root, string key)
+void OPCUAServer::flushAggregates(time_t now)
 {
-	OpcUa::Node opcNode = root;
-	std::stack<std::string> pathSegments;
-
-	if (m_parseAsset)
+	if (m_windows.empty())
 	{
-		ParsePath(pathSegments, reading->getAssetName(), '/');
+		return;
 	}
-
-	vector<Datapoint *> datapoints = reading->getReadingData();
-	for (int i = 0; i < datapoints.size(); i++)
+	vector<string> expired;
+	m_aggregateWheel.expire(now, expired);
+	for (auto &assetName : expired)
 	{
-		string name = datapoints[i]->getName();
-		for (int j = 0; j < hierarchy.size(); j++)
+		auto it = m_assets.find(assetName);
+		if (it == m_assets.end())
 		{
-			if (hierarchy[j].getName().compare(name) == 0)
+			continue;
+		}
+		AssetNode &asset = it->second;
+		asset.m_aggregatesScheduled = false;
+		// Publishing may add datapoints to the asset, so find the due windows first
+		vector<pair<string, NodeHandle> > due;
+		time_t next = 0;
+		for (auto &dp : asset.getDatapoints())
+		{
+			auto window = m_windows.find(dp.second.m_node);
+			if (dp.second.m_object || window == m_windows.end() || !window->second.isOpen())
 			{
-				DatapointValue value = datapoints[i]->getData();
-				string svalue = value.toStringValue();
-				string newkey = StringSlashFix(key);
-
-				// If the first path segment from the Asset Name matches
-				// the last segment of the path, remove the duplicate.
-				if (!pathSegments.empty())
+				continue;
+			}
+			time_t idle = asset.m_lastSeen + window->second.getRule()->getWindow();
+			if (asset.m_readingTime >= window->second.getEnd() || now >= idle)
+				due.push_back(pair<string, NodeHandle>(dp.first, dp.second.m_node));
+			else if (!next || idle < next)
+				next = idle;
+		}
+		for (auto &d : due)
+		{
+			auto window = m_windows.find(d.second);
+			AggregateWindow completed = window->second;
+			window->second.clear();
+			size_t dot = d.first.rfind('.');
+			string prefix = (dot == string::npos) ? "" : d.first.substr(0, dot + 1);
+			string name = d.first.substr(prefix.length());
+			NodeHandle parent = asset.getObject();
+			if (!prefix.empty())
+			{
+				DatapointNode *object = asset.findDatapoint(d.first.substr(0, dot));
+				if (!object)
 				{
-					TrimTokenFromEndOfPath(pathSegments.top(), svalue, '/');
+					continue;
 				}
-
-				ParsePath(pathSegments, svalue, '/');
-				opcNode = createHierarchyFromPathSegments(pathSegments, opcNode, newkey);
-				return findParent(hierarchy[j].getChildren(), reading, opcNode, svalue);
+				parent = object->m_node;
+			}
+			if (!publishAggregates(asset, prefix, assetName, parent, name, completed))
+			{
+				m_windows.erase(d.second);
 			}
 		}
+		if (next)
+		{
+			m_aggregateWheel.schedule(assetName, next);
+			asset.m_aggregatesScheduled = true;
+		}
 	}
-
-	return opcNode;
+	flushNodes();
+	flushWrites();
 }
 
 /**
- * Create an OPC UA Address Space hierarchy from a collection of path segments
+ * Publish the aggregates of a completed window as sibling variables
+ * of the source variable, named by appending the aggregate function
+ * to the name of the variable. The aggregates are timestamped with
+ * the start of the window. If the name of an aggregate variable is
+ * already used by a datapoint of the asset the aggregates of the
+ * variable are rejected rather than overwriting the datapoint.
  *
- * @param pathSegments	Stack object containing path segments
- * @param root			OPC UA Node under which to add child Nodes
- * @param key			Key to lookup an OPC UA Node in the index of Nodes
- * @return				OPC UA Node representing the leaf node of the created hierarchy
+ * @param asset		The asset the variable belongs to
+ * @param prefix	The path of the parent of the variable within the asset
+ * @param assetName	The name of the asset
+ * @param parent	The handle of the parent object of the variable
+ * @param name		The name of the source variable
+ * @param window	The completed window
+ * @return		False if the aggregates collide with a datapoint and have been rejected
  */
-OpcUa::Node OPCUAServer::createHierarchyFromPathSegments(std::stack<std::string> &pathSegments, const OpcUa::Node &root, std::string &key)
+bool OPCUAServer::publishAggregates(AssetNode &asset, const string &prefix, string &assetName, NodeHandle parent,
+				const string &name, const AggregateWindow &window)
 {
-	OpcUa::Node opcNode = root;
+	struct timeval ts;
+	ts.tv_sec = window.getStart();
+	ts.tv_usec = 0;
+	unsigned int functions = window.getRule()->getFunctions();
 
-	while (!pathSegments.empty())
+	for (unsigned int f = AggregateRule::Minimum; f <= AggregateRule::Last; f <<= 1)
 	{
-		string pathSegment = pathSegments.top();
-
-		if (key.empty())
+		if ((functions & f) == 0)
 		{
-			key.append(pathSegment);
+			continue;
 		}
-		else
+		string path = prefix + name + "_" + AggregateRules::functionName((AggregateRule::Function)f);
+		DatapointNode *dp = asset.findDatapoint(path);
+		if (dp && !dp->isAggregate())
 		{
-			key.append("/");
-			key.append(pathSegment);
+			m_log->error("The aggregates of asset %s datapoint %s%s will not be published, %s is also a datapoint of the asset",
+					assetName.c_str(), prefix.c_str(), name.c_str(), path.c_str());
+			return false;
 		}
+	}
 
-		auto it = m_parents.find(key);
-		if (it != m_parents.end())
+	DatapointNode *source = asset.findDatapoint(prefix + name);
+	if (!source)
+	{
+		return true;
+	}
+	m_aggregateSource = source->m_node;
+	for (unsigned int f = AggregateRule::Minimum; f <= AggregateRule::Last; f <<= 1)
+	{
+		if ((functions & f) == 0)
 		{
-			opcNode = it->second;
+			continue;
 		}
-		else
+		string variable = name + "_" + AggregateRules::functionName((AggregateRule::Function)f);
+		if (f == AggregateRule::Count)
 		{
-			NodeId parentId = opcNode.GetId();
-			NodeId nodeId(key, m_idx);
-			QualifiedName qn(pathSegment, m_idx);
-			opcNode = opcNode.AddObject(nodeId, qn);
-			m_parents.insert(pair<string, Node>(key, opcNode));
-			m_log->debug("Asset added: %s (NodeId: %s ParentId: %s)",
-						 pathSegment.c_str(),
-						 NodeIdString(opcNode.GetId()).c_str(),
-						 NodeIdString(parentId).c_str());
+			DatapointValue count((long)window.getCount());
+			updateDatapoint(asset, prefix, assetName, parent, variable, count, ts);
+			continue;
+		}
+		double result;
+		if (f == AggregateRule::Minimum)
+			result = window.getMinimum();
+		else if (f == AggregateRule::Maximum)
+			result = window.getMaximum();
+		else if (f == AggregateRule::Mean)
+			result = window.getMean();
+		else
+			result = window.getLast();
+		DatapointValue aggregate(result);
+		updateDatapoint(asset, prefix, assetName, parent, variable, aggregate, ts);
+	}
+	m_aggregateSource = INVALID_NODE_HANDLE;
+	return true;
+}
+
+/**
+ * Append the value of a numeric variable to its history
+ *
+ * @param handle	The handle of the variable
+ * @param value		The datapoint value
+ * @param userTS	The timestamp of the value
+ */
+void OPCUAServer::historyValue(NodeHandle handle, DatapointValue &value, struct timeval userTS)
+{
+	if (value.getType() == DatapointValue::T_INTEGER || value.getType() == DatapointValue::T_FLOAT)
+	{
+		int64_t timestamp = (int64_t)DateTime::FromTimeT(userTS.tv_sec, userTS.tv_usec);
+		double v = value.getType() == DatapointValue::T_INTEGER ? (double)value.toInt() : value.toDouble();
+		m_history.append(handle, timestamp, v);
+		m_historyStore.append(handle, timestamp, v);
+	}
+}
+
+/**
+ * Register a callback with the server so that reads of the value
+ * of a variable are served from the value store
+ *
+ * @param handle	The handle of the variable
+ */
+void OPCUAServer::registerValueCallback(NodeHandle handle)
+{
+	ValueStore *values = &m_values;
+	m_backend->setReadHandler(m_nodes.getNodeId(handle),
+			[values, handle]() { return values->read(handle); },
+			[values, handle]() { values->release(handle); });
+}
+
+/**
+ * Delete a set of nodes from the address space
+ *
+ * @param nodes	The ids of the nodes to delete
+ */
+void OPCUAServer::deleteNodes(const vector<NodeId> &nodes)
+{
+	if (nodes.empty())
+	{
+		return;
+	}
+	vector<StatusCode> results = m_backend->deleteNodes(nodes);
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		if (results[i] != StatusCode::Good)
+		{
+			m_log->warn("Failed to delete node %s, status 0x%08x",
+					NodeIdString(nodes[i]).c_str(), (unsigned int)results[i]);
 		}
-		
-		pathSegments.pop();
 	}
-
-	return opcNode;
 }
 
 /**
@@ -798,84 +2664,413 @@ void OPCUAServer::addControlNode(const string &name, const string &type, Control
  */
 void OPCUAServer::createControlNodes()
 {
-	m_subscriptionClient.registerServer(this);
-	m_subscription = m_server->CreateSubscription(100, m_subscriptionClient);
-	Node objects = m_server->GetObjectsNode();
-	NodeId nid(99, m_idx);
+	NodeId parent(99, m_idx);
 	QualifiedName qn(m_controlRoot, m_idx);
-	Node parent = objects.AddObject(nid, qn);
+	m_batch.addObject(m_backend->objectsFolder(), parent, qn);
+	for (auto &n : m_control)
+	{
+		n.createNode(m_idx, parent, m_batch);
+	}
+	m_batch.flush();
+	shared_ptr<map<NodeId, ControlNode> > index = make_shared<map<NodeId, ControlNode> >();
+	vector<NodeId> nodes;
 	for (auto &n : m_control)
 	{
-		n.createNode(m_idx, parent);
-		m_subscription->SubscribeDataChange(n.getNode());
+		if (n.getNode() != INVALID_NODE_HANDLE)
+		{
+			NodeId nodeId = m_nodes.getNodeId(n.getNode());
+			index->insert(pair<NodeId, ControlNode>(nodeId, n));
+			nodes.push_back(nodeId);
+		}
+	}
+	// The index is published before subscribing as writes are reported on a thread of the backend
+	m_controlIndex.publish(index);
+	m_backend->subscribeWrites(nodes, [this](const NodeId &node, const Variant &value) {
+		nodeChange(node, value);
+	});
+	if (!m_methods.empty())
+	{
+		createControlMethods(parent);
 	}
 }
 
 /**
- * One of our nodes has changed value. Find the corresponding
- * ControlNode entry and set the set point operation.
+ * Add the control methods to the control object and start the threads
+ * that run the operations they request
  *
- * @param node	The node that has changed
- * @param value	The new value of the node
+ * @param parent	The NodeId of the control object
  */
-void OPCUAServer::nodeChange(const Node &node, const string &value)
+void OPCUAServer::createControlMethods(const NodeId &parent)
 {
-	if (!m_write)
+	m_dispatcher.start(m_methodThreads, m_methodConcurrency);
+	for (auto &method : m_methods)
 	{
-		m_log->error("Node change has occurred but we have no callback registered for the service");
+		ControlMethod m = method;
+		NodeId methodId;
+		if (!m_backend->addMethod(parent, m_idx, m.m_name,
+				[this, m](const vector<Variant> &arguments) {
+					return callMethod(m, arguments);
+				}, methodId))
+		{
+			m_log->warn("The %s backend does not support methods, the control methods will not be created",
+					m_backend->name());
+			m_dispatcher.stop();
+			return;
+		}
+		m_nodes.add(methodId);
+	}
+}
+
+/**
+ * Create the methods that allow clients to read the history of variables.
+ * The freeopcua server does not implement the HistoryRead service so
+ * the history is made available via method calls instead.
+ */
+void OPCUAServer::createHistoryMethods()
+{
+	HistoryBuffer *history = &m_history;
+	HistoryStore *store = &m_historyStore;
+	NodeId parent(98, m_idx);
+	QualifiedName qn("History", m_idx);
+	m_batch.addObject(m_backend->objectsFolder(), parent, qn);
+	m_batch.flush();
+	NodeId readRaw, readProcessed;
+	bool added = m_backend->addMethod(parent, m_idx, "ReadRaw",
+		[history, store](const vector<Variant> &arguments) {
+			return HistoryReadRaw(history, store, arguments);
+		}, readRaw);
+	added = added && m_backend->addMethod(parent, m_idx, "ReadProcessed",
+		[history, store](const vector<Variant> &arguments) {
+			return HistoryReadProcessed(history, store, arguments);
+		}, readProcessed);
+	if (!added)
+	{
+		m_log->warn("The %s backend does not support methods, the history can not be read by clients",
+				m_backend->name());
 		return;
 	}
-	for (auto &n : m_control)
+	// Record the methods so that they are removed with the other nodes of the instance
+	m_nodes.add(readRaw);
+	m_nodes.add(readProcessed);
+}
+
+/**
+ * Create the objects that publish the latency metrics. There is an
+ * object for each group of assets within an object called Latency in
+ * the Objects folder.
+ */
+void OPCUAServer::createLatencyNodes()
+{
+	static const char *names[] = { "Count", "MeanMs", "P50Ms", "P95Ms", "P99Ms", "MaxMs" };
+	NodeId parent(97, m_idx);
+	QualifiedName qn("Latency", m_idx);
+	m_batch.addObject(m_backend->objectsFolder(), parent, qn);
+	m_latencyNodes.clear();
+	for (size_t group = 0; group < m_latency.groups(); group++)
 	{
-		if (n.getNode() == node)
+		const string &name = m_latency.groupName(group);
+		NodeId obj("Latency_" + name, m_idx);
+		m_batch.addObject(parent, obj, QualifiedName(name, m_idx));
+		for (auto source : { "Source", "Ingest" })
 		{
-			ControlDestination dest = n.getDestination();
-			if (dest != DestinationBroadcast)
+			for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
 			{
-				const string arg = n.getArgument();
-				(*m_write)(n.getName().c_str(), value.c_str(), dest, arg.c_str());
+				string variable = string(source) + names[i];
+				Variant initial = (i == 0) ? Variant((uint64_t)0) : Variant(0.0);
+				m_latencyNodes.push_back(m_batch.addVariable(obj, m_idx, variable, initial, false));
 			}
-			else
+		}
+	}
+	m_batch.flush();
+}
+
+/**
+ * Write the latency summaries of the last interval to the latency objects
+ */
+void OPCUAServer::publishLatency()
+{
+	if (m_latencyNodes.empty())
+	{
+		return;
+	}
+	try
+	{
+		vector<WriteValue> writes;
+		size_t i = 0;
+		for (size_t group = 0; group < m_latency.groups(); group++)
+		{
+			for (auto latency : { &m_latency.sourceLatency(group), &m_latency.ingestLatency(group) })
 			{
-				(*m_write)(n.getName().c_str(), value.c_str(), DestinationBroadcast, NULL);
+				Variant values[] = { Variant((uint64_t)latency->m_count), Variant(latency->m_mean),
+						Variant(latency->m_p50), Variant(latency->m_p95),
+						Variant(latency->m_p99), Variant(latency->m_max) };
+				for (auto &value : values)
+				{
+					writes.push_back(WriteValue(m_nodes.getNodeId(m_latencyNodes[i++]),
+								AttributeId::Value, DataValue(value)));
+				}
 			}
-			return;
 		}
+		m_backend->write(writes);
+	}
+	catch (exception &e)
+	{
+		m_log->error("Failed to publish latency metrics, %s", e.what());
 	}
-	m_log->warn("Failed to find control node");
 }
 
 /**
- * Create the control node
+ * Publish a block of readings from the statistics source when the
+ * statistics fast path is enabled. Statistics
+ * are a small, fixed set of cumulative counters, so the asset table and
+ * the per datapoint processing of readings are bypassed. Each statistic
+ * is an object holding a variable for each of its counters and, if
+ * enabled, a variable with the rate of change of the counter per second.
+ * The nodes of any new statistics are added as a single batch and the
+ * values of all of the counters in the block are written with a single
+ * call to the backend.
  *
- * @param idx		The namespace index
- * @param parent	The parent node
+ * @param readings	The block of readings
  */
-void OPCUAServer::ControlNode::createNode(uint32_t idx, Node &parent)
+void OPCUAServer::publishStatistics(const vector<Reading *> &readings)
 {
-	if (m_type.compare("integer") == 0)
-		m_node = parent.AddVariable(idx, m_name, Variant(32));
-	if (m_type.compare("float") == 0)
-		m_node = parent.AddVariable(idx, m_name, Variant(32.8));
+	TraceSpan span(m_trace, "publishStatistics");
+	vector<StatisticNode *> statistics(readings.size(), NULL);
+	size_t first = 0;
+	for (size_t i = 0; i < readings.size(); i++)
+	{
+		auto it = m_statistics.find(readings[i]->getAssetName());
+		StatisticNode *statistic = (it == m_statistics.end()) ? NULL : &it->second;
+		if (!statistic || !statistic->matches(readings[i]))
+		{
+			if (statistic)
+			{
+				// The layout is about to change, write the earlier readings with the old one
+				writeStatistics(readings, statistics, first, i);
+				first = i;
+			}
+			statistic = addStatistic(readings[i], statistic);
+		}
+		statistics[i] = statistic;
+	}
+	writeStatistics(readings, statistics, first, readings.size());
+}
+
+/**
+ * Add any new statistic nodes and write the values of a range of the
+ * readings of a block of statistics
+ *
+ * @param readings	The block of readings
+ * @param statistics	The statistic of each reading in the block
+ * @param first		The index of the first reading to write
+ * @param last		The index after the last reading to write
+ */
+void OPCUAServer::writeStatistics(const vector<Reading *> &readings,
+		const vector<StatisticNode *> &statistics, size_t first, size_t last)
+{
+	try
+	{
+		m_batch.flush();
+	}
+	catch (exception &e)
+	{
+		m_log->error("Failed to add statistics: %s", e.what());
+	}
+
+	for (size_t i = first; i < last; i++)
+	{
+		if (!statistics[i])
+		{
+			continue;
+		}
+		struct timeval userTS;
+		readings[i]->getUserTimestamp(&userTS);
+		DateTime sourceTime = DateTime::FromTimeT(userTS.tv_sec, userTS.tv_usec);
+		vector<Datapoint *> &dataPoints = readings[i]->getReadingData();
+		const vector<int> &layout = statistics[i]->m_layout;
+		for (size_t j = 0; j < dataPoints.size() && j < layout.size(); j++)
+		{
+			if (layout[j] >= 0)
+			{
+				writeStatistic(statistics[i]->m_counters[layout[j]], dataPoints[j]->getData(),
+						userTS, sourceTime);
+			}
+		}
+	}
+	flushWrites();
+}
+
+/**
+ * Create the nodes of the configured statistics when the server starts,
+ * so that clients can browse and subscribe to them before the first
+ * block of statistics is sent. Each statistic is given a counter for
+ * the value datapoint that Fledge sends for every statistic.
+ */
+void OPCUAServer::createStatisticNodes()
+{
+	m_statistics.clear();
+	try
+	{
+		for (auto &key : m_statisticKeys)
+		{
+			NodeId obj(key, m_idx);
+			NodeHandle handle = m_batch.addObject(m_objects, obj, QualifiedName(key, m_idx));
+			StatisticNode *statistic = &m_statistics.insert(pair<string, StatisticNode>(key,
+						StatisticNode(handle))).first->second;
+			addStatisticCounter(statistic, obj, "value", Variant((int64_t)0));
+		}
+		m_batch.flush();
+	}
+	catch (exception &e)
+	{
+		m_log->error("Failed to create the statistics: %s", e.what());
+	}
+}
+
+/**
+ * Add the nodes of a statistic, or of counters that have not been seen
+ * before, to the batch of nodes. Datapoints that are not numeric are
+ * ignored.
+ *
+ * @param reading	The reading of the statistic
+ * @param statistic	The statistic, NULL if it is new
+ * @return		The statistic, NULL if it could not be added
+ */
+OPCUAServer::StatisticNode *OPCUAServer::addStatistic(Reading *reading, StatisticNode *statistic)
+{
+	string key = reading->getAssetName();
+	try
+	{
+		NodeId obj(key, m_idx);
+		if (!statistic)
+		{
+			NodeHandle handle = m_batch.addObject(m_objects, obj, QualifiedName(key, m_idx));
+			statistic = &m_statistics.insert(pair<string, StatisticNode>(key, StatisticNode(handle))).first->second;
+		}
+		vector<Datapoint *> &dataPoints = reading->getReadingData();
+		for (auto dp : dataPoints)
+		{
+			string name = dp->getName();
+			DatapointValue &value = dp->getData();
+			if (value.getType() != DatapointValue::T_INTEGER && value.getType() != DatapointValue::T_FLOAT)
+			{
+				continue;
+			}
+			bool found = false;
+			for (auto &counter : statistic->m_counters)
+			{
+				if (counter.m_name.compare(name) == 0)
+					found = true;
+			}
+			if (found)
+			{
+				continue;
+			}
+			Variant initial = value.getType() == DatapointValue::T_INTEGER ?
+					Variant((int64_t)value.toInt()) : Variant(value.toDouble());
+			addStatisticCounter(statistic, obj, name, initial);
+		}
+		statistic->layout(reading);
+	}
+	catch (exception &e)
+	{
+		m_log->error("Failed to add statistic %s: %s", key.c_str(), e.what());
+	}
+	return statistic;
+}
+
+/**
+ * Add the variable of a statistic counter and, if rates are enabled,
+ * the variable of its rate to the batch of nodes
+ *
+ * @param statistic	The statistic
+ * @param obj		The NodeId of the object of the statistic
+ * @param name		The name of the counter
+ * @param initial	The initial value of the counter
+ */
+void OPCUAServer::addStatisticCounter(StatisticNode *statistic, const NodeId &obj,
+				const string &name, const Variant &initial)
+{
+	NodeHandle variable = m_batch.addVariable(obj, m_idx, name, initial, false);
+	NodeHandle rate = INVALID_NODE_HANDLE;
+	if (m_statisticsRates)
+	{
+		rate = m_batch.addVariable(obj, m_idx, name + "_rate", Variant(0.0), false);
+	}
+	statistic->m_counters.push_back(StatisticCounter(name, variable, rate));
+}
+
+/**
+ * Queue the write of the value of a statistic counter and, if rates are
+ * enabled, of its rate of change since the previous value. No rate is
+ * written for the first value or if the counter has gone backwards, as
+ * it does when Fledge is restarted.
+ *
+ * @param counter	The counter
+ * @param value		The value of the counter
+ * @param userTS	The timestamp of the value
+ * @param sourceTime	The timestamp of the value as an OPC UA DateTime
+ */
+void OPCUAServer::writeStatistic(StatisticCounter &counter, DatapointValue &value,
+				struct timeval userTS, const DateTime &sourceTime)
+{
+	double current;
+	Variant variant;
+	if (value.getType() == DatapointValue::T_INTEGER)
+	{
+		current = (double)value.toInt();
+		variant = Variant((int64_t)value.toInt());
+	}
+	else if (value.getType() == DatapointValue::T_FLOAT)
+	{
+		current = value.toDouble();
+		variant = Variant(current);
+	}
+	else
+	{
+		return;
+	}
+	DataValue dv(variant);
+	dv.Status = StatusCode::Good;
+	dv.SourceTimestamp = sourceTime;
+	dv.Encoding |= DATA_VALUE_STATUS_CODE | DATA_VALUE_SOURCE_TIMESTAMP;
+	m_writes.push_back(WriteValue(m_nodes.getNodeId(counter.m_value), AttributeId::Value, dv));
+
+	if (counter.m_rate == INVALID_NODE_HANDLE)
+	{
+		return;
+	}
+	double now = (double)userTS.tv_sec + (double)userTS.tv_usec / 1000000.0;
+	if (counter.m_primed && now <= counter.m_lastTime)
+	{
+		return;
+	}
+	if (counter.m_primed && current >= counter.m_last)
+	{
+		DataValue rate(Variant((current - counter.m_last) / (now - counter.m_lastTime)));
+		rate.Status = StatusCode::Good;
+		rate.SourceTimestamp = sourceTime;
+		rate.Encoding |= DATA_VALUE_STATUS_CODE | DATA_VALUE_SOURCE_TIMESTAMP;
+		m_writes.push_back(WriteValue(m_nodes.getNodeId(counter.m_rate), AttributeId::Value, rate));
+	}
+	counter.m_last = current;
+	counter.m_lastTime = now;
+	counter.m_primed = true;
 }
 
 /**
- * Subscription Client handler for data change events
+ * Convert the value written to a control node to the string passed to
+ * the control write operation
  *
- * @param handle
- * @param node		The node that has changed
  * @param val		The value the node is being assigned
- * @param attr		The Attribute ID
+ * @return		The value as a string, empty if the value is null
  */
-void SubClient::DataChange(uint32_t handle,
-						   const OpcUa::Node &node,
-						   const OpcUa::Variant &val,
-						   OpcUa::AttributeId attr)
+static string VariantToString(const OpcUa::Variant &val)
 {
 	string value;
 
 	if (val.IsNul())
-		return;
+		return value;
 	if (val.IsScalar())
 	{
 		switch (val.Type())
@@ -977,5 +3172,229 @@ void SubClient::DataChange(uint32_t handle,
 		}
 		}
 	}
-	m_server->nodeChange(node, value);
+	return value;
+}
+
+/**
+ * Return the destination of a control operation as a string, used to
+ * limit the operations in progress for each destination
+ *
+ * @param destination	The type of the destination
+ * @param arg		The service, asset or script
+ * @return		The destination
+ */
+static string DestinationKey(ControlDestination destination, const string &arg)
+{
+	switch (destination)
+	{
+		case DestinationService:
+			return "service " + arg;
+		case DestinationAsset:
+			return "asset " + arg;
+		case DestinationScript:
+			return "script " + arg;
+		default:
+			return "broadcast";
+	}
+}
+
+/**
+ * Implementation of a control method. The input arguments are converted
+ * to strings and passed as the parameters of the control operation,
+ * which is run by the dispatcher.
+ *
+ * This is called on a thread of the backend. It waits for at most the
+ * timeout of the method, the operation continuing in the dispatcher if
+ * it takes longer.
+ *
+ * @param method	The method called
+ * @param arguments	The input arguments of the method
+ * @return		The output arguments, the outcome of the call and the value returned by the operation
+ */
+vector<Variant> OPCUAServer::callMethod(const ControlMethod &method, const vector<Variant> &arguments)
+{
+	vector<Variant> result;
+	TraceSpan span(Tracer::isEnabled(), "controlMethod", method.m_name.c_str());
+	ControlOperation operation = m_operation.load();
+	if (!operation)
+	{
+		m_log->error("Method %s called but we have no control operation callback registered", method.m_name.c_str());
+		result.push_back(Variant(string("Unavailable")));
+		result.push_back(Variant((int32_t)0));
+		return result;
+	}
+	if (arguments.size() != method.m_parameters.size())
+	{
+		m_log->warn("Method %s called with %u arguments, %u are expected", method.m_name.c_str(),
+				(unsigned int)arguments.size(), (unsigned int)method.m_parameters.size());
+		result.push_back(Variant(string("InvalidArguments")));
+		result.push_back(Variant((int32_t)0));
+		return result;
+	}
+	vector<string> values;
+	for (auto &argument : arguments)
+	{
+		values.push_back(VariantToString(argument));
+	}
+
+	// Everything the operation uses is copied as it may outlive this call
+	string name = method.m_operation;
+	ControlDestination destination = method.m_destination;
+	string arg = method.m_arg;
+	int rval = 0;
+	ControlDispatcher::Outcome outcome = m_dispatcher.call(DestinationKey(destination, arg),
+		[operation, name, values, destination, arg]() {
+			TraceSpan span(Tracer::isEnabled(), "controlOperation", name.c_str());
+			vector<char *> parameters;
+			for (auto &v : values)
+			{
+				parameters.push_back((char *)v.c_str());
+			}
+			if (destination == DestinationBroadcast)
+			{
+				return (*operation)((char *)name.c_str(), (int)parameters.size(), parameters.data(),
+						destination, NULL);
+			}
+			return (*operation)((char *)name.c_str(), (int)parameters.size(), parameters.data(),
+					destination, arg.c_str());
+		}, method.m_timeout, rval);
+	switch (outcome)
+	{
+		case ControlDispatcher::Completed:
+			result.push_back(Variant(string("Completed")));
+			break;
+		case ControlDispatcher::Rejected:
+			result.push_back(Variant(string("Busy")));
+			break;
+		case ControlDispatcher::TimedOut:
+			result.push_back(Variant(string("Timeout")));
+			break;
+	}
+	result.push_back(Variant((int32_t)rval));
+	return result;
+}
+
+/**
+ * One of our nodes has changed value. Find the corresponding
+ * ControlNode entry and set the set point operation.
+ *
+ * This is called on a thread of the backend so uses only the snapshot
+ * of the control nodes, not the node table that the north thread is
+ * modifying.
+ *
+ * @param node	The node that has changed
+ * @param value	The new value of the node
+ */
+void OPCUAServer::nodeChange(const NodeId &node, const Variant &val)
+{
+	string value = VariantToString(val);
+	if (value.empty())
+	{
+		return;
+	}
+	ControlWrite write = m_write.load();
+	if (!write)
+	{
+		m_log->error("Node change has occurred but we have no callback registered for the service");
+		return;
+	}
+	shared_ptr<const map<NodeId, ControlNode> > index = m_controlIndex.get();
+	if (!index)
+	{
+		m_log->warn("Failed to find control node");
+		return;
+	}
+	auto it = index->find(node);
+	if (it == index->end())
+	{
+		m_log->warn("Failed to find control node");
+		return;
+	}
+	const ControlNode &n = it->second;
+	TraceSpan span(Tracer::isEnabled(), "controlWrite", n.getName().c_str());
+	ControlDestination dest = n.getDestination();
+	if (dest != DestinationBroadcast)
+	{
+		const string arg = n.getArgument();
+		(*write)(n.getName().c_str(), value.c_str(), dest, arg.c_str());
+	}
+	else
+	{
+		(*write)(n.getName().c_str(), value.c_str(), DestinationBroadcast, NULL);
+	}
+}
+
+/**
+ * Check if a reading has the shape the layout of the statistic was
+ * built from, i.e. the same datapoints in the same positions with the
+ * same numeric or non-numeric types
+ *
+ * @param reading	The reading of the statistic
+ * @return		True if the layout can be used to write the reading
+ */
+bool OPCUAServer::StatisticNode::matches(Reading *reading) const
+{
+	vector<Datapoint *> &dataPoints = reading->getReadingData();
+	if (dataPoints.size() != m_layout.size())
+	{
+		return false;
+	}
+	for (size_t i = 0; i < dataPoints.size(); i++)
+	{
+		DatapointValue::DatapointTag type = dataPoints[i]->getData().getType();
+		bool numeric = type == DatapointValue::T_INTEGER || type == DatapointValue::T_FLOAT;
+		if (m_layout[i] < 0)
+		{
+			if (numeric)
+				return false;
+		}
+		else if (!numeric || m_counters[m_layout[i]].m_name.compare(dataPoints[i]->getName()) != 0)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Build the layout of the statistic from the shape of a reading
+ *
+ * @param reading	The reading of the statistic
+ */
+void OPCUAServer::StatisticNode::layout(Reading *reading)
+{
+	vector<Datapoint *> &dataPoints = reading->getReadingData();
+	m_layout.assign(dataPoints.size(), -1);
+	for (size_t i = 0; i < dataPoints.size(); i++)
+	{
+		DatapointValue::DatapointTag type = dataPoints[i]->getData().getType();
+		if (type != DatapointValue::T_INTEGER && type != DatapointValue::T_FLOAT)
+		{
+			continue;
+		}
+		const string &name = dataPoints[i]->getName();
+		for (size_t j = 0; j < m_counters.size(); j++)
+		{
+			if (m_counters[j].m_name.compare(name) == 0)
+			{
+				m_layout[i] = j;
+				break;
+			}
+		}
+	}
+}
+
+/**
+ * Create the control node
+ *
+ * @param idx		The namespace index
+ * @param parent	The NodeId of the parent object
+ * @param batch		The batch to which the node is added
+ */
+void OPCUAServer::ControlNode::createNode(uint16_t idx, const NodeId &parent, NodeBatch &batch)
+{
+	if (m_type.compare("integer") == 0)
+		m_node = batch.addVariable(parent, idx, m_name, Variant(32), true);
+	if (m_type.compare("float") == 0)
+		m_node = batch.addVariable(parent, idx, m_name, Variant(32.8), true);
 }
@@ -0,0 +1,34 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <opcua_backend.h>
+#include <freeopcua_backend.h>
+#include <open62541_backend.h>
+
+using namespace std;
+
+/**
+ * Create a backend
+ *
+ * @param name	The name of the backend, freeopcua or open62541
+ * @return	The backend or NULL if the backend is not available
+ */
+OPCUABackend *OPCUABackend::create(const string& name)
+{
+	if (name.compare("freeopcua") == 0)
+	{
+		return new FreeOpcUaBackend();
+	}
+#ifdef HAVE_OPEN62541
+	if (name.compare("open62541") == 0)
+	{
+		return new Open62541Backend();
+	}
+#endif
+	return NULL;
+}
@@ -0,0 +1,621 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#ifdef HAVE_OPEN62541
+#include <open62541_backend.h>
+#include <open62541/server.h>
+#include <open62541/server_config_default.h>
+#include <logger.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+
+using namespace std;
+using namespace OpcUa;
+
+// The longest time in milliseconds the server thread waits between iterations
+#define ITERATE_WAIT	5
+
+/**
+ * A UA_NodeId converted from a NodeId, cleared when it goes out of scope
+ */
+class UANodeId {
+	public:
+		UANodeId(const NodeId& id)
+		{
+			if (id.IsInteger())
+			{
+				m_id = UA_NODEID_NUMERIC(id.GetNamespaceIndex(), id.GetIntegerIdentifier());
+			}
+			else if (id.IsString())
+			{
+				m_id = UA_NODEID_STRING_ALLOC(id.GetNamespaceIndex(), id.GetStringIdentifier().c_str());
+			}
+			else
+			{
+				UA_NodeId_init(&m_id);
+			}
+		};
+		~UANodeId() { UA_NodeId_clear(&m_id); };
+		UA_NodeId	m_id;
+};
+
+/**
+ * Convert a UA_NodeId to a NodeId
+ *
+ * @param id	The UA_NodeId
+ * @return	The NodeId
+ */
+static NodeId FromUA(const UA_NodeId& id)
+{
+	if (id.identifierType == UA_NODEIDTYPE_NUMERIC)
+	{
+		return NodeId(id.identifier.numeric, id.namespaceIndex);
+	}
+	if (id.identifierType == UA_NODEIDTYPE_STRING)
+	{
+		return NodeId(string((const char *)id.identifier.string.data, id.identifier.string.length),
+				id.namespaceIndex);
+	}
+	return NodeId();
+}
+
+/**
+ * Convert a Variant to a UA_Variant. Only the types of value that the
+ * plugin creates are supported, others convert to an empty variant.
+ *
+ * @param value		The Variant
+ * @param variant	The UA_Variant, which the caller must clear
+ */
+static void ToUA(const Variant& value, UA_Variant& variant)
+{
+	UA_Variant_init(&variant);
+	if (value.IsNul())
+	{
+		return;
+	}
+	if (value.IsArray())
+	{
+		if (value.Type() == VariantType::DOUBLE)
+		{
+			vector<double> array = value.As<vector<double> >();
+			UA_Variant_setArrayCopy(&variant, array.data(), array.size(), &UA_TYPES[UA_TYPES_DOUBLE]);
+		}
+		return;
+	}
+	switch (value.Type())
+	{
+		case VariantType::BOOLEAN:
+		{
+			UA_Boolean v = value.As<bool>();
+			UA_Variant_setScalarCopy(&variant, &v, &UA_TYPES[UA_TYPES_BOOLEAN]);
+			break;
+		}
+		case VariantType::INT32:
+		{
+			UA_Int32 v = value.As<int32_t>();
+			UA_Variant_setScalarCopy(&variant, &v, &UA_TYPES[UA_TYPES_INT32]);
+			break;
+		}
+		case VariantType::UINT32:
+		{
+			UA_UInt32 v = value.As<uint32_t>();
+			UA_Variant_setScalarCopy(&variant, &v, &UA_TYPES[UA_TYPES_UINT32]);
+			break;
+		}
+		case VariantType::INT64:
+		{
+			UA_Int64 v = value.As<int64_t>();
+			UA_Variant_setScalarCopy(&variant, &v, &UA_TYPES[UA_TYPES_INT64]);
+			break;
+		}
+		case VariantType::UINT64:
+		{
+			UA_UInt64 v = value.As<uint64_t>();
+			UA_Variant_setScalarCopy(&variant, &v, &UA_TYPES[UA_TYPES_UINT64]);
+			break;
+		}
+		case VariantType::FLOAT:
+		{
+			UA_Float v = value.As<float>();
+			UA_Variant_setScalarCopy(&variant, &v, &UA_TYPES[UA_TYPES_FLOAT]);
+			break;
+		}
+		case VariantType::DOUBLE:
+		{
+			UA_Double v = value.As<double>();
+			UA_Variant_setScalarCopy(&variant, &v, &UA_TYPES[UA_TYPES_DOUBLE]);
+			break;
+		}
+		case VariantType::STRING:
+		{
+			string s = value.As<string>();
+			UA_String v = UA_STRING((char *)s.c_str());
+			UA_Variant_setScalarCopy(&variant, &v, &UA_TYPES[UA_TYPES_STRING]);
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+/**
+ * Convert a scalar UA_Variant to a Variant
+ *
+ * @param variant	The UA_Variant
+ * @return		The Variant, empty if the type is not supported
+ */
+static Variant FromUA(const UA_Variant& variant)
+{
+	if (!UA_Variant_isScalar(&variant))
+	{
+		return Variant();
+	}
+	if (UA_Variant_hasScalarType(&variant, &UA_TYPES[UA_TYPES_BOOLEAN]))
+		return Variant((bool)*(UA_Boolean *)variant.data);
+	if (UA_Variant_hasScalarType(&variant, &UA_TYPES[UA_TYPES_INT16]))
+		return Variant((int16_t)*(UA_Int16 *)variant.data);
+	if (UA_Variant_hasScalarType(&variant, &UA_TYPES[UA_TYPES_UINT16]))
+		return Variant((uint16_t)*(UA_UInt16 *)variant.data);
+	if (UA_Variant_hasScalarType(&variant, &UA_TYPES[UA_TYPES_INT32]))
+		return Variant((int32_t)*(UA_Int32 *)variant.data);
+	if (UA_Variant_hasScalarType(&variant, &UA_TYPES[UA_TYPES_UINT32]))
+		return Variant((uint32_t)*(UA_UInt32 *)variant.data);
+	if (UA_Variant_hasScalarType(&variant, &UA_TYPES[UA_TYPES_INT64]))
+		return Variant((int64_t)*(UA_Int64 *)variant.data);
+	if (UA_Variant_hasScalarType(&variant, &UA_TYPES[UA_TYPES_UINT64]))
+		return Variant((uint64_t)*(UA_UInt64 *)variant.data);
+	if (UA_Variant_hasScalarType(&variant, &UA_TYPES[UA_TYPES_FLOAT]))
+		return Variant((float)*(UA_Float *)variant.data);
+	if (UA_Variant_hasScalarType(&variant, &UA_TYPES[UA_TYPES_DOUBLE]))
+		return Variant((double)*(UA_Double *)variant.data);
+	if (UA_Variant_hasScalarType(&variant, &UA_TYPES[UA_TYPES_STRING]))
+	{
+		const UA_String *s = (const UA_String *)variant.data;
+		return Variant(string((const char *)s->data, s->length));
+	}
+	return Variant();
+}
+
+/**
+ * Convert a DataValue to a UA_DataValue
+ *
+ * @param value		The DataValue
+ * @param dv		The UA_DataValue, which the caller must clear
+ */
+static void ToUA(const DataValue& value, UA_DataValue& dv)
+{
+	UA_DataValue_init(&dv);
+	ToUA(value.Value, dv.value);
+	dv.hasValue = true;
+	if (value.Encoding & DATA_VALUE_STATUS_CODE)
+	{
+		dv.status = (UA_StatusCode)value.Status;
+		dv.hasStatus = true;
+	}
+	if (value.Encoding & DATA_VALUE_SOURCE_TIMESTAMP)
+	{
+		dv.sourceTimestamp = (UA_DateTime)(int64_t)value.SourceTimestamp;
+		dv.hasSourceTimestamp = true;
+	}
+}
+
+/**
+ * Value callback called before a variable with a read handler is read
+ */
+static void OnRead(UA_Server *server, const UA_NodeId *sessionId, void *sessionContext,
+			const UA_NodeId *nodeId, void *nodeContext, const UA_NumericRange *range,
+			const UA_DataValue *value)
+{
+	((Open62541Backend *)nodeContext)->valueRead(FromUA(*nodeId));
+}
+
+/**
+ * Value callback called after a control variable is written
+ */
+static void OnWrite(UA_Server *server, const UA_NodeId *sessionId, void *sessionContext,
+			const UA_NodeId *nodeId, void *nodeContext, const UA_NumericRange *range,
+			const UA_DataValue *data)
+{
+	if (data->hasValue)
+	{
+		((Open62541Backend *)nodeContext)->valueWritten(FromUA(*nodeId), FromUA(data->value));
+	}
+}
+
+/**
+ * Server callback called when a monitored item is created or deleted
+ */
+static void OnMonitoredItem(UA_Server *server, const UA_NodeId *sessionId, void *sessionContext,
+			const UA_NodeId *nodeId, void *nodeContext, UA_UInt32 attributeId, UA_Boolean removed)
+{
+	if (nodeContext && attributeId == UA_ATTRIBUTEID_VALUE)
+	{
+		((Open62541Backend *)nodeContext)->monitoredItem(FromUA(*nodeId), removed);
+	}
+}
+
+/**
+ * Constructor for the open62541 backend
+ */
+Open62541Backend::Open62541Backend() : m_server(NULL), m_thread(NULL), m_running(false)
+{
+}
+
+/**
+ * Destructor for the open62541 backend
+ */
+Open62541Backend::~Open62541Backend()
+{
+	stop();
+}
+
+/**
+ * Start the server and the thread that drives it
+ *
+ * @param url	The endpoint URL of the server, the port and host are used
+ * @param uri	The URI of the server
+ * @param name	The name of the server
+ */
+void Open62541Backend::start(const string& url, const string& uri, const string& name)
+{
+	string host;
+	UA_UInt16 port = 4840;
+	size_t start = url.find("://");
+	start = (start == string::npos) ? 0 : start + 3;
+	size_t end = url.find('/', start);
+	string authority = url.substr(start, end == string::npos ? string::npos : end - start);
+	size_t colon = authority.rfind(':');
+	if (colon != string::npos)
+	{
+		port = strtoul(authority.substr(colon + 1).c_str(), NULL, 10);
+		host = authority.substr(0, colon);
+	}
+	else
+	{
+		host = authority;
+	}
+
+	m_server = UA_Server_new();
+	UA_ServerConfig *config = UA_Server_getConfig(m_server);
+	UA_ServerConfig_setMinimal(config, port, NULL);
+	if (!host.empty())
+	{
+		UA_String_clear(&config->customHostname);
+		config->customHostname = UA_STRING_ALLOC(host.c_str());
+	}
+	UA_String_clear(&config->applicationDescription.applicationUri);
+	config->applicationDescription.applicationUri = UA_STRING_ALLOC(uri.c_str());
+	UA_LocalizedText_clear(&config->applicationDescription.applicationName);
+	config->applicationDescription.applicationName = UA_LOCALIZEDTEXT_ALLOC("", name.c_str());
+#ifdef UA_ENABLE_SUBSCRIPTIONS
+	config->monitoredItemRegisterCallback = OnMonitoredItem;
+#endif
+
+	UA_StatusCode status = UA_Server_run_startup(m_server);
+	if (status != UA_STATUSCODE_GOOD)
+	{
+		UA_Server_delete(m_server);
+		m_server = NULL;
+		throw runtime_error(string("open62541 server failed to start: ") + UA_StatusCode_name(status));
+	}
+	m_running = true;
+	m_thread = new thread(&Open62541Backend::run, this);
+}
+
+/**
+ * Stop the server thread and shut down the server
+ */
+void Open62541Backend::stop()
+{
+	if (m_thread)
+	{
+		m_running = false;
+		m_thread->join();
+		delete m_thread;
+		m_thread = NULL;
+	}
+	if (m_server)
+	{
+		UA_Server_run_shutdown(m_server);
+		UA_Server_delete(m_server);
+		m_server = NULL;
+	}
+}
+
+/**
+ * The server thread. The server is iterated without waiting on the
+ * network so that the mutex is not held while idle, the thread sleeps
+ * between iterations instead.
+ */
+void Open62541Backend::run()
+{
+	while (m_running)
+	{
+		UA_UInt16 wait;
+		{
+			lock_guard<mutex> guard(m_mutex);
+			wait = UA_Server_run_iterate(m_server, false);
+		}
+		this_thread::sleep_for(chrono::milliseconds(max(1, min((int)wait, ITERATE_WAIT))));
+	}
+}
+
+/**
+ * Register a namespace. The server returns the existing index of a
+ * namespace that is already registered.
+ *
+ * @param uri	The URI of the namespace
+ * @return	The index of the namespace
+ */
+uint16_t Open62541Backend::registerNamespace(const string& uri)
+{
+	lock_guard<mutex> guard(m_mutex);
+	return UA_Server_addNamespace(m_server, uri.c_str());
+}
+
+/**
+ * Add a set of nodes to the address space. The mutex is taken once for
+ * the whole set.
+ *
+ * @param nodes	The nodes to add, updated with the result of adding each
+ */
+void Open62541Backend::addNodes(vector<BackendNode>& nodes)
+{
+	lock_guard<mutex> guard(m_mutex);
+	for (auto& node : nodes)
+	{
+		UANodeId requested(node.m_requested);
+		UANodeId parent(node.m_parent);
+		UA_QualifiedName browseName = UA_QUALIFIEDNAME(node.m_name.NamespaceIndex, (char *)node.m_name.Name.c_str());
+		UA_LocalizedText text = UA_LOCALIZEDTEXT((char *)"", (char *)node.m_name.Name.c_str());
+		UA_NodeId added;
+		UA_NodeId_init(&added);
+		UA_StatusCode status;
+		if (node.m_object)
+		{
+			UA_ObjectAttributes attr = UA_ObjectAttributes_default;
+			attr.displayName = text;
+			attr.description = text;
+			status = UA_Server_addObjectNode(m_server, requested.m_id, parent.m_id,
+					UA_NODEID_NUMERIC(0, UA_NS0ID_HASCOMPONENT), browseName,
+					UA_NODEID_NUMERIC(0, UA_NS0ID_BASEOBJECTTYPE), attr, this, &added);
+		}
+		else
+		{
+			UA_VariableAttributes attr = UA_VariableAttributes_default;
+			attr.displayName = text;
+			attr.description = text;
+			ToUA(node.m_value, attr.value);
+			if (attr.value.type)
+			{
+				attr.dataType = attr.value.type->typeId;
+			}
+			attr.valueRank = UA_Variant_isScalar(&attr.value) ? UA_VALUERANK_SCALAR : UA_VALUERANK_ONE_DIMENSION;
+			attr.accessLevel = UA_ACCESSLEVELMASK_READ;
+			if (node.m_writable)
+			{
+				attr.accessLevel |= UA_ACCESSLEVELMASK_WRITE;
+			}
+			attr.userAccessLevel = attr.accessLevel;
+			status = UA_Server_addVariableNode(m_server, requested.m_id, parent.m_id,
+					UA_NODEID_NUMERIC(0, UA_NS0ID_HASCOMPONENT), browseName,
+					UA_NODEID_NUMERIC(0, UA_NS0ID_BASEDATAVARIABLETYPE), attr, this, &added);
+			UA_Variant_clear(&attr.value);
+		}
+		node.m_status = (StatusCode)status;
+		node.m_id = FromUA(added);
+		UA_NodeId_clear(&added);
+	}
+}
+
+/**
+ * Delete a set of nodes and the references to them
+ *
+ * @param nodes	The nodes to delete
+ * @return	The status of deleting each node
+ */
+vector<StatusCode> Open62541Backend::deleteNodes(const vector<NodeId>& nodes)
+{
+	vector<StatusCode> results;
+	results.reserve(nodes.size());
+	lock_guard<mutex> guard(m_mutex);
+	for (auto& id : nodes)
+	{
+		UANodeId node(id);
+		results.push_back((StatusCode)UA_Server_deleteNode(m_server, node.m_id, true));
+		m_readHandlers.erase(id);
+		m_releaseHandlers.erase(id);
+		m_monitored.erase(id);
+		m_writeHandlers.erase(id);
+	}
+	return results;
+}
+
+/**
+ * Write a set of attributes, normally the values of variables. The mutex
+ * is taken once for the whole set.
+ *
+ * @param values	The values to write
+ * @return		The status of each write
+ */
+vector<StatusCode> Open62541Backend::write(const vector<WriteValue>& values)
+{
+	vector<StatusCode> results;
+	results.reserve(values.size());
+	lock_guard<mutex> guard(m_mutex);
+	for (auto& value : values)
+	{
+		UANodeId node(value.NodeId);
+		UA_WriteValue wv;
+		UA_WriteValue_init(&wv);
+		wv.nodeId = node.m_id;
+		wv.attributeId = (UA_UInt32)value.AttributeId;
+		ToUA(value.Value, wv.value);
+		results.push_back((StatusCode)UA_Server_write(m_server, &wv));
+		UA_DataValue_clear(&wv.value);
+	}
+	return results;
+}
+
+/**
+ * Read the value of a variable
+ *
+ * @param node	The variable to read
+ * @return	The value of the variable
+ */
+DataValue Open62541Backend::read(const NodeId& node)
+{
+	UANodeId id(node);
+	UA_ReadValueId rvi;
+	UA_ReadValueId_init(&rvi);
+	rvi.nodeId = id.m_id;
+	rvi.attributeId = UA_ATTRIBUTEID_VALUE;
+	UA_DataValue dv;
+	{
+		lock_guard<mutex> guard(m_mutex);
+		dv = UA_Server_read(m_server, &rvi, UA_TIMESTAMPSTORETURN_SOURCE);
+	}
+	DataValue value;
+	if (dv.hasValue)
+	{
+		value = DataValue(FromUA(dv.value));
+	}
+	if (dv.hasStatus)
+	{
+		value.Status = (StatusCode)dv.status;
+		value.Encoding |= DATA_VALUE_STATUS_CODE;
+	}
+	if (dv.hasSourceTimestamp)
+	{
+		value.SourceTimestamp = DateTime((int64_t)dv.sourceTimestamp);
+		value.Encoding |= DATA_VALUE_SOURCE_TIMESTAMP;
+	}
+	UA_DataValue_clear(&dv);
+	return value;
+}
+
+/**
+ * Set a value callback on a set of variables in order to see the values
+ * written to them by clients
+ *
+ * @param nodes		The variables
+ * @param handler	Called on the server thread with each new value
+ */
+void Open62541Backend::subscribeWrites(const vector<NodeId>& nodes, WriteHandler handler)
+{
+	lock_guard<mutex> guard(m_mutex);
+	UA_ValueCallback callback;
+	callback.onRead = NULL;
+	callback.onWrite = OnWrite;
+	for (auto& id : nodes)
+	{
+		m_writeHandlers[id] = handler;
+		UANodeId node(id);
+		UA_Server_setVariableNode_valueCallback(m_server, node.m_id, callback);
+	}
+}
+
+/**
+ * Serve reads of the value of a variable from a callback. The value is
+ * written into the variable immediately before each read.
+ *
+ * @param node		The variable
+ * @param handler	Returns the value of the variable
+ * @param released	Called when the last monitored item of the variable is deleted
+ */
+void Open62541Backend::setReadHandler(const NodeId& node, ReadHandler handler, ReleaseHandler released)
+{
+	lock_guard<mutex> guard(m_mutex);
+	m_readHandlers[node] = handler;
+	m_releaseHandlers[node] = released;
+	UA_ValueCallback callback;
+	callback.onRead = OnRead;
+	callback.onWrite = NULL;
+	UANodeId id(node);
+	UA_Server_setVariableNode_valueCallback(m_server, id.m_id, callback);
+}
+
+/**
+ * Methods are not supported by this backend
+ *
+ * @return	False
+ */
+bool Open62541Backend::addMethod(const NodeId& parent, uint16_t ns, const string& name, MethodHandler handler,
+				NodeId& method)
+{
+	return false;
+}
+
+/**
+ * Called from the value callback, on the server thread with the mutex
+ * held, before a variable with a read handler is read
+ *
+ * @param node	The variable being read
+ */
+void Open62541Backend::valueRead(const NodeId& node)
+{
+	auto it = m_readHandlers.find(node);
+	if (it == m_readHandlers.end())
+	{
+		return;
+	}
+	UANodeId id(node);
+	UA_WriteValue wv;
+	UA_WriteValue_init(&wv);
+	wv.nodeId = id.m_id;
+	wv.attributeId = UA_ATTRIBUTEID_VALUE;
+	ToUA(it->second(), wv.value);
+	UA_Server_write(m_server, &wv);
+	UA_DataValue_clear(&wv.value);
+}
+
+/**
+ * Called from the value callback, on the server thread with the mutex
+ * held, after a control variable has been written
+ *
+ * @param node	The variable
+ * @param value	The value written
+ */
+void Open62541Backend::valueWritten(const NodeId& node, const Variant& value)
+{
+	auto it = m_writeHandlers.find(node);
+	if (it != m_writeHandlers.end() && !value.IsNul())
+	{
+		it->second(node, value);
+	}
+}
+
+/**
+ * Called on the server thread with the mutex held when a monitored item
+ * of the value of a variable is created or deleted. The release handler
+ * of the variable is called when its last monitored item is deleted.
+ *
+ * @param node		The variable
+ * @param removed	True if the monitored item was deleted
+ */
+void Open62541Backend::monitoredItem(const NodeId& node, bool removed)
+{
+	if (!removed)
+	{
+		m_monitored[node]++;
+		return;
+	}
+	auto it = m_monitored.find(node);
+	if (it == m_monitored.end() || --it->second > 0)
+	{
+		return;
+	}
+	m_monitored.erase(it);
+	auto release = m_releaseHandlers.find(node);
+	if (release != m_releaseHandlers.end())
+	{
+		release->second();
+	}
+}
+#endif
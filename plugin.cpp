@@ -17,7 +17,7 @@
 #include <iostream>
 #include <config_category.h>
 #include <version.h>
-#include <opcua.h>
+#include <sharded_server.h>
 
 
 using namespace std;
@@ -36,6 +36,34 @@ extern "C" {
 				]					\
 		})
 
+#define AGGREGATES QUOTE({						\
+				"aggregates" : [ ]			\
+		})
+
+#define PUBLISH_POLICIES QUOTE({					\
+				"policies" : [ ]			\
+		})
+
+#define STATISTICS_KEYS QUOTE({					\
+				"statistics" : [ "READINGS",		\
+					"BUFFERED", "UNSENT",		\
+					"PURGED", "UNSNPURGED",		\
+					"DISCARDED" ]			\
+		})
+
+#define DATAPOINT_FILTER QUOTE({					\
+				"default" : "include",			\
+				"rules" : [ ]				\
+		})
+
+#define ASSET_MAPPING QUOTE({						\
+				"rules" : [ ]				\
+		})
+
+#define LATENCY_GROUPS QUOTE({						\
+				"groups" : [ ]				\
+		})
+
 /**
  * Plugin specific default configuration
  */
@@ -123,6 +151,309 @@ static const char *default_config = QUOTE({
 				"default" : CONTROL_MAP,
 				"order" : "11",
 				"displayName" : "Control Map"
+			},
+			"staleTimeout" : {
+				"description" : "The number of seconds without a reading after which the values of an asset are marked as uncertain. A value of 0 disables this",
+				"type" : "integer",
+				"default" : "0",
+				"minimum" : "0",
+				"order" : "12",
+				"displayName" : "Stale Asset Timeout"
+			},
+			"removeTimeout" : {
+				"description" : "The number of seconds without a reading after which an asset is removed from the OPC UA server. A value of 0 disables removal",
+				"type" : "integer",
+				"default" : "0",
+				"minimum" : "0",
+				"order" : "13",
+				"displayName" : "Asset Removal Timeout"
+			},
+			"maxNodes" : {
+				"description" : "The maximum number of nodes to create for assets. If exceeded the least recently updated assets are removed. A value of 0 means no limit",
+				"type" : "integer",
+				"default" : "0",
+				"minimum" : "0",
+				"order" : "14",
+				"displayName" : "Maximum Nodes"
+			},
+			"lazyValues" : {
+				"description" : "If true, hold current values in the plugin and only write them to the OPC UA server for variables that clients are observing",
+				"type" : "boolean",
+				"default" : "false",
+				"order" : "15",
+				"displayName" : "Lazy Value Updates"
+			},
+			"sharedMemory" : {
+				"description" : "The path prefix of the memory mapped files to which current values are exported for local readers. Leave empty to disable the export",
+				"type" : "string",
+				"default" : "",
+				"order" : "16",
+				"displayName" : "Shared Memory Export"
+			},
+			"sharedMemoryRecords" : {
+				"description" : "The maximum number of variables in the shared memory export",
+				"type" : "integer",
+				"default" : "10000",
+				"minimum" : "1",
+				"order" : "17",
+				"displayName" : "Shared Memory Records"
+			},
+			"historyDepth" : {
+				"description" : "The number of values to retain in memory for each numeric variable so that clients can retrieve recent history. A value of 0 disables the history",
+				"type" : "integer",
+				"default" : "0",
+				"minimum" : "0",
+				"order" : "18",
+				"displayName" : "History Depth"
+			},
+			"historyMemory" : {
+				"description" : "The maximum amount of memory in megabytes to use for the history",
+				"type" : "integer",
+				"default" : "64",
+				"minimum" : "1",
+				"order" : "19",
+				"displayName" : "History Memory Limit"
+			},
+			"historyDirectory" : {
+				"description" : "The directory in which to store the history of numeric variables on disk. If empty no history is stored on disk",
+				"type" : "string",
+				"default" : "",
+				"order" : "20",
+				"displayName" : "History Directory"
+			},
+			"historySegment" : {
+				"description" : "The period in seconds covered by each history segment file",
+				"type" : "integer",
+				"default" : "3600",
+				"minimum" : "60",
+				"order" : "21",
+				"displayName" : "History Segment Period"
+			},
+			"historyRetention" : {
+				"description" : "The number of hours of history to retain on disk. A value of 0 retains history until the storage limit is reached",
+				"type" : "integer",
+				"default" : "168",
+				"minimum" : "0",
+				"order" : "22",
+				"displayName" : "History Retention"
+			},
+			"historyStorage" : {
+				"description" : "The maximum amount of disk space in megabytes to use for the history. A value of 0 removes the limit",
+				"type" : "integer",
+				"default" : "1024",
+				"minimum" : "0",
+				"order" : "23",
+				"displayName" : "History Storage Limit"
+			},
+			"aggregates" : {
+				"description" : "Windowed aggregates to calculate for datapoints and publish as additional variables",
+				"type" : "JSON",
+				"default" : AGGREGATES,
+				"order" : "24",
+				"displayName" : "Aggregates"
+			},
+			"publishPolicies" : {
+				"description" : "Maximum publish rates and priorities for assets",
+				"type" : "JSON",
+				"default" : PUBLISH_POLICIES,
+				"order" : "25",
+				"displayName" : "Publish Policies"
+			},
+			"datapointFilter" : {
+				"description" : "Rules that select the datapoints to include in the address space",
+				"type" : "JSON",
+				"default" : DATAPOINT_FILTER,
+				"order" : "26",
+				"displayName" : "Datapoint Filter"
+			},
+			"assetMapping" : {
+				"description" : "Rules that place assets in the hierarchy based on their asset name",
+				"type" : "JSON",
+				"default" : ASSET_MAPPING,
+				"order" : "27",
+				"displayName" : "Asset Mapping"
+			},
+			"structuredDatapoints" : {
+				"description" : "Publish nested datapoints as a single String variable containing a JSON document rather than as an object with a variable for each child datapoint. The variable is not an ExtensionObject, so clients of existing nested datapoints see the type of the node change",
+				"type" : "boolean",
+				"default" : "false",
+				"order" : "28",
+				"displayName" : "Structured Nested Datapoints"
+			},
+			"conversionThreads" : {
+				"description" : "The number of threads used to convert large blocks of readings before they are written to the server, 0 or 1 to convert on the north task thread only",
+				"type" : "integer",
+				"default" : "0",
+				"minimum" : "0",
+				"order" : "29",
+				"displayName" : "Conversion Threads"
+			},
+			"parallelThreshold" : {
+				"description" : "The minimum number of readings in a block for the block to be converted by the conversion threads",
+				"type" : "integer",
+				"default" : "500",
+				"minimum" : "1",
+				"order" : "30",
+				"displayName" : "Parallel Block Size"
+			},
+			"shards" : {
+				"description" : "The number of OPC UA servers between which the assets are divided. Each additional server listens on the next port after that of the server URL",
+				"type" : "integer",
+				"default" : "1",
+				"minimum" : "1",
+				"order" : "31",
+				"displayName" : "Server Shards"
+			},
+			"shardBy" : {
+				"description" : "Divide the assets between the servers by asset name or by the top level of the hierarchy they are placed in",
+				"type" : "enumeration",
+				"options" : ["asset", "hierarchy"],
+				"default" : "asset",
+				"order" : "32",
+				"displayName" : "Shard By"
+			},
+			"latencyMetrics" : {
+				"description" : "Record the latency between the timestamps of readings and their values being written to the server and publish it in the Latency object",
+				"type" : "boolean",
+				"default" : "false",
+				"order" : "33",
+				"displayName" : "Latency Metrics"
+			},
+			"latencyInterval" : {
+				"description" : "The interval in seconds over which the latency metrics are summarised",
+				"type" : "integer",
+				"default" : "60",
+				"minimum" : "1",
+				"order" : "34",
+				"displayName" : "Latency Interval"
+			},
+			"latencyGroups" : {
+				"description" : "Groups of assets for which latency metrics are published separately",
+				"type" : "JSON",
+				"default" : LATENCY_GROUPS,
+				"order" : "35",
+				"displayName" : "Latency Groups"
+			},
+			"captureFile" : {
+				"description" : "A file to which the blocks of readings received are written so that they can be replayed later. Leave empty to disable capture",
+				"type" : "string",
+				"default" : "",
+				"order" : "36",
+				"displayName" : "Capture File"
+			},
+			"captureLimit" : {
+				"description" : "The maximum size in megabytes of the capture file, capture stops when it is reached",
+				"type" : "integer",
+				"default" : "1024",
+				"minimum" : "0",
+				"order" : "37",
+				"displayName" : "Capture Size Limit"
+			},
+			"captureAnonymise" : {
+				"description" : "Replace the asset names, datapoint names and string values in the capture file with tokens",
+				"type" : "boolean",
+				"default" : "false",
+				"order" : "38",
+				"displayName" : "Anonymise Capture"
+			},
+			"backend" : {
+				"description" : "The OPC UA server SDK that holds the address space, open62541 is only available if the plugin was built with it",
+				"type" : "enumeration",
+				"options" : ["freeopcua", "open62541"],
+				"default" : "freeopcua",
+				"order" : "39",
+				"displayName" : "Server Backend"
+			},
+			"samplingHints" : {
+				"description" : "Set the MinimumSamplingInterval of each variable from the rate at which it is updated, so that clients do not sample variables faster than they change",
+				"type" : "boolean",
+				"default" : "false",
+				"order" : "40",
+				"displayName" : "Sampling Hints"
+			},
+			"maxSamplingHint" : {
+				"description" : "The largest MinimumSamplingInterval in milliseconds set for a variable that is updated slowly",
+				"type" : "integer",
+				"default" : "60000",
+				"minimum" : "1",
+				"order" : "41",
+				"displayName" : "Maximum Sampling Hint"
+			},
+			"methodThreads" : {
+				"description" : "The number of threads that run the control operations requested by calls of the control methods",
+				"type" : "integer",
+				"default" : "2",
+				"minimum" : "1",
+				"order" : "42",
+				"displayName" : "Method Threads"
+			},
+			"methodConcurrency" : {
+				"description" : "The number of control operations that may be in progress at once for each service, asset or script",
+				"type" : "integer",
+				"default" : "1",
+				"minimum" : "1",
+				"order" : "43",
+				"displayName" : "Method Concurrency"
+			},
+			"methodTimeout" : {
+				"description" : "The default number of seconds a method call waits for its control operation to complete",
+				"type" : "integer",
+				"default" : "5",
+				"minimum" : "1",
+				"order" : "44",
+				"displayName" : "Method Timeout"
+			},
+			"traceFile" : {
+				"description" : "A file to which the time spent in each phase of sending a block of readings is written in the Chrome trace event format. Leave empty to disable tracing",
+				"type" : "string",
+				"default" : "",
+				"order" : "45",
+				"displayName" : "Trace File"
+			},
+			"traceSampling" : {
+				"description" : "Trace one block of readings in every this many blocks",
+				"type" : "integer",
+				"default" : "100",
+				"minimum" : "1",
+				"order" : "46",
+				"displayName" : "Trace Sampling"
+			},
+			"datapointWindow" : {
+				"description" : "The number of seconds after which datapoints that have not appeared in any reading of their asset are treated as vanished. A value of 0 disables this",
+				"type" : "integer",
+				"default" : "0",
+				"minimum" : "0",
+				"order" : "47",
+				"displayName" : "Vanished Datapoint Window"
+			},
+			"vanishedDatapoints" : {
+				"description" : "Whether the variables of vanished datapoints are removed or have their status set to uncertain",
+				"type" : "enumeration",
+				"options" : ["remove", "flag"],
+				"default" : "remove",
+				"order" : "48",
+				"displayName" : "Vanished Datapoints"
+			},
+			"statisticsRates" : {
+				"description" : "When the statistics fast path is used, publish the rate of change per second of each statistic alongside its cumulative value",
+				"type" : "boolean",
+				"default" : "false",
+				"order" : "49",
+				"displayName" : "Statistics Rates"
+			},
+			"statistics" : {
+				"description" : "When the statistics fast path is used, the keys of the statistics whose nodes are created when the server starts",
+				"type" : "JSON",
+				"default" : STATISTICS_KEYS,
+				"order" : "50",
+				"displayName" : "Statistics"
+			},
+			"statisticsFastPath" : {
+				"description" : "When the source is statistics, publish each statistic as an object in the root using a simpler path than readings. The asset name, hierarchy and asset mapping settings are not used, so the nodes of existing statistics move",
+				"type" : "boolean",
+				"default" : "false",
+				"order" : "51",
+				"displayName" : "Statistics Fast Path"
 			}
 		});
 
@@ -158,7 +489,7 @@ PLUGIN_INFORMATION *plugin_info()
 PLUGIN_HANDLE plugin_init(ConfigCategory* configData)
 {
 
-	OPCUAServer *opcua = new OPCUAServer();
+	ShardedServer *opcua = new ShardedServer();
 	opcua->configure(configData);
 
 	return (PLUGIN_HANDLE)opcua;
@@ -170,7 +501,7 @@ PLUGIN_HANDLE plugin_init(ConfigCategory* configData)
 uint32_t plugin_send(const PLUGIN_HANDLE handle,
 		     const vector<Reading *>& readings)
 {
-OPCUAServer	*opcua = (OPCUAServer *)handle;
+ShardedServer	*opcua = (ShardedServer *)handle;
 
 	return opcua->send(readings);
 }
@@ -179,7 +510,7 @@ void plugin_register(PLUGIN_HANDLE handle,
 		bool ( *write)(const char *name, const char *value, ControlDestination destination, ...),
 		int (* operation)(char *operation, int paramCount, char *parameters[], ControlDestination destination, ...))
 {
-OPCUAServer	*opcua = (OPCUAServer *)handle;
+ShardedServer	*opcua = (ShardedServer *)handle;
 
 	opcua->registerControl(write, operation);
 }
@@ -193,7 +524,7 @@ OPCUAServer	*opcua = (OPCUAServer *)handle;
  */
 void plugin_shutdown(PLUGIN_HANDLE handle)
 {
-OPCUAServer	*opcua = (OPCUAServer *)handle;
+ShardedServer	*opcua = (ShardedServer *)handle;
 
 	opcua->stop();
         delete opcua;
@@ -0,0 +1,136 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <publish_policy.h>
+#include <logger.h>
+#include <fnmatch.h>
+#include <json_config.h>
+
+using namespace std;
+
+/**
+ * Check if the policy applies to an asset
+ *
+ * @param asset	The asset name
+ * @return	True if the asset name matches the pattern of the policy
+ */
+bool PublishPolicy::matches(const string& asset) const
+{
+	return fnmatch(m_asset.c_str(), asset.c_str(), 0) == 0;
+}
+
+/**
+ * Parse the publish policy configuration item. The item is a JSON
+ * document with an array of policies, each policy has an asset pattern
+ * and optionally a maximum rate in readings per second, a burst size
+ * and a priority of high, normal or low.
+ *
+ * { "policies" : [ { "asset" : "vibration*", "maxRate" : 10, "burst" : 5 },
+ *		    { "asset" : "alarm*", "priority" : "high" } ] }
+ *
+ * @param json	The configuration item
+ */
+void PublishPolicies::parse(const string& json)
+{
+	Logger *log = Logger::getLogger();
+
+	m_policies.clear();
+	if (json.empty())
+	{
+		return;
+	}
+	rapidjson::Document doc;
+	if (!ParseJsonConfig(doc, json, "publish policies"))
+	{
+		return;
+	}
+	if (!doc.HasMember("policies") || !doc["policies"].IsArray())
+	{
+		log->error("Missing the policies element in the publish policy configuration");
+		return;
+	}
+	for (auto &policy : doc["policies"].GetArray())
+	{
+		string asset;
+		double rate = 0.0, burst = 1.0;
+		PublishPolicy::Priority priority = PublishPolicy::Normal;
+		if (policy.HasMember("asset") && policy["asset"].IsString())
+			asset = policy["asset"].GetString();
+		if (policy.HasMember("maxRate") && policy["maxRate"].IsNumber())
+			rate = policy["maxRate"].GetDouble();
+		if (policy.HasMember("burst") && policy["burst"].IsNumber())
+			burst = policy["burst"].GetDouble();
+		if (policy.HasMember("priority") && policy["priority"].IsString())
+		{
+			string name = policy["priority"].GetString();
+			if (name.compare("high") == 0)
+				priority = PublishPolicy::High;
+			else if (name.compare("low") == 0)
+				priority = PublishPolicy::Low;
+			else if (name.compare("normal") != 0)
+				log->error("Unsupported publish priority '%s' for %s", name.c_str(), asset.c_str());
+		}
+		if (asset.empty() || rate < 0.0 || burst < 1.0)
+		{
+			log->error("Badly formed publish policy, an asset pattern must be given and the rate and burst may not be negative");
+			continue;
+		}
+		m_policies.push_back(PublishPolicy(asset, rate, burst, priority));
+	}
+}
+
+/**
+ * Find the first policy that applies to an asset
+ *
+ * @param asset	The asset name
+ * @return	The policy or NULL if no policy applies
+ */
+const PublishPolicy *PublishPolicies::match(const string& asset) const
+{
+	for (auto &policy : m_policies)
+	{
+		if (policy.matches(asset))
+		{
+			return &policy;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Add the tokens that have accumulated since the last refill
+ *
+ * @param now	The current time in seconds
+ */
+void TokenBucket::refill(double now)
+{
+	if (m_last > 0)
+	{
+		m_tokens += (now - m_last) * m_rate;
+		if (m_tokens > m_burst)
+			m_tokens = m_burst;
+	}
+	m_last = now;
+}
+
+/**
+ * Take a token from the bucket
+ *
+ * @param now	The current time in seconds
+ * @return	False if no token is available
+ */
+bool TokenBucket::take(double now)
+{
+	refill(now);
+	if (m_tokens < 1.0)
+	{
+		return false;
+	}
+	m_tokens -= 1.0;
+	return true;
+}
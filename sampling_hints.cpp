@@ -0,0 +1,127 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <sampling_hints.h>
+#include <math.h>
+
+using namespace std;
+
+// The weight given to each new interval in the mean update interval
+#define SMOOTHING	0.2
+
+// The number of intervals observed before a hint is first advertised
+#define MIN_SAMPLES	4
+
+// The relative change in the hint needed before it is advertised again
+#define HYSTERESIS	0.5
+
+/**
+ * Constructor for the sampling hints
+ */
+SamplingHints::SamplingHints() : m_enabled(false), m_maximum(60000)
+{
+}
+
+/**
+ * Configure the sampling hints
+ *
+ * @param enabled	True if sampling hints are advertised
+ * @param maximum	The largest hint to advertise in milliseconds
+ */
+void SamplingHints::configure(bool enabled, unsigned long maximum)
+{
+	m_enabled = enabled;
+	m_maximum = maximum ? maximum : 60000;
+	if (!m_enabled)
+	{
+		m_rates.clear();
+	}
+}
+
+/**
+ * Record an update of a variable
+ *
+ * @param node		The variable that has been updated
+ * @param userTS	The user timestamp of the new value
+ * @param interval	Set to the new hint in milliseconds if it should be advertised
+ * @return		True if a new hint should be advertised
+ */
+bool SamplingHints::update(NodeHandle node, const struct timeval& userTS, double& interval)
+{
+	Rate& rate = m_rates[node];
+	int64_t ts = (int64_t)userTS.tv_sec * 1000000 + userTS.tv_usec;
+	if (rate.m_last == 0)
+	{
+		rate.m_last = ts;
+		return false;
+	}
+	if (ts <= rate.m_last)
+	{
+		// A value that is out of order tells us nothing of the rate
+		return false;
+	}
+	double ms = (ts - rate.m_last) / 1000.0;
+	rate.m_last = ts;
+	rate.m_mean = rate.m_samples ? rate.m_mean + SMOOTHING * (ms - rate.m_mean) : ms;
+	if (++rate.m_samples < MIN_SAMPLES)
+	{
+		return false;
+	}
+	rate.m_samples = MIN_SAMPLES;
+
+	double target = rate.m_mean / 2;
+	if (target > m_maximum)
+	{
+		target = m_maximum;
+	}
+	if (rate.m_advertised >= 0 && fabs(target - rate.m_advertised) <= rate.m_advertised * HYSTERESIS)
+	{
+		return false;
+	}
+	double hint = quantise(target);
+	if (hint == rate.m_advertised)
+	{
+		return false;
+	}
+	rate.m_advertised = hint;
+	interval = hint;
+	return true;
+}
+
+/**
+ * Round an interval down to the 1, 2, 5 series of milliseconds. Intervals
+ * of less than a millisecond are rounded down to zero, the fastest rate.
+ *
+ * @param interval	The interval in milliseconds
+ * @return		The rounded interval
+ */
+double SamplingHints::quantise(double interval)
+{
+	if (interval < 1.0)
+	{
+		return 0;
+	}
+	double decade = pow(10.0, floor(log10(interval)));
+	double mantissa = interval / decade;
+	if (mantissa >= 5.0)
+		return 5 * decade;
+	if (mantissa >= 2.0)
+		return 2 * decade;
+	return decade;
+}
+
+/**
+ * Return the approximate memory used to track the update rates
+ *
+ * @return	The memory usage in bytes
+ */
+size_t SamplingHints::memoryUsage() const
+{
+	return m_rates.size() * (sizeof(NodeHandle) + sizeof(Rate) + 2 * sizeof(void *))
+		+ m_rates.bucket_count() * sizeof(void *);
+}
@@ -0,0 +1,217 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <sharded_server.h>
+#include <logger.h>
+#include <algorithm>
+
+using namespace std;
+
+// The maximum number of shards, each shard uses a port
+#define MAX_SHARDS	64
+
+/**
+ * Constructor for the sharded server
+ */
+ShardedServer::ShardedServer() : m_byHierarchy(false)
+{
+}
+
+/**
+ * Destructor for the sharded server
+ */
+ShardedServer::~ShardedServer()
+{
+	for (auto shard : m_shards)
+	{
+		delete shard;
+	}
+}
+
+/**
+ * Configure the shards. The number of shards is fixed by the first call.
+ *
+ * @param conf	Fledge configuration category
+ */
+void ShardedServer::configure(const ConfigCategory *conf)
+{
+	if (m_shards.empty())
+	{
+		unsigned int shards = 1;
+		if (conf->itemExists("shards"))
+			shards = strtoul(conf->getValue("shards").c_str(), NULL, 10);
+		if (shards < 1)
+			shards = 1;
+		if (shards > MAX_SHARDS)
+		{
+			Logger::getLogger()->warn("The number of shards is limited to %d", MAX_SHARDS);
+			shards = MAX_SHARDS;
+		}
+		for (unsigned int i = 0; i < shards; i++)
+		{
+			m_shards.push_back(new OPCUAServer(i));
+		}
+		if (shards > 1)
+		{
+			m_pool.start(shards - 1);
+		}
+	}
+	if (conf->itemExists("shardBy"))
+		m_byHierarchy = conf->getValue("shardBy").compare("hierarchy") == 0;
+	if (conf->itemExists("captureFile") && !conf->getValue("captureFile").empty())
+	{
+		size_t limit = 1024;
+		bool anonymise = false;
+		if (conf->itemExists("captureLimit"))
+			limit = strtoul(conf->getValue("captureLimit").c_str(), NULL, 10);
+		if (conf->itemExists("captureAnonymise"))
+		{
+			string configValue = conf->getValue("captureAnonymise");
+			std::transform(configValue.begin(), configValue.end(), configValue.begin(), ::tolower);
+			anonymise = configValue.compare("true") == 0;
+		}
+		m_capture.open(conf->getValue("captureFile"), limit * 1024 * 1024, anonymise);
+	}
+	if (conf->itemExists("traceFile") && !conf->getValue("traceFile").empty())
+	{
+		unsigned int sampling = 100;
+		if (conf->itemExists("traceSampling"))
+			sampling = strtoul(conf->getValue("traceSampling").c_str(), NULL, 10);
+		Tracer::open(conf->getValue("traceFile"), sampling);
+	}
+	for (auto shard : m_shards)
+	{
+		shard->configure(conf);
+	}
+}
+
+/**
+ * Send a block of readings, dividing them between the shards. The
+ * shards write their readings concurrently. If capture is enabled the
+ * block is first appended to the capture file. If the block is sampled
+ * for tracing the spans recorded are written to the trace file once
+ * the block has been sent.
+ *
+ * @param readings	The readings to send
+ * @return		The number of readings sent
+ */
+uint32_t ShardedServer::send(const vector<Reading *>& readings)
+{
+	bool trace = Tracer::sample();
+	uint32_t total = sendBlock(readings, trace);
+	if (trace)
+	{
+		Tracer::flush();
+	}
+	return total;
+}
+
+/**
+ * Send a block of readings to the shards
+ *
+ * @param readings	The readings to send
+ * @param trace		True if the block is traced
+ * @return		The number of readings sent
+ */
+uint32_t ShardedServer::sendBlock(const vector<Reading *>& readings, bool trace)
+{
+	TraceSpan span(trace, "block");
+	if (m_capture.isOpen())
+	{
+		TraceSpan span(trace, "capture");
+		m_capture.write(readings);
+	}
+	if (m_shards.size() == 1)
+	{
+		return m_shards[0]->send(readings, trace);
+	}
+	vector<vector<Reading *> > blocks(m_shards.size());
+	for (auto reading : readings)
+	{
+		blocks[shardOf(reading)].push_back(reading);
+	}
+	// Every shard is called, even with no readings, to start its server and expire assets
+	vector<uint32_t> sent(m_shards.size(), 0);
+	m_pool.run(m_shards.size(), [this, &blocks, &sent, trace](size_t shard) {
+		sent[shard] = m_shards[shard]->send(blocks[shard], trace);
+	});
+	uint32_t total = 0;
+	for (auto n : sent)
+	{
+		total += n;
+	}
+	return total;
+}
+
+/**
+ * Stop all of the shards
+ */
+void ShardedServer::stop()
+{
+	m_capture.close();
+	Tracer::flush();
+	m_pool.stop();
+	for (auto shard : m_shards)
+	{
+		shard->stop();
+	}
+}
+
+/**
+ * Register the control callbacks with all of the shards
+ *
+ * @param write		The control write callback
+ * @param operation	The control operation callback
+ */
+void ShardedServer::registerControl(bool (*write)(const char *name, const char *value, ControlDestination destination, ...),
+				  int (*operation)(char *operation, int paramCount, char *parameters[], ControlDestination destination, ...))
+{
+	for (auto shard : m_shards)
+	{
+		shard->registerControl(write, operation);
+	}
+}
+
+/**
+ * Return the shard an asset is assigned to, assigning it on the first
+ * reading of the asset
+ *
+ * @param reading	A reading of the asset
+ * @return		The shard number
+ */
+unsigned int ShardedServer::shardOf(const Reading *reading)
+{
+	const string &assetName = reading->getAssetName();
+	auto it = m_assignment.find(assetName);
+	if (it != m_assignment.end())
+	{
+		return it->second;
+	}
+	string key = m_byHierarchy ? m_shards[0]->shardKey(reading) : assetName;
+	unsigned int shard = hash(key) % m_shards.size();
+	m_assignment.insert(pair<string, unsigned int>(assetName, shard));
+	return shard;
+}
+
+/**
+ * Hash a shard key. The FNV-1a hash is used rather than std::hash so
+ * that assets are assigned to the same shard on every run of the plugin.
+ *
+ * @param key	The shard key
+ * @return	The hash of the key
+ */
+uint32_t ShardedServer::hash(const string& key)
+{
+	uint32_t h = 2166136261u;
+	for (unsigned char c : key)
+	{
+		h ^= c;
+		h *= 16777619u;
+	}
+	return h;
+}
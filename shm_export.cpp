@@ -0,0 +1,294 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <shm_export.h>
+#include <logger.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+/**
+ * Constructor for the shared memory export
+ */
+ShmExport::ShmExport() : m_fd(-1), m_size(0), m_header(NULL), m_records(NULL), m_index(NULL),
+	m_capacity(0), m_next(0), m_full(false)
+{
+}
+
+/**
+ * Destructor for the shared memory export
+ */
+ShmExport::~ShmExport()
+{
+	close();
+}
+
+/**
+ * Create and map the value file and open the index file
+ *
+ * @param path		The path prefix for the two files
+ * @param capacity	The maximum number of variables to export
+ * @return		True if the export was created
+ */
+bool ShmExport::open(const string& path, unsigned int capacity)
+{
+	Logger *log = Logger::getLogger();
+
+	close();
+	m_path = path;
+	m_capacity = capacity;
+	string values = path + ".values";
+	string index = path + ".index";
+
+	m_fd = ::open(values.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (m_fd == -1)
+	{
+		log->error("Unable to create shared memory export file %s: %s", values.c_str(), strerror(errno));
+		return false;
+	}
+	m_size = sizeof(ShmExportHeader) + (size_t)capacity * sizeof(ShmExportRecord);
+	if (ftruncate(m_fd, m_size) == -1)
+	{
+		log->error("Unable to size shared memory export file %s: %s", values.c_str(), strerror(errno));
+		close();
+		return false;
+	}
+	void *addr = mmap(NULL, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+	if (addr == MAP_FAILED)
+	{
+		log->error("Unable to map shared memory export file %s: %s", values.c_str(), strerror(errno));
+		close();
+		return false;
+	}
+	m_index = fopen(index.c_str(), "w");
+	if (!m_index)
+	{
+		log->error("Unable to create shared memory index file %s: %s", index.c_str(), strerror(errno));
+		munmap(addr, m_size);
+		close();
+		return false;
+	}
+
+	// The file was truncated so all records start zeroed and empty
+	m_header = (ShmExportHeader *)addr;
+	m_records = (ShmExportRecord *)((char *)addr + sizeof(ShmExportHeader));
+	strncpy(m_header->magic, SHM_EXPORT_MAGIC, sizeof(m_header->magic));
+	m_header->version = SHM_EXPORT_VERSION;
+	m_header->recordSize = sizeof(ShmExportRecord);
+	m_header->capacity = capacity;
+	m_header->started = time(NULL);
+	m_header->running.store(1, memory_order_release);
+	log->info("Exporting current values to %s", values.c_str());
+	return true;
+}
+
+/**
+ * Unmap the value file and close the index. The files are left in
+ * place with the running flag cleared so that readers can see the
+ * plugin has stopped.
+ */
+void ShmExport::close()
+{
+	if (m_header)
+	{
+		m_header->running.store(0, memory_order_release);
+		munmap(m_header, m_size);
+	}
+	if (m_fd != -1)
+	{
+		::close(m_fd);
+	}
+	if (m_index)
+	{
+		fclose(m_index);
+	}
+	m_fd = -1;
+	m_header = NULL;
+	m_records = NULL;
+	m_index = NULL;
+	m_next = 0;
+	m_free.clear();
+	m_slots.clear();
+	m_full = false;
+}
+
+/**
+ * Allocate a slot for a variable and record it in the index
+ *
+ * @param handle	The node handle of the variable
+ * @param asset		The asset name
+ * @param datapoint	The datapoint path within the asset
+ */
+void ShmExport::add(NodeHandle handle, const string& asset, const string& datapoint)
+{
+	if (!m_records)
+	{
+		return;
+	}
+	uint32_t slot;
+	if (!m_free.empty())
+	{
+		slot = m_free.back();
+		m_free.pop_back();
+	}
+	else if (m_next < m_capacity)
+	{
+		slot = m_next++;
+	}
+	else
+	{
+		if (!m_full)
+		{
+			Logger::getLogger()->warn("Shared memory export is full, %u variables are exported", m_capacity);
+			m_full = true;
+		}
+		return;
+	}
+	if (handle >= m_slots.size())
+	{
+		m_slots.resize(handle + 1, -1);
+	}
+	m_slots[handle] = slot;
+	fprintf(m_index, "%u\t%s\t%s\n", slot, asset.c_str(), datapoint.c_str());
+	fflush(m_index);
+}
+
+/**
+ * Release the slot of a variable that has been removed
+ *
+ * @param handle	The node handle of the variable
+ */
+void ShmExport::remove(NodeHandle handle)
+{
+	ShmExportRecord *record = begin(handle);
+	if (!record)
+	{
+		return;
+	}
+	record->type = Empty;
+	end(record);
+	m_free.push_back(m_slots[handle]);
+	m_slots[handle] = -1;
+}
+
+/**
+ * Start an update of the record for a variable
+ *
+ * @param handle	The node handle of the variable
+ * @return		The record, with an odd sequence number, or NULL if the variable is not exported
+ */
+ShmExportRecord *ShmExport::begin(NodeHandle handle)
+{
+	if (handle >= m_slots.size() || m_slots[handle] < 0)
+	{
+		return NULL;
+	}
+	ShmExportRecord *record = &m_records[m_slots[handle]];
+	record->seq.store(record->seq.load(memory_order_relaxed) + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	return record;
+}
+
+/**
+ * Complete an update of a record
+ *
+ * @param record	The record being updated
+ */
+void ShmExport::end(ShmExportRecord *record)
+{
+	record->seq.store(record->seq.load(memory_order_relaxed) + 1, memory_order_release);
+}
+
+/**
+ * Update an integer value
+ *
+ * @param handle	The node handle of the variable
+ * @param value		The new value
+ * @param timestamp	The timestamp of the value in microseconds since the epoch
+ */
+void ShmExport::set(NodeHandle handle, int64_t value, int64_t timestamp)
+{
+	ShmExportRecord *record = begin(handle);
+	if (!record)
+	{
+		return;
+	}
+	record->type = Integer;
+	record->status = 0;
+	record->timestamp = timestamp;
+	record->value.i = value;
+	end(record);
+}
+
+/**
+ * Update a floating point value
+ *
+ * @param handle	The node handle of the variable
+ * @param value		The new value
+ * @param timestamp	The timestamp of the value in microseconds since the epoch
+ */
+void ShmExport::set(NodeHandle handle, double value, int64_t timestamp)
+{
+	ShmExportRecord *record = begin(handle);
+	if (!record)
+	{
+		return;
+	}
+	record->type = Double;
+	record->status = 0;
+	record->timestamp = timestamp;
+	record->value.d = value;
+	end(record);
+}
+
+/**
+ * Update a string value
+ *
+ * @param handle	The node handle of the variable
+ * @param value		The new value
+ * @param timestamp	The timestamp of the value in microseconds since the epoch
+ */
+void ShmExport::set(NodeHandle handle, const string& value, int64_t timestamp)
+{
+	ShmExportRecord *record = begin(handle);
+	if (!record)
+	{
+		return;
+	}
+	size_t len = value.length() < SHM_EXPORT_STRING_LEN ? value.length() : SHM_EXPORT_STRING_LEN - 1;
+	record->type = String;
+	record->status = 0;
+	record->timestamp = timestamp;
+	record->length = value.length();
+	memcpy(record->str, value.c_str(), len);
+	record->str[len] = 0;
+	end(record);
+}
+
+/**
+ * Update the status of a variable
+ *
+ * @param handle	The node handle of the variable
+ * @param status	The OPC UA status code
+ */
+void ShmExport::setStatus(NodeHandle handle, uint32_t status)
+{
+	ShmExportRecord *record = begin(handle);
+	if (!record)
+	{
+		return;
+	}
+	record->status = status;
+	end(record);
+}
@@ -0,0 +1,79 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <timer_wheel.h>
+
+using namespace std;
+
+/**
+ * Construct a timer wheel
+ *
+ * @param slots		The number of slots in the wheel
+ * @param resolution	The number of seconds covered by each slot
+ */
+TimerWheel::TimerWheel(unsigned int slots, unsigned int resolution) :
+		m_slots(slots ? slots : 1), m_resolution(resolution ? resolution : 1), m_count(0)
+{
+	m_current = time(NULL) / m_resolution;
+}
+
+/**
+ * Add a timer to the wheel. Timers that have already expired
+ * are placed in the next slot to be processed.
+ *
+ * @param key		The key to return when the timer expires
+ * @param expiry	The time at which the timer expires
+ */
+void TimerWheel::schedule(const string& key, time_t expiry)
+{
+	time_t tick = expiry / m_resolution;
+
+	if (tick <= m_current)
+		tick = m_current + 1;
+	m_slots[tick % m_slots.size()].push_back(Timer(key, expiry));
+	m_count++;
+}
+
+/**
+ * Advance the wheel to the given time and return the keys of all
+ * timers that have expired.
+ *
+ * @param now		The current time
+ * @param expired	Vector to which the expired keys are appended
+ */
+void TimerWheel::expire(time_t now, vector<string>& expired)
+{
+	time_t tick = now / m_resolution;
+	time_t steps = tick - m_current;
+
+	if (steps <= 0)
+		return;
+	if (steps > (time_t)m_slots.size())
+		steps = m_slots.size();
+	for (time_t i = 1; i <= steps; i++)
+	{
+		vector<Timer>& slot = m_slots[(m_current + i) % m_slots.size()];
+		size_t keep = 0;
+		for (size_t j = 0; j < slot.size(); j++)
+		{
+			if (slot[j].m_expiry <= now)
+			{
+				expired.push_back(slot[j].m_key);
+				m_count--;
+			}
+			else
+			{
+				if (keep != j)
+					slot[keep] = slot[j];
+				keep++;
+			}
+		}
+		slot.erase(slot.begin() + keep, slot.end());
+	}
+	m_current = tick;
+}
@@ -0,0 +1,287 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <trace.h>
+#include <logger.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+using namespace std;
+
+mutex				Tracer::m_mutex;
+vector<TraceBuffer *>		Tracer::m_buffers;
+FILE				*Tracer::m_file = NULL;
+string				Tracer::m_path;
+bool				Tracer::m_first = true;
+atomic<bool>			Tracer::m_enabled(false);
+atomic<unsigned int>		Tracer::m_sampling(100);
+atomic<unsigned long>		Tracer::m_blocks(0);
+atomic<unsigned int>		Tracer::m_threads(0);
+
+/**
+ * Marks the buffer of a thread as orphaned when the thread exits, so
+ * that it is freed once the spans it holds have been written
+ */
+class TraceBufferOwner {
+	public:
+		TraceBufferOwner() : m_buffer(NULL) {};
+		~TraceBufferOwner()
+		{
+			if (m_buffer)
+				m_buffer->m_orphaned.store(true, memory_order_release);
+		};
+		TraceBuffer	*m_buffer;
+};
+
+static thread_local TraceBufferOwner threadBuffer;
+
+/**
+ * Add a span to the buffer. Called only by the thread that owns the buffer.
+ *
+ * @param name		The name of the span
+ * @param detail	The detail of the span, may be NULL
+ * @param start		The start of the span in microseconds
+ * @param end		The end of the span in microseconds
+ * @return		False if the buffer is full and the span was dropped
+ */
+bool TraceBuffer::push(const char *name, const char *detail, int64_t start, int64_t end)
+{
+	size_t head = m_head.load(memory_order_relaxed);
+	if (head - m_tail.load(memory_order_acquire) >= TRACE_BUFFER)
+	{
+		m_dropped.fetch_add(1, memory_order_relaxed);
+		return false;
+	}
+	TraceEvent &event = m_events[head % TRACE_BUFFER];
+	event.m_name = name;
+	if (detail)
+	{
+		strncpy(event.m_detail, detail, TRACE_DETAIL - 1);
+		event.m_detail[TRACE_DETAIL - 1] = 0;
+	}
+	else
+	{
+		event.m_detail[0] = 0;
+	}
+	event.m_start = start;
+	event.m_duration = end - start;
+	m_head.store(head + 1, memory_order_release);
+	return true;
+}
+
+/**
+ * Remove the oldest span from the buffer. Called only by the thread
+ * flushing the trace.
+ *
+ * @param event	Set to the span
+ * @return	False if the buffer is empty
+ */
+bool TraceBuffer::pop(TraceEvent& event)
+{
+	size_t tail = m_tail.load(memory_order_relaxed);
+	if (tail == m_head.load(memory_order_acquire))
+	{
+		return false;
+	}
+	event = m_events[tail % TRACE_BUFFER];
+	m_tail.store(tail + 1, memory_order_release);
+	return true;
+}
+
+/**
+ * Open the trace file. If the file is already open, as it is when it
+ * is shared by several instances of the plugin, only the sampling
+ * interval is changed.
+ *
+ * @param path		The path of the trace file
+ * @param sampling	Trace one block in every sampling blocks
+ * @return		True if the trace file is open
+ */
+bool Tracer::open(const string& path, unsigned int sampling)
+{
+	lock_guard<mutex> guard(m_mutex);
+	m_sampling = sampling ? sampling : 1;
+	if (m_file && path.compare(m_path) == 0)
+	{
+		return true;
+	}
+	if (m_file)
+	{
+		Logger::getLogger()->warn("The trace file %s is in use, %s will not be used",
+				m_path.c_str(), path.c_str());
+		return true;
+	}
+	m_file = fopen(path.c_str(), "w");
+	if (!m_file)
+	{
+		Logger::getLogger()->error("Failed to open trace file %s: %s", path.c_str(), strerror(errno));
+		return false;
+	}
+	m_path = path;
+	m_first = true;
+	fputs("[\n", m_file);
+	m_enabled = true;
+	Logger::getLogger()->info("Tracing one block in every %u to %s", m_sampling.load(), path.c_str());
+	return true;
+}
+
+/**
+ * Write any remaining spans and close the trace file
+ */
+void Tracer::close()
+{
+	flush();
+	lock_guard<mutex> guard(m_mutex);
+	m_enabled = false;
+	if (m_file)
+	{
+		fputs("\n]\n", m_file);
+		fclose(m_file);
+		m_file = NULL;
+	}
+}
+
+/**
+ * Decide if the next block should be traced
+ *
+ * @return	True if the block should be traced
+ */
+bool Tracer::sample()
+{
+	if (!isEnabled())
+	{
+		return false;
+	}
+	return m_blocks.fetch_add(1, memory_order_relaxed) % m_sampling.load(memory_order_relaxed) == 0;
+}
+
+/**
+ * Return the current time in microseconds from a monotonic clock
+ *
+ * @return	The time in microseconds
+ */
+int64_t Tracer::now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Return the buffer of the calling thread, creating it the first time
+ * the thread records a span
+ *
+ * @return	The buffer of the thread
+ */
+TraceBuffer *Tracer::buffer()
+{
+	if (!threadBuffer.m_buffer)
+	{
+		TraceBuffer *buffer = new TraceBuffer(++m_threads);
+		lock_guard<mutex> guard(m_mutex);
+		m_buffers.push_back(buffer);
+		threadBuffer.m_buffer = buffer;
+	}
+	return threadBuffer.m_buffer;
+}
+
+/**
+ * Record a span
+ *
+ * @param name		The name of the span, which must be a string constant
+ * @param detail	The detail of the span, may be NULL
+ * @param start		The start of the span in microseconds
+ * @param end		The end of the span in microseconds
+ */
+void Tracer::record(const char *name, const char *detail, int64_t start, int64_t end)
+{
+	if (isEnabled())
+	{
+		buffer()->push(name, detail, start, end);
+	}
+}
+
+/**
+ * Write a string to the trace file as a JSON string
+ *
+ * @param str	The string
+ */
+void Tracer::writeString(const char *str)
+{
+	fputc('"', m_file);
+	for (const char *p = str; *p; p++)
+	{
+		if (*p == '"' || *p == '\\')
+		{
+			fputc('\\', m_file);
+			fputc(*p, m_file);
+		}
+		else if ((unsigned char)*p < 0x20)
+		{
+			fprintf(m_file, "\\u%04x", (unsigned char)*p);
+		}
+		else
+		{
+			fputc(*p, m_file);
+		}
+	}
+	fputc('"', m_file);
+}
+
+/**
+ * Write the spans held by all of the threads to the trace file and free
+ * the buffers of threads that have exited
+ */
+void Tracer::flush()
+{
+	lock_guard<mutex> guard(m_mutex);
+	if (!m_file)
+	{
+		return;
+	}
+	int pid = getpid();
+	TraceEvent event;
+	for (auto it = m_buffers.begin(); it != m_buffers.end(); )
+	{
+		TraceBuffer *buffer = *it;
+		bool orphaned = buffer->m_orphaned.load(memory_order_acquire);
+		while (buffer->pop(event))
+		{
+			fputs(m_first ? "" : ",\n", m_file);
+			m_first = false;
+			fputs("{\"name\":", m_file);
+			writeString(event.m_name);
+			fprintf(m_file, ",\"cat\":\"opcua\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%u",
+					(long long)event.m_start, (long long)event.m_duration, pid, buffer->m_tid);
+			if (event.m_detail[0])
+			{
+				fputs(",\"args\":{\"detail\":", m_file);
+				writeString(event.m_detail);
+				fputc('}', m_file);
+			}
+			fputc('}', m_file);
+		}
+		unsigned long dropped = buffer->m_dropped.exchange(0);
+		if (dropped)
+		{
+			Logger::getLogger()->warn("%lu trace spans of thread %u were dropped", dropped, buffer->m_tid);
+		}
+		if (orphaned)
+		{
+			delete buffer;
+			it = m_buffers.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+	fflush(m_file);
+}
@@ -0,0 +1,225 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <value_store.h>
+
+using namespace std;
+using namespace OpcUa;
+
+/**
+ * Make sure the columns are large enough to hold the given handle.
+ * Called with the mutex held.
+ *
+ * @param handle	The handle of the variable
+ */
+void ValueStore::reserve(NodeHandle handle)
+{
+	if (handle < m_types.size())
+	{
+		return;
+	}
+	size_t size = handle + 1;
+	if (size < m_types.size() * 2)
+	{
+		size = m_types.size() * 2;
+	}
+	Value zero;
+	zero.i = 0;
+	m_types.resize(size, Empty);
+	m_observed.resize(size, 0);
+	m_values.resize(size, zero);
+	m_timestamps.resize(size, 0);
+	m_status.resize(size, (uint32_t)StatusCode::Good);
+}
+
+/**
+ * Store an integer value
+ *
+ * @param handle	The handle of the variable
+ * @param value		The value to store
+ * @param timestamp	The source timestamp of the value
+ * @return		True if the variable is being observed by a client
+ */
+bool ValueStore::set(NodeHandle handle, int64_t value, int64_t timestamp)
+{
+	lock_guard<mutex> guard(m_mutex);
+	reserve(handle);
+	m_types[handle] = Integer;
+	m_values[handle].i = value;
+	m_timestamps[handle] = timestamp;
+	m_status[handle] = (uint32_t)StatusCode::Good;
+	return m_observed[handle];
+}
+
+/**
+ * Store a floating point value
+ *
+ * @param handle	The handle of the variable
+ * @param value		The value to store
+ * @param timestamp	The source timestamp of the value
+ * @return		True if the variable is being observed by a client
+ */
+bool ValueStore::set(NodeHandle handle, double value, int64_t timestamp)
+{
+	lock_guard<mutex> guard(m_mutex);
+	reserve(handle);
+	m_types[handle] = Double;
+	m_values[handle].d = value;
+	m_timestamps[handle] = timestamp;
+	m_status[handle] = (uint32_t)StatusCode::Good;
+	return m_observed[handle];
+}
+
+/**
+ * Store a string value
+ *
+ * @param handle	The handle of the variable
+ * @param value		The value to store
+ * @param timestamp	The source timestamp of the value
+ * @return		True if the variable is being observed by a client
+ */
+bool ValueStore::set(NodeHandle handle, const string& value, int64_t timestamp)
+{
+	lock_guard<mutex> guard(m_mutex);
+	reserve(handle);
+	m_types[handle] = String;
+	m_strings[handle] = value;
+	m_timestamps[handle] = timestamp;
+	m_status[handle] = (uint32_t)StatusCode::Good;
+	return m_observed[handle];
+}
+
+/**
+ * Set the status of a variable, the value is retained
+ *
+ * @param handle	The handle of the variable
+ * @param status	The new status
+ * @return		True if the variable is being observed by a client
+ */
+bool ValueStore::setStatus(NodeHandle handle, StatusCode status)
+{
+	lock_guard<mutex> guard(m_mutex);
+	if (handle >= m_types.size())
+	{
+		return false;
+	}
+	m_status[handle] = (uint32_t)status;
+	return m_observed[handle];
+}
+
+/**
+ * Check if the store holds a value for the variable
+ *
+ * @param handle	The handle of the variable
+ * @return		True if a value is held
+ */
+bool ValueStore::contains(NodeHandle handle)
+{
+	lock_guard<mutex> guard(m_mutex);
+	return handle < m_types.size() && m_types[handle] != Empty;
+}
+
+/**
+ * Remove the value of a variable from the store, this must be called
+ * when the variable is removed so that the handle may be reused.
+ *
+ * @param handle	The handle of the variable
+ */
+void ValueStore::clear(NodeHandle handle)
+{
+	lock_guard<mutex> guard(m_mutex);
+	if (handle >= m_types.size())
+	{
+		return;
+	}
+	if (m_types[handle] == String)
+	{
+		m_strings.erase(handle);
+	}
+	m_types[handle] = Empty;
+	m_observed[handle] = 0;
+	m_status[handle] = (uint32_t)StatusCode::Good;
+}
+
+/**
+ * Read the current value of a variable. This is called from the
+ * OPC UA server threads via the value callback of the variable.
+ *
+ * @param handle	The handle of the variable
+ * @return		The value of the variable
+ */
+DataValue ValueStore::read(NodeHandle handle)
+{
+	DataValue dv;
+
+	lock_guard<mutex> guard(m_mutex);
+	if (handle >= m_types.size() || m_types[handle] == Empty)
+	{
+		dv.Status = StatusCode::BadWaitingForInitialData;
+		dv.Encoding |= DATA_VALUE_STATUS_CODE;
+		return dv;
+	}
+	m_observed[handle] = 1;
+	switch (m_types[handle])
+	{
+		case Integer:
+			dv.Value = Variant(m_values[handle].i);
+			break;
+		case Double:
+			dv.Value = Variant(m_values[handle].d);
+			break;
+		case String:
+			dv.Value = Variant(m_strings[handle]);
+			break;
+		default:
+			break;
+	}
+	dv.Encoding |= DATA_VALUE;
+	dv.SourceTimestamp = DateTime(m_timestamps[handle]);
+	dv.Encoding |= DATA_VALUE_SOURCE_TIMESTAMP;
+	dv.ServerTimestamp = DateTime::Current();
+	dv.Encoding |= DATA_VALUE_SERVER_TIMESTAMP;
+	if (m_status[handle] != (uint32_t)StatusCode::Good)
+	{
+		dv.Status = (StatusCode)m_status[handle];
+		dv.Encoding |= DATA_VALUE_STATUS_CODE;
+	}
+	return dv;
+}
+
+/**
+ * Clear the observed mark of a variable once it no longer has any
+ * monitored items. This is called from the OPC UA server threads.
+ *
+ * @param handle	The handle of the variable
+ */
+void ValueStore::release(NodeHandle handle)
+{
+	lock_guard<mutex> guard(m_mutex);
+	if (handle < m_observed.size())
+	{
+		m_observed[handle] = 0;
+	}
+}
+
+/**
+ * Return an estimate of the memory used by the store
+ *
+ * @return	The number of bytes used
+ */
+size_t ValueStore::memoryUsage()
+{
+	lock_guard<mutex> guard(m_mutex);
+	size_t size = sizeof(*this);
+	size += m_types.capacity() * (2 * sizeof(uint8_t) + sizeof(Value) + sizeof(int64_t) + sizeof(uint32_t));
+	for (auto& s : m_strings)
+	{
+		size += sizeof(s) + 2 * sizeof(void *) + s.second.capacity();
+	}
+	return size;
+}
@@ -0,0 +1,127 @@
+/*
+ * Fledge OPC UA north plugin.
+ *
+ * Copyright (c) 2024 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <worker_pool.h>
+
+using namespace std;
+
+/**
+ * Constructor for the worker pool
+ */
+WorkerPool::WorkerPool() : m_task(NULL), m_tasks(0), m_next(0), m_busy(0), m_generation(0), m_stop(false)
+{
+}
+
+/**
+ * Destructor for the worker pool
+ */
+WorkerPool::~WorkerPool()
+{
+	stop();
+}
+
+/**
+ * Start the worker threads
+ *
+ * @param threads	The number of threads to start
+ */
+void WorkerPool::start(unsigned int threads)
+{
+	stop();
+	m_stop = false;
+	for (unsigned int i = 0; i < threads; i++)
+	{
+		m_threads.push_back(thread(&WorkerPool::worker, this, m_generation));
+	}
+}
+
+/**
+ * Stop and join the worker threads
+ */
+void WorkerPool::stop()
+{
+	{
+		lock_guard<mutex> guard(m_mutex);
+		m_stop = true;
+	}
+	m_start.notify_all();
+	for (auto &t : m_threads)
+	{
+		t.join();
+	}
+	m_threads.clear();
+}
+
+/**
+ * Run a batch of tasks and wait for them all to complete
+ *
+ * @param tasks	The number of tasks in the batch
+ * @param task	The function to call with the number of each task
+ */
+void WorkerPool::run(size_t tasks, const function<void(size_t)>& task)
+{
+	if (m_threads.empty())
+	{
+		for (size_t i = 0; i < tasks; i++)
+		{
+			task(i);
+		}
+		return;
+	}
+	{
+		lock_guard<mutex> guard(m_mutex);
+		m_task = &task;
+		m_tasks = tasks;
+		m_next.store(0);
+		m_busy = m_threads.size();
+		m_generation++;
+	}
+	m_start.notify_all();
+	work();
+	unique_lock<mutex> lck(m_mutex);
+	m_done.wait(lck, [this] { return m_busy == 0; });
+	m_task = NULL;
+}
+
+/**
+ * Claim and run tasks from the current batch until none remain
+ */
+void WorkerPool::work()
+{
+	size_t i;
+	while ((i = m_next.fetch_add(1)) < m_tasks)
+	{
+		(*m_task)(i);
+	}
+}
+
+/**
+ * The worker thread
+ *
+ * @param seen	The last batch submitted before the thread was started
+ */
+void WorkerPool::worker(unsigned long seen)
+{
+	unique_lock<mutex> lck(m_mutex);
+	while (true)
+	{
+		m_start.wait(lck, [this, &seen] { return m_stop || m_generation != seen; });
+		if (m_stop)
+		{
+			return;
+		}
+		seen = m_generation;
+		lck.unlock();
+		work();
+		lck.lock();
+		if (--m_busy == 0)
+		{
+			m_done.notify_one();
+		}
+	}
+}